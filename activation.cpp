@@ -1,5 +1,8 @@
 #include "activation.hpp"
 
+#include "activation_scheduler.hpp"
+#include "async_utils.hpp"
+#include "flash_model.hpp"
 #include "images.hpp"
 #include "item_updater.hpp"
 #include "msl_verify.hpp"
@@ -14,6 +17,10 @@
 #include <xyz/openbmc_project/Common/error.hpp>
 #include <xyz/openbmc_project/Software/Version/error.hpp>
 
+#include <algorithm>
+#include <filesystem>
+#include <string_view>
+
 #ifdef WANT_SIGNATURE_VERIFY
 #include "image_verify.hpp"
 #endif
@@ -38,46 +45,183 @@ using InternalFailure =
 namespace control = sdbusplus::server::xyz::openbmc_project::control;
 #endif
 
-void Activation::subscribeToSystemdSignals()
+Activation::~Activation()
 {
-    auto method = this->bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
-                                            SYSTEMD_INTERFACE, "Subscribe");
-    try
+    parent.jobTracker.forget(this);
+    parent.scheduler.release(versionId);
+    if (estimateInterface)
     {
-        this->bus.call_noreply(method);
+        parent.objectServer.remove_interface(estimateInterface);
     }
-    catch (const sdbusplus::exception_t& e)
-    {
-        if (e.name() != nullptr &&
-            strcmp("org.freedesktop.systemd1.AlreadySubscribed", e.name()) == 0)
+}
+
+JobTracker::Callback Activation::whileActivating(JobTracker::Callback callback)
+{
+    return [this, callback = std::move(callback)](const std::string& result) {
+        // Results only matter while the activation is in progress
+        if (softwareServer::Activation::activation() ==
+            softwareServer::Activation::Activations::Activating)
+        {
+            callback(result);
+        }
+    };
+}
+
+void Activation::startJob(const std::string& unit,
+                          JobTracker::Callback callback)
+{
+    parent.jobTracker.startUnit(unit, whileActivating(std::move(callback)),
+                                flashJobTimeout, this);
+}
+
+void Activation::watchJob(const std::string& unit,
+                          JobTracker::Callback callback)
+{
+    parent.jobTracker.watchUnit(unit, whileActivating(std::move(callback)),
+                                this);
+}
+
+void Activation::runFlashWorker(
+    std::function<void(const FlashProgress&, const FlashEstimate&)> work,
+    uint8_t endProgress, JobTracker::Callback callback)
+{
+    uint8_t startProgress = activationProgress
+                                ? activationProgress->progress()
+                                : 0;
+    auto& io = bus.get_io_context();
+    std::weak_ptr<char> alive = lifetime;
+    callback = whileActivating(std::move(callback));
+
+    // Assigning stops and joins any previous worker first
+    flashWorker = std::jthread([this, work = std::move(work), startProgress,
+                                endProgress, &io, alive,
+                                callback](std::stop_token stop) {
+        std::string result = "done";
+        uint8_t lastProgress = startProgress;
+        auto progress = [&](uint64_t done, uint64_t total) {
+            uint8_t value = total ? startProgress + (endProgress -
+                                                     startProgress) *
+                                                        done / total
+                                  : startProgress;
+            if (value != lastProgress)
+            {
+                lastProgress = value;
+                boost::asio::post(io, [this, alive, value]() {
+                    if (!alive.expired() && activationProgress)
+                    {
+                        activationProgress->progress(value);
+                    }
+                });
+            }
+            return !stop.stop_requested();
+        };
+        auto estimate = [this, &io, alive](
+                            const std::string& partition, uint64_t bytes,
+                            std::optional<std::chrono::seconds> duration) {
+            boost::asio::post(io, [this, alive, partition, bytes, duration]() {
+                if (!alive.expired())
+                {
+                    publishEstimate(partition, bytes, duration);
+                }
+            });
+        };
+
+        try
         {
-            // If an Activation attempt fails, the Unsubscribe method is not
-            // called. This may lead to an AlreadySubscribed error if the
-            // Activation is re-attempted.
+            work(progress, estimate);
         }
-        else
+        catch (const std::exception& e)
         {
-            error("Error subscribing to systemd: {ERROR}", "ERROR", e);
+            error("Failed to write flash: {ERROR}", "ERROR", e.what());
+            result = "failed";
         }
-    }
+        boost::asio::post(io, [alive, callback, result]() {
+            if (!alive.expired())
+            {
+                callback(result);
+            }
+        });
+    });
+}
+
+void Activation::writeMtd(const std::string& image, const std::string& device,
+                          JobTracker::Callback callback, uint8_t endProgress)
+{
+    // The journal lets a later activation of the same image resume an
+    // interrupted write
+    auto journal = flashJournalPath(versionId);
+    std::error_code ec;
+    std::filesystem::create_directories(
+        std::filesystem::path(journal).parent_path(), ec);
+
+    runFlashWorker(
+        [image, device, journal](const FlashProgress& progress,
+                                 const FlashEstimate& estimate) {
+        MtdWriter writer(device);
+
+        // Compare first, so that the estimate covers only what differs, and
+        // write only the blocks the comparison found
+        auto plan = writer.compare(image);
+        std::optional<std::chrono::seconds> duration;
+        if (auto rates = FlashModel(flashModelPath()).rates(device))
+        {
+            std::error_code ec;
+            auto size = std::filesystem::file_size(image, ec);
+            duration = FlashModel::duration(*rates, ec ? 0 : size, plan.bytes);
+        }
+        estimate(std::filesystem::path(device).filename().string(), plan.bytes,
+                 duration);
 
-    return;
+        auto stats = writer.write(plan, progress, journal);
+        if (stats.resumed)
+        {
+            info("Resumed writing {IMAGE} after {RESUMED} blocks", "IMAGE",
+                 image, "RESUMED", stats.resumed);
+        }
+        info("Wrote {WRITTEN} of {BLOCKS} blocks of {IMAGE} to {DEVICE}",
+             "WRITTEN", stats.written, "BLOCKS", stats.blocks, "IMAGE", image,
+             "DEVICE", device);
+    },
+        endProgress, std::move(callback));
 }
 
-void Activation::unsubscribeFromSystemdSignals()
+void Activation::writePartitions(
+    const std::vector<PartitionWriter::Target>& targets,
+    JobTracker::Callback callback)
 {
-    auto method = this->bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
-                                            SYSTEMD_INTERFACE, "Unsubscribe");
-    try
-    {
-        this->bus.call_noreply(method);
-    }
-    catch (const sdbusplus::exception_t& e)
-    {
-        error("Error unsubscribing from systemd signals: {ERROR}", "ERROR", e);
-    }
+    runFlashWorker(
+        [targets](const FlashProgress& progress,
+                  const FlashEstimate& estimate) {
+        // Partitions are streamed whole, nothing is compared
+        FlashModel model(flashModelPath());
+        for (const auto& target : targets)
+        {
+            auto bytes = PartitionWriter::targetSize(target).value_or(0);
+            std::optional<std::chrono::seconds> duration;
+            if (auto rates = model.rates(target.device))
+            {
+                duration = FlashModel::duration(*rates, 0, bytes);
+            }
+            estimate(std::filesystem::path(target.device).filename().string(),
+                     bytes, duration);
+        }
 
-    return;
+        auto stats = PartitionWriter::write(targets, progress);
+        for (size_t i = 0; i < targets.size(); i++)
+        {
+            info("Wrote {IMAGE} to {DEVICE}", "IMAGE", targets[i].image,
+                 "DEVICE", targets[i].device);
+            // Shows whether decompression or the device is the bottleneck
+            for (const auto& stage : stats[i])
+            {
+                info("{IMAGE} {STAGE}: {BYTES} bytes at {RATE} KiB/s busy",
+                     "IMAGE", targets[i].image, "STAGE", stage.name, "BYTES",
+                     stage.bytes, "RATE",
+                     static_cast<uint64_t>(stage.throughput() / 1024));
+            }
+        }
+    },
+        80, std::move(callback));
 }
 
 auto Activation::activation(Activations value) -> Activations
@@ -139,81 +283,171 @@ auto Activation::activation(Activations value) -> Activations
                 std::make_unique<ActivationBlocksTransition>(bus, path);
         }
 
+        // Writing a flash another activation is writing waits for it
+        auto resource = ActivationScheduler::bmcFlash;
 #ifdef HOST_BIOS_UPGRADE
-        auto it = parent.versions.find(versionId);
-        if (it == parent.versions.end())
+        if (versionItr->second->purpose() == VersionPurpose::Host)
         {
-            return softwareServer::Activation::activation(
-                softwareServer::Activation::Activations::Failed);
+            resource = ActivationScheduler::biosFlash;
         }
-        auto purpose = it->second->purpose();
-        if (purpose == VersionPurpose::Host)
+#endif
+        std::weak_ptr<char> alive = lifetime;
+        if (!parent.scheduler.request(versionId, {resource}, [this, alive]() {
+            boost::asio::post(bus.get_io_context(), [this, alive]() {
+                if (alive.expired() ||
+                    softwareServer::Activation::activation() !=
+                        softwareServer::Activation::Activations::Activating)
+                {
+                    return;
+                }
+                info("Starting queued activation of {VERSIONID}", "VERSIONID",
+                     versionId);
+                using Activations = softwareServer::Activation::Activations;
+                if (auto state = startFlash(); state != Activations::Activating)
+                {
+                    activation(state);
+                }
+            });
+        }))
         {
-            // Enable systemd signals
-            subscribeToSystemdSignals();
+            info("Queued activation of {VERSIONID} until {RESOURCE} is free",
+                 "VERSIONID", versionId, "RESOURCE", resource);
+            return softwareServer::Activation::activation(value);
+        }
+
+        auto state = startFlash();
+        if (state != softwareServer::Activation::Activations::Activating)
+        {
+            parent.scheduler.release(versionId);
+        }
+        return softwareServer::Activation::activation(state);
+    }
+    else
+    {
+        parent.scheduler.release(versionId);
+        activationBlocksTransition.reset(nullptr);
+    }
+    return softwareServer::Activation::activation(value);
+}
 
-            // Set initial progress
-            activationProgress->progress(20);
+auto Activation::startFlash() -> Activations
+{
+    resetEstimate();
+
+#ifdef HOST_BIOS_UPGRADE
+    auto it = parent.versions.find(versionId);
+    if (it == parent.versions.end())
+    {
+        return softwareServer::Activation::Activations::Failed;
+    }
+    auto purpose = it->second->purpose();
+    if (purpose == VersionPurpose::Host)
+    {
+        // Set initial progress
+        activationProgress->progress(20);
 
-            // Initiate image writing to flash
-            flashWriteHost();
+        // Initiate image writing to flash
+        flashWriteHost();
 
-            return softwareServer::Activation::activation(value);
-        }
+        return softwareServer::Activation::Activations::Activating;
+    }
 #endif
 
-        activationProgress->progress(10);
-
-        parent.freeSpace(*this);
+    activationProgress->progress(10);
 
-        // Enable systemd signals
-        Activation::subscribeToSystemdSignals();
+    parent.freeSpace(*this);
 
+    try
+    {
         flashWrite();
+    }
+    catch (const std::exception& e)
+    {
+        error("Failed to write {VERSIONID}: {ERROR}", "VERSIONID", versionId,
+              "ERROR", e.what());
+        activationBlocksTransition.reset(nullptr);
+        return softwareServer::Activation::Activations::Failed;
+    }
 
 #ifdef NVIDIA_SECURE_BOOT
-        if (!secureFlashSuceeded || !unsecureFlashSuceeded)
-        {
-            Activation::unsubscribeFromSystemdSignals();
-            activationBlocksTransition.reset(nullptr);
-            return softwareServer::Activation::activation(
-                softwareServer::Activation::Activations::Failed);
-        }
-        if (secureUpdateProgress != SecureUpdate::IDLE)
-        {
-            return softwareServer::Activation::activation(value);
-        }
+    if (!secureFlashSuceeded || !unsecureFlashSuceeded)
+    {
+        parent.jobTracker.forget(this);
+        activationBlocksTransition.reset(nullptr);
+        return softwareServer::Activation::Activations::Failed;
+    }
+    if (secureUpdateProgress != SecureUpdate::IDLE)
+    {
+        return softwareServer::Activation::Activations::Activating;
+    }
 
-        bool cecStatus = utils::checkCECExist();
-        // Set progress for non-cec update
-        if (unsecureFlashSuceeded && !cecStatus)
-        {
-            activationProgress->progress(100);
-            activationBlocksTransition.reset(nullptr);
-        }
+    bool cecStatus = utils::checkCECExist();
+    // Set progress for non-cec update
+    if (unsecureFlashSuceeded && !cecStatus)
+    {
+        activationProgress->progress(100);
+        activationBlocksTransition.reset(nullptr);
+    }
 #endif
 
 #if defined UBIFS_LAYOUT || defined MMC_LAYOUT
 
-        return softwareServer::Activation::activation(value);
+    return softwareServer::Activation::Activations::Activating;
 
 #else // STATIC_LAYOUT
 
-        if (parent.runningImageSlot == 0)
-        {
-            // On primary, update it as before
-            onFlashWriteSuccess();
-            return softwareServer::Activation::activation(
-                softwareServer::Activation::Activations::Active);
-        }
-        // On secondary, wait for the service to complete
+    if (parent.runningImageSlot == 0)
+    {
+        // On primary, update it as before
+        onFlashWriteSuccess();
+        return softwareServer::Activation::Activations::Active;
+    }
+    // On secondary, wait for the service to complete
 #endif
+    return softwareServer::Activation::Activations::Activating;
+}
+
+void Activation::publishEstimate(const std::string& partition,
+                                 uint64_t bytes,
+                                 std::optional<std::chrono::seconds> duration)
+{
+    if (!estimateInterface)
+    {
+        estimateInterface = parent.objectServer.add_interface(
+            path, activationEstimateIntf);
+        estimateInterface->register_property("BytesToWrite", bytesToWrite);
+        estimateInterface->register_property("EstimatedCompletion",
+                                             estimatedCompletion);
+        estimateInterface->initialize();
     }
-    else
+
+    bytesToWrite[partition] = bytes;
+    estimateInterface->set_property("BytesToWrite", bytesToWrite);
+    if (duration)
     {
-        activationBlocksTransition.reset(nullptr);
+        auto completion = std::chrono::duration_cast<std::chrono::seconds>(
+            (std::chrono::system_clock::now() + *duration).time_since_epoch());
+        estimatedCompletion = std::max<uint64_t>(estimatedCompletion,
+                                                 completion.count());
+        estimateInterface->set_property("EstimatedCompletion",
+                                        estimatedCompletion);
+        info("Writing {BYTES} bytes to {PARTITION} of {VERSIONID} should "
+             "take {SECONDS} s",
+             "BYTES", bytes, "PARTITION", partition, "VERSIONID", versionId,
+             "SECONDS", duration->count());
+    }
+}
+
+void Activation::resetEstimate()
+{
+    bytesToWrite.clear();
+    estimatedCompletion = 0;
+    if (estimateInterface)
+    {
+        estimateInterface->set_property("BytesToWrite", bytesToWrite);
+        estimateInterface->set_property("EstimatedCompletion",
+                                        estimatedCompletion);
     }
-    return softwareServer::Activation::activation(value);
 }
 
 void Activation::onFlashWriteSuccess()
@@ -226,7 +460,7 @@ void Activation::onFlashWriteSuccess()
     rwVolumeCreated = false;
     roVolumeCreated = false;
     ubootEnvVarsUpdated = false;
-    Activation::unsubscribeFromSystemdSignals();
+    parent.jobTracker.forget(this);
 
     auto it = parent.versions.find(versionId);
     if (it == parent.versions.end())
@@ -252,15 +486,15 @@ void Activation::onFlashWriteSuccess()
     // can be re-programmed.
     parent.createUpdateableAssociation(path);
 
-    if (Activation::checkApplyTimeImmediate() == true)
-    {
+    checkApplyTimeImmediate([&parent = parent, &bus = bus](bool immediate) {
+        if (!immediate)
+        {
+            info("BMC image ready; need reboot to get activated.");
+            return;
+        }
         info("Image Active and ApplyTime is immediate; rebooting BMC.");
-        Activation::rebootBmc();
-    }
-    else
-    {
-        info("BMC image ready; need reboot to get activated.");
-    }
+        rebootBmcWhenIdle(parent, bus);
+    });
 
     activation(softwareServer::Activation::Activations::Active);
 }
@@ -268,44 +502,39 @@ void Activation::onFlashWriteSuccess()
 void Activation::deleteImageManagerObject()
 {
     // Call the Delete object for <versionID> inside image_manager if the object
-    // has not already been deleted due to a successful update or Delete call
+    // has not already been deleted due to a successful update or Delete call.
+    // Only the bus and the path are captured, this object may be gone by the
+    // time the replies arrive.
     const std::string interface = std::string{VERSION_IFACE};
-    auto method = this->bus.new_method_call(MAPPER_BUSNAME, MAPPER_PATH,
-                                            MAPPER_BUSNAME, "GetObject");
-    method.append(path.c_str());
-    method.append(std::vector<std::string>({interface}));
-
-    std::map<std::string, std::vector<std::string>> response;
-
-    try
-    {
-        auto reply = bus.call(method);
-        reply.read(response);
-        auto it = response.find(VERSION_IFACE);
-        if (it != response.end())
+    bus.async_method_call(
+        [&bus = bus, path = path, interface](
+            const boost::system::error_code& ec,
+            const std::map<std::string, std::vector<std::string>>& response) {
+        if (ec)
         {
-            auto deleteMethod = this->bus.new_method_call(
-                VERSION_BUSNAME, path.c_str(),
-                "xyz.openbmc_project.Object.Delete", "Delete");
-            try
-            {
-                bus.call_noreply(deleteMethod);
-            }
-            catch (const sdbusplus::exception_t& e)
+            error(
+                "Error in mapper method call for ({PATH}, {INTERFACE}: {ERROR}",
+                "ERROR", ec.message(), "PATH", path, "INTERFACE", interface);
+            return;
+        }
+        if (response.find(VERSION_IFACE) == response.end())
+        {
+            return;
+        }
+        bus.async_method_call(
+            [path](const boost::system::error_code& ec) {
+            if (ec)
             {
                 error(
                     "Error deleting image ({PATH}) from image manager: {ERROR}",
-                    "PATH", path, "ERROR", e);
-                return;
+                    "PATH", path, "ERROR", ec.message());
             }
-        }
-    }
-    catch (const sdbusplus::exception_t& e)
-    {
-        error("Error in mapper method call for ({PATH}, {INTERFACE}: {ERROR}",
-              "ERROR", e, "PATH", path, "INTERFACE", interface);
-    }
-    return;
+        },
+            VERSION_BUSNAME, path, "xyz.openbmc_project.Object.Delete",
+            "Delete");
+    },
+        MAPPER_BUSNAME, MAPPER_PATH, MAPPER_BUSNAME, "GetObject", path,
+        std::vector<std::string>({interface}));
 }
 
 auto Activation::requestedActivation(RequestedActivations value)
@@ -354,33 +583,6 @@ uint8_t RedundancyPriority::sdbusPriority(uint8_t value)
     return softwareServer::RedundancyPriority::priority(value);
 }
 
-void Activation::unitStateChange(sdbusplus::message_t& msg)
-{
-    if (softwareServer::Activation::activation() !=
-        softwareServer::Activation::Activations::Activating)
-    {
-        return;
-    }
-
-#ifdef HOST_BIOS_UPGRADE
-    auto it = parent.versions.find(versionId);
-    if (it == parent.versions.end())
-    {
-        return;
-    }
-    auto purpose = it->second->purpose();
-    if (purpose == VersionPurpose::Host)
-    {
-        onStateChangesBios(msg);
-        return;
-    }
-#endif
-
-    onStateChanges(msg);
-
-    return;
-}
-
 #ifdef WANT_SIGNATURE_VERIFY
 bool Activation::verifySignature(const fs::path& imageDir,
                                  const fs::path& confDir)
@@ -395,146 +597,185 @@ bool Activation::verifySignature(const fs::path& imageDir,
 
 void ActivationBlocksTransition::enableRebootGuard()
 {
+    // Activations may run concurrently, the first one enables the guard
+    if (guards++ > 0)
+    {
+        return;
+    }
+
     info("BMC image activating - BMC reboots are disabled.");
 
-    auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
-                                      SYSTEMD_INTERFACE, "StartUnit");
-    method.append("reboot-guard-enable.service", "replace");
-    bus.call_noreply(method);
+    utils::startUnitAsync(bus, "reboot-guard-enable.service");
 }
 
 void ActivationBlocksTransition::disableRebootGuard()
 {
+    // and the last one disables it
+    if (--guards > 0)
+    {
+        return;
+    }
+
     info("BMC activation has ended - BMC reboots are re-enabled.");
 
-    auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
-                                      SYSTEMD_INTERFACE, "StartUnit");
-    method.append("reboot-guard-disable.service", "replace");
-    bus.call_noreply(method);
+    utils::startUnitAsync(bus, "reboot-guard-disable.service");
+
+    auto callbacks = std::move(unguarded);
+    unguarded.clear();
+    for (auto& callback : callbacks)
+    {
+        callback();
+    }
 }
 
-bool Activation::checkApplyTimeImmediate()
+void ActivationBlocksTransition::whenUnguarded(std::function<void()> callback)
 {
-    auto service = utils::getService(bus, applyTimeObjPath, applyTimeIntf);
-    if (service.empty())
+    if (guards > 0)
     {
-        info("Error getting the service name for BMC image ApplyTime. "
-             "The BMC needs to be manually rebooted to complete the image "
-             "activation if needed immediately.");
+        unguarded.push_back(std::move(callback));
+        return;
     }
-    else
-    {
-        auto method = bus.new_method_call(service.c_str(), applyTimeObjPath,
-                                          dbusPropIntf, "Get");
-        method.append(applyTimeIntf, applyTimeProp);
+    callback();
+}
 
-        try
+void Activation::checkApplyTimeImmediate(std::function<void(bool)> callback)
+{
+    utils::getServiceAsync(
+        bus, applyTimeObjPath, applyTimeIntf,
+        [&bus = bus,
+         callback = std::move(callback)](const std::string& service) {
+        if (service.empty())
         {
-            auto reply = bus.call(method);
+            info("Error getting the service name for BMC image ApplyTime. "
+                 "The BMC needs to be manually rebooted to complete the image "
+                 "activation if needed immediately.");
+            callback(false);
+            return;
+        }
 
-            std::variant<std::string> result;
-            reply.read(result);
-            auto applyTime = std::get<std::string>(result);
-            if (applyTime == applyTimeImmediate)
+        bus.async_method_call(
+            [callback](const boost::system::error_code& ec,
+                       const std::variant<std::string>& result) {
+            if (ec)
             {
-                return true;
+                error("Error in getting ApplyTime: {ERROR}", "ERROR",
+                      ec.message());
+                callback(false);
+                return;
             }
-        }
-        catch (const sdbusplus::exception_t& e)
-        {
-            error("Error in getting ApplyTime: {ERROR}", "ERROR", e);
-        }
-    }
-    return false;
+            callback(std::get<std::string>(result) == applyTimeImmediate);
+        },
+            service, applyTimeObjPath, dbusPropIntf, "Get", applyTimeIntf,
+            applyTimeProp);
+    });
 }
 
 #ifdef HOST_BIOS_UPGRADE
 void Activation::flashWriteHost()
 {
-    auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
-                                      SYSTEMD_INTERFACE, "StartUnit");
-    auto biosServiceFile = "obmc-flash-host-bios@" + versionId + ".service";
-    method.append(biosServiceFile, "replace");
-    try
+    if (std::string_view(BIOS_FLASH_DEVICE).empty())
     {
-        auto reply = bus.call(method);
-    }
-    catch (const sdbusplus::exception_t& e)
-    {
-        error("Error in trying to upgrade Host Bios: {ERROR}", "ERROR", e);
-        report<InternalFailure>();
+        auto biosServiceFile = "obmc-flash-host-bios@" + versionId +
+                               ".service";
+        startJob(biosServiceFile, [this](const std::string& result) {
+            onStateChangesBios(result);
+        });
+        return;
     }
+
+    // Only the sectors that differ are erased and written, and each is
+    // read back, with progress per erase block
+    auto image = fs::path(IMG_UPLOAD_DIR) / versionId / BIOS_IMAGE_NAME;
+    writeMtd(image, BIOS_FLASH_DEVICE, [this](const std::string& result) {
+        onStateChangesBios(result);
+    });
 }
 
-void Activation::onStateChangesBios(sdbusplus::message_t& msg)
+void Activation::onStateChangesBios(const std::string& result)
 {
-    uint32_t newStateID{};
-    sdbusplus::message::object_path newStateObjPath;
-    std::string newStateUnit{};
-    std::string newStateResult{};
-
-    // Read the msg and populate each variable
-    msg.read(newStateID, newStateObjPath, newStateUnit, newStateResult);
-
-    auto biosServiceFile = "obmc-flash-host-bios@" + versionId + ".service";
-
-    if (newStateUnit == biosServiceFile)
+    if (result == "done")
     {
-        // unsubscribe to systemd signals
-        unsubscribeFromSystemdSignals();
-
-        if (newStateResult == "done")
-        {
-            // Set activation progress to 100
-            activationProgress->progress(100);
+        // Set activation progress to 100
+        activationProgress->progress(100);
 
-            // Set Activation value to active
-            activation(softwareServer::Activation::Activations::Active);
+        // Set Activation value to active
+        activation(softwareServer::Activation::Activations::Active);
 
-            info("Bios upgrade completed successfully.");
-            auto it = parent.versions.find(versionId);
-            if (it == parent.versions.end())
-            {
-                error("Cound not find version");
-                return;
-            }
-            parent.biosVersion->version(it->second->version());
-
-            // Delete the uploaded activation
-            boost::asio::post(getIOContext(), [this]() {
-                this->parent.erase(this->versionId);
-            });
-        }
-        else if (newStateResult == "failed")
+        info("Bios upgrade completed successfully.");
+        auto it = parent.versions.find(versionId);
+        if (it == parent.versions.end())
         {
-            // Set Activation value to Failed
-            activation(softwareServer::Activation::Activations::Failed);
-
-            error("Bios upgrade failed.");
+            error("Cound not find version");
+            return;
         }
+        parent.biosVersion->version(it->second->version());
+
+        // Delete the uploaded activation
+        boost::asio::post(getIOContext(), [this]() {
+            this->parent.erase(this->versionId);
+        });
     }
+    else
+    {
+        // Set Activation value to Failed
+        activation(softwareServer::Activation::Activations::Failed);
 
-    return;
+        error("Bios upgrade failed: {RESULT}", "RESULT", result);
+    }
 }
 
 #endif
 
-void Activation::rebootBmc()
+void Activation::rebootBmc(sdbusplus::asio::connection& bus)
 {
-    auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
-                                      SYSTEMD_INTERFACE, "StartUnit");
-    method.append("force-reboot.service", "replace");
-    try
+    bus.async_method_call(
+        [](const boost::system::error_code& ec) {
+        if (ec)
+        {
+            rebootPending = false;
+            alert("Error in trying to reboot the BMC. The BMC needs to be "
+                  "manually rebooted to complete the image activation. "
+                  "{ERROR}",
+                  "ERROR", ec.message());
+            report<InternalFailure>();
+        }
+    },
+        SYSTEMD_BUSNAME, SYSTEMD_PATH, SYSTEMD_INTERFACE, "StartUnit",
+        "force-reboot.service", "replace");
+}
+
+void Activation::rebootBmcWhenIdle(ItemUpdater& parent,
+                                   sdbusplus::asio::connection& bus)
+{
+    if (rebootPending)
     {
-        auto reply = bus.call(method);
+        return;
     }
-    catch (const sdbusplus::exception_t& e)
+    rebootPending = true;
+    rebootBmcIfIdle(parent, bus);
+}
+
+void Activation::rebootBmcIfIdle(ItemUpdater& parent,
+                                 sdbusplus::asio::connection& bus)
+{
+    // force-reboot.service bypasses the reboot guard, so check both the
+    // scheduler and the guard ourselves
+    if (!parent.scheduler.idle())
     {
-        alert("Error in trying to reboot the BMC. The BMC needs to be manually "
-              "rebooted to complete the image activation. {ERROR}",
-              "ERROR", e);
-        report<InternalFailure>();
+        info("BMC reboot deferred until no activation is running.");
+        parent.scheduler.whenIdle(
+            [&parent, &bus]() { rebootBmcIfIdle(parent, bus); });
+        return;
     }
+    ActivationBlocksTransition::whenUnguarded([&parent, &bus]() {
+        // An activation may have started while waiting for the guard
+        if (!parent.scheduler.idle())
+        {
+            rebootBmcIfIdle(parent, bus);
+            return;
+        }
+        rebootBmc(bus);
+    });
 }
 
 } // namespace updater
@@ -3,16 +3,29 @@
 #include "config.h"
 
 #include "flash.hpp"
+#include "job_tracker.hpp"
+#include "mtd_writer.hpp"
+#include "partition_writer.hpp"
 #include "utils.hpp"
 #include "xyz/openbmc_project/Software/ActivationProgress/server.hpp"
 #include "xyz/openbmc_project/Software/RedundancyPriority/server.hpp"
 
 #include <boost/asio/steady_timer.hpp>
+#include <sdbusplus/asio/connection.hpp>
+#include <sdbusplus/asio/object_server.hpp>
 #include <sdbusplus/server.hpp>
 #include <xyz/openbmc_project/Association/Definitions/server.hpp>
 #include <xyz/openbmc_project/Software/Activation/server.hpp>
 #include <xyz/openbmc_project/Software/ActivationBlocksTransition/server.hpp>
 
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <vector>
+
 #ifdef WANT_SIGNATURE_VERIFY
 #include <filesystem>
 #endif
@@ -47,8 +60,8 @@ constexpr auto applyTimeIntf = "xyz.openbmc_project.Software.ApplyTime";
 constexpr auto dbusPropIntf = "org.freedesktop.DBus.Properties";
 constexpr auto applyTimeObjPath = "/xyz/openbmc_project/software/apply_time";
 constexpr auto applyTimeProp = "RequestedApplyTime";
-
-namespace sdbusRule = sdbusplus::bus::match::rules;
+constexpr auto activationEstimateIntf =
+    "com.nvidia.Software.ActivationEstimate";
 
 class ItemUpdater;
 class Activation;
@@ -128,7 +141,8 @@ class ActivationBlocksTransition : public ActivationBlocksTransitionInherit
      *  @param[in] bus    - The Dbus bus object
      *  @param[in] path   - The Dbus object path
      */
-    ActivationBlocksTransition(sdbusplus::bus_t& bus, const std::string& path) :
+    ActivationBlocksTransition(sdbusplus::asio::connection& bus,
+                               const std::string& path) :
         ActivationBlocksTransitionInherit(bus, path.c_str(),
                                           action::emit_interface_added),
         bus(bus)
@@ -141,8 +155,22 @@ class ActivationBlocksTransition : public ActivationBlocksTransitionInherit
         disableRebootGuard();
     }
 
+    /** @brief Run a callback once no activation holds the guard
+     *  @details Runs it right away if none does, otherwise once the last
+     *  one disables the guard.
+     *
+     *  @param[in] callback - Called once unguarded
+     */
+    static void whenUnguarded(std::function<void()> callback);
+
   private:
-    sdbusplus::bus_t& bus;
+    sdbusplus::asio::connection& bus;
+
+    /** @brief Number of activations holding the guard */
+    static inline size_t guards = 0;
+
+    /** @brief Waiting for the guard to be disabled */
+    static inline std::vector<std::function<void()>> unguarded;
 
     /** @brief Enables a Guard that blocks any BMC reboot commands */
     void enableRebootGuard();
@@ -184,21 +212,14 @@ class Activation : public ActivationInherit, public Flash
      * @param[in] activationStatus - The status of Activation
      * @param[in] assocs - Association objects
      */
-    Activation(sdbusplus::bus_t& bus, const std::string& path,
+    Activation(sdbusplus::asio::connection& bus, const std::string& path,
                ItemUpdater& parent, std::string& versionId,
                sdbusplus::server::xyz::openbmc_project::software::Activation::
                    Activations activationStatus,
                AssociationList& assocs) :
         ActivationInherit(bus, path.c_str(),
                           ActivationInherit::action::defer_emit),
-        bus(bus), path(path), parent(parent), versionId(versionId),
-        systemdSignals(
-            bus,
-            sdbusRule::type::signal() + sdbusRule::member("JobRemoved") +
-                sdbusRule::path("/org/freedesktop/systemd1") +
-                sdbusRule::interface("org.freedesktop.systemd1.Manager"),
-            std::bind(std::mem_fn(&Activation::unitStateChange), this,
-                      std::placeholders::_1))
+        bus(bus), path(path), parent(parent), versionId(versionId)
     {
         // Set Properties.
         activation(activationStatus);
@@ -208,6 +229,9 @@ class Activation : public ActivationInherit, public Flash
         emit_object_added();
     }
 
+    /** @brief Drops the callbacks of jobs that are still running */
+    ~Activation() override;
+
     /** @brief Overloaded Activation property setter function
      *
      * @param[in] value - One of Activation::Activations
@@ -231,6 +255,13 @@ class Activation : public ActivationInherit, public Flash
     /** @brief Overloaded write flash function */
     void flashWrite() override;
 
+    /** @brief Start writing the image once the scheduler allows it
+     *
+     * @return The resulting activation state, Activating while the write
+     *         completes asynchronously
+     */
+    Activations startFlash();
+
     /**
      * @brief Handle the success of the flashWrite() function
      *
@@ -241,67 +272,127 @@ class Activation : public ActivationInherit, public Flash
     void onFlashWriteSuccess();
 
 #ifdef HOST_BIOS_UPGRADE
-    /* @brief write to Host flash function */
+    /* @brief write to Host flash function
+     *
+     * Writes the image to BIOS_FLASH_DEVICE with writeMtd() if configured,
+     * or starts the obmc-flash-host-bios@ unit otherwise.
+     */
     void flashWriteHost();
 
-    /** @brief Function that acts on Bios upgrade service file state changes */
-    void onStateChangesBios(sdbusplus::message_t&);
+    /** @brief Function that acts on Bios upgrade service file state changes
+     *
+     * @param[in] result - The result of the Bios upgrade job
+     */
+    void onStateChangesBios(const std::string& result);
 #endif
 
     /** @brief Overloaded function that acts on service file state changes */
-    void onStateChanges(sdbusplus::message_t&) override;
+    void onStateChanges(const std::string& result) override;
 
-    /** @brief Check if systemd state change is relevant to this object
+    /** @brief Start a unit as part of the activation
+     *
+     * The callback is only invoked while the activation is in progress, and
+     * not at all once this object is gone.
      *
-     * Instance specific interface to handle the detected systemd state
-     * change
+     * @param[in] unit - The unit to start
+     * @param[in] callback - Called with the result of the job
+     */
+    void startJob(const std::string& unit, JobTracker::Callback callback);
+
+    /** @brief Wait for a unit that is started on behalf of the activation
      *
-     * @param[in]  msg       - Data associated with subscribed signal
+     * Like startJob(), for units that are started elsewhere, e.g. by the
+     * helper once the priority has been set.
      *
+     * @param[in] unit - The unit to watch
+     * @param[in] callback - Called with the result of the job
      */
-    void unitStateChange(sdbusplus::message_t& msg);
+    void watchJob(const std::string& unit, JobTracker::Callback callback);
 
-    /**
-     * @brief subscribe to the systemd signals
+    /** @brief Write an image to an MTD device without blocking
      *
-     * This object needs to capture when it's systemd targets complete
-     * so it can keep it's state updated
+     * The write runs in the flash worker thread with MtdWriter, so only the
+     * erase blocks that differ are written. The progress moves from its
+     * current value up to endProgress. Like startJob(), the callback is
+     * invoked from the event loop with "done" or "failed", and only while
+     * activating.
      *
+     * @param[in] image - The image to write
+     * @param[in] device - The MTD device
+     * @param[in] callback - Called with the result of the write
+     * @param[in] endProgress - The progress once the write is done
      */
-    void subscribeToSystemdSignals();
+    void writeMtd(const std::string& image, const std::string& device,
+                  JobTracker::Callback callback, uint8_t endProgress = 90);
 
-    /**
-     * @brief unsubscribe from the systemd signals
+    /** @brief Write images to block device partitions without blocking
      *
-     * systemd signals are only of interest during the activation process.
-     * Once complete, we want to unsubscribe to avoid unnecessary calls of
-     * unitStateChange().
+     * Like writeMtd(), with PartitionWriter writing all partitions
+     * concurrently. The progress moves up to 80.
      *
+     * @param[in] targets - The images and their partitions
+     * @param[in] callback - Called with the result of the write
+     */
+    void writePartitions(const std::vector<PartitionWriter::Target>& targets,
+                         JobTracker::Callback callback);
+
+    /** @brief How long a job that writes the flash may take, generous
+     *  enough for the slowest secure copy
      */
-    void unsubscribeFromSystemdSignals();
+    static constexpr auto flashJobTimeout = std::chrono::hours(1);
 
     /**
      * @brief Deletes the version from Image Manager and the
      *        untar image from image upload dir.
+     *
+     * The mapper lookup and the delete are asynchronous, this returns
+     * before they complete.
      */
     void deleteImageManagerObject();
 
     /**
      * @brief Determine the configured image apply time value
      *
-     * @return true if the image apply time value is immediate
+     * @param[in] callback - Called with true if the image apply time value
+     *                       is immediate
      **/
-    bool checkApplyTimeImmediate();
+    void checkApplyTimeImmediate(std::function<void(bool)> callback);
 
     /**
      * @brief Reboot the BMC. Called when ApplyTime is immediate.
      *
+     * @param[in] bus - The D-Bus connection
+     *
      * @return none
      **/
-    void rebootBmc();
+    static void rebootBmc(sdbusplus::asio::connection& bus);
+
+    /**
+     * @brief Reboot the BMC once no activation is writing a flash
+     * @details Another activation, e.g. a BIOS one, may still be writing
+     * when this one completes: the reboot waits for the scheduler to be idle
+     * and for the reboot guard to be disabled. Only one reboot is started.
+     *
+     * @param[in] parent - The item updater with the scheduler
+     * @param[in] bus - The D-Bus connection
+     **/
+    static void rebootBmcWhenIdle(ItemUpdater& parent,
+                                  sdbusplus::asio::connection& bus);
+
+    /** @brief Reboot the BMC, or wait again, unless an activation runs or
+     *  holds the reboot guard
+     *
+     *  @param[in] parent - The item updater with the scheduler
+     *  @param[in] bus - The D-Bus connection
+     */
+    static void rebootBmcIfIdle(ItemUpdater& parent,
+                                sdbusplus::asio::connection& bus);
+
+    /** @brief Whether a reboot was started or is waiting */
+    static inline bool rebootPending = false;
 
     /** @brief Persistent sdbusplus DBus bus connection */
-    sdbusplus::bus_t& bus;
+    sdbusplus::asio::connection& bus;
 
     /** @brief Persistent DBus object path */
     std::string path;
@@ -321,9 +412,6 @@ class Activation : public ActivationInherit, public Flash
     /** @brief Persistent ActivationProgress dbus object */
     std::unique_ptr<ActivationProgress> activationProgress;
 
-    /** @brief Used to subscribe to dbus systemd signals **/
-    sdbusplus::bus::match_t systemdSignals;
-
     /** @brief Tracks whether the read-write volume has been created as
      * part of the activation process. **/
     bool rwVolumeCreated = false;
@@ -365,8 +453,69 @@ class Activation : public ActivationInherit, public Flash
 
 #endif
 
-#ifdef WANT_SIGNATURE_VERIFY
   private:
+    /** @brief Wrap a job callback so that it only runs while activating
+     *
+     * @param[in] callback - The callback to wrap
+     *
+     * @return The wrapped callback
+     */
+    JobTracker::Callback whileActivating(JobTracker::Callback callback);
+
+    /** @brief Reports the bytes or blocks written by a flash worker, returns
+     * false once the worker should stop */
+    using FlashProgress = std::function<bool(uint64_t done, uint64_t total)>;
+
+    /** @brief Reports, before a flash worker writes anything, how many bytes
+     * it will write to a partition and how long that should take, if the
+     * device was characterized */
+    using FlashEstimate =
+        std::function<void(const std::string& partition, uint64_t bytes,
+                           std::optional<std::chrono::seconds> duration)>;
+
+    /** @brief Run a flash write in the worker thread
+     *
+     * The progress moves from its current value up to endProgress as the
+     * work reports it. The callback gets "failed" if the work throws and
+     * "done" otherwise, and is invoked from the event loop while activating.
+     *
+     * @param[in] work - The write to run
+     * @param[in] endProgress - The progress once the work is done
+     * @param[in] callback - Called with the result of the write
+     */
+    void runFlashWorker(
+        std::function<void(const FlashProgress&, const FlashEstimate&)> work,
+        uint8_t endProgress, JobTracker::Callback callback);
+
+    /** @brief Publish the estimate of a partition write
+     *
+     * The partitions of one worker are written concurrently, so the
+     * estimated completion is that of the slowest.
+     *
+     * @param[in] partition - The partition
+     * @param[in] bytes - The bytes to write to it
+     * @param[in] duration - The estimated duration of the write, if known
+     */
+    void publishEstimate(const std::string& partition, uint64_t bytes,
+                         std::optional<std::chrono::seconds> duration);
+
+    /** @brief Clear the estimate of a previous attempt */
+    void resetEstimate();
+
+    /** @brief Publishes the estimate, created by the first one */
+    std::shared_ptr<sdbusplus::asio::dbus_interface> estimateInterface;
+
+    /** @brief The bytes to write to each partition */
+    std::map<std::string, uint64_t> bytesToWrite;
+
+    /** @brief Estimated completion in seconds since the epoch, 0 if
+     * unknown */
+    uint64_t estimatedCompletion = 0;
+
+    /** @brief Expires with this object, for work posted by the writer */
+    std::shared_ptr<char> lifetime = std::make_shared<char>();
+
+#ifdef WANT_SIGNATURE_VERIFY
     /** @brief Verify signature of the images.
      *
      * @param[in] imageDir - The path of images to verify
@@ -379,6 +528,10 @@ class Activation : public ActivationInherit, public Flash
     /** @brief Called when image verification fails. */
     void onVerifyFailed();
 #endif
+
+    /** @brief The flash worker thread, declared last so that it is stopped
+     * and joined before anything it uses is destroyed */
+    std::jthread flashWorker;
 };
 
 } // namespace updater
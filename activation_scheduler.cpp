@@ -0,0 +1,142 @@
+#include "activation_scheduler.hpp"
+
+#include <algorithm>
+
+namespace phosphor
+{
+namespace software
+{
+namespace updater
+{
+
+bool ActivationScheduler::request(const std::string& id,
+                                  const std::set<std::string>& resources,
+                                  Start start)
+{
+    // A failed activation may be requested again
+    remove(runningEntries, id);
+    remove(queuedEntries, id);
+
+    bool runNow = !conflicts(resources, runningEntries) &&
+                  !conflicts(resources, queuedEntries);
+    if (runNow)
+    {
+        runningEntries.push_back({id, resources, {}});
+    }
+    else
+    {
+        queuedEntries.push_back({id, resources, std::move(start)});
+    }
+    notify();
+    return runNow;
+}
+
+void ActivationScheduler::release(const std::string& id)
+{
+    if (!remove(runningEntries, id) && !remove(queuedEntries, id))
+    {
+        return;
+    }
+
+    // Start what no longer conflicts with the running activations nor with
+    // an earlier queued one
+    std::vector<Start> starts;
+    std::vector<Entry> waiting;
+    for (auto& entry : queuedEntries)
+    {
+        if (conflicts(entry.resources, runningEntries) ||
+            conflicts(entry.resources, waiting))
+        {
+            waiting.push_back(std::move(entry));
+            continue;
+        }
+        starts.push_back(std::move(entry.start));
+        runningEntries.push_back({entry.id, entry.resources, {}});
+    }
+    queuedEntries = std::move(waiting);
+    notify();
+
+    // Last, a start may well request or release again
+    for (auto& start : starts)
+    {
+        if (start)
+        {
+            start();
+        }
+    }
+    notifyIdle();
+}
+
+void ActivationScheduler::whenIdle(Idle callback)
+{
+    idleCallbacks.push_back(std::move(callback));
+    notifyIdle();
+}
+
+bool ActivationScheduler::idle() const
+{
+    return runningEntries.empty() && queuedEntries.empty();
+}
+
+std::vector<std::string> ActivationScheduler::running() const
+{
+    std::vector<std::string> ids;
+    for (const auto& entry : runningEntries)
+    {
+        ids.push_back(entry.id);
+    }
+    return ids;
+}
+
+std::vector<std::string> ActivationScheduler::queued() const
+{
+    std::vector<std::string> ids;
+    for (const auto& entry : queuedEntries)
+    {
+        ids.push_back(entry.id);
+    }
+    return ids;
+}
+
+bool ActivationScheduler::conflicts(const std::set<std::string>& resources,
+                                    const std::vector<Entry>& entries)
+{
+    return std::any_of(entries.begin(), entries.end(),
+                       [&resources](const Entry& entry) {
+        return std::any_of(entry.resources.begin(), entry.resources.end(),
+                           [&resources](const std::string& resource) {
+            return resources.contains(resource);
+        });
+    });
+}
+
+bool ActivationScheduler::remove(std::vector<Entry>& entries,
+                                 const std::string& id)
+{
+    return std::erase_if(entries, [&id](const Entry& entry) {
+        return entry.id == id;
+    }) != 0;
+}
+
+void ActivationScheduler::notify()
+{
+    if (changed)
+    {
+        changed();
+    }
+}
+
+void ActivationScheduler::notifyIdle()
+{
+    // One at a time, a callback may request an activation or wait again
+    while (idle() && !idleCallbacks.empty())
+    {
+        auto callback = std::move(idleCallbacks.front());
+        idleCallbacks.erase(idleCallbacks.begin());
+        callback();
+    }
+}
+
+} // namespace updater
+} // namespace software
+} // namespace phosphor
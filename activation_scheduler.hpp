@@ -0,0 +1,132 @@
+#pragma once
+
+#include <functional>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace phosphor
+{
+namespace software
+{
+namespace updater
+{
+
+/** @class ActivationScheduler
+ *  @brief Decides which activations may write the flash at the same time.
+ *  @details Each activation names the resources it needs, e.g. the BMC
+ *  flash or the host BIOS flash. Activations that share no resource run
+ *  concurrently, one that conflicts with a running activation is queued and
+ *  started once the resources are released. Queued activations start in the
+ *  order they were requested: one never overtakes an earlier queued
+ *  activation it conflicts with.
+ */
+class ActivationScheduler
+{
+  public:
+    /** @brief Starts a queued activation */
+    using Start = std::function<void()>;
+
+    /** @brief Called whenever the running or queued activations change */
+    using Changed = std::function<void()>;
+
+    /** @brief Called once no activation is running nor queued */
+    using Idle = std::function<void()>;
+
+    /** @brief The resource of activations writing the BMC flash */
+    static constexpr auto bmcFlash = "bmc-flash";
+
+    /** @brief The resource of activations writing the host BIOS flash */
+    static constexpr auto biosFlash = "bios-flash";
+
+    /** @brief Constructor
+     *
+     *  @param[in] changed - Called when the running or queued activations
+     *                       change
+     */
+    explicit ActivationScheduler(Changed changed = {}) :
+        changed(std::move(changed))
+    {}
+
+    /** @brief Ask to run an activation
+     *
+     *  @param[in] id - Identifies the activation
+     *  @param[in] resources - The resources the activation needs
+     *  @param[in] start - Called once the activation may run, if it cannot
+     *                     run right away
+     *
+     *  @return Whether the activation may run right away, in which case the
+     *          caller starts it and start is not used
+     */
+    bool request(const std::string& id, const std::set<std::string>& resources,
+                 Start start);
+
+    /** @brief Release the resources of an activation, or drop it from the
+     *  queue, and start the queued activations that may now run
+     *  @details Does nothing for an unknown activation.
+     *
+     *  @param[in] id - Identifies the activation
+     */
+    void release(const std::string& id);
+
+    /** @brief Run a callback once no activation is running nor queued
+     *  @details Runs it right away if that is already the case, otherwise
+     *  from the release of the last activation.
+     *
+     *  @param[in] callback - Called once idle
+     */
+    void whenIdle(Idle callback);
+
+    /** @brief Whether no activation is running nor queued */
+    bool idle() const;
+
+    /** @brief The running activations, in the order they started */
+    std::vector<std::string> running() const;
+
+    /** @brief The queued activations, in the order they will start */
+    std::vector<std::string> queued() const;
+
+  private:
+    /** @brief An activation and its resources */
+    struct Entry
+    {
+        /** @brief Identifies the activation */
+        std::string id;
+        /** @brief The resources it needs */
+        std::set<std::string> resources;
+        /** @brief Starts it once dequeued */
+        Start start;
+    };
+
+    /** @brief Whether an activation conflicts with any of a list */
+    static bool conflicts(const std::set<std::string>& resources,
+                          const std::vector<Entry>& entries);
+
+    /** @brief Remove an activation from a list
+     *
+     *  @return Whether it was in the list
+     */
+    static bool remove(std::vector<Entry>& entries, const std::string& id);
+
+    /** @brief Notify that the running or queued activations changed */
+    void notify();
+
+    /** @brief Run the idle callbacks, if idle */
+    void notifyIdle();
+
+    /** @brief The running activations */
+    std::vector<Entry> runningEntries;
+
+    /** @brief The queued activations */
+    std::vector<Entry> queuedEntries;
+
+    /** @brief Called on changes */
+    Changed changed;
+
+    /** @brief Waiting for no activation to run */
+    std::vector<Idle> idleCallbacks;
+};
+
+} // namespace updater
+} // namespace software
+} // namespace phosphor
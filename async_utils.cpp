@@ -0,0 +1,70 @@
+#include "config.h"
+
+#include "async_utils.hpp"
+
+#include "utils.hpp"
+
+#include <phosphor-logging/lg2.hpp>
+
+#include <utility>
+#include <vector>
+
+namespace utils
+{
+
+PHOSPHOR_LOG2_USING;
+
+void getServiceAsync(sdbusplus::asio::connection& bus, const std::string& path,
+                     const std::string& interface,
+                     std::function<void(const std::string& service)> callback)
+{
+    auto& cache = getServiceCache(bus);
+    if (auto service = cache.lookup(path, interface))
+    {
+        callback(*service);
+        return;
+    }
+
+    bus.async_method_call(
+        [&cache, path, interface, callback = std::move(callback)](
+            const boost::system::error_code& ec,
+            const std::vector<std::pair<std::string, std::vector<std::string>>>&
+                response) {
+        if (ec)
+        {
+            error(
+                "Error in mapper method call for ({PATH}, {INTERFACE}: {ERROR}",
+                "ERROR", ec.message(), "PATH", path, "INTERFACE", interface);
+            callback(std::string{});
+            return;
+        }
+        if (response.empty())
+        {
+            error(
+                "Empty response from mapper for getting service name: {PATH} {INTERFACE}",
+                "PATH", path, "INTERFACE", interface);
+            callback(std::string{});
+            return;
+        }
+        cache.insert(path, interface, response[0].first);
+        callback(response[0].first);
+    },
+        MAPPER_BUSNAME, MAPPER_PATH, MAPPER_BUSNAME, "GetObject", path,
+        std::vector<std::string>({interface}));
+}
+
+void startUnitAsync(sdbusplus::asio::connection& bus, const std::string& unit)
+{
+    bus.async_method_call(
+        [unit](const boost::system::error_code& ec) {
+        if (ec)
+        {
+            error("Failed to start {UNIT}: {ERROR}", "UNIT", unit, "ERROR",
+                  ec.message());
+        }
+    },
+        SYSTEMD_BUSNAME, SYSTEMD_PATH, SYSTEMD_INTERFACE, "StartUnit", unit,
+        "replace");
+}
+
+} // namespace utils
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <sdbusplus/asio/connection.hpp>
+
+#include <functional>
+#include <string>
+
+namespace utils
+{
+
+/**
+ * @brief Get the bus service without blocking the event loop
+ *
+ * Shares the cache of utils::getService(). A cached service is reported
+ * from within this call.
+ *
+ * @param[in] bus - The asio D-Bus connection
+ * @param[in] path - The D-Bus object path
+ * @param[in] interface - The D-Bus interface
+ * @param[in] callback - Called with the service name, empty on failure
+ **/
+void getServiceAsync(sdbusplus::asio::connection& bus, const std::string& path,
+                     const std::string& interface,
+                     std::function<void(const std::string& service)> callback);
+
+/**
+ * @brief Start a systemd unit without waiting for the reply
+ *
+ * Failures are logged. Use JobTracker to act on the completion of the job.
+ *
+ * @param[in] bus - The asio D-Bus connection
+ * @param[in] unit - The unit to start
+ **/
+void startUnitAsync(sdbusplus::asio::connection& bus, const std::string& unit);
+
+} // namespace utils
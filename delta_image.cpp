@@ -0,0 +1,500 @@
+#include "delta_image.hpp"
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <unordered_map>
+
+extern char** environ;
+
+namespace phosphor
+{
+namespace software
+{
+namespace updater
+{
+
+namespace fs = std::filesystem;
+
+namespace
+{
+
+constexpr std::array<char, 8> deltaMagic{'O', 'B', 'M', 'C',
+                                         'D', 'L', 'T', '1'};
+
+/** @brief Magic of a delta whose records are zstd compressed */
+constexpr std::array<char, 8> compressedMagic{'O', 'B', 'M', 'C',
+                                              'D', 'L', 'T', '2'};
+
+constexpr size_t digestSize = 64;
+
+/** @brief Decode a little endian integer */
+template <typename T>
+T decodeInt(const std::array<uint8_t, sizeof(T)>& bytes)
+{
+    T value = 0;
+    for (size_t i = 0; i < bytes.size(); i++)
+    {
+        value |= static_cast<T>(bytes[i]) << (8 * i);
+    }
+    return value;
+}
+
+/** @brief Read a little endian integer */
+template <typename T>
+T readInt(std::istream& in)
+{
+    std::array<uint8_t, sizeof(T)> bytes{};
+    if (!in.read(reinterpret_cast<char*>(bytes.data()), bytes.size()))
+    {
+        throw std::runtime_error("Delta is truncated");
+    }
+    return decodeInt<T>(bytes);
+}
+
+/** @brief Write a little endian integer */
+template <typename T>
+void writeInt(std::ostream& out, T value)
+{
+    for (size_t i = 0; i < sizeof(T); i++)
+    {
+        out.put(static_cast<char>((value >> (8 * i)) & 0xff));
+    }
+}
+
+/** @brief Read the header, leaving the stream at the first record */
+DeltaImage::Header readHeader(std::istream& in)
+{
+    std::array<char, deltaMagic.size()> magic{};
+    if (!in.read(magic.data(), magic.size()) ||
+        (magic != deltaMagic && magic != compressedMagic))
+    {
+        throw std::runtime_error("Not a delta image");
+    }
+
+    DeltaImage::Header header{};
+    header.compressed = magic == compressedMagic;
+    header.blockSize = readInt<uint32_t>(in);
+    header.targetSize = readInt<uint64_t>(in);
+    header.baseVersion.resize(readInt<uint16_t>(in));
+    header.targetDigest.resize(digestSize);
+    if (!in.read(header.baseVersion.data(), header.baseVersion.size()) ||
+        !in.read(header.targetDigest.data(), header.targetDigest.size()))
+    {
+        throw std::runtime_error("Delta is truncated");
+    }
+    if (header.blockSize == 0)
+    {
+        throw std::runtime_error("Delta has no block size");
+    }
+    return header;
+}
+
+/** @brief Offset of the first record */
+off_t recordsOffset(const DeltaImage::Header& header)
+{
+    return deltaMagic.size() + sizeof(uint32_t) + sizeof(uint64_t) +
+           sizeof(uint16_t) + header.baseVersion.size() + digestSize;
+}
+
+/** @brief Number of blocks of the target */
+uint64_t blockCount(const DeltaImage::Header& header)
+{
+    return (header.targetSize + header.blockSize - 1) / header.blockSize;
+}
+
+/** @brief Size of a block of the target, the last one may be short */
+size_t blockLength(const DeltaImage::Header& header, uint64_t block)
+{
+    return std::min<uint64_t>(header.blockSize,
+                              header.targetSize - block * header.blockSize);
+}
+
+/** @brief Read a whole file */
+std::vector<uint8_t> readFile(const std::string& path)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+    {
+        throw std::runtime_error("Failed to open " + path);
+    }
+    return {std::istreambuf_iterator<char>(in),
+            std::istreambuf_iterator<char>()};
+}
+
+/** @brief Append a file to another as one zstd frame */
+void appendCompressed(const std::string& path, const std::string& to)
+{
+    int out = open(to.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (out < 0)
+    {
+        throw std::runtime_error("Failed to open " + to + ": " +
+                                 std::strerror(errno));
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+    std::array<const char*, 5> argv{"zstd", "-c", "-q", path.c_str(),
+                                    nullptr};
+    pid_t pid = -1;
+    auto rc = posix_spawnp(&pid, "zstd", &actions, nullptr,
+                           const_cast<char* const*>(argv.data()), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(out);
+    if (rc != 0)
+    {
+        throw std::runtime_error("Failed to run zstd: " +
+                                 std::string(std::strerror(rc)));
+    }
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+    {}
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        throw std::runtime_error("Failed to compress " + to);
+    }
+}
+
+} // namespace
+
+/** @class DeltaRecords
+ *  @brief Reads the records of a delta through a buffer, decompressing
+ *  them if needed
+ */
+class DeltaRecords
+{
+  public:
+    /** @brief Constructor
+     *
+     *  @param[in] path - Path to the delta
+     *  @param[in] header - Its header
+     *
+     *  @throw std::runtime_error if the delta cannot be read
+     */
+    DeltaRecords(const std::string& path, const DeltaImage::Header& header) :
+        buffer(64 * 1024)
+    {
+        if (header.compressed)
+        {
+            source = std::make_unique<ZstdSource>(path, recordsOffset(header));
+        }
+        else
+        {
+            source = std::make_unique<FileSource>(path, recordsOffset(header));
+        }
+    }
+
+    /** @brief Read exactly size bytes
+     *
+     *  @throw std::runtime_error if the delta ends before
+     */
+    void read(uint8_t* data, size_t size)
+    {
+        while (size > 0)
+        {
+            if (pos == end)
+            {
+                pos = 0;
+                end = source->read(buffer.data(), buffer.size());
+                if (end == 0)
+                {
+                    throw std::runtime_error("Delta is truncated");
+                }
+            }
+            auto n = std::min(size, end - pos);
+            std::memcpy(data, buffer.data() + pos, n);
+            pos += n;
+            data += n;
+            size -= n;
+        }
+    }
+
+    /** @brief Read a little endian integer */
+    template <typename T>
+    T readInt()
+    {
+        std::array<uint8_t, sizeof(T)> bytes{};
+        read(bytes.data(), bytes.size());
+        return decodeInt<T>(bytes);
+    }
+
+    /** @brief Check that the records are all read and that they were
+     *  decompressed successfully
+     *
+     *  @throw std::runtime_error otherwise
+     */
+    void finish()
+    {
+        uint8_t extra = 0;
+        if (pos != end || source->read(&extra, 1) != 0)
+        {
+            throw std::runtime_error("Delta has trailing data");
+        }
+        source->finish();
+    }
+
+  private:
+    /** @brief The file or the decompressor */
+    std::unique_ptr<Source> source;
+
+    /** @brief Data read from the source */
+    std::vector<uint8_t> buffer;
+
+    /** @brief Position of the next byte in the buffer */
+    size_t pos = 0;
+
+    /** @brief End of the data in the buffer */
+    size_t end = 0;
+};
+
+DeltaImage::Header DeltaImage::readHeader(const std::string& path)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+    {
+        throw std::runtime_error("Failed to open " + path);
+    }
+    return updater::readHeader(in);
+}
+
+void DeltaImage::validate(const std::string& path, bool inPlace)
+{
+    auto header = readHeader(path);
+    DeltaRecords records(path, header);
+    std::vector<uint8_t> data(header.blockSize);
+
+    for (uint64_t block = 0; block < blockCount(header); block++)
+    {
+        auto op = static_cast<Op>(records.readInt<uint8_t>());
+        if (op == Op::copy)
+        {
+            auto index = records.readInt<uint64_t>();
+            if (inPlace && index < block)
+            {
+                throw std::runtime_error(
+                    "Delta copies block " + std::to_string(index) +
+                    " after it is overwritten");
+            }
+        }
+        else if (op == Op::data)
+        {
+            records.read(data.data(), blockLength(header, block));
+        }
+        else
+        {
+            throw std::runtime_error("Invalid delta record");
+        }
+    }
+    records.finish();
+}
+
+void DeltaImage::create(const std::string& base, const std::string& target,
+                        const std::string& baseVersion,
+                        const std::string& delta, uint32_t blockSize,
+                        bool compress)
+{
+    auto baseData = readFile(base);
+    auto targetData = readFile(target);
+
+    // Index the full blocks of the base by content
+    std::unordered_map<std::string_view, uint64_t> baseBlocks;
+    for (uint64_t i = 0; (i + 1) * blockSize <= baseData.size(); i++)
+    {
+        baseBlocks.try_emplace(
+            std::string_view(reinterpret_cast<const char*>(baseData.data()) +
+                                 i * blockSize,
+                             blockSize),
+            i);
+    }
+
+    Sha256Sink hash;
+    hash.write(targetData.data(), targetData.size());
+    hash.finish();
+
+    std::ofstream out(delta, std::ios::binary | std::ios::trunc);
+    const auto& magic = compress ? compressedMagic : deltaMagic;
+    out.write(magic.data(), magic.size());
+    writeInt<uint32_t>(out, blockSize);
+    writeInt<uint64_t>(out, targetData.size());
+    writeInt<uint16_t>(out, baseVersion.size());
+    out.write(baseVersion.data(), baseVersion.size());
+    out.write(hash.digest().data(), hash.digest().size());
+
+    // Compressed records are written aside, then appended by zstd
+    auto recordsPath = delta + ".records";
+    std::ofstream aside;
+    if (compress)
+    {
+        aside.open(recordsPath, std::ios::binary | std::ios::trunc);
+    }
+    std::ostream& records = compress ? aside : out;
+
+    for (uint64_t offset = 0, i = 0; offset < targetData.size();
+         offset += blockSize, i++)
+    {
+        size_t length = std::min<uint64_t>(blockSize,
+                                           targetData.size() - offset);
+        std::string_view block(
+            reinterpret_cast<const char*>(targetData.data()) + offset,
+            length);
+
+        // Prefer the block at the same index, which also keeps the delta
+        // applicable in place
+        std::optional<uint64_t> index;
+        if (length == blockSize && offset + blockSize <= baseData.size() &&
+            std::equal(block.begin(), block.end(),
+                       baseData.begin() + offset))
+        {
+            index = i;
+        }
+        else if (auto it = baseBlocks.find(block);
+                 length == blockSize && it != baseBlocks.end())
+        {
+            index = it->second;
+        }
+
+        if (index)
+        {
+            writeInt<uint8_t>(records, static_cast<uint8_t>(Op::copy));
+            writeInt<uint64_t>(records, *index);
+        }
+        else
+        {
+            writeInt<uint8_t>(records, static_cast<uint8_t>(Op::data));
+            records.write(block.data(), block.size());
+        }
+    }
+
+    if (!out.flush() || !records.flush())
+    {
+        fs::remove(recordsPath);
+        throw std::runtime_error("Failed to write " + delta);
+    }
+    if (compress)
+    {
+        out.close();
+        aside.close();
+        try
+        {
+            appendCompressed(recordsPath, delta);
+        }
+        catch (...)
+        {
+            fs::remove(recordsPath);
+            throw;
+        }
+        fs::remove(recordsPath);
+    }
+}
+
+DeltaSource::DeltaSource(const std::string& deltaPath,
+                         const std::string& basePath, bool inPlace) :
+    basePath(basePath), base(open(basePath.c_str(), O_RDONLY | O_CLOEXEC)),
+    inPlace(inPlace)
+{
+    if (base < 0)
+    {
+        throw std::runtime_error("Failed to open " + basePath + ": " +
+                                 std::strerror(errno));
+    }
+    try
+    {
+        deltaHeader = DeltaImage::readHeader(deltaPath);
+        records = std::make_unique<DeltaRecords>(deltaPath, deltaHeader);
+    }
+    catch (...)
+    {
+        close(base);
+        throw;
+    }
+}
+
+DeltaSource::~DeltaSource()
+{
+    close(base);
+}
+
+size_t DeltaSource::read(uint8_t* data, size_t size)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        if (pendingPos == pending.size())
+        {
+            if (produced == deltaHeader.targetSize)
+            {
+                break;
+            }
+            nextBlock();
+        }
+        auto n = std::min(size - done, pending.size() - pendingPos);
+        std::memcpy(data + done, pending.data() + pendingPos, n);
+        pendingPos += n;
+        done += n;
+    }
+    return done;
+}
+
+void DeltaSource::nextBlock()
+{
+    pending.resize(blockLength(deltaHeader, block));
+    pendingPos = 0;
+
+    auto op = static_cast<DeltaImage::Op>(records->readInt<uint8_t>());
+    if (op == DeltaImage::Op::copy)
+    {
+        auto index = records->readInt<uint64_t>();
+        if (inPlace && index < block)
+        {
+            throw std::runtime_error("Delta copies block " +
+                                     std::to_string(index) +
+                                     " after it is overwritten");
+        }
+        auto n = pread(base, pending.data(), pending.size(),
+                       index * deltaHeader.blockSize);
+        if (n != static_cast<ssize_t>(pending.size()))
+        {
+            throw std::runtime_error("Failed to read block " +
+                                     std::to_string(index) + " of " +
+                                     basePath);
+        }
+    }
+    else if (op == DeltaImage::Op::data)
+    {
+        records->read(pending.data(), pending.size());
+    }
+    else
+    {
+        throw std::runtime_error("Invalid delta record");
+    }
+
+    produced += pending.size();
+    block++;
+}
+
+void DeltaSource::finish()
+{
+    if (produced != deltaHeader.targetSize)
+    {
+        throw std::runtime_error("Delta ended early");
+    }
+    records->finish();
+}
+
+} // namespace updater
+} // namespace software
+} // namespace phosphor
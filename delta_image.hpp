@@ -0,0 +1,173 @@
+#pragma once
+
+#include "pipeline.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace phosphor
+{
+namespace software
+{
+namespace updater
+{
+
+/** @class DeltaImage
+ *  @brief Block-level difference of an image against a base version.
+ *  @details A delta is shipped in the image tarball as <image>.delta, in
+ *  place of <image>, and is signed like any other image. It starts with a
+ *  header naming the base version and the SHA-256 of the target image,
+ *  followed by one record per target block: either the index of a base
+ *  block to copy, or the block data itself. All integers are little
+ *  endian.
+ *
+ *    magic "OBMCDLT1" or "OBMCDLT2" | u32 block size | u64 target size |
+ *    u16 length + base version | 64 hex digits of the target SHA-256 |
+ *    records: u8 0 + u64 base block index, or u8 1 + block data
+ *
+ *  The last block of the target may be short, its data record is then
+ *  short as well. With "OBMCDLT2" the records are compressed as a single
+ *  zstd frame, so that a delta stays smaller than the compressed full
+ *  image it replaces. The header is never compressed.
+ */
+class DeltaImage
+{
+  public:
+    /** @brief The header of a delta */
+    struct Header
+    {
+        /** @brief Size of each block */
+        uint32_t blockSize;
+        /** @brief Size of the reconstructed image */
+        uint64_t targetSize;
+        /** @brief Version of the image the delta applies to */
+        std::string baseVersion;
+        /** @brief SHA-256 of the reconstructed image as a hex string */
+        std::string targetDigest;
+        /** @brief Whether the records are zstd compressed */
+        bool compressed;
+    };
+
+    /** @brief Record types */
+    enum class Op : uint8_t
+    {
+        copy = 0,
+        data = 1,
+    };
+
+    /** @brief Read the header of a delta
+     *
+     *  @param[in] path - Path to the delta
+     *
+     *  @return The header
+     *
+     *  @throw std::runtime_error if the file is not a valid delta
+     */
+    static Header readHeader(const std::string& path);
+
+    /** @brief Check that every record of a delta is well formed
+     *
+     *  @param[in] path - Path to the delta
+     *  @param[in] inPlace - Whether the base will be overwritten by the
+     *                       target, which requires every copied block to
+     *                       come from the same or a later index
+     *
+     *  @throw std::runtime_error if the delta cannot be applied
+     */
+    static void validate(const std::string& path, bool inPlace);
+
+    /** @brief Create a delta, e.g. for tests or release tooling
+     *
+     *  @param[in] base - The base image
+     *  @param[in] target - The target image
+     *  @param[in] baseVersion - The version of the base image
+     *  @param[in] delta - Path of the delta to write
+     *  @param[in] blockSize - Size of each block
+     *  @param[in] compress - Whether to compress the records, which runs
+     *                        zstd
+     *
+     *  @throw std::runtime_error on failure
+     */
+    static void create(const std::string& base, const std::string& target,
+                       const std::string& baseVersion,
+                       const std::string& delta, uint32_t blockSize = 4096,
+                       bool compress = true);
+};
+
+/** @brief Reads the records of a delta, compressed or not */
+class DeltaRecords;
+
+/** @class DeltaSource
+ *  @brief Pipeline source reconstructing the target image of a delta
+ */
+class DeltaSource : public Source
+{
+  public:
+    /** @brief Constructor
+     *
+     *  @param[in] delta - Path to the delta
+     *  @param[in] base - The partition or file holding the base image
+     *  @param[in] inPlace - Whether the target is written over the base
+     *
+     *  @throw std::runtime_error if the delta or base cannot be opened
+     */
+    DeltaSource(const std::string& delta, const std::string& base,
+                bool inPlace = false);
+    ~DeltaSource() override;
+
+    DeltaSource(const DeltaSource&) = delete;
+    DeltaSource& operator=(const DeltaSource&) = delete;
+
+    std::string name() const override
+    {
+        return "delta";
+    }
+
+    size_t read(uint8_t* data, size_t size) override;
+
+    /** @brief Checks that the whole target has been produced */
+    void finish() override;
+
+    /** @brief The header of the delta */
+    const DeltaImage::Header& header() const
+    {
+        return deltaHeader;
+    }
+
+  private:
+    /** @brief Reconstruct the next block into the pending buffer */
+    void nextBlock();
+
+    /** @brief The records of the delta, positioned at the next one */
+    std::unique_ptr<DeltaRecords> records;
+
+    /** @brief The header of the delta */
+    DeltaImage::Header deltaHeader;
+
+    /** @brief The path of the base, for error messages */
+    std::string basePath;
+
+    /** @brief The open base */
+    int base;
+
+    /** @brief Whether the target is written over the base */
+    bool inPlace;
+
+    /** @brief Index of the next block */
+    uint64_t block = 0;
+
+    /** @brief Number of bytes produced */
+    uint64_t produced = 0;
+
+    /** @brief The block being handed out */
+    std::vector<uint8_t> pending;
+
+    /** @brief Bytes of the pending block already handed out */
+    size_t pendingPos = 0;
+};
+
+} // namespace updater
+} // namespace software
+} // namespace phosphor
@@ -1,6 +1,6 @@
 #pragma once
 
-#include <sdbusplus/bus.hpp>
+#include <string>
 
 namespace phosphor
 {
@@ -23,13 +23,18 @@ class Flash
 
     /**
      * @brief Writes the image file(s) to flash
+     *
+     * @throw std::runtime_error if the write fails before it returns, a
+     *        write completing later reports through onStateChanges()
      */
     virtual void flashWrite() = 0;
 
     /**
-     * @brief Takes action when the state of the activation service file changes
+     * @brief Takes action when a job started to write the flash completes
+     *
+     * @param[in] result - The systemd job result
      */
-    virtual void onStateChanges(sdbusplus::message_t& msg) = 0;
+    virtual void onStateChanges(const std::string& result) = 0;
 };
 
 } // namespace updater
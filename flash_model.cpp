@@ -0,0 +1,111 @@
+#include "flash_model.hpp"
+
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+namespace phosphor
+{
+namespace software
+{
+namespace updater
+{
+
+FlashModel::FlashModel(const std::string& path) : path(path)
+{
+    // One line per chip: the chip and its erase, program and read
+    // rates. A missing or damaged model only means no estimates.
+    std::ifstream file(path);
+    std::string device;
+    Rates rates;
+    while (file >> device >> rates.erase >> rates.program >> rates.read)
+    {
+        devices[device] = rates;
+    }
+}
+
+std::optional<FlashModel::Rates>
+    FlashModel::rates(const std::string& device) const
+{
+    auto it = devices.find(chip(device));
+    if (it == devices.end())
+    {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+void FlashModel::store(const std::string& device, const Rates& rates)
+{
+    devices[chip(device)] = rates;
+
+    // Replace the model atomically, so that a crash while writing it
+    // leaves the previous one behind
+    std::error_code ec;
+    std::filesystem::create_directories(
+        std::filesystem::path(path).parent_path(), ec);
+    auto tmp = path + ".tmp";
+    {
+        std::ofstream file(tmp, std::ios::trunc);
+        for (const auto& [name, deviceRates] : devices)
+        {
+            file << name << " " << deviceRates.erase << " "
+                 << deviceRates.program << " " << deviceRates.read << "\n";
+        }
+        if (!file.flush())
+        {
+            throw std::runtime_error("Failed to write " + tmp);
+        }
+    }
+    std::filesystem::rename(tmp, path, ec);
+    if (ec)
+    {
+        throw std::runtime_error("Failed to write " + path + ": " +
+                                 ec.message());
+    }
+}
+
+std::string FlashModel::chip(const std::string& device)
+{
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    auto path = fs::canonical(device, ec);
+    if (ec)
+    {
+        return device;
+    }
+    auto name = path.filename().string();
+
+    // An MTD partition links to the MTD device or controller it is on
+    auto parent = fs::canonical(fs::path("/sys/class/mtd") / name / "device",
+                                ec);
+    if (!ec)
+    {
+        return parent.filename().string();
+    }
+
+    // A block partition is a directory of its disk
+    auto block = fs::canonical(fs::path("/sys/class/block") / name, ec);
+    if (!ec && fs::exists(block / "partition", ec))
+    {
+        return block.parent_path().filename().string();
+    }
+    return path.string();
+}
+
+std::chrono::seconds FlashModel::duration(const Rates& rates,
+                                          uint64_t compared, uint64_t written)
+{
+    auto time = [](uint64_t bytes, double rate) {
+        return rate > 0 ? bytes / rate : 0.0;
+    };
+    // Written blocks are also read back to verify them
+    double seconds = time(compared, rates.read) +
+                     time(written, rates.erase) +
+                     time(written, rates.program) + time(written, rates.read);
+    return std::chrono::seconds(static_cast<int64_t>(seconds + 0.5));
+}
+
+} // namespace updater
+} // namespace software
+} // namespace phosphor
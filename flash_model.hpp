@@ -0,0 +1,91 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+
+namespace phosphor
+{
+namespace software
+{
+namespace updater
+{
+
+/** @class FlashModel
+ *  @brief Persisted throughput of the flash devices the updater writes.
+ *  @details The rates are measured once per flash chip with
+ *  MtdWriter::characterize(), e.g. with phosphor-image-updater
+ *  --characterize on a spare partition, and are used to estimate how long
+ *  an activation will take from the number of bytes it has to compare and
+ *  to write. They are kept per chip, so measuring one partition covers all
+ *  the partitions of the same chip.
+ */
+class FlashModel
+{
+  public:
+    /** @brief Throughput of a device in bytes per second */
+    struct Rates
+    {
+        /** @brief Erase throughput, 0 for devices that are not erased */
+        double erase = 0;
+        /** @brief Program throughput */
+        double program = 0;
+        /** @brief Read throughput */
+        double read = 0;
+    };
+
+    /** @brief Constructor, loads the persisted model
+     *
+     *  @param[in] path - Path to the model, which may not exist yet
+     */
+    explicit FlashModel(const std::string& path);
+
+    /** @brief The measured rates of the chip of a device, if any */
+    std::optional<Rates> rates(const std::string& device) const;
+
+    /** @brief Record the rates of the chip of a device and persist the
+     *  model
+     *
+     *  @param[in] device - The device, or partition, that was measured
+     *  @param[in] rates - The measured rates
+     *
+     *  @throw std::runtime_error if the model cannot be written
+     */
+    void store(const std::string& device, const Rates& rates);
+
+    /** @brief Estimate how long a write takes
+     *
+     *  @details The image is compared with the device first, then the
+     *  blocks that differ are erased, programmed and read back.
+     *
+     *  @param[in] rates - The rates of the device
+     *  @param[in] compared - Number of bytes compared
+     *  @param[in] written - Number of bytes written
+     *
+     *  @return The estimated duration
+     */
+    static std::chrono::seconds duration(const Rates& rates, uint64_t compared,
+                                         uint64_t written);
+
+    /** @brief The chip a device is on, which the model is keyed by
+     *
+     *  @param[in] device - An MTD or block device, or a partition of one
+     *
+     *  @return The name of the MTD or disk device the partition is on, or
+     *          the device itself if it is not a partition
+     */
+    static std::string chip(const std::string& device);
+
+  private:
+    /** @brief Path to the persisted model */
+    std::string path;
+
+    /** @brief The rates of each measured chip */
+    std::map<std::string, Rates> devices;
+};
+
+} // namespace updater
+} // namespace software
+} // namespace phosphor
@@ -170,9 +170,9 @@ bool Signature::verify()
 
         if (!valid)
         {
-            // Validate bmcImages
-            imageUpdateList.clear();
-            imageUpdateList.assign(bmcImages.begin(), bmcImages.end());
+            // Validate bmcImages, the signature of an image shipped as a
+            // delta covers the delta
+            imageUpdateList = resolveDeltaImages(imageDirPath, bmcImages);
             valid = checkAndVerifyImage(imageDirPath, publicKeyFile,
                                         imageUpdateList, bmcFilesFound);
             if (bmcFilesFound && !valid)
@@ -2,9 +2,11 @@
 
 #include "images.hpp"
 
+#include <filesystem>
 #include <iterator>
 #include <sstream>
 #include <string>
+#include <system_error>
 #include <vector>
 
 namespace phosphor
@@ -23,6 +25,30 @@ std::vector<std::string> getOptionalImages()
     return optionalImages;
 }
 
+std::vector<std::string> resolveDeltaImages(
+    const std::string& dir, const std::vector<std::string>& images)
+{
+    std::vector<std::string> resolved;
+    for (const auto& image : images)
+    {
+        std::filesystem::path file(dir);
+        file /= image;
+        auto delta = image + deltaImageExt;
+
+        std::error_code ec;
+        if (!std::filesystem::exists(file, ec) &&
+            std::filesystem::exists(std::filesystem::path(dir) / delta, ec))
+        {
+            resolved.push_back(delta);
+        }
+        else
+        {
+            resolved.push_back(image);
+        }
+    }
+    return resolved;
+}
+
 } // namespace image
 } // namespace software
 } // namespace phosphor
@@ -25,8 +25,22 @@ const std::vector<std::string> bmcImages = {"image-kernel", "image-rofs",
 // BMC flash image file name list for full flash image (image-bmc)
 const std::string bmcFullImages = {"image-bmc"};
 
+// Suffix of an image shipped as a delta against an installed version
+constexpr auto deltaImageExt = ".delta";
+
 std::vector<std::string> getOptionalImages();
 
+/** @brief Substitute <image>.delta for the images of a list that are only
+ *  present in the image directory as a delta
+ *
+ *  @param[in] dir - The image directory
+ *  @param[in] images - The image file names
+ *
+ *  @return The file names that are present, or the names of the list
+ */
+std::vector<std::string> resolveDeltaImages(
+    const std::string& dir, const std::vector<std::string>& images);
+
 } // namespace image
 } // namespace software
 } // namespace phosphor
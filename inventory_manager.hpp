@@ -1,4 +1,5 @@
 #pragma once
+#include "uboot_env.hpp"
 #include "utils.hpp"
 #include "version_inv_entry.hpp"
 
@@ -115,16 +116,18 @@ class InventoryManager :
      * recreation upon reboot. */
     void reset()
     {
-        constexpr auto setFactoryResetWait = std::chrono::seconds(3);
+        phosphor::software::updater::UbootEnv env;
+
         // Mark the read-write partition for recreation upon reboot.
-        utils::execute("/sbin/fw_setenv", "openbmconce", "factory-reset");
+        env.set("openbmconce", "factory-reset");
 
         // used to create a RF log upon reboot
-        utils::execute("/sbin/fw_setenv", "openbmclog", "factory-reset");
+        env.set("openbmclog", "factory-reset");
 
-        // Need to wait for env variables to complete, otherwise an immediate
-        // reboot will not factory reset.
-        std::this_thread::sleep_for(setFactoryResetWait);
+        if (!env.tryCommit())
+        {
+            return;
+        }
 
         log<level::INFO>("BMC factory reset will take effect upon reboot.");
     }
@@ -133,20 +136,22 @@ class InventoryManager :
      * recreation upon reboot, clears logs and diagnostic data */
     void completeReset()
     {
-        constexpr auto setCompleteResetWait = std::chrono::seconds(3);
+        phosphor::software::updater::UbootEnv env;
+
         // Mark the read-write partition for recreation upon reboot.
-        utils::execute("/sbin/fw_setenv", "openbmconce", "complete-reset");
+        env.set("openbmconce", "complete-reset");
 
 #ifdef OEM_NVIDIA_HMC_EMMC_ENABLED
         completeReset_utils::checkAndSetEmmcLoggingErase();
 #endif
 
         // used to create a RF log upon reboot
-        utils::execute("/sbin/fw_setenv", "openbmclog", "logs-reset");
+        env.set("openbmclog", "logs-reset");
 
-        // Need to wait for env variables to complete, otherwise an immediate
-        // reboot will not factory reset.
-        std::this_thread::sleep_for(setCompleteResetWait);
+        if (!env.tryCommit())
+        {
+            return;
+        }
 
         log<level::INFO>("BMC complete reset will take effect upon reboot.");
     }
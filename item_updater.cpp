@@ -2,6 +2,8 @@
 
 #include "item_updater.hpp"
 
+#include "async_utils.hpp"
+#include "delta_image.hpp"
 #include "images.hpp"
 #include "serialize.hpp"
 #include "version.hpp"
@@ -456,6 +458,11 @@ void ItemUpdater::erase(std::string entryId)
     }
     ItemUpdater::resetUbootEnvVars();
 
+    // The journal of an interrupted write is kept for when the version is
+    // activated again, whether or not it was installed
+    std::error_code ec;
+    fs::remove(flashJournalPath(entryId), ec);
+
     if (it != versions.end())
     {
         auto flashId = it->second->path();
@@ -507,8 +514,7 @@ ItemUpdater::ActivationStatus
     valid = checkImage(filePath, imageUpdateList);
     if (!valid)
     {
-        imageUpdateList.clear();
-        imageUpdateList.assign(bmcImages.begin(), bmcImages.end());
+        imageUpdateList = resolveDeltaImages(filePath, bmcImages);
         valid = checkImage(filePath, imageUpdateList);
         if (!valid)
         {
@@ -517,9 +523,101 @@ ItemUpdater::ActivationStatus
         }
     }
 
+    for (const auto& image : imageUpdateList)
+    {
+        if (!image.ends_with(deltaImageExt))
+        {
+            continue;
+        }
+#ifndef MMC_LAYOUT
+        error("Delta image {IMAGE} is only supported with the mmc layout",
+              "IMAGE", image);
+        return ItemUpdater::ActivationStatus::invalid;
+#else
+        try
+        {
+            auto delta = fs::path(filePath) / image;
+            auto header = DeltaImage::readHeader(delta);
+            if (ACTIVE_BMC_MAX_ALLOWED <= 1)
+            {
+                error("Delta image {IMAGE} needs active-bmc-max-allowed of "
+                      "2 or more",
+                      "IMAGE", image);
+                return ItemUpdater::ActivationStatus::invalid;
+            }
+            if (getDeltaBaseFlashId(header.baseVersion).empty())
+            {
+                error("Base version {VERSION} of {IMAGE} is not running",
+                      "VERSION", header.baseVersion, "IMAGE", image);
+                return ItemUpdater::ActivationStatus::invalid;
+            }
+            DeltaImage::validate(delta, false);
+        }
+        catch (const std::exception& e)
+        {
+            error("Invalid delta image {IMAGE}: {ERROR}", "IMAGE", image,
+                  "ERROR", e.what());
+            return ItemUpdater::ActivationStatus::invalid;
+        }
+#endif
+    }
+
     return ItemUpdater::ActivationStatus::ready;
 }
 
+std::string ItemUpdater::getDeltaBaseFlashId(const std::string& version) const
+{
+    // With a single active BMC the functional version is erased as well
+    if (ACTIVE_BMC_MAX_ALLOWED <= 1)
+    {
+        return {};
+    }
+
+    for (const auto& [id, versionPtr] : versions)
+    {
+        auto activation = activations.find(id);
+        if (versionPtr->isFunctional() && versionPtr->version() == version &&
+            activation != activations.end() &&
+            activation->second->activation() ==
+                server::Activation::Activations::Active)
+        {
+            return versionPtr->path();
+        }
+    }
+    return {};
+}
+
+void ItemUpdater::createQueueInterface(sdbusplus::asio::object_server& server,
+                                       const std::string& path)
+{
+    queueInterface = server.add_interface(path, activationQueueIntf);
+    queueInterface->register_property(
+        "Running", std::vector<sdbusplus::message::object_path>{});
+    queueInterface->register_property(
+        "Queued", std::vector<sdbusplus::message::object_path>{});
+    queueInterface->initialize();
+    publishQueue();
+}
+
+void ItemUpdater::publishQueue()
+{
+    if (!queueInterface)
+    {
+        return;
+    }
+
+    auto toPaths = [](const std::vector<std::string>& ids) {
+        std::vector<sdbusplus::message::object_path> paths;
+        for (const auto& id : ids)
+        {
+            paths.emplace_back((fs::path(SOFTWARE_OBJPATH) / id).string());
+        }
+        return paths;
+    };
+    queueInterface->set_property("Running", toPaths(scheduler.running()));
+    queueInterface->set_property("Queued", toPaths(scheduler.queued()));
+}
+
 void ItemUpdater::savePriority(const std::string& versionId, uint8_t value)
 {
     auto flashId = versions.find(versionId)->second->path();
@@ -587,13 +685,10 @@ void ItemUpdater::freePriority(uint8_t value, const std::string& versionId)
 
 void ItemUpdater::reset()
 {
-    constexpr auto setFactoryResetWait = std::chrono::seconds(3);
+    // The environment is written and synced before this returns, so an
+    // immediate reboot will factory reset without any further wait.
     helper.factoryReset();
 
-    // Need to wait for env variables to complete, otherwise an immediate reboot
-    // will not factory reset.
-    std::this_thread::sleep_for(setFactoryResetWait);
-
     log<level::INFO>("BMC factory reset will take effect upon reboot.");
 }
 
@@ -615,23 +710,33 @@ bool ItemUpdater::fieldModeEnabled(bool value)
     {
         control::FieldMode::fieldModeEnabled(value);
 
-        auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
-                                          SYSTEMD_INTERFACE, "StartUnit");
-        method.append("obmc-flash-bmc-setenv@fieldmode\\x3dtrue.service",
-                      "replace");
-        bus.call_noreply(method);
+        UbootEnv env;
+        env.set("fieldmode", "true");
+        env.tryCommit();
 
-        method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
-                                     SYSTEMD_INTERFACE, "StopUnit");
-        method.append("usr-local.mount", "replace");
-        bus.call_noreply(method);
+        bus.async_method_call(
+            [](const boost::system::error_code& ec) {
+            if (ec)
+            {
+                error("Failed to stop usr-local.mount: {ERROR}", "ERROR",
+                      ec.message());
+            }
+        },
+            SYSTEMD_BUSNAME, SYSTEMD_PATH, SYSTEMD_INTERFACE, "StopUnit",
+            "usr-local.mount", "replace");
 
         std::vector<std::string> usrLocal = {"usr-local.mount"};
 
-        method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
-                                     SYSTEMD_INTERFACE, "MaskUnitFiles");
-        method.append(usrLocal, false, true);
-        bus.call_noreply(method);
+        bus.async_method_call(
+            [](const boost::system::error_code& ec) {
+            if (ec)
+            {
+                error("Failed to mask usr-local.mount: {ERROR}", "ERROR",
+                      ec.message());
+            }
+        },
+            SYSTEMD_BUSNAME, SYSTEMD_PATH, SYSTEMD_INTERFACE, "MaskUnitFiles",
+            usrLocal, false, true);
     }
     else if (!value && control::FieldMode::fieldModeEnabled())
     {
@@ -645,19 +750,22 @@ bool ItemUpdater::fieldModeEnabled(bool value)
 void ItemUpdater::restoreFieldModeStatus()
 {
     // The fieldmode u-boot environment variable may not exist since it is not
-    // part of the default environment, run fw_printenv with 2>&1 to ignore the
-    // error message in the journal "Error: "fieldmode" not defined"
-    std::pair<int, std::string> ret = utils::execute("/sbin/fw_printenv", "-n",
-                                                     "fieldmode", "2>&1");
-
-    if (ret.first != 0)
+    // part of the default environment.
+    std::optional<std::string> fieldMode;
+    try
+    {
+        UbootEnv env;
+        fieldMode = env.get("fieldmode");
+    }
+    catch (const std::exception& e)
     {
+        error("Failed to read U-Boot environment: {ERROR}", "ERROR",
+              e.what());
         return;
     }
 
     // truncate any extra characters off the end to compare against a "true" str
-    std::string result = ret.second.substr(0, 4);
-    if (result == "true")
+    if (fieldMode && fieldMode->substr(0, 4) == "true")
     {
         ItemUpdater::fieldModeEnabled(true);
     }
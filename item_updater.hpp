@@ -1,16 +1,21 @@
 #pragma once
 
 #include "activation.hpp"
+#include "activation_scheduler.hpp"
 #include "item_updater_helper.hpp"
+#include "job_tracker.hpp"
 #include "version.hpp"
 #include "xyz/openbmc_project/Collection/DeleteAll/server.hpp"
 
+#include <sdbusplus/asio/connection.hpp>
+#include <sdbusplus/asio/object_server.hpp>
 #include <sdbusplus/server.hpp>
 #include <xyz/openbmc_project/Association/Definitions/server.hpp>
 #include <xyz/openbmc_project/Common/FactoryReset/server.hpp>
 #include <xyz/openbmc_project/Control/FieldMode/server.hpp>
 #include <xyz/openbmc_project/Software/UpdatePolicy/server.hpp>
 
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -34,6 +39,8 @@ using VersionClass = phosphor::software::manager::Version;
 using AssociationList =
     std::vector<std::tuple<std::string, std::string, std::string>>;
 
+constexpr auto activationQueueIntf = "com.nvidia.Software.ActivationQueue";
+
 /** @class ItemUpdater
  *  @brief Manages the activation of the BMC version items.
  */
@@ -53,13 +60,17 @@ class ItemUpdater : public ItemUpdaterInherit, FactoryResetInherit
     /** @brief Constructs ItemUpdater
      *
      * @param[in] bus    - The D-Bus bus object
+     * @param[in] server - The object server hosting the activation queue
      */
-    ItemUpdater(sdbusplus::bus_t& bus, const std::string& path) :
+    ItemUpdater(sdbusplus::asio::connection& bus,
+                sdbusplus::asio::object_server& server,
+                const std::string& path) :
         ItemUpdaterInherit(bus, path.c_str(),
                            ItemUpdaterInherit::action::defer_emit),
         FactoryResetInherit(bus, BMC_FACTORY_RESET_OBJPATH,
                             FactoryResetInherit::action::defer_emit),
-        bus(bus), helper(bus),
+        jobTracker(bus), scheduler([this]() { publishQueue(); }),
+        objectServer(server), bus(bus), helper(bus, jobTracker),
         versionMatch(bus,
                      MatchRules::interfacesAdded() +
                          MatchRules::path("/xyz/openbmc_project/software"),
@@ -70,6 +81,7 @@ class ItemUpdater : public ItemUpdaterInherit, FactoryResetInherit
         setBMCInventoryPath();
         processBMCImage();
         restoreFieldModeStatus();
+        createQueueInterface(server, path);
 #ifdef HOST_BIOS_UPGRADE
         createBIOSObject();
 #endif
@@ -169,6 +181,28 @@ class ItemUpdater : public ItemUpdaterInherit, FactoryResetInherit
      */
     void createUpdateableAssociation(const std::string& path);
 
+    /** @brief Find the partition a delta against a BMC version is applied to
+     *
+     *  Only the functional version can be a delta base: freeSpace() keeps
+     *  it, but may erase any other version before the delta is written.
+     *
+     *  @param[in] version - The version string, as in os-release
+     *
+     *  @return The flash id of the functional version if it is the given
+     *          version and survives freeSpace(), or an empty string
+     */
+    std::string getDeltaBaseFlashId(const std::string& version) const;
+
+    /** @brief Tracks completion of the systemd jobs started by the updater */
+    JobTracker jobTracker;
+
+    /** @brief Runs activations that write different flashes concurrently and
+     *  queues those that would write the same one */
+    ActivationScheduler scheduler;
+
+    /** @brief Hosts the interfaces that have no generated bindings */
+    sdbusplus::asio::object_server& objectServer;
+
     /** @brief Persistent map of Version D-Bus objects and their
      * version id */
     std::map<std::string, std::unique_ptr<VersionClass>> versions;
@@ -230,7 +264,22 @@ class ItemUpdater : public ItemUpdaterInherit, FactoryResetInherit
     void createFunctionalAssociation(const std::string& path);
 
     /** @brief Persistent sdbusplus D-Bus bus connection. */
-    sdbusplus::bus_t& bus;
+    sdbusplus::asio::connection& bus;
+
+    /** @brief Publishes the running and queued activations, outlives the
+     *  activations which update it when destroyed */
+    std::shared_ptr<sdbusplus::asio::dbus_interface> queueInterface;
+
+    /** @brief Creates the interface publishing the activation queue
+     *
+     * @param[in] server - The object server
+     * @param[in] path - The object path to add it to
+     */
+    void createQueueInterface(sdbusplus::asio::object_server& server,
+                              const std::string& path);
+
+    /** @brief Updates the interface after the scheduler changed */
+    void publishQueue();
 
     /** @brief The helper of image updater. */
     Helper helper;
@@ -1,8 +1,12 @@
 #pragma once
 
+#include "job_tracker.hpp"
+#include "uboot_env.hpp"
+
 #include <sdbusplus/bus.hpp>
 
 #include <string>
+#include <thread>
 
 namespace phosphor
 {
@@ -17,14 +21,16 @@ class Helper
     Helper() = delete;
     Helper(const Helper&) = delete;
     Helper& operator=(const Helper&) = delete;
-    Helper(Helper&&) = default;
-    Helper& operator=(Helper&&) = default;
+    Helper(Helper&&) = delete;
+    Helper& operator=(Helper&&) = delete;
 
     /** @brief Constructor
      *
      *  @param[in] bus - sdbusplus D-Bus bus connection
+     *  @param[in] jobTracker - Tracks the systemd jobs started by the helper
      */
-    explicit Helper(sdbusplus::bus_t& bus) : bus(bus)
+    Helper(sdbusplus::bus_t& bus, JobTracker& jobTracker) :
+        bus(bus), jobTracker(jobTracker)
     {
         // Empty
     }
@@ -66,6 +72,25 @@ class Helper
   private:
     /** @brief Persistent sdbusplus D-Bus bus connection. */
     sdbusplus::bus_t& bus;
+
+    /** @brief Tracks the systemd jobs started by the helper */
+    JobTracker& jobTracker;
+
+    /** @brief The U-Boot environment, changes are staged until committed */
+    UbootEnv env;
+
+    /** @brief Whether a commit of the staged environment is queued */
+    bool envCommitQueued = false;
+
+    /** @brief Write all staged U-Boot environment changes in one go */
+    void commitEnv()
+    {
+        envCommitQueued = false;
+        env.tryCommit();
+    }
+
+    /** @brief Runs the U-Boot mirror, joined before the rest is destroyed */
+    std::jthread mirrorWorker;
 };
 
 } // namespace updater
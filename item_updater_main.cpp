@@ -1,26 +1,186 @@
 #include "config.h"
 
+#include "flash_model.hpp"
 #include "item_updater.hpp"
+#include "mtd_writer.hpp"
+#include "serialize.hpp"
 
+#include <CLI/CLI.hpp>
 #include <boost/asio/io_context.hpp>
+#include <phosphor-logging/lg2.hpp>
 #include <sdbusplus/asio/connection.hpp>
+#include <sdbusplus/asio/object_server.hpp>
 #include <sdbusplus/bus.hpp>
 #include <sdbusplus/server/manager.hpp>
 
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
 boost::asio::io_context& getIOContext()
 {
     static boost::asio::io_context io;
     return io;
 }
 
-int main()
+/** @brief Refuse to measure a region the BMC may need while it is measured
+ *
+ *  @details The region is restored afterwards, but a power loss in between
+ *  would leave the scratch pattern behind. Offset 0 of a flash holds the
+ *  boot loader, and a mounted device may be read while it is overwritten.
+ *
+ *  @throw std::runtime_error if the region is not safe to overwrite
+ */
+void checkScratchRegion(const std::string& device, uint64_t offset)
 {
-    sdbusplus::asio::connection bus(getIOContext());
+    namespace fs = std::filesystem;
+    if (offset == 0)
+    {
+        throw std::runtime_error("Offset 0 holds the boot loader");
+    }
+
+    std::error_code ec;
+    auto path = fs::canonical(device, ec);
+    if (ec)
+    {
+        throw std::runtime_error("Cannot resolve " + device + ": " +
+                                 ec.message());
+    }
+    auto name = path.filename().string();
+
+    // MTD partitions carry their name, block partitions their label
+    std::string label;
+    std::string mtdBlock;
+    if (std::ifstream mtdName("/sys/class/mtd/" + name + "/name"); mtdName)
+    {
+        std::getline(mtdName, label);
+        mtdBlock = "/dev/mtdblock" + name.substr(3);
+    }
+    else
+    {
+        std::ifstream uevent("/sys/class/block/" + name + "/uevent");
+        for (std::string line; std::getline(uevent, line);)
+        {
+            if (line.starts_with("PARTNAME="))
+            {
+                label = line.substr(9);
+            }
+        }
+    }
+    if (label.find("u-boot") != std::string::npos ||
+        label.find("uboot") != std::string::npos ||
+        name.find("boot") != std::string::npos)
+    {
+        throw std::runtime_error(device + " holds the boot loader");
+    }
+
+    // Refuse the device, any of its partitions, and its MTD block device
+    std::ifstream mounts("/proc/self/mounts");
+    std::string source;
+    std::string rest;
+    while (mounts >> source && std::getline(mounts, rest))
+    {
+        auto mounted = fs::canonical(source, ec);
+        if (!source.starts_with("/") || ec)
+        {
+            continue;
+        }
+        if (mounted.string().starts_with(path.string()) ||
+            mounted.string() == mtdBlock)
+        {
+            throw std::runtime_error(device + " is mounted");
+        }
+    }
+
+    // A UBI volume is mounted from its own device, check the attachment
+    for (const auto& ubi : fs::directory_iterator("/sys/class/ubi", ec))
+    {
+        std::ifstream mtdNum(ubi.path() / "mtd_num");
+        std::string num;
+        if (mtdNum >> num && !mtdBlock.empty() && name == "mtd" + num)
+        {
+            throw std::runtime_error(device + " is attached to UBI");
+        }
+    }
+}
+
+/** @brief Measure the throughput of a flash chip on a scratch region of one
+ *  of its partitions and store it in the model the activations estimate
+ *  their duration with
+ *
+ *  @return The exit code
+ */
+int characterize(const std::string& device, uint64_t offset, uint64_t size)
+{
+    using phosphor::software::updater::FlashModel;
+    using phosphor::software::updater::MtdWriter;
+    try
+    {
+        checkScratchRegion(device, offset);
+        MtdWriter writer(device);
+        auto rates = writer.characterize(offset, size);
+        FlashModel(phosphor::software::updater::flashModelPath())
+            .store(device, rates);
+        lg2::info("{DEVICE}: erase {ERASE} KiB/s, program {PROGRAM} KiB/s, "
+                  "read {READ} KiB/s",
+                  "DEVICE", device, "ERASE",
+                  static_cast<uint64_t>(rates.erase / 1024), "PROGRAM",
+                  static_cast<uint64_t>(rates.program / 1024), "READ",
+                  static_cast<uint64_t>(rates.read / 1024));
+    }
+    catch (const std::exception& e)
+    {
+        lg2::error("Failed to characterize {DEVICE}: {ERROR}", "DEVICE",
+                   device, "ERROR", e.what());
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    std::string device;
+    uint64_t offset = 0;
+    uint64_t size = 0;
+
+    CLI::App app{"Activate the BMC and host firmware images"};
+    auto* characterizeOption = app.add_option(
+        "--characterize", device,
+        "Measure the throughput of a flash device and exit. The region given "
+        "by --offset and --size is overwritten, then restored. The device "
+        "must not be mounted or hold the boot loader.");
+    auto* offsetOption =
+        app.add_option("--offset", offset,
+                       "Start of the scratch region, a non-zero multiple of "
+                       "the erase block size")
+            ->needs(characterizeOption);
+    auto* sizeOption = app.add_option("--size", size,
+                                      "Size of the scratch region, a "
+                                      "multiple of the erase block size")
+                           ->needs(characterizeOption);
+    characterizeOption->needs(offsetOption)->needs(sizeOption);
+
+    CLI11_PARSE(app, argc, argv);
+
+    if (!device.empty())
+    {
+        return characterize(device, offset, size);
+    }
+
+    auto conn = std::make_shared<sdbusplus::asio::connection>(getIOContext());
+    auto& bus = *conn;
 
     // Add sdbusplus ObjectManager.
     sdbusplus::server::manager_t objManager(bus, OBJ_MANAGER_PATH);
 
-    phosphor::software::updater::ItemUpdater updater(bus, SOFTWARE_OBJPATH);
+    // The ObjectManager above also covers the interfaces it adds
+    sdbusplus::asio::object_server server(conn, true);
+
+    phosphor::software::updater::ItemUpdater updater(bus, server,
+                                                     SOFTWARE_OBJPATH);
 
     bus.request_name(BUSNAME_UPDATER);
 
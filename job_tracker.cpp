@@ -0,0 +1,262 @@
+#include "config.h"
+
+#include "job_tracker.hpp"
+
+#include <boost/asio/post.hpp>
+#include <phosphor-logging/lg2.hpp>
+#include <sdbusplus/exception.hpp>
+
+#include <cstring>
+#include <iterator>
+
+namespace phosphor
+{
+namespace software
+{
+namespace updater
+{
+
+PHOSPHOR_LOG2_USING;
+
+namespace sdbusRule = sdbusplus::bus::match::rules;
+
+JobTracker::JobTracker(sdbusplus::asio::connection& bus) :
+    JobTracker(static_cast<sdbusplus::bus_t&>(bus))
+{
+    connection = &bus;
+}
+
+JobTracker::JobTracker(sdbusplus::bus_t& bus) :
+    bus(bus), connection(nullptr),
+    jobRemoved(bus,
+               sdbusRule::type::signal() + sdbusRule::member("JobRemoved") +
+                   sdbusRule::path("/org/freedesktop/systemd1") +
+                   sdbusRule::interface("org.freedesktop.systemd1.Manager"),
+               std::bind(std::mem_fn(&JobTracker::onJobRemoved), this,
+                         std::placeholders::_1))
+{
+    // The subscription lasts as long as the connection, so it is made once
+    // for the whole process and never undone.
+    subscribe();
+}
+
+void JobTracker::subscribe()
+{
+    auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
+                                      SYSTEMD_INTERFACE, "Subscribe");
+    try
+    {
+        bus.call_noreply(method);
+    }
+    catch (const sdbusplus::exception_t& e)
+    {
+        if (e.name() == nullptr ||
+            strcmp("org.freedesktop.systemd1.AlreadySubscribed", e.name()) != 0)
+        {
+            error("Error subscribing to systemd: {ERROR}", "ERROR", e);
+        }
+    }
+}
+
+void JobTracker::startUnit(const std::string& unit, Callback callback,
+                           std::chrono::seconds timeout, const void* owner)
+{
+    if (!connection)
+    {
+        sdbusplus::message::object_path jobPath;
+        try
+        {
+            auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
+                                              SYSTEMD_INTERFACE, "StartUnit");
+            method.append(unit, "replace");
+            auto reply = bus.call(method);
+            reply.read(jobPath);
+        }
+        catch (const sdbusplus::exception_t& e)
+        {
+            error("Failed to start {UNIT}: {ERROR}", "UNIT", unit, "ERROR",
+                  e);
+            callback("failed");
+            return;
+        }
+        addJob(jobPath.str, Job{unit, {{std::move(callback), owner}}, nullptr});
+        return;
+    }
+
+    // The job is busy from now on, so whenIdle() callbacks wait for it even
+    // before systemd has replied.
+    auto id = nextStartId++;
+    starting[id] = Job{unit, {{std::move(callback), owner}}, nullptr};
+
+    // systemd replies to StartUnit before it runs the job, and messages from
+    // one sender are delivered in order, so the reply always arrives before
+    // the JobRemoved signal of the job.
+    connection->async_method_call(
+        [this, id, timeout](const boost::system::error_code& ec,
+                            const sdbusplus::message::object_path& jobPath) {
+        auto it = starting.find(id);
+        auto job = std::move(it->second);
+        starting.erase(it);
+
+        if (ec)
+        {
+            error("Failed to start {UNIT}: {ERROR}", "UNIT", job.unit,
+                  "ERROR", ec.message());
+            for (auto& watch : job.callbacks)
+            {
+                if (watch.callback)
+                {
+                    watch.callback("failed");
+                }
+            }
+            runIdleCallbacks();
+            return;
+        }
+
+        auto& tracked = addJob(jobPath.str, std::move(job));
+        if (tracked.timer)
+        {
+            return;
+        }
+        tracked.timer = std::make_unique<boost::asio::steady_timer>(
+            connection->get_io_context());
+        tracked.timer->expires_after(timeout);
+        tracked.timer->async_wait([this, path = jobPath.str,
+                                   unit = tracked.unit](
+                                      const boost::system::error_code& ec) {
+            if (ec)
+            {
+                // Cancelled because the job completed
+                return;
+            }
+            warning("Timed out waiting for {UNIT} to complete", "UNIT", unit);
+            complete(path, "timeout");
+        });
+    },
+        SYSTEMD_BUSNAME, SYSTEMD_PATH, SYSTEMD_INTERFACE, "StartUnit", unit,
+        "replace");
+}
+
+JobTracker::Job& JobTracker::addJob(const std::string& jobPath, Job&& job)
+{
+    auto [it, added] = jobs.try_emplace(jobPath, std::move(job));
+    if (!added)
+    {
+        // A second StartUnit of a unit whose job is still queued
+        auto& callbacks = it->second.callbacks;
+        std::move(job.callbacks.begin(), job.callbacks.end(),
+                  std::back_inserter(callbacks));
+    }
+    return it->second;
+}
+
+void JobTracker::watchUnit(const std::string& unit, Callback callback,
+                           const void* owner)
+{
+    watches[unit] = Watch{std::move(callback), owner};
+}
+
+void JobTracker::forget(const void* owner)
+{
+    auto forgetJob = [owner](Job& job) {
+        for (auto& watch : job.callbacks)
+        {
+            if (watch.owner == owner)
+            {
+                watch.callback = nullptr;
+            }
+        }
+    };
+    for (auto& [path, job] : jobs)
+    {
+        forgetJob(job);
+    }
+    for (auto& [id, job] : starting)
+    {
+        forgetJob(job);
+    }
+    std::erase_if(watches, [owner](const auto& watch) {
+        return watch.second.owner == owner;
+    });
+}
+
+void JobTracker::whenIdle(std::function<void()> callback)
+{
+    idleCallbacks.push_back(std::move(callback));
+    if (!connection)
+    {
+        runIdleCallbacks();
+        return;
+    }
+    boost::asio::post(connection->get_io_context(),
+                      [this]() { runIdleCallbacks(); });
+}
+
+void JobTracker::runIdleCallbacks()
+{
+    while (!busy() && !idleCallbacks.empty())
+    {
+        auto callback = std::move(idleCallbacks.front());
+        idleCallbacks.pop_front();
+        callback();
+    }
+}
+
+void JobTracker::onJobRemoved(sdbusplus::message_t& msg)
+{
+    uint32_t id{};
+    sdbusplus::message::object_path jobPath;
+    std::string unit;
+    std::string result;
+
+    try
+    {
+        msg.read(id, jobPath, unit, result);
+    }
+    catch (const sdbusplus::exception_t& e)
+    {
+        error("Failed to read JobRemoved signal: {ERROR}", "ERROR", e);
+        return;
+    }
+
+    auto watch = watches.find(unit);
+    if (watch != watches.end())
+    {
+        auto callback = std::move(watch->second.callback);
+        watches.erase(watch);
+        callback(result);
+    }
+
+    complete(jobPath.str, result);
+}
+
+void JobTracker::complete(const std::string& jobPath,
+                          const std::string& result)
+{
+    auto it = jobs.find(jobPath);
+    if (it == jobs.end())
+    {
+        return;
+    }
+
+    auto job = std::move(it->second);
+    jobs.erase(it);
+    if (job.timer)
+    {
+        job.timer->cancel();
+    }
+
+    // The callbacks may start the next job, so they run last.
+    for (auto& watch : job.callbacks)
+    {
+        if (watch.callback)
+        {
+            watch.callback(result);
+        }
+    }
+    runIdleCallbacks();
+}
+
+} // namespace updater
+} // namespace software
+} // namespace phosphor
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <boost/asio/steady_timer.hpp>
+#include <sdbusplus/asio/connection.hpp>
+#include <sdbusplus/bus.hpp>
+#include <sdbusplus/bus/match.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace phosphor
+{
+namespace software
+{
+namespace updater
+{
+
+/** @class JobTracker
+ *  @brief Starts systemd units and reports when their jobs complete.
+ *  @details Completion is taken from the systemd JobRemoved signal of the job
+ *  returned by StartUnit, so callers continue as soon as the unit is done
+ *  instead of sleeping for a fixed amount of time. A timeout guards against
+ *  a missed signal or a hung unit. StartUnit is called asynchronously, so
+ *  nothing here blocks the event loop.
+ *
+ *  One tracker is shared by the whole process: it subscribes to systemd once
+ *  and dispatches every JobRemoved signal with a hash lookup, by job path for
+ *  the units it started and by unit name for units started by someone else.
+ *  systemd returns the queued job when a unit is started again before its
+ *  job ran, so every callback of a job path is kept and invoked.
+ */
+class JobTracker
+{
+  public:
+    /** @brief Called with the systemd job result ("done", "failed", ...) or
+     *  "timeout" if the job did not complete in time
+     */
+    using Callback = std::function<void(const std::string& result)>;
+
+    /** @brief Default time to wait for a job to complete */
+    static constexpr auto defaultTimeout = std::chrono::seconds(60);
+
+    JobTracker() = delete;
+    JobTracker(const JobTracker&) = delete;
+    JobTracker& operator=(const JobTracker&) = delete;
+    JobTracker(JobTracker&&) = delete;
+    JobTracker& operator=(JobTracker&&) = delete;
+    ~JobTracker() = default;
+
+    /** @brief Constructor
+     *
+     *  @param[in] bus - The D-Bus connection, whose event loop runs the
+     *                   callbacks and the job timeouts
+     */
+    explicit JobTracker(sdbusplus::asio::connection& bus);
+
+    /** @brief Constructor for processes that do not run an asio event loop
+     *  @details StartUnit is called synchronously, jobs are not timed out,
+     *  and the callback of a unit that cannot be started is invoked from
+     *  within startUnit().
+     *
+     *  @param[in] bus - The D-Bus bus object
+     */
+    explicit JobTracker(sdbusplus::bus_t& bus);
+
+    /** @brief Start a unit and invoke the callback once its job completes
+     *
+     *  @param[in] unit - The unit to start
+     *  @param[in] callback - Called once with the job result
+     *  @param[in] timeout - How long to wait for the job
+     *  @param[in] owner - Identifies the callback for forget()
+     */
+    void startUnit(const std::string& unit, Callback callback,
+                   std::chrono::seconds timeout = defaultTimeout,
+                   const void* owner = nullptr);
+
+    /** @brief Invoke the callback when the next job of a unit completes
+     *  @details For units that are started elsewhere, e.g. by a service
+     *  reacting to a property change. A later watch of the same unit
+     *  replaces an earlier one.
+     *
+     *  @param[in] unit - The unit to watch
+     *  @param[in] callback - Called once with the job result
+     *  @param[in] owner - Identifies the callback for forget()
+     */
+    void watchUnit(const std::string& unit, Callback callback,
+                   const void* owner = nullptr);
+
+    /** @brief Drop all pending callbacks registered by an owner
+     *  @details Jobs that are still running keep counting as busy.
+     *
+     *  @param[in] owner - The owner passed to startUnit() or watchUnit()
+     */
+    void forget(const void* owner);
+
+    /** @brief Run a callback once no started job is outstanding
+     *  @details Callbacks run in the order they were queued, and always from
+     *  the event loop rather than from within this call when there is one. A
+     *  callback that starts a unit holds back the remaining ones until that
+     *  unit is done.
+     *
+     *  @param[in] callback - The callback to run
+     */
+    void whenIdle(std::function<void()> callback);
+
+    /** @brief Whether any started job has not completed yet */
+    bool busy() const
+    {
+        return !jobs.empty() || !starting.empty();
+    }
+
+  private:
+    /** @brief A callback waiting for a job */
+    struct Watch
+    {
+        /** @brief Called when the job is removed */
+        Callback callback;
+        /** @brief The owner of the callback */
+        const void* owner;
+    };
+
+    /** @brief A job that has been started and not yet removed */
+    struct Job
+    {
+        /** @brief The unit the job belongs to */
+        std::string unit;
+        /** @brief Called when the job is removed, one per StartUnit call
+         *  that returned the job */
+        std::vector<Watch> callbacks;
+        /** @brief Fires if the job takes longer than the timeout of the
+         *  first StartUnit call that returned it */
+        std::unique_ptr<boost::asio::steady_timer> timer;
+    };
+
+    /** @brief Track a job that StartUnit returned, along with the earlier
+     *  calls that returned the same job
+     *
+     *  @param[in] jobPath - The job object path
+     *  @param[in] job - The job of this call
+     *
+     *  @return The tracked job
+     */
+    Job& addJob(const std::string& jobPath, Job&& job);
+
+    /** @brief Subscribe to systemd so that it emits JobRemoved */
+    void subscribe();
+
+    /** @brief Callback for the systemd JobRemoved signal
+     *
+     *  @param[in] msg - Data associated with the signal
+     */
+    void onJobRemoved(sdbusplus::message_t& msg);
+
+    /** @brief Remove a job and report its result
+     *
+     *  @param[in] jobPath - The job object path
+     *  @param[in] result - The result to report
+     */
+    void complete(const std::string& jobPath, const std::string& result);
+
+    /** @brief Run the queued idle callbacks while no job is outstanding */
+    void runIdleCallbacks();
+
+    /** @brief Persistent sdbusplus D-Bus bus connection. */
+    sdbusplus::bus_t& bus;
+
+    /** @brief The asio connection for asynchronous calls, if any */
+    sdbusplus::asio::connection* connection;
+
+    /** @brief Jobs waiting for the StartUnit reply */
+    std::unordered_map<uint64_t, Job> starting;
+
+    /** @brief Identifies the next StartUnit call */
+    uint64_t nextStartId = 0;
+
+    /** @brief Outstanding jobs by their object path */
+    std::unordered_map<std::string, Job> jobs;
+
+    /** @brief Watched units by their name */
+    std::unordered_map<std::string, Watch> watches;
+
+    /** @brief Callbacks waiting for all jobs to complete */
+    std::deque<std::function<void()>> idleCallbacks;
+
+    /** @brief Match for the systemd JobRemoved signal */
+    sdbusplus::bus::match_t jobRemoved;
+};
+
+} // namespace updater
+} // namespace software
+} // namespace phosphor
@@ -3,7 +3,20 @@
 #include "flash.hpp"
 
 #include "activation.hpp"
+#include "delta_image.hpp"
+#include "images.hpp"
 #include "item_updater.hpp"
+#include "serialize.hpp"
+#include "uboot_mirror.hpp"
+
+#include <phosphor-logging/lg2.hpp>
+
+#include <array>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
 
 namespace phosphor
 {
@@ -13,68 +26,190 @@ namespace updater
 {
 
 namespace softwareServer = sdbusplus::server::xyz::openbmc_project::software;
+namespace fs = std::filesystem;
+using phosphor::software::image::deltaImageExt;
 
-void Activation::flashWrite()
-{
-    auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
-                                      SYSTEMD_INTERFACE, "StartUnit");
-    auto serviceFile = "obmc-flash-mmc@" + versionId + ".service";
-    method.append(serviceFile, "replace");
-    bus.call_noreply(method);
-}
+PHOSPHOR_LOG2_USING;
 
-void Activation::onStateChanges(sdbusplus::message_t& msg)
+namespace
 {
-    uint32_t newStateID{};
-    sdbusplus::message::object_path newStateObjPath;
-    std::string newStateUnit{};
-    std::string newStateResult{};
 
-    // Read the msg and populate each variable
-    msg.read(newStateID, newStateObjPath, newStateUnit, newStateResult);
+constexpr auto partLabelDir = "/dev/disk/by-partlabel/";
 
-    auto mmcServiceFile = "obmc-flash-mmc@" + versionId + ".service";
-    auto flashId = parent.versions.find(versionId)->second->path();
-    auto mmcSetPrimary = "obmc-flash-mmc-setprimary@" + flashId + ".service";
+/** @brief Get the label (a or b) of the partitions the BMC is not running
+ *  from, like mmc_get_secondary_label in obmc-flash-bmc
+ *
+ *  @return The label, or an empty string if the root device is unknown
+ */
+std::string getSecondaryLabel()
+{
+    std::ifstream mounts("/proc/self/mounts");
+    std::string line;
+    std::string root;
+    while (std::getline(mounts, line))
+    {
+        std::istringstream fields(line);
+        std::string device;
+        std::string mountPoint;
+        if (fields >> device >> mountPoint && mountPoint == "/")
+        {
+            root = device;
+        }
+    }
 
-    if (newStateUnit == mmcServiceFile && newStateResult == "done")
+    std::error_code ec;
+    constexpr std::array<std::pair<const char*, const char*>, 2> labels{
+        {{"a", "b"}, {"b", "a"}}};
+    for (const auto& [label, other] : labels)
     {
-        roVolumeCreated = true;
-        activationProgress->progress(activationProgress->progress() + 1);
+        auto rofs = fs::canonical(std::string(partLabelDir) + "rofs-" + label,
+                                  ec);
+        if (!ec && !root.empty() && rofs == fs::canonical(root, ec))
+        {
+            return other;
+        }
     }
+    return {};
+}
 
-    if (newStateUnit == mmcSetPrimary && newStateResult == "done")
+/** @brief Get what to write to a partition: the compressed image, or the
+ *  delta against the partition of its base version when only that is
+ *  shipped
+ *
+ *  @param[in] updater - The item updater, to find the base version
+ *  @param[in] image - Path to the image
+ *  @param[in] prefix - The partition name without the label
+ *  @param[in] label - The label of the partition to write
+ *
+ *  @throw std::runtime_error if the delta cannot be applied
+ */
+PartitionWriter::Target getTarget(const ItemUpdater& updater,
+                                  const fs::path& image,
+                                  const std::string& prefix,
+                                  const std::string& label)
+{
+    auto device = partLabelDir + (prefix + label);
+    auto delta = image.string() + deltaImageExt;
+    std::error_code ec;
+    if (fs::exists(image, ec) || !fs::exists(delta, ec))
     {
-        ubootEnvVarsUpdated = true;
+        return {image, device, true};
     }
 
-    if (newStateUnit == mmcServiceFile || newStateUnit == mmcSetPrimary)
+    // Reconstruct the image from the partition of the running version the
+    // delta was made against, checked when the image was validated. The
+    // running version is never erased by freeSpace().
+    auto header = DeltaImage::readHeader(delta);
+    auto flashId = updater.getDeltaBaseFlashId(header.baseVersion);
+    if (flashId.empty())
     {
-        if (newStateResult == "failed" || newStateResult == "dependency")
-        {
-            Activation::activation(
-                softwareServer::Activation::Activations::Failed);
-        }
-        else if (roVolumeCreated)
-        {
-            if (!ubootEnvVarsUpdated)
+        throw std::runtime_error("Base version " + header.baseVersion +
+                                 " is not running");
+    }
+    info("Writing {IMAGE} as a delta against {VERSION}", "IMAGE", image,
+         "VERSION", header.baseVersion);
+    return {delta, device, false, partLabelDir + (prefix + flashId)};
+}
+
+} // namespace
+
+void Activation::flashWrite()
+{
+    // freeSpace() may have just started removing the version whose
+    // partitions are about to be written, so wait for that to finish.
+    parent.jobTracker.whenIdle([this]() {
+        // Updates U-Boot if needed, the partitions are written from here.
+        // The U-Boot mirror has to compare the partitions again after that.
+        UbootMirror::invalidate(mirrorCachePath());
+        auto serviceFile = "obmc-flash-mmc@" + versionId + ".service";
+        startJob(serviceFile, [this](const std::string& result) {
+            if (result != "done")
             {
-                activationProgress->progress(90);
+                onStateChanges(result);
+                return;
+            }
+
+            auto label = getSecondaryLabel();
+            if (label.empty())
+            {
+                error("Failed to find the partitions to write");
+                onStateChanges("failed");
+                return;
+            }
 
-                // Set the priority which triggers the service that updates the
-                // environment variables.
-                if (!Activation::redundancyPriority)
+            std::vector<PartitionWriter::Target> targets;
+            try
+            {
+                auto imageDir = fs::path(IMG_UPLOAD_DIR) / versionId;
+                targets.push_back(getTarget(parent, imageDir / "image-kernel",
+                                            "boot-", label));
+                targets.push_back(getTarget(parent, imageDir / "image-rofs",
+                                            "rofs-", label));
+            }
+            catch (const std::exception& e)
+            {
+                error("Failed to prepare the partition writes: {ERROR}",
+                      "ERROR", e.what());
+                onStateChanges("failed");
+                return;
+            }
+            writePartitions(targets, [this](const std::string& result) {
+                if (result != "done")
                 {
-                    Activation::redundancyPriority =
-                        std::make_unique<RedundancyPriority>(bus, path, *this,
-                                                             0);
+                    onStateChanges(result);
+                    return;
                 }
-            }
-            else // Environment variables were updated
+
+                // Restores the partition labels and sets the flash id
+                auto finishFile = "obmc-flash-mmc-finish@" + versionId +
+                                  ".service";
+                startJob(finishFile, [this](const std::string& result) {
+                    if (result == "done")
+                    {
+                        roVolumeCreated = true;
+                    }
+                    onStateChanges(result);
+                });
+            });
+        });
+    });
+}
+
+void Activation::onStateChanges(const std::string& result)
+{
+    if (result == "failed" || result == "dependency" || result == "timeout")
+    {
+        Activation::activation(softwareServer::Activation::Activations::Failed);
+    }
+    else if (roVolumeCreated)
+    {
+        if (!ubootEnvVarsUpdated)
+        {
+            activationProgress->progress(90);
+
+            // Setting the priority starts the service that updates the
+            // environment variables, so wait for it before doing so.
+            auto flashId = parent.versions.find(versionId)->second->path();
+            auto mmcSetPrimary = "obmc-flash-mmc-setprimary@" + flashId +
+                                 ".service";
+            watchJob(mmcSetPrimary, [this](const std::string& result) {
+                if (result == "done")
+                {
+                    ubootEnvVarsUpdated = true;
+                }
+                onStateChanges(result);
+            });
+
+            if (!Activation::redundancyPriority)
             {
-                Activation::onFlashWriteSuccess();
+                Activation::redundancyPriority =
+                    std::make_unique<RedundancyPriority>(bus, path, *this, 0);
             }
         }
+        else // Environment variables were updated
+        {
+            Activation::onFlashWriteSuccess();
+        }
     }
 
     return;
@@ -2,9 +2,14 @@
 
 #include "item_updater_helper.hpp"
 
-#include "utils.hpp"
+#include "serialize.hpp"
+#include "uboot_mirror.hpp"
 
-#include <thread>
+#include <phosphor-logging/lg2.hpp>
+
+#include <fstream>
+#include <stdexcept>
+#include <string>
 
 namespace phosphor
 {
@@ -13,6 +18,15 @@ namespace software
 namespace updater
 {
 
+PHOSPHOR_LOG2_USING;
+
+namespace
+{
+
+constexpr auto abrImagePath = "/sys/kernel/debug/aspeed/sbc/abr_image";
+
+} // namespace
+
 void Helper::setEntry(const std::string& /* entryId */, uint8_t /* value */)
 {
     // Empty
@@ -31,44 +45,92 @@ void Helper::cleanup()
 void Helper::factoryReset()
 {
     // Mark the read-write partition for recreation upon reboot.
-    utils::execute("/sbin/fw_setenv", "rwreset", "true");
+    env.set("rwreset", "true");
+    commitEnv();
 }
 
 void Helper::removeVersion(const std::string& flashId)
 {
-    auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
-                                      SYSTEMD_INTERFACE, "StartUnit");
     auto serviceFile = "obmc-flash-mmc-remove@" + flashId + ".service";
-    method.append(serviceFile, "replace");
-    bus.call_noreply(method);
 
-    // Wait a few seconds for the service file to finish, otherwise the BMC may
-    // start the update while the image is still being deleted.
-    constexpr auto removeWait = std::chrono::seconds(3);
-    std::this_thread::sleep_for(removeWait);
+    // Queue behind any outstanding job: the BMC must not start the update
+    // while the image is still being deleted, and the image must not be
+    // deleted before the primary side has been moved away from it.
+    jobTracker.whenIdle([this, serviceFile]() {
+        jobTracker.startUnit(serviceFile, [serviceFile](const auto& result) {
+            if (result != "done")
+            {
+                error("Failed to remove version, {UNIT}: {RESULT}", "UNIT",
+                      serviceFile, "RESULT", result);
+            }
+        });
+    });
 }
 
 void Helper::updateUbootVersionId(const std::string& flashId)
 {
-    auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
-                                      SYSTEMD_INTERFACE, "StartUnit");
     auto serviceFile = "obmc-flash-mmc-setprimary@" + flashId + ".service";
-    method.append(serviceFile, "replace");
-    bus.call_noreply(method);
 
-    // Wait a few seconds for the service file to finish, otherwise the BMC may
-    // be rebooted while pointing to a non-existent version.
-    constexpr auto setPrimaryWait = std::chrono::seconds(3);
-    std::this_thread::sleep_for(setPrimaryWait);
+    // Queue behind any outstanding job so that the BMC is never left
+    // pointing to a version that is being removed.
+    jobTracker.whenIdle([this, serviceFile]() {
+        jobTracker.startUnit(serviceFile, [serviceFile](const auto& result) {
+            if (result != "done")
+            {
+                error("Failed to set primary version, {UNIT}: {RESULT}",
+                      "UNIT", serviceFile, "RESULT", result);
+            }
+        });
+    });
 }
 
 void Helper::mirrorAlt()
 {
-    auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
-                                      SYSTEMD_INTERFACE, "StartUnit");
-    auto serviceFile = "obmc-flash-mmc-mirroruboot.service";
-    method.append(serviceFile, "replace");
-    bus.call_noreply(method);
+    // Reading the partitions takes a while, keep it off the event loop
+    mirrorWorker = std::jthread([](std::stop_token stop) {
+        try
+        {
+            // 0 if booted from the primary boot partition, 1 otherwise
+            std::ifstream abr(abrImagePath);
+            std::string bootdev;
+            if (!(abr >> bootdev))
+            {
+                throw std::runtime_error("Failed to read the boot partition");
+            }
+            std::string source = bootdev == "0" ? "mmcblk0boot0"
+                                                : "mmcblk0boot1";
+            std::string target = bootdev == "0" ? "mmcblk0boot1"
+                                                : "mmcblk0boot0";
+
+            // The boot partitions are read-only unless asked otherwise
+            auto forceRo = "/sys/block/" + target + "/force_ro";
+            std::ofstream(forceRo) << "0";
+            UbootMirror mirror(mirrorCachePath());
+            UbootMirror::Result result{};
+            try
+            {
+                result = mirror.mirror("/dev/" + source, "/dev/" + target,
+                                       stop);
+            }
+            catch (...)
+            {
+                std::ofstream(forceRo) << "1";
+                throw;
+            }
+            std::ofstream(forceRo) << "1";
+
+            if (result.written)
+            {
+                info("Mirrored {BLOCKS} blocks of U-Boot to {TARGET}",
+                     "BLOCKS", result.written, "TARGET", target);
+            }
+        }
+        catch (const std::exception& e)
+        {
+            error("Failed to copy U-Boot to alternate chip: {ERROR}",
+                  "ERROR", e.what());
+        }
+    });
 }
 
 } // namespace updater
@@ -0,0 +1,548 @@
+#include "mtd_writer.hpp"
+
+#include <fcntl.h>
+#include <mtd/mtd-user.h>
+#include <openssl/evp.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+
+namespace phosphor
+{
+namespace software
+{
+namespace updater
+{
+
+namespace
+{
+
+/** @brief RAII wrapper for a file descriptor */
+struct FileDescriptor
+{
+    explicit FileDescriptor(int fd) : fd(fd) {}
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+    ~FileDescriptor()
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+
+    int fd;
+};
+
+/** @brief Read exactly size bytes unless the end of the file is reached
+ *
+ *  @return The number of bytes read, or -1 on error
+ */
+ssize_t readFull(int fd, uint8_t* data, size_t size, off_t offset)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        auto n = pread(fd, data + done, size - done, offset + done);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            return -1;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+/** @brief Write exactly size bytes
+ *
+ *  @return Whether all bytes were written
+ */
+bool writeFull(int fd, const uint8_t* data, size_t size, off_t offset)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        auto n = pwrite(fd, data + done, size - done, offset + done);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+/** @brief Compute the SHA-256 of a file as a hex string */
+std::string fileDigest(int fd, size_t size)
+{
+    std::unique_ptr<EVP_MD_CTX, decltype(&::EVP_MD_CTX_free)> ctx(
+        EVP_MD_CTX_new(), ::EVP_MD_CTX_free);
+    if (!ctx || EVP_DigestInit_ex(ctx.get(), EVP_sha256(), nullptr) != 1)
+    {
+        throw std::runtime_error("Failed to initialize SHA-256");
+    }
+
+    std::vector<uint8_t> buf(1024 * 1024);
+    for (size_t offset = 0; offset < size; offset += buf.size())
+    {
+        auto n = readFull(fd, buf.data(), std::min(buf.size(), size - offset),
+                          offset);
+        if (n <= 0 || EVP_DigestUpdate(ctx.get(), buf.data(), n) != 1)
+        {
+            throw std::runtime_error("Failed to hash image");
+        }
+    }
+
+    std::array<uint8_t, EVP_MAX_MD_SIZE> md{};
+    unsigned int mdSize = 0;
+    if (EVP_DigestFinal_ex(ctx.get(), md.data(), &mdSize) != 1)
+    {
+        throw std::runtime_error("Failed to finalize SHA-256");
+    }
+
+    static constexpr auto hex = "0123456789abcdef";
+    std::string digest;
+    for (unsigned int i = 0; i < mdSize; i++)
+    {
+        digest += hex[md[i] >> 4];
+        digest += hex[md[i] & 0xf];
+    }
+    return digest;
+}
+
+/** @brief Get the size of a file, which may also be a device */
+size_t fileSize(int fd, const std::string& path)
+{
+    struct stat st
+    {};
+    if (fstat(fd, &st) < 0)
+    {
+        throw std::runtime_error("Failed to stat " + path + ": " +
+                                 std::strerror(errno));
+    }
+    if (S_ISREG(st.st_mode))
+    {
+        return st.st_size;
+    }
+
+    auto end = lseek(fd, 0, SEEK_END);
+    if (end < 0)
+    {
+        throw std::runtime_error("Failed to get the size of " + path + ": " +
+                                 std::strerror(errno));
+    }
+    return end;
+}
+
+} // namespace
+
+MtdWriter::MtdWriter(const std::string& device, size_t blockSize) :
+    device(device), fd(open(device.c_str(), O_RDWR | O_CLOEXEC)),
+    eraseSize(blockSize)
+{
+    if (fd < 0)
+    {
+        throw std::runtime_error("Failed to open " + device + ": " +
+                                 std::strerror(errno));
+    }
+
+    mtd_info_user info{};
+    if (ioctl(fd, MEMGETINFO, &info) == 0)
+    {
+        isMtd = true;
+        deviceSize = info.size;
+        eraseSize = info.erasesize;
+    }
+    current.resize(eraseSize);
+}
+
+MtdWriter::~MtdWriter()
+{
+    close(fd);
+}
+
+MtdWriter::Stats MtdWriter::write(const std::string& image,
+                                  const Progress& progress,
+                                  const std::string& journal)
+{
+    return writeImage(image, nullptr, progress, journal);
+}
+
+MtdWriter::Stats MtdWriter::write(const Plan& plan, const Progress& progress,
+                                  const std::string& journal)
+{
+    return writeImage(plan.image, &plan.differs, progress, journal);
+}
+
+MtdWriter::Stats MtdWriter::writeImage(const std::string& image,
+                                       const std::vector<bool>* differs,
+                                       const Progress& progress,
+                                       const std::string& journal)
+{
+    FileDescriptor in(open(image.c_str(), O_RDONLY | O_CLOEXEC));
+    if (in.fd < 0)
+    {
+        throw std::runtime_error("Failed to open " + image + ": " +
+                                 std::strerror(errno));
+    }
+
+    size_t imageSize = fileSize(in.fd, image);
+    if (deviceSize && imageSize > deviceSize)
+    {
+        throw std::runtime_error(image + " does not fit in " + device);
+    }
+
+    Stats stats{(imageSize + eraseSize - 1) / eraseSize, 0, 0};
+    if (differs && differs->size() != stats.blocks)
+    {
+        throw std::runtime_error(image + " changed since it was compared");
+    }
+    std::string digest;
+    if (!journal.empty())
+    {
+        digest = fileDigest(in.fd, imageSize);
+        stats.resumed = std::min(loadJournal(journal, digest), stats.blocks);
+    }
+
+    bool cancelled = false;
+    try
+    {
+        std::vector<uint8_t> target(eraseSize);
+        for (size_t block = 0; block < stats.blocks; block++)
+        {
+            // Blocks that compared equal match already, and are not read
+            // again. The journaled prefix is compared like the rest, as
+            // something else may have been written to the device since.
+            if (!differs || (*differs)[block])
+            {
+                off_t offset = block * eraseSize;
+                size_t size = std::min(eraseSize, imageSize - offset);
+                if (readFull(in.fd, target.data(), size, offset) !=
+                    static_cast<ssize_t>(size))
+                {
+                    throw std::runtime_error("Failed to read " + image);
+                }
+
+                // On flash the last block is read anyway, for the part
+                // beyond the image that its erase covers
+                bool compare = !differs || (isMtd && size < eraseSize);
+                if (writeBlock(offset, target, size, compare))
+                {
+                    stats.written++;
+                }
+
+                if (!journal.empty() && (block + 1) % journalInterval == 0)
+                {
+                    // Only what reached the device may be journaled
+                    sync();
+                    storeJournal(journal, digest, block + 1);
+                }
+            }
+
+            if (progress && !progress(block + 1, stats.blocks))
+            {
+                cancelled = true;
+                throw std::runtime_error("Write to " + device +
+                                         " cancelled");
+            }
+        }
+
+        sync();
+    }
+    catch (const std::exception&)
+    {
+        // A cancelled write stopped after a verified block, a failed one
+        // may have left anything behind.
+        if (!journal.empty() && !cancelled)
+        {
+            std::error_code ec;
+            std::filesystem::remove(journal, ec);
+        }
+        throw;
+    }
+
+    if (!journal.empty())
+    {
+        std::error_code ec;
+        std::filesystem::remove(journal, ec);
+    }
+    return stats;
+}
+
+void MtdWriter::sync()
+{
+    if (fsync(fd) < 0 && errno != EINVAL)
+    {
+        throw std::runtime_error("Failed to sync " + device + ": " +
+                                 std::strerror(errno));
+    }
+}
+
+std::string MtdWriter::digest(const std::string& image)
+{
+    FileDescriptor in(open(image.c_str(), O_RDONLY | O_CLOEXEC));
+    if (in.fd < 0)
+    {
+        throw std::runtime_error("Failed to open " + image + ": " +
+                                 std::strerror(errno));
+    }
+    return fileDigest(in.fd, fileSize(in.fd, image));
+}
+
+MtdWriter::Plan MtdWriter::compare(const std::string& image)
+{
+    FileDescriptor in(open(image.c_str(), O_RDONLY | O_CLOEXEC));
+    if (in.fd < 0)
+    {
+        throw std::runtime_error("Failed to open " + image + ": " +
+                                 std::strerror(errno));
+    }
+
+    size_t imageSize = fileSize(in.fd, image);
+    if (deviceSize && imageSize > deviceSize)
+    {
+        throw std::runtime_error(image + " does not fit in " + device);
+    }
+
+    Plan plan{image, {}, 0};
+    std::vector<uint8_t> target(eraseSize);
+    for (size_t offset = 0; offset < imageSize; offset += eraseSize)
+    {
+        size_t size = std::min(eraseSize, imageSize - offset);
+        if (readFull(in.fd, target.data(), size, offset) !=
+            static_cast<ssize_t>(size))
+        {
+            throw std::runtime_error("Failed to read " + image);
+        }
+        bool differs = !blockMatches(offset, target, size);
+        plan.differs.push_back(differs);
+        if (differs)
+        {
+            plan.bytes += isMtd ? eraseSize : size;
+        }
+    }
+    return plan;
+}
+
+FlashModel::Rates MtdWriter::characterize(off_t offset, size_t size)
+{
+    if (size == 0 || offset % eraseSize != 0 || size % eraseSize != 0 ||
+        (deviceSize && offset + size > deviceSize))
+    {
+        throw std::runtime_error("Invalid region to characterize " + device);
+    }
+
+    // Save the region, so that it holds what it did before once measured
+    std::vector<uint8_t> saved(size);
+    if (readFull(fd, saved.data(), size, offset) != static_cast<ssize_t>(size))
+    {
+        throw std::runtime_error("Failed to read " + device + ": " +
+                                 std::strerror(errno));
+    }
+    auto restore = [this, offset, size, &saved]() {
+        std::vector<uint8_t> target(eraseSize);
+        for (size_t done = 0; done < size; done += eraseSize)
+        {
+            std::copy(saved.begin() + done, saved.begin() + done + eraseSize,
+                      target.begin());
+            writeBlock(offset + done, target, eraseSize);
+        }
+        sync();
+    };
+
+    FlashModel::Rates rates;
+    try
+    {
+        rates = measure(offset, size);
+    }
+    catch (const std::exception&)
+    {
+        restore();
+        throw;
+    }
+    restore();
+    return rates;
+}
+
+FlashModel::Rates MtdWriter::measure(off_t offset, size_t size)
+{
+    using Clock = std::chrono::steady_clock;
+    Clock::duration erasing{};
+    Clock::duration programming{};
+    Clock::duration reading{};
+
+    // Not a constant pattern, which some controllers handle faster
+    std::vector<uint8_t> pattern(eraseSize);
+    for (size_t i = 0; i < pattern.size(); i++)
+    {
+        pattern[i] = static_cast<uint8_t>((i * 131 + 7) ^ (i >> 8));
+    }
+
+    for (size_t done = 0; done < size; done += eraseSize)
+    {
+        off_t blockOffset = offset + done;
+        auto start = Clock::now();
+        if (isMtd)
+        {
+            erase_info_user erase{static_cast<uint32_t>(blockOffset),
+                                  static_cast<uint32_t>(eraseSize)};
+            if (ioctl(fd, MEMERASE, &erase) < 0)
+            {
+                throw std::runtime_error("Failed to erase " + device + ": " +
+                                         std::strerror(errno));
+            }
+            auto erased = Clock::now();
+            erasing += erased - start;
+            start = erased;
+        }
+        if (!writeFull(fd, pattern.data(), pattern.size(), blockOffset))
+        {
+            throw std::runtime_error("Failed to write " + device + ": " +
+                                     std::strerror(errno));
+        }
+        programming += Clock::now() - start;
+    }
+
+    auto syncStart = Clock::now();
+    sync();
+    programming += Clock::now() - syncStart;
+
+    for (size_t done = 0; done < size; done += eraseSize)
+    {
+        auto readStart = Clock::now();
+        auto n = readFull(fd, current.data(), eraseSize, offset + done);
+        reading += Clock::now() - readStart;
+        if (n != static_cast<ssize_t>(eraseSize) || current != pattern)
+        {
+            throw std::runtime_error("Verification of " + device +
+                                     " failed at offset " +
+                                     std::to_string(offset + done));
+        }
+    }
+
+    auto rate = [size](Clock::duration time) {
+        auto seconds = std::chrono::duration<double>(time).count();
+        return seconds > 0 ? size / seconds : 0.0;
+    };
+    return {isMtd ? rate(erasing) : 0.0, rate(programming), rate(reading)};
+}
+
+size_t MtdWriter::loadJournal(const std::string& journal,
+                              const std::string& digest) const
+{
+    std::ifstream file(journal);
+    std::string journalDevice;
+    std::string journalDigest;
+    size_t blocks = 0;
+    size_t journalEraseSize = 0;
+    if (!(file >> journalDevice >> journalDigest >> journalEraseSize >>
+          blocks) ||
+        journalDevice != device || journalDigest != digest ||
+        journalEraseSize != eraseSize)
+    {
+        return 0;
+    }
+    return blocks;
+}
+
+void MtdWriter::storeJournal(const std::string& journal,
+                             const std::string& digest, size_t blocks) const
+{
+    // Replace the journal atomically, so that a crash while writing it
+    // leaves the previous one behind
+    auto tmp = journal + ".tmp";
+    {
+        std::ofstream file(tmp, std::ios::trunc);
+        file << device << "\n"
+             << digest << "\n"
+             << eraseSize << "\n"
+             << blocks << "\n";
+        if (!file.flush())
+        {
+            return;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp, journal, ec);
+}
+
+bool MtdWriter::blockMatches(off_t offset, const std::vector<uint8_t>& target,
+                             size_t size)
+{
+    size_t length = isMtd ? eraseSize : size;
+    auto n = readFull(fd, current.data(), length, offset);
+    if (n < 0)
+    {
+        throw std::runtime_error("Failed to read " + device + ": " +
+                                 std::strerror(errno));
+    }
+    return static_cast<size_t>(n) == length &&
+           std::equal(target.begin(), target.begin() + size, current.begin());
+}
+
+bool MtdWriter::writeBlock(off_t offset, std::vector<uint8_t>& target,
+                           size_t size, bool compare)
+{
+    if (compare && blockMatches(offset, target, size))
+    {
+        return false;
+    }
+
+    // An erase covers the whole block, so on flash the part of the last
+    // block beyond the image was read and is written back unchanged.
+    size_t length = isMtd ? eraseSize : size;
+
+    if (isMtd)
+    {
+        std::copy(current.begin() + size, current.begin() + length,
+                  target.begin() + size);
+        erase_info_user erase{static_cast<uint32_t>(offset),
+                              static_cast<uint32_t>(eraseSize)};
+        if (ioctl(fd, MEMERASE, &erase) < 0)
+        {
+            throw std::runtime_error("Failed to erase " + device + ": " +
+                                     std::strerror(errno));
+        }
+    }
+
+    if (!writeFull(fd, target.data(), length, offset))
+    {
+        throw std::runtime_error("Failed to write " + device + ": " +
+                                 std::strerror(errno));
+    }
+
+    if (readFull(fd, current.data(), length, offset) !=
+            static_cast<ssize_t>(length) ||
+        !std::equal(target.begin(), target.begin() + length, current.begin()))
+    {
+        throw std::runtime_error("Verification of " + device +
+                                 " failed at offset " + std::to_string(offset));
+    }
+    return true;
+}
+
+} // namespace updater
+} // namespace software
+} // namespace phosphor
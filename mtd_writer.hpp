@@ -0,0 +1,262 @@
+#pragma once
+
+#include "flash_model.hpp"
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace phosphor
+{
+namespace software
+{
+namespace updater
+{
+
+/** @class MtdWriter
+ *  @brief Writes an image to an MTD device one erase block at a time.
+ *  @details Replaces flashcp: every block of the image is compared with the
+ *  flash first, and only blocks that differ are erased, written and read
+ *  back. Updating a device that already holds most of the image therefore
+ *  takes a fraction of the time of a full write.
+ *
+ *  The device may also be a plain file, which is written in place without
+ *  erasing. This is what the unit tests use. The image may be a device as
+ *  well, which mirrors one partition to another.
+ *
+ *  An optional journal records the device, the image digest and how many
+ *  blocks have been written and verified. If the write is interrupted, a
+ *  later write of the same image to the same device reports how far the
+ *  journal got. The journaled prefix is still compared like the rest of
+ *  the image, since the device may have been written since, and any block
+ *  of it that differs is written again.
+ */
+class MtdWriter
+{
+  public:
+    /** @brief Called after each block with the number of blocks done and
+     *  the total number of blocks. Returning false cancels the write.
+     */
+    using Progress = std::function<bool(size_t done, size_t total)>;
+
+    /** @brief What write() did */
+    struct Stats
+    {
+        /** @brief Number of blocks in the image */
+        size_t blocks;
+        /** @brief Number of blocks that had to be written */
+        size_t written;
+        /** @brief Number of blocks verified according to the journal of an
+         *  interrupted write, compared again all the same */
+        size_t resumed;
+    };
+
+    /** @brief Which blocks of an image differ from the device */
+    struct Plan
+    {
+        /** @brief Path to the image */
+        std::string image;
+        /** @brief Whether each block of the image differs from the device */
+        std::vector<bool> differs;
+        /** @brief Number of bytes write() will erase and program, a whole
+         *  erase block for each block that differs */
+        uint64_t bytes = 0;
+    };
+
+    /** @brief Number of blocks between journal updates */
+    static constexpr size_t journalInterval = 64;
+
+    /** @brief Block size used for devices that are not MTD */
+    static constexpr size_t defaultBlockSize = 64 * 1024;
+
+    MtdWriter() = delete;
+    MtdWriter(const MtdWriter&) = delete;
+    MtdWriter& operator=(const MtdWriter&) = delete;
+    MtdWriter(MtdWriter&&) = delete;
+    MtdWriter& operator=(MtdWriter&&) = delete;
+    ~MtdWriter();
+
+    /** @brief Constructor
+     *
+     *  @param[in] device - The MTD device or file to write
+     *  @param[in] blockSize - Block size for devices that are not MTD
+     *
+     *  @throw std::runtime_error if the device cannot be opened
+     */
+    explicit MtdWriter(const std::string& device,
+                       size_t blockSize = defaultBlockSize);
+
+    /** @brief Write an image to the start of the device
+     *
+     *  @param[in] image - Path to the image
+     *  @param[in] progress - Called after each block
+     *  @param[in] journal - Path to the progress journal, empty for none.
+     *                       It is removed once the write has completed or
+     *                       has failed, and kept if it was cancelled.
+     *
+     *  @return The number of blocks checked and written
+     *
+     *  @throw std::runtime_error if the image does not fit, a block cannot
+     *         be written or does not read back correctly, or the write is
+     *         cancelled
+     */
+    Stats write(const std::string& image, const Progress& progress = {},
+                const std::string& journal = {});
+
+    /** @brief Write the blocks of an image that compare() found to differ
+     *
+     *  @details The blocks that matched are not read again, so the device
+     *  must not have changed since compare().
+     *
+     *  @param[in] plan - The result of compare()
+     *  @param[in] progress - Called after each block
+     *  @param[in] journal - Path to the progress journal, as for write()
+     *
+     *  @return The number of blocks checked and written
+     *
+     *  @throw std::runtime_error as write() does, or if the plan does not
+     *         match the image
+     */
+    Stats write(const Plan& plan, const Progress& progress = {},
+                const std::string& journal = {});
+
+    /** @brief Compare an image with the device without writing anything
+     *
+     *  @param[in] image - Path to the image
+     *
+     *  @return Which blocks differ, to be written with write()
+     *
+     *  @throw std::runtime_error if the image does not fit or cannot be
+     *         read, or the device cannot be read
+     */
+    Plan compare(const std::string& image);
+
+    /** @brief Measure the throughput of the device
+     *
+     *  @details Erases, programs and reads back a scratch region, then
+     *  restores its previous content. On a plain file nothing is erased
+     *  and the reads are likely served by the page cache.
+     *
+     *  @param[in] offset - Start of the region, a multiple of the block size
+     *  @param[in] size - Size of the region, a multiple of the block size
+     *
+     *  @return The measured rates
+     *
+     *  @throw std::runtime_error if the region is invalid, cannot be read,
+     *         or cannot be written or does not read back correctly
+     */
+    FlashModel::Rates characterize(off_t offset, size_t size);
+
+    /** @brief Compute the SHA-256 of an image, as recorded in the journal
+     *
+     *  @param[in] image - Path to the image, or a device
+     *
+     *  @return The digest as a hex string
+     *
+     *  @throw std::runtime_error if the image cannot be read
+     */
+    static std::string digest(const std::string& image);
+
+    /** @brief The erase block size of the device */
+    size_t blockSize() const
+    {
+        return eraseSize;
+    }
+
+  private:
+    /** @brief Write an image, comparing each block or following a plan
+     *
+     *  @param[in] image - Path to the image
+     *  @param[in] differs - Which blocks differ, nullptr to compare them
+     *  @param[in] progress - Called after each block
+     *  @param[in] journal - Path to the progress journal, empty for none
+     */
+    Stats writeImage(const std::string& image,
+                     const std::vector<bool>* differs,
+                     const Progress& progress, const std::string& journal);
+
+    /** @brief Read the number of verified blocks from a journal
+     *
+     *  @param[in] journal - Path to the journal
+     *  @param[in] digest - Digest of the image being written
+     *
+     *  @return The number of verified blocks, 0 if the journal does not
+     *          exist or belongs to a different image or device
+     */
+    size_t loadJournal(const std::string& journal,
+                       const std::string& digest) const;
+
+    /** @brief Record the number of verified blocks in a journal
+     *
+     *  @param[in] journal - Path to the journal
+     *  @param[in] digest - Digest of the image being written
+     *  @param[in] blocks - Number of verified blocks
+     */
+    void storeJournal(const std::string& journal, const std::string& digest,
+                      size_t blocks) const;
+
+    /** @brief Whether a block already has the target content
+     *
+     *  @details Reads the block, or all of it on flash, into current.
+     *
+     *  @param[in] offset - Offset of the block in the device
+     *  @param[in] target - The content the block should have
+     *  @param[in] size - Number of bytes of the image in this block
+     */
+    bool blockMatches(off_t offset, const std::vector<uint8_t>& target,
+                      size_t size);
+
+    /** @brief Write one block if it differs from the target content
+     *
+     *  @param[in] offset - Offset of the block in the device
+     *  @param[in,out] target - The content the block should have
+     *  @param[in] size - Number of bytes of the image in this block
+     *  @param[in] compare - Whether to compare the block first, false if
+     *                       it is known to differ
+     *
+     *  @return Whether the block had to be written
+     */
+    bool writeBlock(off_t offset, std::vector<uint8_t>& target, size_t size,
+                    bool compare = true);
+
+    /** @brief Erase, program and read back a region, overwriting it
+     *
+     *  @param[in] offset - Start of the region, checked by characterize()
+     *  @param[in] size - Size of the region, checked by characterize()
+     *
+     *  @return The measured rates
+     */
+    FlashModel::Rates measure(off_t offset, size_t size);
+
+    /** @brief Flush the writes to the device
+     *
+     *  @throw std::runtime_error if the device cannot be synced
+     */
+    void sync();
+
+    /** @brief Path of the device, for error messages */
+    std::string device;
+
+    /** @brief The open device */
+    int fd;
+
+    /** @brief Whether the device is MTD and has to be erased */
+    bool isMtd = false;
+
+    /** @brief Size of the device, 0 if unlimited */
+    size_t deviceSize = 0;
+
+    /** @brief Erase block size */
+    size_t eraseSize;
+
+    /** @brief Buffer for the current content of a block */
+    std::vector<uint8_t> current;
+};
+
+} // namespace updater
+} // namespace software
+} // namespace phosphor
@@ -60,50 +60,6 @@ struct RemovablePath
     }
 };
 
-void UpdateManager::subscribeToSystemdSignals()
-{
-    auto method = this->bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
-                                            SYSTEMD_INTERFACE, "Subscribe");
-    try
-    {
-        this->bus.call_noreply(method);
-    }
-    catch (const SdBusError& e)
-    {
-        if (e.name() != nullptr &&
-            strcmp("org.freedesktop.systemd1.AlreadySubscribed", e.name()) == 0)
-        {
-            // If an Activation attempt fails, the Unsubscribe method is not
-            // called. This may lead to an AlreadySubscribed error if the
-            // Activation is re-attempted.
-        }
-        else
-        {
-            log<level::ERR>("Error subscribing to systemd",
-                            entry("ERROR=%s", e.what()));
-        }
-    }
-
-    return;
-}
-
-void UpdateManager::unsubscribeFromSystemdSignals()
-{
-    auto method = this->bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
-                                            SYSTEMD_INTERFACE, "Unsubscribe");
-    try
-    {
-        this->bus.call_noreply(method);
-    }
-    catch (const SdBusError& e)
-    {
-        log<level::ERR>("Error in unsubscribing from systemd signals",
-                        entry("ERROR=%s", e.what()));
-    }
-
-    return;
-}
-
 ObjectValueTree UpdateManager::getManagedObjects(const std::string& service,
                                                  const std::string& objPath)
 {
@@ -183,6 +139,13 @@ bool UpdateManager::checkActiveBMCUpdate()
 void UpdateManager::failUpdate(uint8_t progressChange, std::string msg,
                                bool failed)
 {
+    // Stop the copy, which keeps the image open to the page being sent, and
+    // is joined on the loop when it ends
+    if (copyWorker)
+    {
+        copyWorker->Cancel();
+    }
+
     std::string filePath = std::any_cast<std::string>(
         sUpdateMachineContext->GetData(keyFWImgName));
 
@@ -303,6 +266,16 @@ int UpdateManager::processImage(const std::string& filePath)
             return -1;
         }
 
+        // The copy of a failed update may still be on the bus
+        if (copyWorker && copyWorker->Running())
+        {
+            RemovablePath fwFilePathRemove(filePath);
+            log<level::ERR>("The image copy of the last update is still "
+                            "stopping");
+
+            return -1;
+        }
+
         EnableRebootGuard();
 
         std::string objPath = std::string{SOFTWARE_CEC_UPDATE_OBJPATH};
@@ -368,8 +341,6 @@ int UpdateManager::processImage(const std::string& filePath)
             return -1;
         }
 
-        subscribeToSystemdSignals();
-
         fwUpdateMachine->TriggerFWUpdate();
 
         std::tuple<bool, std::string> ret =
@@ -380,7 +351,6 @@ int UpdateManager::processImage(const std::string& filePath)
         {
             std::string msg{"SECURE UPDATE FAILED IN A STATE "};
             std::string retMsg = std::get<1>(ret);
-            unsubscribeFromSystemdSignals();
             failUpdate(progress, msg + retMsg);
 
             log<level::ERR>(msg.c_str(), entry("FAILURE=%s", retMsg.c_str()));
@@ -389,7 +359,6 @@ int UpdateManager::processImage(const std::string& filePath)
     }
     catch (const std::exception& e)
     {
-        unsubscribeFromSystemdSignals();
         std::string msg{"SECURE UPDATE RUN EXCEPTION "};
         failUpdate(progress, msg);
 
@@ -400,36 +369,20 @@ int UpdateManager::processImage(const std::string& filePath)
     return 0;
 }
 
-void UpdateManager::unitStateChange(sdbusplus::message::message& msg)
+void UpdateManager::onStateChanges(const std::string& result)
 {
     if (secureUpdateProgress != SecureUpdate::INPROGRESS)
     {
         return;
     }
 
-    uint32_t newStateID{};
-    sdbusplus::message::object_path newStateObjPath;
-    std::string newStateUnit{};
-    std::string newStateResult{};
     uint8_t progress{50};
 
     try
     {
-        // Read the msg and populate each variable
-        msg.read(newStateID, newStateObjPath, newStateUnit, newStateResult);
-
-        auto copyImageServiceFile = std::any_cast<std::string>(
-            sUpdateMachineContext->GetData(keyCopyServiceNameString));
-
-        if (newStateUnit != copyImageServiceFile)
-        {
-            return;
-        }
-
         secureUpdateTimer->stop();
-        unsubscribeFromSystemdSignals();
 
-        if (newStateResult == "done")
+        if (result == "done")
         {
             if (fwUpdateMachine &&
                 fwUpdateMachine->GetCurrentState() ==
@@ -471,12 +424,9 @@ void UpdateManager::unitStateChange(sdbusplus::message::message& msg)
         }
         else
         {
-            if (newStateResult == "failed" || newStateResult == "dependency")
-            {
-                log<level::ERR>(
-                    "onStateChanges Secure Image Copy script: failed run.",
-                    entry("RESULT=%s", newStateResult.c_str()));
-            }
+            log<level::ERR>(
+                "onStateChanges Secure Image Copy script: failed run.",
+                entry("RESULT=%s", result.c_str()));
         }
     }
     catch (const std::exception& e)
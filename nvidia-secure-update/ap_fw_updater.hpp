@@ -1,5 +1,6 @@
 #pragma once
 #include "ap_fw_activation.hpp"
+#include "cec_copy_worker.hpp"
 #include "version.hpp"
 
 #include <sdbusplus/bus.hpp>
@@ -11,8 +12,6 @@ namespace software
 {
 namespace firmwareupdater
 {
-namespace sdbusRule = sdbusplus::bus::match::rules;
-
 static const std::string progressFile{"progress.txt"};
 
 using DbusInterface = std::string;
@@ -34,15 +33,7 @@ class UpdateManager;
 class UpdateManager
 {
   public:
-    UpdateManager(sdbusplus::bus::bus& bus) :
-        bus(bus),
-        systemdSignals(
-            bus,
-            sdbusRule::type::signal() + sdbusRule::member("JobRemoved") +
-                sdbusRule::path("/org/freedesktop/systemd1") +
-                sdbusRule::interface("org.freedesktop.systemd1.Manager"),
-            std::bind(std::mem_fn(&UpdateManager::unitStateChange), this,
-                      std::placeholders::_1)){};
+    UpdateManager(sdbusplus::bus::bus& bus) : bus(bus){};
 
     int processImage(const std::string& filePath);
 
@@ -52,11 +43,9 @@ class UpdateManager
     void progress(uint8_t progress, std::string msg = "",
                   bool fwUpdatePass = false, bool updateResult = false);
 
-  private:
-    void subscribeToSystemdSignals();
-
-    void unsubscribeFromSystemdSignals();
+    void onStateChanges(const std::string& result);
 
+  private:
     void EnableRebootGuard();
 
     void DisableRebootGuard();
@@ -66,8 +55,6 @@ class UpdateManager
 
     bool checkActiveBMCUpdate();
 
-    void unitStateChange(sdbusplus::message::message& msg);
-
   public:
     enum class SecureUpdate
     {
@@ -83,9 +70,10 @@ class UpdateManager
 
     sdbusplus::bus::bus& bus;
 
+    /** @brief Copies the image to the CEC and reports when it completes **/
+    std::unique_ptr<phosphor::software::updater::CecCopyWorker> copyWorker;
+
   private:
-    /** @brief Used to subscribe to dbus systemd signals **/
-    sdbusplus::bus::match_t systemdSignals;
     std::unique_ptr<ApFwActivation> activation;
     std::unique_ptr<ApFwActivationProgress> activationProgress;
 };
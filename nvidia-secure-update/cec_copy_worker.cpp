@@ -0,0 +1,178 @@
+#include "config.h"
+
+#include "cec_copy_worker.hpp"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <phosphor-logging/log.hpp>
+
+#include <cstring>
+#include <stdexcept>
+
+namespace phosphor
+{
+namespace software
+{
+namespace updater
+{
+
+using namespace phosphor::logging;
+using namespace std::string_literals;
+
+// A failed attempt is resumed from the last page the CEC got
+static constexpr auto transferAttempts = 3;
+
+CecCopyWorker::CecCopyWorker(sd_event* loop, ProgressCallback progress,
+                             DoneCallback done) :
+    progressCallback(std::move(progress)),
+    doneCallback(std::move(done))
+{
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (-1 == fd)
+    {
+        auto error = errno;
+        throw std::runtime_error("eventfd failed, errno="s +
+                                 std::strerror(error));
+    }
+
+    auto rc = sd_event_add_io(loop, &source, fd, EPOLLIN, callback, this);
+    if (0 > rc)
+    {
+        close(fd);
+        throw std::runtime_error("failed to add to event loop, rc="s +
+                                 std::strerror(-rc));
+    }
+}
+
+CecCopyWorker::~CecCopyWorker()
+{
+    Cancel();
+    // Only before the loop joined the thread, such as on exit
+    if (thread.joinable())
+    {
+        thread.join();
+    }
+    sd_event_source_unref(source);
+    close(fd);
+}
+
+void CecCopyWorker::Start(const std::string& file, uint32_t size)
+{
+    if (thread.joinable())
+    {
+        throw std::runtime_error("CecCopyWorker - copy already started");
+    }
+
+    imageSize = size;
+    thread = std::thread([this, file, size]() {
+        I2CCommLib deviceLayer(CEC_BUS_IDENTIFIER, CEC_DEVICE_ADDRESS);
+        deviceLayer.SetPageCallback([this](uint32_t bytes, uint32_t) {
+            sent = bytes;
+            Notify();
+            return !cancelled;
+        });
+        succeeded = CopyImage(deviceLayer, file, size, cancelled);
+        finished = true;
+        Notify();
+    });
+}
+
+void CecCopyWorker::Cancel()
+{
+    cancelled = true;
+}
+
+bool CecCopyWorker::CopyImage(I2CCommLib& deviceLayer, const std::string& file,
+                              uint32_t size, const std::atomic<bool>& cancelled)
+{
+    I2CCommLib::StatusPolling polling;
+    polling.initialDelay = std::chrono::milliseconds(CEC_POLL_INITIAL_DELAY_MS);
+    polling.maxDelay = std::chrono::milliseconds(CEC_POLL_MAX_DELAY_MS);
+    polling.pageTimeout = std::chrono::milliseconds(CEC_PAGE_TIMEOUT_MS);
+    polling.settleDelay = std::chrono::milliseconds(CEC_SETTLE_DELAY_MS);
+    polling.window = CEC_TRANSFER_WINDOW;
+    polling.maxBlockSize = CEC_MAX_BLOCK_SIZE;
+    deviceLayer.SetStatusPolling(polling);
+    deviceLayer.SetCheckpointFile(cecTransferCheckpointFile);
+
+    std::string fileName = file;
+    bool copied = false;
+    for (int attempt = 1;
+         !copied && !cancelled && attempt <= transferAttempts; attempt++)
+    {
+        try
+        {
+            deviceLayer.SendImageToCEC(fileName, size);
+            copied = true;
+        }
+        catch (const std::exception& e)
+        {
+            log<level::ERR>("CecCopyWorker - transfer image failed.",
+                            entry("EXCEPTION=%s", e.what()),
+                            entry("ATTEMPT=%d", attempt));
+        }
+    }
+
+    try
+    {
+        I2CCommLib::WriteTransferStats(cecTransferStatsFile,
+                                       deviceLayer.GetTransferStats());
+    }
+    catch (const std::exception& e)
+    {
+        log<level::ERR>("CecCopyWorker - saving transfer stats failed.",
+                        entry("EXCEPTION=%s", e.what()));
+    }
+
+    return copied;
+}
+
+void CecCopyWorker::Notify()
+{
+    eventfd_write(fd, 1);
+}
+
+int CecCopyWorker::callback(sd_event_source* /* s */, int fd,
+                            uint32_t revents, void* userdata)
+{
+    if (!(revents & EPOLLIN))
+    {
+        return 0;
+    }
+
+    eventfd_t count;
+    eventfd_read(fd, &count);
+
+    auto worker = static_cast<CecCopyWorker*>(userdata);
+    if (worker->finished && worker->thread.joinable())
+    {
+        // The thread has ended, so this does not block the loop
+        worker->thread.join();
+    }
+    if (worker->cancelled)
+    {
+        return 0;
+    }
+
+    uint32_t bytes = worker->sent;
+    if (bytes != worker->reported && worker->progressCallback)
+    {
+        worker->reported = bytes;
+        worker->progressCallback(bytes, worker->imageSize);
+    }
+
+    if (worker->finished)
+    {
+        // The callback may destroy the worker, so it is called last.
+        auto done = std::move(worker->doneCallback);
+        std::string result = worker->succeeded ? "done" : "failed";
+        worker->cancelled = true;
+        done(result);
+    }
+    return 0;
+}
+
+} // namespace updater
+} // namespace software
+} // namespace phosphor
@@ -0,0 +1,130 @@
+#pragma once
+
+#include "i2c_comm_lib.hpp"
+
+#include <systemd/sd-event.h>
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+
+namespace phosphor
+{
+namespace software
+{
+namespace updater
+{
+
+/** @class CecCopyWorker
+ *
+ *  @brief Copies an image to the CEC on a thread of the updater
+ *
+ *  The pages are sent with I2CCommLib on a worker thread, which wakes the
+ *  sd-event loop through an eventfd. The callbacks run on the loop.
+ */
+class CecCopyWorker
+{
+  public:
+    /** @brief Called with the bytes sent and the size of the image */
+    using ProgressCallback = std::function<void(uint32_t sent, uint32_t size)>;
+
+    /** @brief Called once with "done" or "failed", like a unit result */
+    using DoneCallback = std::function<void(const std::string& result)>;
+
+    /** @brief ctor - hook the worker with sd-event
+     *
+     *  @param[in] loop - sd-event object
+     *  @param[in] progress - The callback for the pages sent
+     *  @param[in] done - The callback for the end of the copy
+     */
+    CecCopyWorker(sd_event* loop, ProgressCallback progress,
+                  DoneCallback done);
+
+    CecCopyWorker(const CecCopyWorker&) = delete;
+    CecCopyWorker& operator=(const CecCopyWorker&) = delete;
+    CecCopyWorker(CecCopyWorker&&) = delete;
+    CecCopyWorker& operator=(CecCopyWorker&&) = delete;
+
+    /** @brief dtor - cancel the copy and close the eventfd, waiting for
+     *  the thread if the loop has not joined it yet */
+    ~CecCopyWorker();
+
+    /** @brief Start copying the image
+     *
+     *  @param[in] file - The image
+     *  @param[in] size - The size of the image to send
+     */
+    void Start(const std::string& file, uint32_t size);
+
+    /** @brief Request that the copy stop after the page being sent,
+     *  without calling the done callback
+     *
+     *  The thread is joined on the loop once it ends, so this does not
+     *  wait for the status polls of the page.
+     */
+    void Cancel();
+
+    /** @brief Whether the copy thread has not been joined yet, which it
+     *  still talks to the CEC until
+     */
+    bool Running() const
+    {
+        return thread.joinable();
+    }
+
+    /** @brief Send an image with the configured polling, resuming a failed
+     *  attempt from the last page the CEC got
+     *
+     *  @param[in] deviceLayer - The CEC
+     *  @param[in] file - The image
+     *  @param[in] size - The size of the image to send
+     *  @param[in] cancelled - Stops the copy when set
+     *
+     *  @return true if the image was sent
+     */
+    static bool CopyImage(I2CCommLib& deviceLayer, const std::string& file,
+                          uint32_t size, const std::atomic<bool>& cancelled);
+
+  private:
+    /** @brief sd-event callback
+     *
+     *  @param[in] s - event source
+     *  @param[in] fd - eventfd
+     *  @param[in] revents - events that matched for fd
+     *  @param[in] userdata - pointer to CecCopyWorker object
+     *  @returns 0 on success
+     */
+    static int callback(sd_event_source* s, int fd, uint32_t revents,
+                        void* userdata);
+
+    /** @brief Wake the loop, from the worker thread */
+    void Notify();
+
+    ProgressCallback progressCallback;
+
+    DoneCallback doneCallback;
+
+    int fd = -1;
+
+    sd_event_source* source = nullptr;
+
+    std::thread thread;
+
+    std::atomic<bool> cancelled{false};
+
+    std::atomic<bool> finished{false};
+
+    std::atomic<bool> succeeded{false};
+
+    std::atomic<uint32_t> sent{0};
+
+    uint32_t imageSize{0};
+
+    /** @brief The bytes sent last reported to the progress callback */
+    uint32_t reported{0};
+};
+
+} // namespace updater
+} // namespace software
+} // namespace phosphor
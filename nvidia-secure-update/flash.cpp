@@ -257,31 +257,13 @@ void Activation::flashWrite()
     }
 }
 
-void Activation::onStateChanges(sdbusplus::message::message& msg)
+void Activation::onStateChanges(const std::string& result)
 {
-    // Empty
-    uint32_t newStateID{};
-    sdbusplus::message::object_path newStateObjPath;
-    std::string newStateUnit{};
-    std::string newStateResult{};
-
     try
     {
-        // Read the msg and populate each variable
-        msg.read(newStateID, newStateObjPath, newStateUnit, newStateResult);
-
-        auto copyImageServiceFile = "obmc-secure-copy-image@" + versionId +
-                                    ".service";
-
-        if (newStateUnit != copyImageServiceFile)
-        {
-            return;
-        }
-
         secureUpdateTimer->cancel();
-        Activation::unsubscribeFromSystemdSignals();
 
-        if (newStateResult == "done")
+        if (result == "done")
         {
             if (fwUpdateMachine &&
                 fwUpdateMachine->GetCurrentState() ==
@@ -311,12 +293,9 @@ void Activation::onStateChanges(sdbusplus::message::message& msg)
         }
         else
         {
-            if (newStateResult == "failed" || newStateResult == "dependency")
-            {
-                log<level::ERR>(
-                    "onStateChanges Secure Image Copy script: failed run.",
-                    entry("RESULT=%s", newStateResult.c_str()));
-            }
+            log<level::ERR>(
+                "onStateChanges Secure Image Copy script: failed run.",
+                entry("RESULT=%s", result.c_str()));
         }
     }
     catch (const std::exception& e)
@@ -332,6 +311,8 @@ void Activation::onStateChanges(sdbusplus::message::message& msg)
 void Activation::failActivation(bool failed)
 {
     secureUpdateProgress = Activation::SecureUpdate::IDLE;
+    // The state is set past the override, which releases the flash
+    parent.scheduler.release(versionId);
     try
     {
         activationBlocksTransition.reset(nullptr);
@@ -112,8 +112,29 @@ void I2CDevice::writeCustom(uint8_t reg, uint8_t size, uint8_t* data)
     if (retVal < 0)
     {
         throw I2CException("IOCTL: Failed to write block data", busStr, reg,
-                           retVal);
+                           errno);
+    }
+}
+
+unsigned long I2CDevice::getFuncs()
+{
+    checkIsOpen();
+    if (cachedFuncs == NO_FUNCS && ioctl(fd, I2C_FUNCS, &cachedFuncs) < 0)
+    {
+        throw I2CException("Failed to get funcs", busStr, devAddr, errno);
+    }
+    return cachedFuncs;
+}
+
+// The custom reads and writes are plain I2C messages. Without I2C_FUNC_I2C
+// the adapter only does SMBus transfers, at most a block long.
+size_t I2CDevice::maxWriteLength()
+{
+    if (getFuncs() & I2C_FUNC_I2C)
+    {
+        return UINT8_MAX;
     }
+    return I2C_SMBUS_BLOCK_MAX;
 }
 
 std::unique_ptr<I2CInterface> I2CDevice::create(uint8_t busId, uint8_t devAddr,
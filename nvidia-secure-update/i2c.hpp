@@ -71,6 +71,12 @@ class I2CDevice : public I2CInterface
         }
     }
 
+    /** @brief Get the functionality of the adapter, cached while open
+     *
+     * @throw I2CException on error
+     */
+    unsigned long getFuncs();
+
     /** @brief Close device without throwing an exception if an error occurs */
     void closeWithoutException() noexcept
     {
@@ -109,6 +115,9 @@ class I2CDevice : public I2CInterface
 
     void writeCustom(uint8_t addr, uint8_t size, uint8_t* data) override;
 
+    /** @copydoc I2CInterface::maxWriteLength() */
+    size_t maxWriteLength() override;
+
     /** @brief Create an I2CInterface instance
      *
      * Automatically opens the I2CInterface if initialState is OPEN.
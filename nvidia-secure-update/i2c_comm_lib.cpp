@@ -15,11 +15,21 @@
 #include <sdbusplus/exception.hpp>
 #include <xyz/openbmc_project/Common/error.hpp>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
 #include <chrono>
+#include <cstddef>
 #include <cstdlib>
 #include <ctime>
 #include <fstream>
+#include <iomanip>
+#include <mutex>
 #include <numeric>
+#include <sstream>
 
 namespace phosphor
 {
@@ -35,14 +45,39 @@ using EVP_PKEY_Ptr = std::unique_ptr<EVP_PKEY, decltype(&::EVP_PKEY_free)>;
 using EVP_MD_CTX_Ptr =
     std::unique_ptr<EVP_MD_CTX, decltype(&::EVP_MD_CTX_free)>;
 
-void I2CCommLib::VerifyCheckSum(const std::vector<uint8_t>& data)
+uint8_t I2CCommLib::Checksum(const uint8_t* data, size_t size)
 {
-    uint8_t checksum = 0;
-    std::string dataStr{" "};
+    // The bytes of a word are added in four 16-bit lanes, which are summed
+    // before 128 words could carry one lane into the next.
+    constexpr uint64_t lowBytes{0x00ff00ff00ff00ffULL};
+    constexpr size_t wordsPerLaneSum{128};
+
+    size_t words = size / sizeof(uint64_t);
+    uint64_t sum{0};
+    for (size_t word = 0; word < words;)
+    {
+        size_t end = std::min(words, word + wordsPerLaneSum);
+        uint64_t lanes{0};
+        for (; word < end; word++)
+        {
+            uint64_t value;
+            memcpy(&value, data + word * sizeof(value), sizeof(value));
+            lanes += (value & lowBytes) + ((value >> 8) & lowBytes);
+        }
+        sum += (lanes & 0xffff) + ((lanes >> 16) & 0xffff) +
+               ((lanes >> 32) & 0xffff) + (lanes >> 48);
+    }
+    for (size_t i = words * sizeof(uint64_t); i < size; i++)
+    {
+        sum += data[i];
+    }
+    return sum & 0xff;
+}
 
-    checksum = (std::accumulate(data.begin() + READ_CKSUM_LOCATION + 1,
-                                data.end(), 0) &
-                0xff);
+void I2CCommLib::VerifyCheckSum(const std::vector<uint8_t>& data)
+{
+    uint8_t checksum = Checksum(data.data() + READ_CKSUM_LOCATION + 1,
+                                data.size() - READ_CKSUM_LOCATION - 1);
 
     if (data[READ_CKSUM_LOCATION] != checksum)
     {
@@ -55,19 +90,500 @@ void I2CCommLib::VerifyCheckSum(const std::vector<uint8_t>& data)
 
 void I2CCommLib::UpdateCheckSum(std::vector<uint8_t>& data)
 {
-    uint8_t checksum = 0;
-    std::string dataStr{" "};
+    data[WRITE_CKSUM_LOCATION] = Checksum(
+        data.data() + WRITE_CKSUM_LOCATION + 1,
+        data.size() - WRITE_CKSUM_LOCATION - 1);
+}
+
+I2CCommLib::OtaHeader I2CCommLib::ReadOtaHeader(const std::string& fileName)
+{
+    struct CachedHeader
+    {
+        std::string fileName;
+        dev_t device;
+        ino_t inode;
+        off_t size;
+        timespec modified;
+        OtaHeader header;
+    };
+    static std::mutex cacheMutex;
+    static std::optional<CachedHeader> cache;
+
+    ScopedFd image(::open(fileName.c_str(), O_RDONLY | O_CLOEXEC));
+    struct stat st{};
+    if (image.fd < 0 || fstat(image.fd, &st) < 0)
+    {
+        throw std::runtime_error("I2CCommLib - Failed to open the image");
+    }
+
+    std::lock_guard lock(cacheMutex);
+    if (cache && cache->fileName == fileName && cache->device == st.st_dev &&
+        cache->inode == st.st_ino && cache->size == st.st_size &&
+        cache->modified.tv_sec == st.st_mtim.tv_sec &&
+        cache->modified.tv_nsec == st.st_mtim.tv_nsec)
+    {
+        return cache->header;
+    }
+
+    OtaHeader header;
+    auto extension = fsys::path(fileName).extension();
+    if (extension == romExtension)
+    {
+        header.offset = st.st_size > MB_SIZE ? OTA_HEADER_OFFSET_2MB_FILE_SIZE
+                                             : OTA_HEADER_OFFSET_1MB_FILE_SIZE;
+    }
+    else if (extension != binExtension)
+    {
+        throw std::runtime_error("I2CCommLib - Invalid image, file: " +
+                                 fileName);
+    }
+    if (st.st_size < static_cast<off_t>(header.offset + OTA_HEADER_SIZE))
+    {
+        throw std::runtime_error("I2CCommLib - Image shorter than its OTA "
+                                 "header");
+    }
+
+    std::array<uint8_t, OTA_HEADER_SIZE> data;
+    ReadImage(image.fd, header.offset, data.data(), data.size());
+    uint32_t size = data[OTA_OFFSET_SIZE1] | (data[OTA_OFFSET_SIZE2] << 8) |
+                    (data[OTA_OFFSET_SIZE3] << 16) |
+                    (static_cast<uint32_t>(data[OTA_OFFSET_SIZE4]) << 24);
+    if (size > static_cast<uint64_t>(st.st_size) - OTA_HEADER_SIZE)
+    {
+        throw std::runtime_error("I2CCommLib - OTA header size larger than "
+                                 "the image");
+    }
+    header.imageSize = OTA_HEADER_SIZE + size;
+
+    cache = CachedHeader{fileName,   st.st_dev, st.st_ino,
+                         st.st_size, st.st_mtim, header};
+    return header;
+}
+
+I2CInterface& I2CCommLib::OpenDevice()
+{
+    if (!device)
+    {
+        device = create(busId, deviceAddr, true,
+                        I2CInterface::InitialState::CLOSED);
+    }
+    if (!device->isOpen())
+    {
+        device->open();
+    }
+    return *device;
+}
+
+void I2CCommLib::CloseDevice() noexcept
+{
+    try
+    {
+        if (device && device->isOpen())
+        {
+            device->close();
+        }
+    }
+    catch (const std::exception& e)
+    {
+        log<level::ERR>("I2CCommLib - Failed to close the device.",
+                        entry("EXCEPTION=%s", e.what()));
+    }
+}
 
-    checksum = (std::accumulate(data.begin() + WRITE_CKSUM_LOCATION + 1,
-                                data.end(), 0) &
-                0xff);
-    data[WRITE_CKSUM_LOCATION] = checksum;
+void I2CCommLib::ReadRegister(uint8_t reg, std::vector<uint8_t>& data)
+{
+    uint8_t size = data.size();
+    try
+    {
+        OpenDevice().readCustom(reg, size, data.data());
+    }
+    catch (const I2CException&)
+    {
+        CloseDevice();
+        throw;
+    }
+}
+
+void I2CCommLib::WriteRegister(uint8_t reg, std::vector<uint8_t>& data)
+{
+    try
+    {
+        OpenDevice().writeCustom(reg, data.size(), data.data());
+    }
+    catch (const I2CException&)
+    {
+        CloseDevice();
+        throw;
+    }
+}
+
+void I2CCommLib::SetStatusPolling(const StatusPolling& statusPolling)
+{
+    polling = statusPolling;
+    auto size = std::lower_bound(BLOCK_SIZES.begin(), BLOCK_SIZES.end(),
+                                 polling.maxBlockSize, std::greater<>());
+    polling.maxBlockSize = size != BLOCK_SIZES.end() ? *size
+                                                     : BLOCK_SIZES.back();
+    pageDelay = polling.initialDelay;
+    pageLatency = polling.initialDelay;
+    transferWindow = std::max<uint8_t>(polling.window, 1);
+}
+
+void I2CCommLib::ReadImage(int fd, off_t offset, uint8_t* data,
+                           size_t length)
+{
+    while (length > 0)
+    {
+        auto bytes = pread(fd, data, length, offset);
+        if (bytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes <= 0)
+        {
+            throw std::runtime_error("I2CCommLib - Failed to read the image");
+        }
+        data += bytes;
+        offset += bytes;
+        length -= bytes;
+    }
+}
+
+std::string I2CCommLib::ImageDigest(int fd, uint32_t imageSize)
+{
+    EVP_MD_CTX_Ptr ctx(EVP_MD_CTX_new(), ::EVP_MD_CTX_free);
+    if (!ctx || !EVP_DigestInit(ctx.get(), EVP_sha256()))
+    {
+        throw std::runtime_error("I2CCommLib - Failed to hash the image");
+    }
+    std::array<uint8_t, 4096> chunk;
+    for (uint32_t offset = 0; offset < imageSize; offset += chunk.size())
+    {
+        auto length = std::min<size_t>(chunk.size(), imageSize - offset);
+        ReadImage(fd, offset, chunk.data(), length);
+        if (!EVP_DigestUpdate(ctx.get(), chunk.data(), length))
+        {
+            throw std::runtime_error("I2CCommLib - Failed to hash the image");
+        }
+    }
+    std::array<uint8_t, EVP_MAX_MD_SIZE> digest;
+    unsigned int digestLength{0};
+    if (!EVP_DigestFinal(ctx.get(), digest.data(), &digestLength))
+    {
+        throw std::runtime_error("I2CCommLib - Failed to hash the image");
+    }
+    std::ostringstream hex;
+    for (unsigned int i = 0; i < digestLength; i++)
+    {
+        hex << std::hex << std::setw(2) << std::setfill('0')
+            << static_cast<int>(digest[i]);
+    }
+    return hex.str();
+}
+
+std::optional<I2CCommLib::Checkpoint> I2CCommLib::ReadCheckpoint() const
+{
+    std::ifstream in(checkpointFile.empty()
+                         ? fsys::path(cecTransferCheckpointFile)
+                         : checkpointFile);
+    Checkpoint checkpoint;
+    if (!(in >> checkpoint.digest >> checkpoint.imageSize >>
+          checkpoint.blockSize >> checkpoint.written >> checkpoint.failed) ||
+        checkpoint.written == 0)
+    {
+        return std::nullopt;
+    }
+    return checkpoint;
+}
+
+std::string I2CCommLib::ResumeRejection(const Checkpoint& checkpoint,
+                                        const std::string& digest,
+                                        uint32_t imageSize)
+{
+    // The command has no offset, so the transfer can only continue with
+    // the page after the last one the CEC got, of the same image.
+    if (checkpoint.digest != digest || checkpoint.imageSize != imageSize)
+    {
+        return "The checkpoint is of another image";
+    }
+    if (checkpoint.failed)
+    {
+        return "The CEC failed a page";
+    }
+    // The last page written, if its status was not read, which the next
+    // page has to wait for
+    auto status = PollCmdStatus(pageDelay, polling.pageTimeout);
+    if (status != static_cast<uint8_t>(CommandStatus::SUCCESS))
+    {
+        return "The CEC failed the last page: " + GetCommandStatusStr(status);
+    }
+    return {};
+}
+
+uint32_t I2CCommLib::ResumePage(const std::string& digest, uint32_t imageSize,
+                                size_t headerSize, uint16_t& blockSize)
+{
+    auto checkpoint = ReadCheckpoint();
+    if (!checkpoint)
+    {
+        return 0;
+    }
+
+    std::string reason;
+    if (std::find(BLOCK_SIZES.begin(), BLOCK_SIZES.end(),
+                  checkpoint->blockSize) == BLOCK_SIZES.end() ||
+        checkpoint->blockSize > polling.maxBlockSize ||
+        headerSize + checkpoint->blockSize > OpenDevice().maxWriteLength())
+    {
+        reason = "The adapter does not take the block size " +
+                 std::to_string(checkpoint->blockSize);
+    }
+    else
+    {
+        reason = ResumeRejection(*checkpoint, digest, imageSize);
+    }
+    if (!reason.empty())
+    {
+        log<level::ERR>("I2CCommLib - Image transfer cannot resume, the "
+                        "update has to restart.",
+                        entry("REASON=%s", reason.c_str()),
+                        entry("PAGE=%u", checkpoint->written));
+        throw std::runtime_error(reason);
+    }
+
+    // The CEC took the pages of the checkpoint, which the rest continues
+    blockSize = checkpoint->blockSize;
+    log<level::INFO>("I2CCommLib - Resuming the image transfer.",
+                     entry("PAGE=%u", checkpoint->written),
+                     entry("SIZE=%d", blockSize));
+    return checkpoint->written;
+}
+
+bool I2CCommLib::CanResumeImage(const std::string& fileName,
+                                uint32_t imageSize)
+{
+    std::lock_guard<std::recursive_mutex> lock(busMutex);
+    // The size tells most other images apart without reading them
+    auto checkpoint = ReadCheckpoint();
+    if (!checkpoint || checkpoint->imageSize != imageSize)
+    {
+        return false;
+    }
+
+    std::string reason;
+    ScopedFd image(::open(fileName.c_str(), O_RDONLY | O_CLOEXEC));
+    struct stat st{};
+    if (image.fd < 0 || fstat(image.fd, &st) < 0 ||
+        st.st_size < static_cast<off_t>(imageSize))
+    {
+        reason = "The image cannot be read";
+    }
+    else
+    {
+        reason = ResumeRejection(*checkpoint,
+                                 ImageDigest(image.fd, imageSize), imageSize);
+    }
+    if (!reason.empty())
+    {
+        log<level::INFO>("I2CCommLib - The checkpoint cannot be resumed, "
+                         "starting a new update.",
+                         entry("REASON=%s", reason.c_str()),
+                         entry("PAGE=%u", checkpoint->written));
+        return false;
+    }
+    log<level::INFO>("I2CCommLib - Continuing the update from the "
+                     "checkpoint.",
+                     entry("PAGE=%u", checkpoint->written));
+    return true;
+}
+
+void I2CCommLib::DiscardCheckpoint()
+{
+    if (auto checkpoint = ReadCheckpoint())
+    {
+        log<level::INFO>("I2CCommLib - Restarting the image transfer, a new "
+                         "update starts from the first page.",
+                         entry("PAGE=%u", checkpoint->written));
+    }
+    std::error_code ec;
+    fsys::remove(checkpointFile.empty() ? fsys::path(cecTransferCheckpointFile)
+                                        : checkpointFile,
+                 ec);
+}
+
+uint16_t I2CCommLib::NegotiateBlockSize(size_t headerSize)
+{
+    auto maxLength = OpenDevice().maxWriteLength();
+    for (auto size : BLOCK_SIZES)
+    {
+        if (size <= std::min({nextBlockSize, cecBlockLimit,
+                              polling.maxBlockSize}) &&
+            headerSize + size <= maxLength)
+        {
+            return size;
+        }
+    }
+    throw std::runtime_error("I2CCommLib - No block size fits the adapter");
+}
+
+void I2CCommLib::StepDownBlockSize(uint16_t failed)
+{
+    auto next = std::upper_bound(BLOCK_SIZES.begin(), BLOCK_SIZES.end(),
+                                 failed, std::greater<>());
+    if (next != BLOCK_SIZES.end())
+    {
+        nextBlockSize = *next;
+    }
+    cleanTransfers = 0;
+    log<level::WARNING>("I2CCommLib - Stepped down the image block size.",
+                        entry("SIZE=%d", nextBlockSize));
+}
+
+void I2CCommLib::RecoverBlockSize()
+{
+    if (nextBlockSize >= std::min(cecBlockLimit, polling.maxBlockSize) ||
+        ++cleanTransfers < CLEAN_TRANSFERS_TO_STEP_UP)
+    {
+        return;
+    }
+    // A step-down is for a noisy bus, which may have recovered since
+    auto next = std::lower_bound(BLOCK_SIZES.begin(), BLOCK_SIZES.end(),
+                                 nextBlockSize, std::greater<>());
+    if (next != BLOCK_SIZES.begin())
+    {
+        nextBlockSize = *std::prev(next);
+    }
+    cleanTransfers = 0;
+    log<level::INFO>("I2CCommLib - Stepped up the image block size.",
+                     entry("SIZE=%d", nextBlockSize));
+}
+
+bool I2CCommLib::LimitBlockSize(uint16_t rejected)
+{
+    auto next = std::upper_bound(BLOCK_SIZES.begin(), BLOCK_SIZES.end(),
+                                 rejected, std::greater<>());
+    if (next == BLOCK_SIZES.end())
+    {
+        return false;
+    }
+    cecBlockLimit = *next;
+    log<level::INFO>("I2CCommLib - The CEC does not take the image block "
+                     "size, trying a smaller one.",
+                     entry("REJECTED=%d", rejected),
+                     entry("SIZE=%d", cecBlockLimit));
+    return true;
+}
+
+I2CCommLib::TransferStats I2CCommLib::ReadTransferStats(const fsys::path& file)
+{
+    TransferStats stats;
+    std::ifstream in(file);
+    uint16_t blockSize{0};
+    uint32_t bytesPerSecond{0};
+    if (in >> blockSize >> bytesPerSecond &&
+        std::find(BLOCK_SIZES.begin(), BLOCK_SIZES.end(), blockSize) !=
+            BLOCK_SIZES.end())
+    {
+        stats.blockSize = blockSize;
+        stats.bytesPerSecond = bytesPerSecond;
+    }
+    return stats;
+}
+
+void I2CCommLib::WriteTransferStats(const fsys::path& file,
+                                    const TransferStats& stats)
+{
+    std::error_code ec;
+    fsys::create_directories(file.parent_path(), ec);
+    auto tmp = file.string() + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        out << stats.blockSize << " " << stats.bytesPerSecond << "\n";
+        if (!out.flush())
+        {
+            throw std::runtime_error("Failed to write " + tmp);
+        }
+    }
+    fsys::rename(tmp, file, ec);
+    if (ec)
+    {
+        throw std::runtime_error("Failed to write " + file.string() + ": " +
+                                 ec.message());
+    }
+}
+
+void I2CCommLib::BackOffPageDelay()
+{
+    pageDelay = std::min<microseconds>(
+        std::max<microseconds>(pageDelay * 2, 1ms), polling.maxDelay);
+}
+
+void I2CCommLib::LearnPageLatency(microseconds latency, bool busy)
+{
+    pageLatency += (latency - pageLatency) / 4;
+    // A busy page backs off the wait, which decays once the pages are done
+    // within it again, so one slow page does not slow the rest
+    if (!busy && pageDelay > pageLatency)
+    {
+        pageDelay = (pageDelay + pageLatency) / 2;
+    }
+}
+
+uint8_t I2CCommLib::PollCmdStatus(microseconds delay, milliseconds timeout)
+{
+    auto deadline = steady_clock::now() + timeout;
+    while (true)
+    {
+        std::this_thread::sleep_for(delay);
+        auto status = GetLastCmdStatus();
+        if (status != static_cast<uint8_t>(CommandStatus::ERR_BUSY) ||
+            steady_clock::now() >= deadline)
+        {
+            return status;
+        }
+        delay = std::min<microseconds>(std::max<microseconds>(delay * 2, 1ms),
+                                       polling.maxDelay);
+    }
+}
+
+uint8_t I2CCommLib::PollPageStatus(bool& busy)
+{
+    auto start = steady_clock::now();
+    std::this_thread::sleep_for(pageDelay);
+    auto status = GetLastCmdStatus();
+    busy = status == static_cast<uint8_t>(CommandStatus::ERR_BUSY);
+    if (busy)
+    {
+        // The device takes longer than the wait, so the next pages wait
+        // longer too, and this one is polled until it is done.
+        BackOffPageDelay();
+        status = PollCmdStatus(pageDelay, polling.pageTimeout);
+        if (status == static_cast<uint8_t>(CommandStatus::SUCCESS))
+        {
+            LearnPageLatency(
+                duration_cast<microseconds>(steady_clock::now() - start),
+                busy);
+        }
+    }
+    else if (status == static_cast<uint8_t>(CommandStatus::SUCCESS))
+    {
+        LearnPageLatency(polling.initialDelay, busy);
+    }
+    if (status == static_cast<uint8_t>(CommandStatus::ERR_BUSY))
+    {
+        log<level::ERR>("I2CCommLib - SendImageToCEC page still busy.",
+                        entry("TIMEOUT_MS=%lld",
+                              static_cast<long long>(
+                                  polling.pageTimeout.count())));
+    }
+    return status;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////
 // READ Calls
 uint8_t I2CCommLib::GetCECState()
 {
+    std::lock_guard<std::recursive_mutex> lock(busMutex);
     uint8_t deviceOffset = RD_CMD_STATUS_REG;
     uint8_t retVal = static_cast<uint8_t>(CommandStatus::UNKNOWN);
 
@@ -86,10 +602,7 @@ uint8_t I2CCommLib::GetCECState()
 
     try
     {
-        std::unique_ptr<I2CInterface> myDevice = create(busId, deviceAddr,
-                                                        true);
-        uint8_t size = buf.size();
-        myDevice->readCustom(deviceOffset, size, &buf[0]);
+        ReadRegister(deviceOffset, buf);
 
         VerifyCheckSum(buf);
 
@@ -109,6 +622,7 @@ uint8_t I2CCommLib::GetCECState()
 
 uint8_t I2CCommLib::GetLastCmdStatus()
 {
+    std::lock_guard<std::recursive_mutex> lock(busMutex);
     uint8_t deviceOffset = RD_CMD_STATUS_REG;
     uint8_t retVal = static_cast<uint8_t>(CommandStatus::UNKNOWN);
 
@@ -127,11 +641,7 @@ uint8_t I2CCommLib::GetLastCmdStatus()
 
     try
     {
-        std::unique_ptr<I2CInterface> myDevice = create(busId, deviceAddr,
-                                                        true);
-
-        uint8_t size = buf.size();
-        myDevice->readCustom(deviceOffset, size, &buf[0]);
+        ReadRegister(deviceOffset, buf);
 
         VerifyCheckSum(buf);
 
@@ -152,6 +662,7 @@ uint8_t I2CCommLib::GetLastCmdStatus()
 
 uint8_t I2CCommLib::QueryAboutInterrupt()
 {
+    std::lock_guard<std::recursive_mutex> lock(busMutex);
     uint8_t deviceOffset = RD_QUERY_INTERRUPT_REG;
     uint8_t retVal = static_cast<uint8_t>(CECInterruptStatus::UNKNOWN);
 
@@ -168,11 +679,7 @@ uint8_t I2CCommLib::QueryAboutInterrupt()
 
     try
     {
-        std::unique_ptr<I2CInterface> myDevice = create(busId, deviceAddr,
-                                                        true);
-
-        uint8_t size = buf.size();
-        myDevice->readCustom(deviceOffset, size, &buf[0]);
+        ReadRegister(deviceOffset, buf);
 
         VerifyCheckSum(buf);
 
@@ -192,6 +699,7 @@ uint8_t I2CCommLib::QueryAboutInterrupt()
 
 uint8_t I2CCommLib::GetFWUpdateStatus()
 {
+    std::lock_guard<std::recursive_mutex> lock(busMutex);
     uint8_t deviceOffset = RD_FW_UPDATE_REG;
     uint8_t retVal =
         static_cast<uint8_t>(FirmwareUpdateStatus::STATUS_CODE_OTHER);
@@ -210,12 +718,7 @@ uint8_t I2CCommLib::GetFWUpdateStatus()
 
     try
     {
-        std::unique_ptr<I2CInterface> myDevice = create(busId, deviceAddr,
-                                                        true);
-
-        uint8_t size = buf.size();
-
-        myDevice->readCustom(deviceOffset, size, &buf[0]);
+        ReadRegister(deviceOffset, buf);
 
         VerifyCheckSum(buf);
         memcpy(&readStruct, &buf[0], sizeof(readStruct));
@@ -234,16 +737,14 @@ uint8_t I2CCommLib::GetFWUpdateStatus()
 
 void I2CCommLib::GetCecVersion(ReadCecVersion& readStruct)
 {
+    std::lock_guard<std::recursive_mutex> lock(busMutex);
     uint8_t deviceOffset = FIRMWARE_VERSION_REG;
     std::vector<uint8_t> buf(sizeof(readStruct), 0);
 
     memcpy(&buf[0], &readStruct, sizeof(readStruct));
     try
     {
-        std::unique_ptr<I2CInterface> myDevice = create(busId, deviceAddr,
-                                                        true);
-        uint8_t size = buf.size();
-        myDevice->readCustom(deviceOffset, size, &buf[0]);
+        ReadRegister(deviceOffset, buf);
         VerifyCheckSum(buf);
         memcpy(&readStruct, &buf[0], sizeof(readStruct));
     }
@@ -261,6 +762,7 @@ void I2CCommLib::GetCecVersion(ReadCecVersion& readStruct)
 
 void I2CCommLib::SendBootComplete()
 {
+    std::lock_guard<std::recursive_mutex> lock(busMutex);
     uint8_t deviceOffset = WR_DEVICE_REG;
     uint8_t reg_msb = (deviceOffset & 0xff00) >> 8;
     uint8_t reg_lsb = (deviceOffset & 0xff);
@@ -307,12 +809,7 @@ void I2CCommLib::SendBootComplete()
     {
         UpdateCheckSum(buf);
 
-        std::unique_ptr<I2CInterface> myDevice = create(busId, deviceAddr,
-                                                        true);
-
-        uint8_t size = buf.size();
-
-        myDevice->writeCustom(deviceOffset, size, &buf[0]);
+        WriteRegister(deviceOffset, buf);
     }
     catch (const std::exception& e)
     {
@@ -326,6 +823,7 @@ void I2CCommLib::SendBootComplete()
 
 void I2CCommLib::SendStartFWUpdate(uint32_t imgFileSize, uint8_t fwType)
 {
+    std::lock_guard<std::recursive_mutex> lock(busMutex);
     uint8_t deviceOffset = WR_DEVICE_REG;
     uint8_t reg_msb = (deviceOffset & 0xff00) >> 8;
     uint8_t reg_lsb = (deviceOffset & 0xff);
@@ -374,16 +872,13 @@ void I2CCommLib::SendStartFWUpdate(uint32_t imgFileSize, uint8_t fwType)
 
     memcpy(&buf[0], &startFWUpdatecmd, sizeof(startFWUpdatecmd));
 
+    DiscardCheckpoint();
+
     try
     {
         UpdateCheckSum(buf);
 
-        std::unique_ptr<I2CInterface> myDevice = create(busId, deviceAddr,
-                                                        true);
-
-        uint8_t size = buf.size();
-
-        myDevice->writeCustom(deviceOffset, size, &buf[0]);
+        WriteRegister(deviceOffset, buf);
     }
     catch (const std::exception& e)
     {
@@ -395,14 +890,15 @@ void I2CCommLib::SendStartFWUpdate(uint32_t imgFileSize, uint8_t fwType)
     }
 }
 
-void I2CCommLib::SendImageToCEC(std::string& fileName, uint32_t imageSize)
+void I2CCommLib::SendImageToCEC(std::string& fileName, uint32_t imageSize,
+                                uint8_t fwType)
 {
+    std::lock_guard<std::recursive_mutex> lock(busMutex);
     uint8_t deviceOffset = WR_DEVICE_REG;
     uint8_t reg_msb = (deviceOffset & 0xff00) >> 8;
     uint8_t reg_lsb = (deviceOffset & 0xff);
-    constexpr uint8_t BLOCK_SIZE{128};
+    uint16_t blockSize{0};
     uint32_t totalPage{0};
-    uint32_t otaHeaderOffset{0};
 
     struct ImageTransferCommand
     {
@@ -421,133 +917,251 @@ void I2CCommLib::SendImageToCEC(std::string& fileName, uint32_t imageSize)
 
     try
     {
-        totalPage = (imageSize + BLOCK_SIZE - 1) / BLOCK_SIZE;
-
         fsys::path filePath(fileName);
-
-        std::ifstream fwFile(fileName.c_str(), std::ios::in | std::ios::binary);
-
-        std::vector<uint8_t> imageData(OTA_HEADER_SIZE);
-
-        uint32_t fileSize = static_cast<uint32_t>(fsys::file_size(filePath));
-
-        if (filePath.extension() == romExtension)
+        if (filePath.extension() != romExtension &&
+            filePath.extension() != binExtension)
         {
-            if (fileSize > MB_SIZE)
-            {
-                otaHeaderOffset = OTA_HEADER_OFFSET_2MB_FILE_SIZE;
-            }
-            else
-            {
-                otaHeaderOffset = OTA_HEADER_OFFSET_1MB_FILE_SIZE;
-            }
-            fwFile.seekg(otaHeaderOffset);
-            fwFile.read(reinterpret_cast<char*>(imageData.data()),
-                        OTA_HEADER_SIZE);
-            fwFile.seekg(0, std::ios::beg);
+            throw std::runtime_error(
+                "I2CCommLib - SendImageToCEC Invalid file format");
         }
-        else if (filePath.extension() == binExtension)
+        if (imageSize == 0)
         {
-            imageData.resize(fileSize);
-            fwFile.seekg(0, std::ios::beg);
-            fwFile.read(reinterpret_cast<char*>(imageData.data()), fileSize);
+            imageSize = ReadOtaHeader(fileName).imageSize;
         }
-        else
+
+        blockSize = NegotiateBlockSize(sizeof(ImageTransferCommand));
+
+        // The pages are read as they are sent, so the image is never in
+        // memory at once.
+        ScopedFd image(::open(fileName.c_str(), O_RDONLY | O_CLOEXEC));
+        struct stat st{};
+        if (image.fd < 0 || fstat(image.fd, &st) < 0)
+        {
+            throw std::runtime_error("I2CCommLib - SendImageToCEC Failed to "
+                                     "open the image");
+        }
+        if (st.st_size < static_cast<off_t>(imageSize))
         {
             throw std::runtime_error(
-                "I2CCommLib - SendImageToCEC Invalid file format");
+                "I2CCommLib - SendImageToCEC Image shorter than its size");
         }
+        posix_fadvise(image.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-        for (uint32_t page = 0; page < totalPage; page++)
+        uint32_t firstPage{0};
+        std::string digest;
+        ScopedFd checkpoint(-1);
+        auto openCheckpoint = [&]() {
+            if (checkpoint.fd >= 0)
+            {
+                ::close(checkpoint.fd);
+            }
+            checkpoint.fd = ::open(checkpointFile.c_str(),
+                                   O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+            if (checkpoint.fd < 0)
+            {
+                throw std::runtime_error("I2CCommLib - SendImageToCEC Failed "
+                                         "to open the checkpoint");
+            }
+        };
+        if (!checkpointFile.empty())
         {
-            bool lastPageSet{false};
-            ImageTransferCommand transferImgCmd;
-
-            transferImgCmd.regMsb = reg_msb;
-            transferImgCmd.regLsb = reg_lsb;
-            transferImgCmd.checkSum = EMPTY;
-            transferImgCmd.versionMajor = CEC_VERSION_MAJOR;
-            transferImgCmd.versionMinor = CEC_VERSION_MINOR;
-            transferImgCmd.command = COPY_IMG_COMPLETE_CMD;
-            transferImgCmd.reserved = EMPTY;
-            transferImgCmd.length4 = EMPTY;
-            transferImgCmd.length3 = EMPTY;
-            transferImgCmd.length2 = EMPTY;
-            transferImgCmd.length1 = BLOCK_SIZE;
-
-            std::vector<uint8_t> buf(sizeof(transferImgCmd), 0);
-
-            // send the last page.
-            if (page == totalPage - 1)
+            digest = ImageDigest(image.fd, imageSize);
+            firstPage = ResumePage(digest, imageSize,
+                                   sizeof(ImageTransferCommand), blockSize);
+            openCheckpoint();
+        }
+        totalPage = (imageSize + blockSize - 1) / blockSize;
+
+        // The pages written to the CEC, and whether it failed one of them,
+        // in a record of a fixed size
+        uint32_t written{firstPage};
+        bool failed{false};
+        auto saveCheckpoint = [&]() {
+            if (checkpoint.fd < 0)
             {
-                uint32_t lastBlockSize{0};
-
-                if (page == 0)
-                {
-                    lastBlockSize = imageSize;
-                }
-                else
-                {
-                    lastBlockSize = imageSize - (page * BLOCK_SIZE);
-                }
-                transferImgCmd.length1 = lastBlockSize;
-
-                buf.resize(sizeof(transferImgCmd) + lastBlockSize);
-                memcpy(&buf[0], &transferImgCmd, sizeof(transferImgCmd));
-                memcpy(&buf[0] + sizeof(transferImgCmd),
-                       &imageData[page * BLOCK_SIZE], lastBlockSize);
-                lastPageSet = true;
+                return;
             }
-            else
+            std::array<char, 128> record;
+            auto length = snprintf(record.data(), record.size(),
+                                   "%s %10u %5u %10u %d\n", digest.c_str(),
+                                   imageSize, blockSize, written, failed);
+            if (pwrite(checkpoint.fd, record.data(), length, 0) != length)
             {
-                lastPageSet = false;
-
-                buf.resize(sizeof(transferImgCmd) + BLOCK_SIZE);
-
-                memcpy(&buf[0], &transferImgCmd, sizeof(transferImgCmd));
-                memcpy(&buf[0] + sizeof(transferImgCmd),
-                       &imageData[page * BLOCK_SIZE], BLOCK_SIZE);
+                throw std::runtime_error("I2CCommLib - SendImageToCEC Failed "
+                                         "to save the checkpoint");
             }
+        };
+        // What is known at a failure, which is already failing
+        auto saveCheckpointOnError = [&]() {
             try
             {
-                uint8_t retVal = static_cast<uint8_t>(CommandStatus::UNKNOWN);
-                constexpr uint16_t sleepBeforeReadLastPage{2000};
-                constexpr uint8_t sleepBeforeRead{100};
+                saveCheckpoint();
+            }
+            catch (const std::exception&)
+            {}
+        };
+        saveCheckpoint();
+
+        ImageTransferCommand transferImgCmd;
+
+        transferImgCmd.regMsb = reg_msb;
+        transferImgCmd.regLsb = reg_lsb;
+        transferImgCmd.checkSum = EMPTY;
+        transferImgCmd.versionMajor = CEC_VERSION_MAJOR;
+        transferImgCmd.versionMinor = CEC_VERSION_MINOR;
+        transferImgCmd.command = COPY_IMG_COMPLETE_CMD;
+        transferImgCmd.reserved = EMPTY;
+        transferImgCmd.length4 = EMPTY;
+        transferImgCmd.length3 = EMPTY;
+        transferImgCmd.length2 = EMPTY;
+        transferImgCmd.length1 = blockSize;
+
+        // One command for all the pages, with the length and the checksum
+        // patched in place.
+        std::vector<uint8_t> buf(sizeof(transferImgCmd) + blockSize, 0);
+        memcpy(&buf[0], &transferImgCmd, sizeof(transferImgCmd));
+
+        auto window = transferWindow;
+        // Pages written since the last status read, and whether the window
+        // before them was busy after the wait
+        uint8_t unacknowledged{0};
+        bool windowBusy{false};
+        auto start = steady_clock::now();
+        for (uint32_t page = firstPage; page < totalPage;)
+        {
+            // The last page holds the rest of the image.
+            bool lastPageSet = (page == totalPage - 1);
+            uint32_t length = lastPageSet ? imageSize - (page * blockSize)
+                                          : blockSize;
 
-                auto setWaitInSecs = std::chrono::milliseconds(sleepBeforeRead);
+            buf.resize(sizeof(transferImgCmd) + length);
+            buf[offsetof(ImageTransferCommand, length1)] = length;
+            ReadImage(image.fd, static_cast<off_t>(page) * blockSize,
+                      &buf[sizeof(transferImgCmd)], length);
 
-                if (lastPageSet)
+            try
+            {
+                UpdateCheckSum(buf);
+                WriteRegister(deviceOffset, buf);
+                written = page + 1;
+                unacknowledged++;
+
+                // The next page is only written once the CEC is done with
+                // this one, or in a window with the pages before it. In a
+                // window the CEC reports the first failed page. The first
+                // page of a block size not taken before tells whether the
+                // CEC takes it, for those above the 128 bytes of the
+                // protocol.
+                bool probe = page == 0 && blockSize > BLOCK_SIZE_128_BYTE &&
+                             blockSize > cecBlockTaken;
+                if (unacknowledged == window || lastPageSet || probe)
                 {
-                    setWaitInSecs =
-                        std::chrono::milliseconds(sleepBeforeReadLastPage);
+                    bool busy{false};
+                    uint8_t retVal = PollPageStatus(busy);
+                    if (probe &&
+                        retVal == static_cast<uint8_t>(
+                                      CommandStatus::ERR_CMD_LENGTH_MISMATCH) &&
+                        LimitBlockSize(blockSize))
+                    {
+                        // The CEC dropped the page, so the update starts over
+                        // in the shorter pages it takes.
+                        SendStartFWUpdate(imageSize, fwType);
+                        retVal = PollCmdStatus(pageDelay, polling.pageTimeout);
+                        if (retVal !=
+                            static_cast<uint8_t>(CommandStatus::SUCCESS))
+                        {
+                            throw std::runtime_error(
+                                "I2CCommLib - SendImageToCEC StartFWUpdate "
+                                "failed: " +
+                                GetCommandStatusStr(retVal));
+                        }
+                        blockSize =
+                            NegotiateBlockSize(sizeof(ImageTransferCommand));
+                        totalPage = (imageSize + blockSize - 1) / blockSize;
+                        written = 0;
+                        unacknowledged = 0;
+                        // StartFWUpdate discarded the checkpoint
+                        if (checkpoint.fd >= 0)
+                        {
+                            openCheckpoint();
+                        }
+                        saveCheckpoint();
+                        continue;
+                    }
+                    if (retVal == static_cast<uint8_t>(
+                                      CommandStatus::ERR_I2C_CHECKSUM))
+                    {
+                        StepDownBlockSize(blockSize);
+                    }
+                    // A page still busy after the timeout may yet be taken,
+                    // and its status is read again when resuming, as is one
+                    // that could not be read.
+                    failed = retVal !=
+                                 static_cast<uint8_t>(CommandStatus::SUCCESS) &&
+                             retVal !=
+                                 static_cast<uint8_t>(CommandStatus::ERR_BUSY);
+                    if (retVal != static_cast<uint8_t>(CommandStatus::SUCCESS))
+                    {
+                        log<level::ERR>(
+                            "I2CCommLib - SendImageToCEC Read commands status failed.",
+                            entry("ERR=0x%x", retVal));
+                        throw std::runtime_error(
+                            "I2CCommLib: - SendImageToCEC Read commands "
+                            "status failed.");
+                    }
+                    unacknowledged = 0;
+                    if (probe)
+                    {
+                        cecBlockTaken = blockSize;
+                    }
+
+                    // The wait backs off after a busy window, so a second
+                    // one means the CEC does not keep up with the window.
+                    if (busy && windowBusy && window > 1)
+                    {
+                        log<level::WARNING>(
+                            "I2CCommLib - SendImageToCEC busy, falling back "
+                            "to stop-and-wait.");
+                        window = 1;
+                        transferWindow = window;
+                    }
+                    windowBusy = busy;
                 }
-
-                UpdateCheckSum(buf);
-
-                uint8_t size = buf.size();
-
-                std::unique_ptr<I2CInterface> myDevice =
-                    create(busId, deviceAddr, true);
-                myDevice->writeCustom(deviceOffset, size, &buf[0]);
-
-                std::this_thread::sleep_for(setWaitInSecs);
-
-                retVal = GetLastCmdStatus();
-
-                if ((retVal != static_cast<uint8_t>(CommandStatus::SUCCESS)) &&
-                    (retVal != static_cast<uint8_t>(CommandStatus::ERR_BUSY)))
+                saveCheckpoint();
+                if (pageCallback &&
+                    !pageCallback(std::min(written * blockSize, imageSize),
+                                  imageSize))
                 {
-                    std::string msg = "I2CCommLib: ";
-                    log<level::ERR>(
-                        "I2CCommLib - SendImageToCEC Read commands status failed.",
-                        entry("ERR=0x%x", retVal));
+                    throw std::runtime_error("Image transfer cancelled");
+                }
 
-                    msg += "- SendImageToCEC Read commands status failed.";
-                    throw std::runtime_error(msg.c_str());
+                if (lastPageSet)
+                {
+                    duration<double> elapsed = steady_clock::now() - start;
+                    transferStats.blockSize = blockSize;
+                    transferStats.bytesPerSecond =
+                        static_cast<uint32_t>(imageSize / elapsed.count());
+                    RecoverBlockSize();
+                }
+                page++;
+            }
+            catch (const I2CException& e)
+            {
+                saveCheckpointOnError();
+                // Messages longer than the adapter takes
+                if (e.errorCode == EOPNOTSUPP || e.errorCode == EMSGSIZE)
+                {
+                    StepDownBlockSize(blockSize);
                 }
+                std::string msg = "SendImageToCEC: ";
+                msg += e.what();
+                log<level::ERR>("I2CCommLib - SendImageToCEC command failed.",
+                                entry("EXCEPTION=%s", msg.c_str()));
+                throw std::runtime_error(msg.c_str());
             }
             catch (const std::exception& e)
             {
+                saveCheckpointOnError();
                 std::string msg = "SendImageToCEC: ";
                 msg += e.what();
                 log<level::ERR>("I2CCommLib - SendImageToCEC command failed.",
@@ -556,11 +1170,15 @@ void I2CCommLib::SendImageToCEC(std::string& fileName, uint32_t imageSize)
             }
         }
 
-        // Sleep for 3 secs after sending the last block to ensure CEC is ready
-        // to update f/w update status.
-        constexpr auto setWaitInSecs = std::chrono::milliseconds(3000);
+        if (checkpoint.fd >= 0)
+        {
+            std::error_code ec;
+            fsys::remove(checkpointFile, ec);
+        }
 
-        std::this_thread::sleep_for(setWaitInSecs);
+        // Sleep after sending the last block to ensure CEC is ready to
+        // update f/w update status.
+        std::this_thread::sleep_for(polling.settleDelay);
     }
     catch (const std::exception& e)
     {
@@ -575,6 +1193,7 @@ void I2CCommLib::SendImageToCEC(std::string& fileName, uint32_t imageSize)
 
 void I2CCommLib::SendCopyImageComplete()
 {
+    std::lock_guard<std::recursive_mutex> lock(busMutex);
     uint8_t deviceOffset = WR_DEVICE_REG;
     uint8_t reg_msb = (deviceOffset & 0xff00) >> 8;
     uint8_t reg_lsb = (deviceOffset & 0xff);
@@ -614,11 +1233,7 @@ void I2CCommLib::SendCopyImageComplete()
     {
         UpdateCheckSum(buf);
 
-        uint8_t size = buf.size();
-
-        std::unique_ptr<I2CInterface> myDevice = create(busId, deviceAddr,
-                                                        true);
-        myDevice->writeCustom(deviceOffset, size, &buf[0]);
+        WriteRegister(deviceOffset, buf);
     }
     catch (const std::exception& e)
     {
@@ -632,6 +1247,7 @@ void I2CCommLib::SendCopyImageComplete()
 
 void I2CCommLib::SendBMCReset()
 {
+    std::lock_guard<std::recursive_mutex> lock(busMutex);
     uint8_t deviceOffset = WR_DEVICE_REG;
     uint8_t reg_msb = (deviceOffset & 0xff00) >> 8;
     uint8_t reg_lsb = (deviceOffset & 0xff);
@@ -671,11 +1287,7 @@ void I2CCommLib::SendBMCReset()
     {
         UpdateCheckSum(buf);
 
-        uint8_t size = buf.size();
-
-        std::unique_ptr<I2CInterface> myDevice = create(busId, deviceAddr,
-                                                        true);
-        myDevice->writeCustom(deviceOffset, size, &buf[0]);
+        WriteRegister(deviceOffset, buf);
     }
     catch (const std::exception& e)
     {
@@ -760,173 +1372,60 @@ int I2CCommLib::CreateRandomList(std::vector<uint8_t>& randomData)
     return SUCCESS;
 }
 
-void I2CCommLib::CreateDERSignature(const std::vector<uint8_t>& data,
-                                    uint16_t dataSize, std::string filename)
+std::vector<uint8_t>
+    I2CCommLib::DERSignature(const std::vector<uint8_t>& payload)
 {
-    uint16_t sigStartAddr = dataSize - SIGNATURE_SIZE;
-    uint8_t sigTotalLen = SIGNATURE_SIZE + 4;
-    uint8_t s_len = SIGNATURE_SIZE / 2;
-    uint8_t r_len = SIGNATURE_SIZE / 2;
-
-    uint16_t s_lenStartaddr = sigStartAddr;
-    uint16_t r_lenStartaddr = sigStartAddr + (SIGNATURE_SIZE / 2);
-
-    if (data[s_lenStartaddr] > 0x7F)
+    const uint8_t* raw = payload.data() + payload.size() - SIGNATURE_SIZE;
+    std::unique_ptr<ECDSA_SIG, decltype(&::ECDSA_SIG_free)> sig(
+        ECDSA_SIG_new(), &::ECDSA_SIG_free);
+    BIGNUM* r = BN_bin2bn(raw, SIGNATURE_SIZE / 2, nullptr);
+    BIGNUM* s = BN_bin2bn(raw + SIGNATURE_SIZE / 2, SIGNATURE_SIZE / 2,
+                          nullptr);
+    // The signature owns r and s once they are set
+    if (!sig || !r || !s || !ECDSA_SIG_set0(sig.get(), r, s))
     {
-        sigTotalLen += 1;
-        r_len += 1;
+        BN_free(r);
+        BN_free(s);
+        throw std::runtime_error("Failed to encode the signature.");
     }
 
-    if (data[r_lenStartaddr] > 0x7F)
+    int length = i2d_ECDSA_SIG(sig.get(), nullptr);
+    if (length <= 0)
     {
-        sigTotalLen += 1;
-        s_len += 1;
+        throw std::runtime_error("Failed to encode the signature.");
     }
-
-    std::ofstream signfile(filename, std::ios::binary | std::ios::out);
-    uint8_t temp = 0x30;
-    signfile << static_cast<char>(temp);
-    signfile << static_cast<char>(sigTotalLen);
-    temp = 0x02;
-    signfile << static_cast<char>(temp);
-    signfile << static_cast<char>(r_len);
-    if (data[s_lenStartaddr] > 0x7F)
-    {
-        temp = 0x00;
-        signfile << static_cast<char>(temp);
-    }
-    signfile.write(reinterpret_cast<const char*>(&data[s_lenStartaddr]),
-                   SIGNATURE_SIZE / 2);
-    temp = 0x02;
-    signfile << static_cast<char>(temp);
-    signfile << static_cast<char>(s_len);
-    if (data[r_lenStartaddr] > 0x7F)
-    {
-        temp = 0x00;
-        signfile << static_cast<char>(temp);
-    }
-    signfile.write(reinterpret_cast<const char*>(&data[r_lenStartaddr]),
-                   SIGNATURE_SIZE / 2);
-    signfile.close();
+    std::vector<uint8_t> der(length);
+    auto out = der.data();
+    i2d_ECDSA_SIG(sig.get(), &out);
+    return der;
 }
 
-bool I2CCommLib::VerifySignature(const fsys::path& dataFile,
-                                 const fsys::path& sigFile,
-                                 const fsys::path& publicKeyFile)
+bool I2CCommLib::VerifySignature(const uint8_t* data, size_t size,
+                                 const std::vector<uint8_t>& signature,
+                                 const std::string& publicKey)
 {
-    EVP_MD_CTX_Ptr md_ctx(EVP_MD_CTX_new(), ::EVP_MD_CTX_free);
-    EC_KEY* ECKey = nullptr;
-    EVP_PKEY* pubKey = nullptr;
-    unsigned int digestLength = 0;
-    unsigned char digest[EVP_MAX_MD_SIZE];
-    unsigned char* pTmp = nullptr;
-    int derPubkeyLen = 0;
-    uint8_t verifyReturn{0};
-
-    try
-    {
-        // Check existence of the files in the system.
-        if (!fsys::exists(dataFile))
-        {
-            log<level::ERR>("Failed to find the data file.",
-                            entry("FILE=%s", dataFile.c_str()));
-            throw std::runtime_error("Failed to find the Data file.");
-        }
-        if (!fsys::exists(sigFile))
-        {
-            log<level::ERR>("Failed to find the signature file.",
-                            entry("FILE=%s", sigFile.c_str()));
-            throw std::runtime_error("Failed to find the signature file.");
-        }
-        if (!fsys::exists(publicKeyFile))
-        {
-            log<level::ERR>("Failed to find the publickey file.",
-                            entry("FILE=%s", publicKeyFile.c_str()));
-            throw std::runtime_error("Failed to find the publickey file.");
-        }
-
-        std::ifstream pubKeyFile(publicKeyFile.c_str(), std::ifstream::binary);
-        std::stringstream pKeyStream;
-        pKeyStream << pubKeyFile.rdbuf();
-        pubKeyFile.close();
-
-        std::ifstream attestDataFile(dataFile.c_str(), std::ifstream::binary);
-        std::stringstream dataStream;
-        dataStream << attestDataFile.rdbuf();
-        attestDataFile.close();
-
-        std::ifstream signatureFile(sigFile.c_str(), std::ifstream::binary);
-        std::stringstream signStream;
-        signStream << signatureFile.rdbuf();
-        signatureFile.close();
-
-        auto pKeyData = pKeyStream.str();
-        auto pKeyDataLen = pKeyData.size();
-
-        auto signData = signStream.str();
-        auto signDataLen = signData.size();
-
-        auto bufferData = dataStream.str();
-        auto bufferDataLen = bufferData.size();
-
-        BIO_MEM_Ptr pbioKeyFile(BIO_new_mem_buf(&pKeyData[0], pKeyDataLen),
-                                &::BIO_free);
-
-        pubKey = PEM_read_bio_PUBKEY(pbioKeyFile.get(), &pubKey, NULL, NULL);
-        if (pubKey == nullptr)
-        {
-            throw std::runtime_error("Load key failed.");
-        }
-        ECKey = EVP_PKEY_get1_EC_KEY(pubKey);
-        if (!ECKey)
-        {
-            throw std::runtime_error("Get ec key failed.");
-        }
-
-        derPubkeyLen = i2d_EC_PUBKEY(ECKey, NULL);
-        if (derPubkeyLen != i2d_EC_PUBKEY(ECKey, &pTmp))
-        {
-            throw std::runtime_error("Get ec public key failed.");
-        }
-
-        EVP_MD_CTX_init(md_ctx.get());
-        if (!EVP_DigestInit(md_ctx.get(), EVP_sha384()))
-        {
-            throw std::runtime_error("Digest init failed.");
-        }
-
-        if (!EVP_DigestUpdate(md_ctx.get(), (const void*)&bufferData[0],
-                              bufferDataLen))
-        {
-            throw std::runtime_error("Digest update failed.");
-        }
-
-        if (!EVP_DigestFinal(md_ctx.get(), digest, &digestLength))
-        {
-            throw std::runtime_error("Digest final failed.");
-        }
-
-        verifyReturn = ECDSA_verify(
-            0, (const unsigned char*)digest, digestLength,
-            (const unsigned char*)&signData[0], signDataLen, ECKey);
-    }
-    catch (const std::exception& e)
-    {
-        verifyReturn = 0;
-        std::string msg = "Exception: VerifySignature: ";
-        msg += e.what();
-        log<level::ERR>(msg.c_str());
-    }
-    if (ECKey)
+    BIO_MEM_Ptr keyBio(
+        BIO_new_mem_buf(publicKey.data(), static_cast<int>(publicKey.size())),
+        &::BIO_free);
+    EVP_PKEY_Ptr key(keyBio ? PEM_read_bio_PUBKEY(keyBio.get(), nullptr,
+                                                  nullptr, nullptr)
+                            : nullptr,
+                     &::EVP_PKEY_free);
+    if (!key || EVP_PKEY_base_id(key.get()) != EVP_PKEY_EC)
     {
-        EC_KEY_free(ECKey);
-        ECKey = nullptr;
+        log<level::ERR>("VerifySignature: Load key failed.");
+        return false;
     }
-    if (pTmp)
+
+    EVP_MD_CTX_Ptr ctx(EVP_MD_CTX_new(), ::EVP_MD_CTX_free);
+    if (!ctx || EVP_DigestVerifyInit(ctx.get(), nullptr, EVP_sha384(),
+                                     nullptr, key.get()) != 1)
     {
-        OPENSSL_free(pTmp);
+        log<level::ERR>("VerifySignature: Digest init failed.");
+        return false;
     }
-    return (verifyReturn == 1);
+    return EVP_DigestVerify(ctx.get(), signature.data(), signature.size(),
+                            data, size) == 1;
 }
 
 void I2CCommLib::WriteStatusFile(std::string& status)
@@ -947,7 +1446,8 @@ std::string I2CCommLib::GetCommandStatusStr(uint8_t status)
     return std::string{};
 }
 
-void I2CCommLib::GetAttestation(uint16_t dataSize, uint16_t blkSize)
+uint16_t I2CCommLib::StartAttestation(const std::vector<uint8_t>& nonce,
+                                      uint16_t blkSize)
 {
     uint8_t deviceOffset = WR_DEVICE_REG;
     uint8_t reg_msb = (deviceOffset & 0xff00) >> 8;
@@ -977,19 +1477,160 @@ void I2CCommLib::GetAttestation(uint16_t dataSize, uint16_t blkSize)
         uint8_t randomNumber[DEFAULT_RANDON_NUMBERS];
     } __attribute__((packed));
 
+    if (blockSizeMap.find(blkSize) == blockSizeMap.end())
+    {
+        blkSize = BLOCK_SIZE_128_BYTE;
+    }
+
+    // add 2 bytes for blockLength and otherOptions attributes.
+    uint8_t payloadLen = nonce.size() + 2;
+
     StartAttestationCommand startAttestcmd;
+    startAttestcmd.regMsb = reg_msb;
+    startAttestcmd.regLsb = reg_lsb;
+    startAttestcmd.checkSum = EMPTY;
+    startAttestcmd.versionMajor = CEC_VERSION_MAJOR;
+    startAttestcmd.versionMinor = CEC_VERSION_MINOR;
+    startAttestcmd.command = ATTESTATION_CMD;
+    startAttestcmd.reserved = EMPTY;
+    startAttestcmd.length4 = (payloadLen & 0xff000000) >> 24;
+    startAttestcmd.length3 = (payloadLen & 0xff0000) >> 16;
+    startAttestcmd.length2 = (payloadLen & 0xff00) >> 8;
+    startAttestcmd.length1 = (payloadLen & 0xff) >> 0;
+    startAttestcmd.blockLength = blockSizeMap[blkSize];
+    startAttestcmd.otherOptions = EMPTY;
+    memcpy(&startAttestcmd.randomNumber[0], nonce.data(), nonce.size());
+
     std::vector<uint8_t> writeBuf(sizeof(startAttestcmd), 0);
+    memcpy(&writeBuf[0], &startAttestcmd, sizeof(startAttestcmd));
+    UpdateCheckSum(writeBuf);
+    WriteRegister(deviceOffset, writeBuf);
+
+    // The CEC is busy while it signs the response
+    uint8_t retVal = PollCmdStatus(ATTESTATION_DELAY, ATTESTATION_TIMEOUT);
+    if (retVal != static_cast<uint8_t>(CommandStatus::SUCCESS))
+    {
+        log<level::ERR>("I2CCommLib - StartAttestcmd command status failed.",
+                        entry("ERR=0x%x", retVal));
+        throw std::runtime_error(
+            "I2CCommLib: - StartAttestcmd command status failed.");
+    }
+    return blkSize;
+}
+
+std::vector<uint8_t> I2CCommLib::ReadAttestationPayload(uint16_t dataSize,
+                                                        uint16_t blkSize)
+{
+    std::vector<uint8_t> payload;
+    payload.reserve(dataSize);
+    std::vector<uint8_t> block;
+    while (payload.size() < dataSize)
+    {
+        // The checksum, then a block, the last one short
+        block.assign(
+            1 + std::min<size_t>(blkSize, dataSize - payload.size()), 0);
+        ReadRegister(CHALLENGE_RESPONSE_REG, block);
+        VerifyCheckSum(block);
+        payload.insert(payload.end(), block.begin() + 1, block.end());
+    }
+    return payload;
+}
+
+I2CCommLib::Attestation I2CCommLib::Attest(const std::vector<uint8_t>& nonce,
+                                           const std::string& publicKey,
+                                           uint16_t dataSize, uint16_t blkSize)
+{
+    if (nonce.size() != DEFAULT_RANDON_NUMBERS)
+    {
+        throw std::runtime_error("Attest: Invalid nonce length.");
+    }
+    if (dataSize < DEFAULT_RANDON_NUMBERS + SIGNATURE_SIZE)
+    {
+        throw std::runtime_error("Attest: Invalid attestation data size.");
+    }
+
+    std::lock_guard<std::recursive_mutex> lock(busMutex);
+
+    Attestation attestation;
+    auto cached = std::find_if(attestations.begin(), attestations.end(),
+                               [&](const Attestation& earlier) {
+        return earlier.nonce == nonce && earlier.payload.size() == dataSize;
+    });
+    if (cached != attestations.end())
+    {
+        attestation = *cached;
+    }
+    else
+    {
+        blkSize = StartAttestation(nonce, blkSize);
+        attestation.nonce = nonce;
+        attestation.payload = ReadAttestationPayload(dataSize, blkSize);
+        if (!std::equal(nonce.begin(), nonce.end(),
+                        attestation.payload.begin()))
+        {
+            throw std::runtime_error("Failed.Random numbers are different.");
+        }
+        attestation.signature = DERSignature(attestation.payload);
+
+        if (attestations.size() == ATTESTATION_CACHE_SIZE)
+        {
+            attestations.pop_front();
+        }
+        attestations.push_back(attestation);
+    }
+
+    if (!publicKey.empty())
+    {
+        attestation.verified = VerifySignature(
+            attestation.payload.data(),
+            attestation.payload.size() - SIGNATURE_SIZE, attestation.signature,
+            publicKey);
+    }
+    return attestation;
+}
+
+std::future<I2CCommLib::Attestation>
+    I2CCommLib::AttestAsync(std::vector<uint8_t> nonce, std::string publicKey,
+                            uint16_t dataSize, uint16_t blkSize,
+                            std::function<void()> ready)
+{
+    std::promise<Attestation> promise;
+    auto attestation = promise.get_future();
+
+    std::lock_guard<std::mutex> lock(attestersMutex);
+    std::erase_if(attesters, [](const std::future<void>& attester) {
+        return attester.wait_for(std::chrono::seconds(0)) ==
+               std::future_status::ready;
+    });
+    attesters.push_back(std::async(
+        std::launch::async,
+        [this, promise = std::move(promise), nonce = std::move(nonce),
+         publicKey = std::move(publicKey), dataSize, blkSize,
+         ready = std::move(ready)]() mutable {
+        try
+        {
+            promise.set_value(Attest(nonce, publicKey, dataSize, blkSize));
+        }
+        catch (...)
+        {
+            promise.set_exception(std::current_exception());
+        }
+        // The future is ready, so the callback can collect it
+        if (ready)
+        {
+            ready();
+        }
+    }));
+    return attestation;
+}
+
+void I2CCommLib::GetAttestation(uint16_t dataSize, uint16_t blkSize)
+{
     std::vector<uint8_t> randomNumber;
     std::string status{"Completed successfully."};
-    std::ofstream statusfile(cecAttestFolder + cecAttestStatusFile,
-                             std::ios::binary | std::ios::out);
     fsys::path publicKeyFile(cecAttestFolder + cecAttestPublicKeyFile);
     fsys::path responseFile(cecAttestFolder + cecAttestPayloadFile);
-    fsys::path dataFile(cecAttestFolder + cecAttestDataFile);
-    fsys::path signatureFile(cecAttestFolder + cecAttestSignatureFile);
     std::string throwableError = "StartAttestcmd: ";
-    RemovablePath removesignatureFile(signatureFile);
-    RemovablePath removedataFile(dataFile);
     RemovablePath removePubKeyFile(publicKeyFile);
 
     try
@@ -1016,148 +1657,27 @@ void I2CCommLib::GetAttestation(uint16_t dataSize, uint16_t blkSize)
     }
     try
     {
-        // add 2 bytes for blockLength and otherOptions attributes.
-        uint8_t payloadLen = randomNumber.size() + 2;
-        uint8_t blkLen = EMPTY;
-        blkLen = (blockSizeMap.find(blkSize) != blockSizeMap.end())
-                     ? blockSizeMap[blkSize]
-                     : BLOCK_SIZE_128_VALUE;
-        blkSize = (blockSizeMap.find(blkSize) == blockSizeMap.end())
-                      ? BLOCK_SIZE_128_BYTE
-                      : blkSize;
-
-        startAttestcmd.regMsb = reg_msb;
-        startAttestcmd.regLsb = reg_lsb;
-        startAttestcmd.checkSum = EMPTY;
-        startAttestcmd.versionMajor = CEC_VERSION_MAJOR;
-        startAttestcmd.versionMinor = CEC_VERSION_MINOR;
-        startAttestcmd.command = ATTESTATION_CMD;
-        startAttestcmd.reserved = EMPTY;
-        startAttestcmd.length4 = (payloadLen & 0xff000000) >> 24;
-        startAttestcmd.length3 = (payloadLen & 0xff0000) >> 16;
-        startAttestcmd.length2 = (payloadLen & 0xff00) >> 8;
-        startAttestcmd.length1 = (payloadLen & 0xff) >> 0;
-        startAttestcmd.blockLength = blkLen;
-        startAttestcmd.otherOptions = EMPTY;
-
-        memcpy(&startAttestcmd.randomNumber[0], &randomNumber[0],
-               randomNumber.size());
-        memcpy(&writeBuf[0], &startAttestcmd, sizeof(startAttestcmd));
-
-        UpdateCheckSum(writeBuf);
-
-        std::unique_ptr<I2CInterface> myDevice = create(busId, deviceAddr,
-                                                        true);
-
-        uint8_t size = writeBuf.size();
-        uint8_t retry{0};
-
-        myDevice->writeCustom(deviceOffset, size, &writeBuf[0]);
-
-        uint16_t sleepBeforeRead{5};
-        auto setWaitInSecs = std::chrono::milliseconds(sleepBeforeRead);
-
-        std::this_thread::sleep_for(setWaitInSecs);
-
-        uint8_t retVal = static_cast<uint8_t>(CommandStatus::UNKNOWN);
-
-        retVal = GetLastCmdStatus();
-
-        while (retVal == static_cast<uint8_t>(CommandStatus::ERR_BUSY) &&
-               retry < 10)
-        {
-            sleepBeforeRead = 1000;
-            setWaitInSecs = std::chrono::milliseconds(sleepBeforeRead);
-
-            retVal = static_cast<uint8_t>(CommandStatus::UNKNOWN);
-            std::this_thread::sleep_for(setWaitInSecs);
-            retVal = GetLastCmdStatus();
-            retry++;
-        }
-        if (retVal != static_cast<uint8_t>(CommandStatus::SUCCESS))
-        {
-            std::string msg = "I2CCommLib: ";
-            log<level::ERR>(
-                "I2CCommLib - StartAttestcmd command status failed.",
-                entry("ERR=0x%x", retVal));
+        auto attestation = Attest(randomNumber, {}, dataSize, blkSize);
 
-            msg += "- StartAttestcmd command status failed.";
-            throw std::runtime_error(msg.c_str());
-        }
-
-        uint8_t readDeviceOffset = CHALLENGE_RESPONSE_REG;
-
-        uint16_t remainLen = dataSize;
-        uint16_t sigCount{0};
-        std::vector<uint8_t> completeBuf(dataSize, 0);
-
-        while (remainLen > 0)
-        {
-            uint8_t blockLen = (remainLen > blkSize) ? blkSize : remainLen;
-            uint8_t correctBlockLen = blkSize - blockLen;
-
-            remainLen = (remainLen > blkSize) ? (remainLen - blkSize) : 0;
-
-            correctBlockLen += (blkSize != BLOCK_SIZE_128_BYTE)
-                                   ? (BLOCK_SIZE_128_BYTE - blkSize)
-                                   : 0;
-
-            retVal =
-                static_cast<uint8_t>(FirmwareUpdateStatus::STATUS_CODE_OTHER);
-
-            struct ReadData
-            {
-                uint8_t checkSum;
-                uint8_t data[BLOCK_SIZE_128_BYTE];
-            } __attribute__((packed));
-
-            ReadData readStruct{};
-            std::vector<uint8_t> readBuf(sizeof(readStruct) - correctBlockLen,
-                                         0);
-            memcpy(&readBuf[0], &readStruct,
-                   sizeof(readStruct) - correctBlockLen);
-
-            size = readBuf.size();
-
-            myDevice->readCustom(readDeviceOffset, size, &readBuf[0]);
-
-            VerifyCheckSum(readBuf);
-            // Ignore checksum and write rest of the data to file.
-            memcpy(&completeBuf[sigCount], &readBuf[1], size - 1);
-            sigCount += (size - 1);
-        }
-        if (!std::equal(randomNumber.begin(), randomNumber.end(),
-                        completeBuf.begin()))
-        {
-            throw std::runtime_error("Failed.Random numbers are different.");
-        }
         std::ofstream attestResponseFile(responseFile.string(),
                                          std::ios::binary | std::ios::out);
-        attestResponseFile.write(reinterpret_cast<char*>(&completeBuf[0]),
-                                 completeBuf.size());
+        attestResponseFile.write(
+            reinterpret_cast<const char*>(attestation.payload.data()),
+            attestation.payload.size());
         attestResponseFile.close();
 
         if (fsys::exists(publicKeyFile))
         {
-            std::ofstream attestDataFile(dataFile.string(),
-                                         std::ios::binary | std::ios::out);
-            attestDataFile.write(reinterpret_cast<char*>(&completeBuf[0]),
-                                 completeBuf.size() - SIGNATURE_SIZE);
-            attestDataFile.close();
-            CreateDERSignature(completeBuf, dataSize, signatureFile.string());
-            try
-            {
-                auto valid = VerifySignature(dataFile, signatureFile,
-                                             publicKeyFile);
-                status = (!valid) ? "Failed.Signature validation failure."
-                                  : status;
-            }
-            catch (const std::exception& e)
-            {
-                status = "Failed.Exception during signature validation.";
-                log<level::ERR>(
-                    "Failed. Exception during signature validation.");
-            }
+            std::ifstream keyFile(publicKeyFile.c_str(), std::ifstream::binary);
+            std::stringstream keyStream;
+            keyStream << keyFile.rdbuf();
+
+            auto valid = VerifySignature(
+                attestation.payload.data(),
+                attestation.payload.size() - SIGNATURE_SIZE,
+                attestation.signature, keyStream.str());
+            status = (!valid) ? "Failed.Signature validation failure."
+                              : status;
         }
         WriteStatusFile(status);
     }
@@ -5,9 +5,17 @@
 
 #include <openssl/evp.h>
 #include <openssl/pem.h>
+#include <unistd.h>
 
+#include <array>
+#include <chrono>
+#include <deque>
 #include <experimental/filesystem>
 #include <functional>
+#include <future>
+#include <list>
+#include <mutex>
+#include <optional>
 #include <typeinfo>
 
 namespace phosphor
@@ -27,14 +35,16 @@ static const std::string cecAttestStatusFile{"attest_status.txt"};
 
 static const std::string cecAttestPayloadFile{"sign_response.bin"};
 
-static const std::string cecAttestDataFile{"sign_data.bin"};
-
-static const std::string cecAttestSignatureFile{"signature.bin"};
-
 static const std::string cecAttestPublicKeyFile{"public_key.pem"};
 
 static const std::string cecAttestRandomFile{"random_num.bin"};
 
+static const std::string cecTransferStatsFile{
+    "/var/lib/phosphor-bmc-code-mgmt/cec-transfer"};
+
+static const std::string cecTransferCheckpointFile{
+    "/tmp/cec_images/transfer-checkpoint"};
+
 namespace fsys = std::experimental::filesystem;
 
 // RAII support for openSSL functions.
@@ -59,6 +69,22 @@ struct RemovablePath
     }
 };
 
+struct ScopedFd
+{
+    int fd;
+
+    explicit ScopedFd(int fd) : fd(fd) {}
+    ScopedFd(const ScopedFd&) = delete;
+    ScopedFd& operator=(const ScopedFd&) = delete;
+    ~ScopedFd()
+    {
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+    }
+};
+
 class I2CCommLib
 {
   public:
@@ -68,6 +94,14 @@ class I2CCommLib
         deviceAddr = deviceAddrress;
     }
 
+    /** @brief Constructor using the given device, e.g. a simulated CEC
+     *
+     * @param[in] i2cDevice - The device, opened on first use
+     */
+    explicit I2CCommLib(std::unique_ptr<I2CInterface> i2cDevice) :
+        device(std::move(i2cDevice))
+    {}
+
     virtual void SendBootComplete();
 
     virtual uint8_t GetCECState();
@@ -75,9 +109,123 @@ class I2CCommLib
     virtual void SendStartFWUpdate(uint32_t imgFileSize,
                                    uint8_t fwType = BMC_FW_ID);
 
+    /** @brief Check whether the transfer of an image can resume from the
+     * checkpoint, so the update continues without SendStartFWUpdate(),
+     * after which the CEC expects the image from the first page
+     *
+     * @param[in] fileName - The image
+     * @param[in] imageSize - The size to send
+     *
+     * @return Whether the checkpoint is of the image, and the CEC took its
+     *         pages
+     */
+    virtual bool CanResumeImage(const std::string& fileName,
+                                uint32_t imageSize);
+
     virtual uint8_t GetLastCmdStatus();
 
-    virtual void SendImageToCEC(std::string& fileName, uint32_t imageSize);
+    /** @brief Send an image to the CEC, in pages
+     *
+     * @param[in] fileName - The image
+     * @param[in] imageSize - The size to send, 0 for the size in the OTA
+     *                        header
+     * @param[in] fwType - The firmware of the image, to start the update
+     *                     over if the CEC rejects a page above 128 bytes
+     */
+    virtual void SendImageToCEC(std::string& fileName, uint32_t imageSize,
+                                uint8_t fwType = CEC_FW_ID);
+
+    /** @struct StatusPolling
+     *  @brief How the status of the image pages is polled.
+     */
+    struct StatusPolling
+    {
+        /** @brief The wait after a page before its status is read, until
+         * the device reports busy after it */
+        std::chrono::milliseconds initialDelay{10};
+        /** @brief The longest wait after a page reported busy */
+        std::chrono::milliseconds maxDelay{500};
+        /** @brief How long a page may report busy */
+        std::chrono::milliseconds pageTimeout{10000};
+        /** @brief The wait after the image, before the CEC reports the
+         * update status */
+        std::chrono::milliseconds settleDelay{3000};
+        /** @brief The pages written before their status is read, 1 for
+         * stop-and-wait. Only for a CEC known to buffer the pages of a
+         * window and to report the first failed one. */
+        uint8_t window{1};
+        /** @brief The largest image page. The protocol defines pages of up
+         * to 128 bytes, larger ones only for a CEC known to take them. */
+        uint16_t maxBlockSize{128};
+    };
+
+    /** @struct TransferStats
+     *  @brief The block size and throughput of the image transfers.
+     */
+    struct TransferStats
+    {
+        /** @brief The block size of the last complete transfer, 0 before
+         * any */
+        uint16_t blockSize{0};
+        /** @brief The throughput of the last complete transfer */
+        uint32_t bytesPerSecond{0};
+    };
+
+    /** @brief Get the block size and throughput of the image transfers */
+    const TransferStats& GetTransferStats() const
+    {
+        return transferStats;
+    }
+
+    /** @brief Read the transfer stats of an earlier process, to publish
+     *
+     * @param[in] file - The file the stats were written to
+     *
+     * @return The stats, the defaults if the file is missing or invalid
+     */
+    static TransferStats ReadTransferStats(const fsys::path& file);
+
+    /** @brief Write the transfer stats for a later process
+     *
+     * @param[in] file - The file to write, replaced atomically
+     * @param[in] stats - The stats to write
+     */
+    static void WriteTransferStats(const fsys::path& file,
+                                   const TransferStats& stats);
+
+    /** @brief Checkpoint image transfers, to resume them from the last
+     * page the CEC accepted
+     *
+     * SendStartFWUpdate() discards the checkpoint, since the CEC then
+     * expects the image from the first page, so an update checks
+     * CanResumeImage() before it.
+     *
+     * @param[in] file - The checkpoint, on a filesystem fit for a write
+     *                   per page
+     */
+    void SetCheckpointFile(const fsys::path& file)
+    {
+        checkpointFile = file;
+    }
+
+    /** @brief Called after each image page, with the bytes sent and the
+     * size of the image, on the thread sending the image
+     *
+     * @return false to abort the transfer, which can be resumed
+     */
+    using PageCallback = std::function<bool(uint32_t sent, uint32_t size)>;
+
+    /** @brief Set the callback for the pages of the image transfers */
+    void SetPageCallback(PageCallback callback)
+    {
+        pageCallback = std::move(callback);
+    }
+
+    /** @brief Set how the status of the image pages is polled
+     *
+     * @param[in] statusPolling - The delays and timeouts to use
+     */
+    void SetStatusPolling(const StatusPolling& statusPolling);
 
     virtual void SendCopyImageComplete();
 
@@ -99,21 +247,280 @@ class I2CCommLib
 
     virtual void SendBMCReset();
 
+    /** @brief Get the attestation of the CEC for the nonce in the random
+     * file, or a generated one, into the files of cecAttestFolder
+     *
+     * The payload and the status are written, the signature is verified
+     * in memory if a public key file is there.
+     */
     virtual void GetAttestation(uint16_t dataSize = ATTESTATION_PAYLOAD_SIZE,
                                 uint16_t blkSize = BLOCK_SIZE_128_BYTE);
 
+    /** @struct Attestation
+     *  @brief The signed response of the CEC to a nonce.
+     */
+    struct Attestation
+    {
+        /** @brief The nonce, echoed at the start of the payload */
+        std::vector<uint8_t> nonce;
+        /** @brief The payload, ending with the raw r and s of the
+         * signature */
+        std::vector<uint8_t> payload;
+        /** @brief The DER encoding of the signature */
+        std::vector<uint8_t> signature;
+        /** @brief Whether the signature matches the public key, if one was
+         * given */
+        std::optional<bool> verified;
+    };
+
+    /** @brief Get the attestation of the CEC for a nonce, in memory
+     *
+     * The last ATTESTATION_CACHE_SIZE attestations are kept by nonce, so a
+     * query repeated with the same nonce does not go to the CEC again.
+     *
+     * @param[in] nonce - The nonce, DEFAULT_RANDON_NUMBERS bytes
+     * @param[in] publicKey - The PEM public key to verify the signature
+     *                        with, empty not to verify it
+     * @param[in] dataSize - The size of the payload
+     * @param[in] blkSize - The block size to read the payload in
+     *
+     * @return The attestation
+     *
+     * @throw std::runtime_error if the CEC fails the command, or its
+     *        response is invalid
+     */
+    Attestation Attest(const std::vector<uint8_t>& nonce,
+                       const std::string& publicKey,
+                       uint16_t dataSize = ATTESTATION_PAYLOAD_SIZE,
+                       uint16_t blkSize = BLOCK_SIZE_128_BYTE);
+
+    /** @brief Attest() on a thread of its own, e.g. off the D-Bus loop
+     *
+     * The other commands wait for the attestation on the bus, so a loop
+     * sending them blocks until it is done.
+     *
+     * @param[in] ready - Called on the thread once the future is ready,
+     *                    e.g. to wake the loop
+     */
+    std::future<Attestation>
+        AttestAsync(std::vector<uint8_t> nonce, std::string publicKey,
+                    uint16_t dataSize = ATTESTATION_PAYLOAD_SIZE,
+                    uint16_t blkSize = BLOCK_SIZE_128_BYTE,
+                    std::function<void()> ready = {});
+
+    /** @brief Verify a signature of the CEC
+     *
+     * @param[in] data - The signed data
+     * @param[in] size - The size of the signed data
+     * @param[in] signature - The DER encoded signature
+     * @param[in] publicKey - The PEM public key
+     *
+     * @return true if the signature is valid for the key
+     */
+    static bool VerifySignature(const uint8_t* data, size_t size,
+                                const std::vector<uint8_t>& signature,
+                                const std::string& publicKey);
+
+    /** @struct OtaHeader
+     *  @brief Where the OTA header of an image is, and the size it gives.
+     */
+    struct OtaHeader
+    {
+        /** @brief The offset of the header in the file */
+        uint32_t offset{0};
+        /** @brief The size of the image to send, the header included */
+        uint32_t imageSize{0};
+    };
+
+    /** @brief Read and validate the OTA header of an image
+     *
+     * The header of the last image read is kept until the file changes,
+     * so the states of an update read it once.
+     *
+     * @param[in] fileName - A .bin image with the header first, or a .rom
+     *                       with it before the end of its first or second
+     *                       MiB
+     *
+     * @return The header
+     *
+     * @throw std::runtime_error if the image or its header is invalid
+     */
+    static OtaHeader ReadOtaHeader(const std::string& fileName);
+
+    /** @brief Get the checksum of a command, the sum of its bytes
+     *
+     * Whole words are summed at a time, which the compiler vectorizes.
+     *
+     * @param[in] data - The bytes
+     * @param[in] size - The number of bytes
+     */
+    static uint8_t Checksum(const uint8_t* data, size_t size);
+
   private:
+    /** @brief The device, opened on first use and after an error
+     *
+     * @throw I2CException if it cannot be opened
+     */
+    I2CInterface& OpenDevice();
+
+    /** @brief Close the device after an error, so that the next command
+     * opens it again */
+    void CloseDevice() noexcept;
+
+    /** @brief Read a register of the device */
+    void ReadRegister(uint8_t reg, std::vector<uint8_t>& data);
+
+    /** @brief Write a command to the device */
+    void WriteRegister(uint8_t reg, std::vector<uint8_t>& data);
+
+    /** @brief Wait longer after the next pages, since the device was
+     * still busy with a page after the current wait */
+    void BackOffPageDelay();
+
+    /** @brief Learn how long the device took with a page, and shrink the
+     * wait back towards it after a page done within the wait
+     *
+     * @param[in] latency - The time the page took, the initial delay if
+     *                      it was done within the wait
+     * @param[in] busy - Whether the page was busy after the wait
+     */
+    void LearnPageLatency(std::chrono::microseconds latency, bool busy);
+
+    /** @brief Read a part of the image, all of it or throw
+     *
+     * @param[in] fd - The image file
+     * @param[in] offset - Where the part starts in the image
+     * @param[out] data - Where to read the part to
+     * @param[in] length - The length of the part
+     */
+    static void ReadImage(int fd, off_t offset, uint8_t* data, size_t length);
+
+    /** @brief Get the SHA-256 digest of the image, in hex */
+    static std::string ImageDigest(int fd, uint32_t imageSize);
+
+    /** @struct Checkpoint
+     *  @brief The progress of an image transfer, saved after each page.
+     */
+    struct Checkpoint
+    {
+        std::string digest;
+        uint32_t imageSize{0};
+        uint16_t blockSize{0};
+        /** @brief The pages written to the CEC */
+        uint32_t written{0};
+        /** @brief Whether the CEC failed one of them */
+        int failed{0};
+    };
+
+    /** @brief Read the checkpoint, the default one if none is set
+     *
+     * @return std::nullopt if there is none, or it has no page
+     */
+    std::optional<Checkpoint> ReadCheckpoint() const;
+
+    /** @brief Get why the transfer of an image cannot continue from a
+     * checkpoint, reading the status of its last page
+     *
+     * @param[in] checkpoint - The checkpoint
+     * @param[in] digest - The digest of the image
+     * @param[in] imageSize - The size of the image
+     *
+     * @return The reason, empty if the transfer can continue
+     */
+    std::string ResumeRejection(const Checkpoint& checkpoint,
+                                const std::string& digest,
+                                uint32_t imageSize);
+
+    /** @brief Get the page to continue the transfer of the image at
+     *
+     * @param[in] digest - The digest of the image
+     * @param[in] imageSize - The size of the image
+     * @param[in] headerSize - The size of the command before the block
+     * @param[in,out] blockSize - The size of the pages, set to the one of
+     *                            the checkpoint when resuming
+     *
+     * @return 0 if there is no checkpoint to resume
+     *
+     * @throw std::runtime_error if the checkpoint cannot be resumed, and
+     *        the update has to restart
+     */
+    uint32_t ResumePage(const std::string& digest, uint32_t imageSize,
+                        size_t headerSize, uint16_t& blockSize);
+
+    /** @brief Remove the checkpoint, logging the page it was at */
+    void DiscardCheckpoint();
+
+    /** @brief Get the largest block size the adapter can write and the CEC
+     * takes, up to the one the transfers stepped down to and the largest
+     * one of the polling
+     *
+     * @param[in] headerSize - The size of the command before the block
+     *
+     * @throw std::runtime_error if not even the smallest block fits
+     */
+    uint16_t NegotiateBlockSize(size_t headerSize);
+
+    /** @brief Make the next transfers use the next smaller block size,
+     * until clean transfers step it back up
+     *
+     * @param[in] failed - The block size of the failed transfer
+     */
+    void StepDownBlockSize(uint16_t failed);
+
+    /** @brief Step the block size back up towards the limit of the CEC
+     * after enough clean transfers in a row */
+    void RecoverBlockSize();
+
+    /** @brief Learn that the CEC does not take blocks of a size, from its
+     * answer to the first page
+     *
+     * @param[in] rejected - The block size the CEC rejected
+     *
+     * @return Whether a smaller block size is left to try
+     */
+    bool LimitBlockSize(uint16_t rejected);
+
+    /** @brief Poll the command status until it is not busy, backing off
+     * from a delay up to the longest one of the polling
+     *
+     * @param[in] delay - The wait before the first read
+     * @param[in] timeout - How long the command may report busy
+     *
+     * @return The command status, busy after the timeout
+     */
+    uint8_t PollCmdStatus(std::chrono::microseconds delay,
+                          std::chrono::milliseconds timeout);
+
+    /** @brief Poll the status of the last page written until it is not
+     * busy, before the next page is written
+     *
+     * @param[out] busy - Whether the page was busy after the wait
+     *
+     * @return The status of the page, busy after the timeout
+     */
+    uint8_t PollPageStatus(bool& busy);
+
     void VerifyCheckSum(const std::vector<uint8_t>& data);
 
     void UpdateCheckSum(std::vector<uint8_t>& data);
 
     int CreateRandomList(std::vector<uint8_t>& randomData);
 
-    bool VerifySignature(const fsys::path& dataFile, const fsys::path& sigFile,
-                         const fsys::path& publicKey);
+    /** @brief Send the attestation command, and wait for the CEC to sign
+     * the response
+     *
+     * @return The block size the payload is sent in
+     */
+    uint16_t StartAttestation(const std::vector<uint8_t>& nonce,
+                              uint16_t blkSize);
+
+    /** @brief Read the payload of the attestation, block by block */
+    std::vector<uint8_t> ReadAttestationPayload(uint16_t dataSize,
+                                                uint16_t blkSize);
 
-    void CreateDERSignature(const std::vector<uint8_t>& data, uint16_t dataSize,
-                            std::string filename);
+    /** @brief Get the DER encoding of the raw r and s ending a payload */
+    static std::vector<uint8_t>
+        DERSignature(const std::vector<uint8_t>& payload);
 
     int HexStringToRandomList(const std::string& str,
                               std::vector<uint8_t>& randomData);
@@ -173,19 +580,79 @@ class I2CCommLib
     static constexpr uint8_t OTA_OFFSET_SIZE3{0xEA};
     static constexpr uint8_t OTA_OFFSET_SIZE4{0xEB};
 
+    static constexpr uint16_t BLOCK_SIZE_240_BYTE{240};
+    static constexpr uint16_t BLOCK_SIZE_192_BYTE{192};
     static constexpr uint16_t BLOCK_SIZE_128_BYTE{128};
     static constexpr uint16_t BLOCK_SIZE_64_BYTE{64};
     static constexpr uint16_t BLOCK_SIZE_48_BYTE{48};
     static constexpr uint16_t BLOCK_SIZE_32_BYTE{32};
+    // The image block sizes, the largest first. The length of a page is a
+    // single byte of the command, and the ones above 128 are only used when
+    // the polling allows them.
+    static constexpr std::array<uint16_t, 6> BLOCK_SIZES{
+        BLOCK_SIZE_240_BYTE, BLOCK_SIZE_192_BYTE, BLOCK_SIZE_128_BYTE,
+        BLOCK_SIZE_64_BYTE,  BLOCK_SIZE_48_BYTE,  BLOCK_SIZE_32_BYTE};
+    // The clean transfers in a row after which a step-down is undone
+    static constexpr unsigned CLEAN_TRANSFERS_TO_STEP_UP{3};
 
     static constexpr uint16_t ATTESTATION_PAYLOAD_SIZE{657};
 
   private:
     std::string deviceName;
 
-    uint8_t busId;
+    uint8_t busId{0};
+
+    uint8_t deviceAddr{0};
+
+    /** @brief The long-lived device, instead of one per command */
+    std::unique_ptr<I2CInterface> device;
+
+    StatusPolling polling;
+
+    /** @brief The wait after a page before its status is read, backed
+     * off while the device is busy after it */
+    std::chrono::microseconds pageDelay{polling.initialDelay};
+
+    /** @brief The typical time the device takes with a page, averaged
+     * over the pages */
+    std::chrono::microseconds pageLatency{polling.initialDelay};
+
+    /** @brief The pages to write before their status is read, 1 once a
+     * transfer fell back to stop-and-wait */
+    uint8_t transferWindow{polling.window};
+
+    TransferStats transferStats;
+
+    /** @brief The largest block size the CEC takes, learned from its
+     * answer to the first page of a transfer */
+    uint16_t cecBlockLimit{BLOCK_SIZES.front()};
+
+    /** @brief The largest block size the CEC is known to take */
+    uint16_t cecBlockTaken{0};
+
+    /** @brief The block size of the next transfer, after step-downs */
+    uint16_t nextBlockSize{BLOCK_SIZES.front()};
+
+    /** @brief The clean transfers since the last step-down */
+    unsigned cleanTransfers{0};
+
+    fsys::path checkpointFile;
+
+    PageCallback pageCallback;
+
+    /** @brief Serializes the commands, each a sequence of transactions on
+     * the bus, with the ones AttestAsync() sends from its thread, and
+     * guards the state they share */
+    std::recursive_mutex busMutex;
+
+    /** @brief The last attestations, the oldest first */
+    std::deque<Attestation> attestations;
+
+    std::mutex attestersMutex;
 
-    uint8_t deviceAddr;
+    /** @brief The threads of AttestAsync(), last so they are joined before
+     * the state they use is destroyed */
+    std::list<std::future<void>> attesters;
 
   private:
     static constexpr uint8_t READ_CKSUM_LOCATION{0};
@@ -218,6 +685,10 @@ class I2CCommLib
 
     static constexpr uint8_t DEFAULT_RANDON_NUMBERS{32};
     static constexpr uint8_t SIGNATURE_SIZE{96};
+    static constexpr size_t ATTESTATION_CACHE_SIZE{8};
+    // The wait for the CEC to sign a response, before the first status read
+    static constexpr std::chrono::milliseconds ATTESTATION_DELAY{5};
+    static constexpr std::chrono::milliseconds ATTESTATION_TIMEOUT{10000};
     static constexpr int SUCCESS{0};
     static constexpr int FAILURE{-1};
     std::vector<std::string> commandStatusStr{"SUCCESS",
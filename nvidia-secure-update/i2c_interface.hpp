@@ -92,6 +92,17 @@ class I2CInterface
     virtual void readCustom(uint8_t addr, uint8_t& size, uint8_t* result) = 0;
 
     virtual void writeCustom(uint8_t addr, uint8_t size, uint8_t* data) = 0;
+
+    /** @brief The longest message the adapter writes to the device
+     *
+     * @return The length in bytes, at most what writeCustom() takes
+     *
+     * @throw I2CException on error
+     */
+    virtual size_t maxWriteLength()
+    {
+        return UINT8_MAX;
+    }
 };
 
 /** @brief Create an I2CInterface instance
@@ -1,5 +1,6 @@
 #include "config.h"
 
+#include "cec_copy_worker.hpp"
 #include "i2c_comm_lib.hpp"
 
 #include <CLI/CLI.hpp>
@@ -8,6 +9,7 @@
 #include <phosphor-logging/log.hpp>
 #include <xyz/openbmc_project/Common/error.hpp>
 
+#include <atomic>
 #include <filesystem>
 #include <fstream>
 
@@ -42,7 +44,9 @@ int main(int argc, char** argv)
 
     // Add an input option
     app.add_option("-f", fileName, "Filename of f/w image")->required();
-    app.add_option("-s", fileSize, "Actual size of the f/w image")->required();
+    app.add_option("-s", fileSize,
+                   "Actual size of the f/w image, by default the size in "
+                   "its OTA header");
 
     // Parse input parameter
     try
@@ -55,17 +59,8 @@ int main(int argc, char** argv)
                         entry("EXCEPTION=%s", e.what()));
     }
 
-    try
-    {
-        deviceLayer.SendImageToCEC(fileName, fileSize);
-    }
-    catch (const std::exception& e)
-    {
-        log<level::ERR>("copy_image_service - transfer image failed.",
-                        entry("EXCEPTION=%s", e.what()));
-
-        return -1;
-    }
-
-    return 0;
+    std::atomic<bool> cancelled{false};
+    return CecCopyWorker::CopyImage(deviceLayer, fileName, fileSize, cancelled)
+               ? 0
+               : -1;
 }
@@ -15,7 +15,6 @@
 #include <chrono>
 #include <experimental/filesystem>
 #include <fstream>
-#include <regex>
 
 namespace phosphor
 {
@@ -264,78 +263,40 @@ void PrisAPFWStateMachine::StateStartFwUpdate(MachineContext& ctx)
         std::string imgFileName =
             std::any_cast<std::string>(ctx.GetData(keyFWImgName));
 
-        uint32_t fileSize = std::any_cast<uint32_t>(ctx.GetData(keyFWFileSize));
-
         uint8_t fwType = I2CCommLib::CEC_FW_ID;
-        fs::path filePath(imgFileName);
 
-        std::ifstream fwFile(imgFileName.c_str(), std::ios::binary);
-        std::vector<char> imageData(I2CCommLib::OTA_HEADER_SIZE);
+        // Validated, and kept for the copy of the image
+        uint32_t imgFileSize =
+            I2CCommLib::ReadOtaHeader(imgFileName).imageSize;
 
-        if (fileSize < I2CCommLib::OTA_HEADER_SIZE)
-        {
-            throw std::runtime_error("APFW:StateStartFwUpdate: Bad image");
-        }
+        ctx.SetData(keyActualFWSize, imgFileSize);
 
-        if (filePath.extension() == swUpdate::romExtension)
+        // A new StartFWUpdate would make the CEC drop the pages it took
+        if (deviceLayer->CanResumeImage(imgFileName, imgFileSize))
         {
-            uint32_t otaHeaderOffset{0};
-
-            if (fileSize > I2CCommLib::MB_SIZE)
-            {
-                otaHeaderOffset = I2CCommLib::OTA_HEADER_OFFSET_2MB_FILE_SIZE;
-            }
-            else
-            {
-                otaHeaderOffset = I2CCommLib::OTA_HEADER_OFFSET_1MB_FILE_SIZE;
-            }
-            fwFile.seekg(0, std::ios::beg);
-            fwFile.seekg(otaHeaderOffset);
-            fwFile.read(imageData.data(), I2CCommLib::OTA_HEADER_SIZE);
-        }
-        else if (filePath.extension() == swUpdate::binExtension)
-        {
-            fwFile.seekg(0, std::ios::beg);
-            fwFile.read(imageData.data(), I2CCommLib::OTA_HEADER_SIZE);
+            log<level::INFO>(
+                "APFW:StateStartFwUpdate - Resuming the image copy.");
         }
         else
         {
-            std::string tmpErr{
-                "APFW:StateStartFwUpdate: Invalid image, file: "};
-            tmpErr += imgFileName;
-            throw std::runtime_error(tmpErr.c_str());
-        }
+            deviceLayer->SendStartFWUpdate(imgFileSize, fwType);
 
-        uint32_t imgFileSize = I2CCommLib::OTA_HEADER_SIZE;
-        imgFileSize +=
-            static_cast<uint32_t>(imageData[I2CCommLib::OTA_OFFSET_SIZE1]);
-        imgFileSize +=
-            static_cast<uint32_t>(imageData[I2CCommLib::OTA_OFFSET_SIZE2]) << 8;
-        imgFileSize +=
-            static_cast<uint32_t>(imageData[I2CCommLib::OTA_OFFSET_SIZE3])
-            << 16;
-        imgFileSize +=
-            static_cast<uint32_t>(imageData[I2CCommLib::OTA_OFFSET_SIZE4])
-            << 24;
+            constexpr auto setWaitInSecs = std::chrono::milliseconds(
+                PrisAPFWStateMachine::sleepBeforeRead);
 
-        ctx.SetData(keyActualFWSize, imgFileSize);
+            std::this_thread::sleep_for(setWaitInSecs);
 
-        deviceLayer->SendStartFWUpdate(imgFileSize, fwType);
+            retVal = deviceLayer->GetLastCmdStatus();
 
-        constexpr auto setWaitInSecs =
-            std::chrono::milliseconds(PrisAPFWStateMachine::sleepBeforeRead);
-
-        std::this_thread::sleep_for(setWaitInSecs);
-
-        retVal = deviceLayer->GetLastCmdStatus();
-
-        if (retVal != static_cast<uint8_t>(I2CCommLib::CommandStatus::SUCCESS))
-        {
-            stateSuccessful = false;
-            log<level::ERR>(
-                "APFW:StateStartFwUpdate - SendStartFWUpdate command failed.",
-                entry("ERR=0x%x", retVal));
-            msg += "StateStartFwUpdate - SendStartFWUpdate command failed.";
+            if (retVal !=
+                static_cast<uint8_t>(I2CCommLib::CommandStatus::SUCCESS))
+            {
+                stateSuccessful = false;
+                log<level::ERR>("APFW:StateStartFwUpdate - SendStartFWUpdate "
+                                "command failed.",
+                                entry("ERR=0x%x", retVal));
+                msg += "StateStartFwUpdate - SendStartFWUpdate command failed.";
+            }
         }
         auto updateManager = std::any_cast<UpdateManager*>(
             fwUpdateMachine->myMachineContext.GetData(keyUpdateManager));
@@ -394,23 +355,22 @@ void PrisAPFWStateMachine::StateCopyImage(MachineContext& ctx)
         std::string imgFileName =
             std::any_cast<std::string>(ctx.GetData(keyFWImgName));
 
-        imgFileName = std::regex_replace(imgFileName, std::regex("-"), "\\x2D");
-        std::replace(imgFileName.begin(), imgFileName.end(), '/', '-');
-
         uint32_t imgFileSize =
             std::any_cast<uint32_t>(ctx.GetData(keyActualFWSize));
 
-        std::string copyImageServiceFile =
-            std::string("nvidia-secure-block-copy@\\x2D") + "f\\x20" +
-            imgFileName + "\\x20\\x2Ds\\x20" + std::to_string(imgFileSize) +
-            ".service";
-
-        ctx.SetData(keyCopyServiceNameString, copyImageServiceFile);
-
-        auto method = fwUpdateManager->bus.new_method_call(
-            SYSTEMD_BUSNAME, SYSTEMD_PATH, SYSTEMD_INTERFACE, "StartUnit");
-        method.append(copyImageServiceFile, "replace");
-        fwUpdateManager->bus.call_noreply(method);
+        // The pages map to the progress up to the update status check
+        auto updateManager = fwUpdateManager;
+        fwUpdateManager->copyWorker = std::make_unique<CecCopyWorker>(
+            fwUpdateManager->bus.get_event(),
+            [updateManager](uint32_t sent, uint32_t size) {
+            updateManager->progress(
+                static_cast<uint8_t>(50 + 40 * uint64_t{sent} / size),
+                "CEC Update status: copy image");
+        },
+            [updateManager](const std::string& result) {
+            updateManager->onStateChanges(result);
+        });
+        fwUpdateManager->copyWorker->Start(imgFileName, imgFileSize);
     }
     catch (const std::exception& e)
     {
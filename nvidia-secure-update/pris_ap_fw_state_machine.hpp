@@ -28,9 +28,6 @@ static const std::string keyActualFWSize{"fw_actual_size"};
 
 static const std::string keyUpdateManager{"fw_update_manager"};
 
-static const std::string keyCopyServiceNameString{
-    "fw_copy_service_name_string"};
-
 static const std::string checkUpdateInProgress{"AP FIRMWARE UPDATE IN PROGESS"};
 
 static const std::string cecFWFolder{"/tmp/cec_images/"};
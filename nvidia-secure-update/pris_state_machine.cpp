@@ -330,10 +330,11 @@ void PrisStateMachine::StateCopyImage([[maybe_unused]] MachineContext& ctx)
         auto copyImageServiceFile =
             "obmc-secure-copy-image@" +
             myMachineContext.activationObject->versionId + ".service";
-        auto method = myMachineContext.activationObject->bus.new_method_call(
-            SYSTEMD_BUSNAME, SYSTEMD_PATH, SYSTEMD_INTERFACE, "StartUnit");
-        method.append(copyImageServiceFile, "replace");
-        myMachineContext.activationObject->bus.call_noreply(method);
+        auto activation = myMachineContext.activationObject;
+        activation->startJob(copyImageServiceFile,
+                             [activation](const std::string& result) {
+            activation->onStateChanges(result);
+        });
     }
     catch (const std::exception& e)
     {
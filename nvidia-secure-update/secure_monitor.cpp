@@ -15,20 +15,24 @@
 #include <sdbusplus/bus.hpp>
 #include <sdbusplus/bus/match.hpp>
 #include <sdbusplus/server.hpp>
+#include <sdbusplus/server/interface.hpp>
 #include <sdbusplus/server/manager.hpp>
 #include <sdbusplus/server/object.hpp>
 #include <sdbusplus/timer.hpp>
+#include <sdbusplus/vtable.hpp>
 #include <sdeventplus/event.hpp>
 #include <sdeventplus/source/event.hpp>
 #include <sdeventplus/source/io.hpp>
 #include <sdeventplus/source/signal.hpp>
 #include <stdplus/signal.hpp>
+#include <sys/eventfd.h>
 #include <xyz/openbmc_project/Common/error.hpp>
 #include <xyz/openbmc_project/Software/Activation/server.hpp>
 
 #include <chrono>
 #include <filesystem>
 #include <fstream>
+#include <list>
 #include <map>
 #include <variant>
 
@@ -59,6 +63,11 @@ static constexpr auto busIdentifier = CEC_BUS_IDENTIFIER;
 
 static constexpr auto deviceAddrress = CEC_DEVICE_ADDRESS;
 
+/** @brief The CEC, shared so that the commands of the service take turns on
+ *  the bus and the attestations it caches live on
+ */
+static std::unique_ptr<I2CCommLib> cecDevice;
+
 std::unique_ptr<sdbusplus::Timer> checkTimer;
 
 static constexpr uint8_t checkTimerExpiry{60};
@@ -118,6 +127,211 @@ class CecImpl : public CecInherit
 
 std::unique_ptr<CecImpl> cecIntManager;
 
+/** @brief The block size and throughput of the image transfers to the CEC,
+ *  read from what the copier saved when they are asked for
+ */
+class CecTransferImpl
+{
+  public:
+    CecTransferImpl(sdbusplus::bus::bus& bus, const std::string& objPath) :
+        interface(bus, objPath.c_str(), interfaceName, vtable, this)
+    {}
+
+    static constexpr auto interfaceName = "com.nvidia.Secureboot.CecTransfer";
+
+  private:
+    static int getBlockSize(sd_bus*, const char*, const char*, const char*,
+                            sd_bus_message* reply, void*, sd_bus_error*)
+    {
+        auto stats = I2CCommLib::ReadTransferStats(cecTransferStatsFile);
+        return sd_bus_message_append(reply, "q", stats.blockSize);
+    }
+
+    static int getBytesPerSecond(sd_bus*, const char*, const char*,
+                                 const char*, sd_bus_message* reply, void*,
+                                 sd_bus_error*)
+    {
+        auto stats = I2CCommLib::ReadTransferStats(cecTransferStatsFile);
+        return sd_bus_message_append(reply, "u", stats.bytesPerSecond);
+    }
+
+    static const sdbusplus::vtable_t vtable[];
+
+    sdbusplus::server::interface::interface interface;
+};
+
+const sdbusplus::vtable_t CecTransferImpl::vtable[] = {
+    sdbusplus::vtable::start(),
+    sdbusplus::vtable::property("BlockSize", "q", getBlockSize),
+    sdbusplus::vtable::property("BytesPerSecond", "u", getBytesPerSecond),
+    sdbusplus::vtable::end()};
+
+std::unique_ptr<CecTransferImpl> cecTransfer;
+
+/** @brief The Attest method, run on a thread so the loop keeps serving while
+ *  the CEC signs, and answered from the loop once the thread wakes it
+ */
+class CecAttestationImpl
+{
+  public:
+    CecAttestationImpl(sdbusplus::bus::bus& bus, const std::string& objPath,
+                       I2CCommLib& device, sd_event* loop) :
+        interface(bus, objPath.c_str(), interfaceName, vtable, this),
+        device(device), doneFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+    {
+        if (doneFd < 0 || sd_event_add_io(loop, &doneSource, doneFd, EPOLLIN,
+                                          attestationDone, this) < 0)
+        {
+            throw std::runtime_error("Failed to watch the attestations.");
+        }
+    }
+
+    CecAttestationImpl(const CecAttestationImpl&) = delete;
+    CecAttestationImpl& operator=(const CecAttestationImpl&) = delete;
+
+    ~CecAttestationImpl()
+    {
+        for (auto& [call, attestation] : pending)
+        {
+            attestation.wait();
+            sd_bus_message_unref(call);
+        }
+        sd_event_source_unref(doneSource);
+        close(doneFd);
+    }
+
+    static constexpr auto interfaceName =
+        "com.nvidia.Secureboot.CecAttestation";
+
+  private:
+    /** @brief Start the attestation of a nonce, verified with the PEM
+     *  public key if one is given, and reply once it is done
+     */
+    static int attest(sd_bus_message* call, void* context, sd_bus_error*)
+    {
+        auto self = static_cast<CecAttestationImpl*>(context);
+        const void* nonce = nullptr;
+        size_t nonceSize = 0;
+        const char* publicKey = nullptr;
+
+        auto rc = sd_bus_message_read_array(call, 'y', &nonce, &nonceSize);
+        if (rc < 0)
+        {
+            return rc;
+        }
+        rc = sd_bus_message_read(call, "s", &publicKey);
+        if (rc < 0)
+        {
+            return rc;
+        }
+
+        auto bytes = static_cast<const uint8_t*>(nonce);
+        auto fd = self->doneFd;
+        self->pending.emplace_back(
+            sd_bus_message_ref(call),
+            self->device.AttestAsync(
+                std::vector<uint8_t>(bytes, bytes + nonceSize), publicKey,
+                I2CCommLib::ATTESTATION_PAYLOAD_SIZE,
+                I2CCommLib::BLOCK_SIZE_128_BYTE,
+                [fd]() { eventfd_write(fd, 1); }));
+
+        // Replied to from attestationDone()
+        return 1;
+    }
+
+    static int attestationDone(sd_event_source*, int fd, uint32_t,
+                               void* context)
+    {
+        auto self = static_cast<CecAttestationImpl*>(context);
+        eventfd_t count{0};
+        eventfd_read(fd, &count);
+
+        for (auto it = self->pending.begin(); it != self->pending.end();)
+        {
+            auto& [call, attestation] = *it;
+            if (attestation.wait_for(seconds(0)) != std::future_status::ready)
+            {
+                ++it;
+                continue;
+            }
+            reply(call, attestation);
+            sd_bus_message_unref(call);
+            it = self->pending.erase(it);
+        }
+        return 0;
+    }
+
+    static void reply(sd_bus_message* call,
+                      std::future<I2CCommLib::Attestation>& result)
+    {
+        try
+        {
+            auto attestation = result.get();
+            sd_bus_message* message = nullptr;
+
+            auto rc = sd_bus_message_new_method_return(call, &message);
+            if (rc >= 0)
+            {
+                rc = sd_bus_message_append_array(message, 'y',
+                                                 attestation.payload.data(),
+                                                 attestation.payload.size());
+            }
+            if (rc >= 0)
+            {
+                rc = sd_bus_message_append_array(message, 'y',
+                                                 attestation.signature.data(),
+                                                 attestation.signature.size());
+            }
+            if (rc >= 0)
+            {
+                rc = sd_bus_message_append(
+                    message, "b",
+                    static_cast<int>(attestation.verified.value_or(false)));
+            }
+            if (rc >= 0)
+            {
+                rc = sd_bus_send(nullptr, message, nullptr);
+            }
+            sd_bus_message_unref(message);
+            if (rc < 0)
+            {
+                log<level::ERR>("secure_monitor_service - Failed to reply "
+                                "with the attestation.",
+                                entry("ERRNO=%d", -rc));
+            }
+        }
+        catch (const std::exception& e)
+        {
+            log<level::ERR>("secure_monitor_service - Attestation failed.",
+                            entry("EXCEPTION=%s", e.what()));
+            sd_bus_reply_method_errorf(call, SD_BUS_ERROR_FAILED, "%s",
+                                       e.what());
+        }
+    }
+
+    static const sdbusplus::vtable_t vtable[];
+
+    sdbusplus::server::interface::interface interface;
+
+    I2CCommLib& device;
+
+    /** @brief Written by the threads as their attestations are done */
+    int doneFd;
+
+    sd_event_source* doneSource{nullptr};
+
+    /** @brief The calls waiting for their attestations, the oldest first */
+    std::list<std::pair<sd_bus_message*, std::future<I2CCommLib::Attestation>>>
+        pending;
+};
+
+const sdbusplus::vtable_t CecAttestationImpl::vtable[] = {
+    sdbusplus::vtable::start(),
+    sdbusplus::vtable::method("Attest", "ays", "ayayb", attest),
+    sdbusplus::vtable::end()};
+
+std::unique_ptr<CecAttestationImpl> cecAttestation;
+
 void RebootBmc()
 {
     auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
@@ -155,11 +369,7 @@ static int GpioInterruptHandler([[maybe_unused]] sd_event_source* s,
 
             cecIntManager->setStatus(!current);
 
-            I2CCommLib deviceLayer(
-                phosphor::NvidiaSecureUpdate::busIdentifier,
-                phosphor::NvidiaSecureUpdate::deviceAddrress);
-
-            retVal = deviceLayer.QueryAboutInterrupt();
+            retVal = cecDevice->QueryAboutInterrupt();
 
             if (retVal ==
                 static_cast<uint8_t>(
@@ -431,14 +641,12 @@ void ApplyRebootGuard()
                     (Activation::convertActivationsFromString(activation) ==
                      Activation::Activations::Staged))
                 {
-                    I2CCommLib deviceLayer(busIdentifier, deviceAddrress);
-
                     uint8_t retVal = static_cast<uint8_t>(
                         I2CCommLib::CommandStatus::UNKNOWN);
 
                     try
                     {
-                        retVal = deviceLayer.GetCECState();
+                        retVal = cecDevice->GetCECState();
 
                         if (retVal == static_cast<uint8_t>(
                                           I2CCommLib::CommandStatus::ERR_BUSY))
@@ -565,6 +773,10 @@ int main([[maybe_unused]] int argc, [[maybe_unused]] char** argv)
         phosphor::NvidiaSecureUpdate::cecGpioEventLoop, SIGTERM,
         phosphor::NvidiaSecureUpdate::HandleTerminate);
 
+    phosphor::NvidiaSecureUpdate::cecDevice = std::make_unique<I2CCommLib>(
+        phosphor::NvidiaSecureUpdate::busIdentifier,
+        phosphor::NvidiaSecureUpdate::deviceAddrress);
+
     phosphor::NvidiaSecureUpdate::bus.request_name(SECUREBOOT_BUSNAME);
 
     sdbusplus::bus::match_t versionMatch(
@@ -581,6 +793,16 @@ int main([[maybe_unused]] int argc, [[maybe_unused]] char** argv)
         std::make_unique<phosphor::NvidiaSecureUpdate::CecImpl>(
             phosphor::NvidiaSecureUpdate::bus, SECUREBOOT_PATH);
 
+    phosphor::NvidiaSecureUpdate::cecTransfer =
+        std::make_unique<phosphor::NvidiaSecureUpdate::CecTransferImpl>(
+            phosphor::NvidiaSecureUpdate::bus, SECUREBOOT_PATH);
+
+    phosphor::NvidiaSecureUpdate::cecAttestation =
+        std::make_unique<phosphor::NvidiaSecureUpdate::CecAttestationImpl>(
+            phosphor::NvidiaSecureUpdate::bus, SECUREBOOT_PATH,
+            *phosphor::NvidiaSecureUpdate::cecDevice,
+            phosphor::NvidiaSecureUpdate::cecGpioEventLoop);
+
     phosphor::NvidiaSecureUpdate::bus.attach_event(
         phosphor::NvidiaSecureUpdate::cecGpioEventLoop,
         SD_EVENT_PRIORITY_NORMAL);
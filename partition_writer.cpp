@@ -0,0 +1,265 @@
+#include "partition_writer.hpp"
+
+#include "delta_image.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <stop_token>
+#include <thread>
+
+namespace phosphor
+{
+namespace software
+{
+namespace updater
+{
+
+namespace
+{
+
+/** @brief Magic number at the start of a zstd frame */
+constexpr uint32_t zstdMagic = 0xFD2FB528;
+
+/** @brief RAII wrapper for a file descriptor */
+struct FileDescriptor
+{
+    explicit FileDescriptor(int fd) : fd(fd) {}
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+    ~FileDescriptor()
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+
+    int fd;
+};
+
+/** @brief Write one target, counting the bytes written in done */
+std::vector<Pipeline::StageStats>
+    writeTarget(const PartitionWriter::Target& target,
+                std::atomic<uint64_t>& done, std::stop_token stop)
+{
+    std::unique_ptr<Source> source;
+    std::vector<std::unique_ptr<Sink>> sinks;
+    std::string expectedDigest;
+    Sha256Sink* hash = nullptr;
+    if (!target.base.empty())
+    {
+        std::error_code ec;
+        auto inPlace = std::filesystem::equivalent(target.base,
+                                                   target.device, ec) &&
+                       !ec;
+        if (inPlace)
+        {
+            // Fail before the base is modified rather than halfway through
+            DeltaImage::validate(target.image, true);
+        }
+        auto delta = std::make_unique<DeltaSource>(target.image, target.base,
+                                                   inPlace);
+        expectedDigest = delta->header().targetDigest;
+        source = std::move(delta);
+
+        auto sha256 = std::make_unique<Sha256Sink>();
+        hash = sha256.get();
+        sinks.push_back(std::move(sha256));
+    }
+    else if (target.compressed)
+    {
+        source = std::make_unique<ZstdSource>(target.image);
+    }
+    else
+    {
+        source = std::make_unique<FileSource>(target.image);
+    }
+    sinks.push_back(std::make_unique<DeviceSink>(target.device));
+
+    Pipeline pipeline(std::move(source), std::move(sinks),
+                      PartitionWriter::bufferSize);
+    uint64_t last = 0;
+    auto stats = pipeline.run(
+        [&done, &last](uint64_t written) {
+        done += written - last;
+        last = written;
+        return true;
+    },
+        stop);
+
+    // The sinks live as long as the pipeline
+    if (hash && hash->digest() != expectedDigest)
+    {
+        throw std::runtime_error("Reconstructed " + target.device +
+                                 " does not match the digest of " +
+                                 target.image);
+    }
+    return stats;
+}
+
+} // namespace
+
+std::vector<std::vector<Pipeline::StageStats>>
+    PartitionWriter::write(const std::vector<Target>& targets,
+                           const Progress& progress)
+{
+    uint64_t total = 0;
+    for (const auto& target : targets)
+    {
+        total += targetSize(target).value_or(0);
+    }
+
+    std::atomic<uint64_t> done{0};
+    std::stop_source stopSource;
+    std::vector<std::exception_ptr> errors(targets.size());
+    std::vector<std::vector<Pipeline::StageStats>> stats(targets.size());
+    std::mutex mutex;
+    std::condition_variable finishedCv;
+    size_t finished = 0;
+
+    std::vector<std::jthread> threads;
+    for (size_t i = 0; i < targets.size(); i++)
+    {
+        threads.emplace_back([&, i]() {
+            try
+            {
+                stats[i] = writeTarget(targets[i], done,
+                                       stopSource.get_token());
+            }
+            catch (...)
+            {
+                // Keep the error that stopped the others, not theirs
+                if (stopSource.request_stop())
+                {
+                    errors[i] = std::current_exception();
+                }
+            }
+            std::lock_guard lock(mutex);
+            finished++;
+            finishedCv.notify_one();
+        });
+    }
+
+    bool cancelled = false;
+    {
+        std::unique_lock lock(mutex);
+        while (!finishedCv.wait_for(lock, progressInterval, [&]() {
+            return finished == targets.size();
+        }))
+        {
+            // The size of an image may not be known up front
+            if (progress && !cancelled &&
+                !progress(std::min<uint64_t>(done, total), total))
+            {
+                cancelled = true;
+                stopSource.request_stop();
+            }
+        }
+    }
+    threads.clear();
+
+    for (const auto& error : errors)
+    {
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+    if (cancelled)
+    {
+        throw std::runtime_error("Partition write cancelled");
+    }
+    if (progress)
+    {
+        progress(total, total);
+    }
+    return stats;
+}
+
+std::optional<uint64_t> PartitionWriter::targetSize(const Target& target)
+{
+    if (!target.base.empty())
+    {
+        try
+        {
+            return DeltaImage::readHeader(target.image).targetSize;
+        }
+        catch (const std::exception&)
+        {
+            // Reported by the writer thread
+            return std::nullopt;
+        }
+    }
+    if (target.compressed)
+    {
+        return zstdContentSize(target.image);
+    }
+
+    std::error_code ec;
+    auto size = std::filesystem::file_size(target.image, ec);
+    if (ec)
+    {
+        return std::nullopt;
+    }
+    return size;
+}
+
+std::optional<uint64_t>
+    PartitionWriter::zstdContentSize(const std::string& path)
+{
+    FileDescriptor file(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    // Magic, frame header descriptor, window descriptor, up to 4 bytes of
+    // dictionary id and up to 8 bytes of content size
+    std::array<uint8_t, 18> header{};
+    if (file.fd < 0 ||
+        pread(file.fd, header.data(), header.size(), 0) < 6)
+    {
+        return std::nullopt;
+    }
+
+    uint32_t magic = header[0] | (header[1] << 8) | (header[2] << 16) |
+                     (static_cast<uint32_t>(header[3]) << 24);
+    if (magic != zstdMagic)
+    {
+        return std::nullopt;
+    }
+
+    uint8_t descriptor = header[4];
+    uint8_t sizeFlag = descriptor >> 6;
+    bool singleSegment = descriptor & 0x20;
+    static constexpr std::array<size_t, 4> dictIdSizes{0, 1, 2, 4};
+    static constexpr std::array<size_t, 4> contentSizeSizes{0, 2, 4, 8};
+
+    size_t pos = 5 + (singleSegment ? 0 : 1) + dictIdSizes[descriptor & 3];
+    size_t fieldSize = contentSizeSizes[sizeFlag];
+    if (sizeFlag == 0)
+    {
+        if (!singleSegment)
+        {
+            return std::nullopt;
+        }
+        fieldSize = 1;
+    }
+
+    uint64_t size = 0;
+    for (size_t i = 0; i < fieldSize; i++)
+    {
+        size |= static_cast<uint64_t>(header[pos + i]) << (8 * i);
+    }
+    // The two byte field is stored with an offset of 256
+    return (fieldSize == 2) ? size + 256 : size;
+}
+
+} // namespace updater
+} // namespace software
+} // namespace phosphor
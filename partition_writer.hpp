@@ -0,0 +1,90 @@
+#pragma once
+
+#include "pipeline.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace phosphor
+{
+namespace software
+{
+namespace updater
+{
+
+/** @class PartitionWriter
+ *  @brief Writes images to block device partitions in parallel.
+ *  @details Replaces "zstd -d -c image | dd of=partition": each image gets
+ *  its own thread running a Pipeline, which writes the output of the
+ *  decompressor to the partition with large aligned buffers and O_DIRECT,
+ *  so the page cache is bypassed and the partitions are written
+ *  concurrently. Decompression runs in a zstd child process per image.
+ *  An image may instead be a delta against the running version, which is
+ *  reconstructed from the base partition on the fly.
+ */
+class PartitionWriter
+{
+  public:
+    /** @brief An image and the partition it is written to */
+    struct Target
+    {
+        /** @brief Path to the image */
+        std::string image;
+        /** @brief The partition, or a plain file in the unit tests */
+        std::string device;
+        /** @brief Whether the image is zstd compressed */
+        bool compressed;
+        /** @brief If set, the image is a DeltaImage against this partition
+         *  and the result is checked against the digest of the delta */
+        std::string base{};
+    };
+
+    /** @brief Called periodically with the number of bytes written and the
+     *  total number of bytes. Returning false cancels the write.
+     */
+    using Progress = std::function<bool(uint64_t done, uint64_t total)>;
+
+    /** @brief Size of the buffer of each writer thread */
+    static constexpr size_t bufferSize = 1024 * 1024;
+
+    /** @brief How often progress is reported */
+    static constexpr auto progressInterval = std::chrono::milliseconds(200);
+
+    /** @brief Write all targets concurrently and wait for them
+     *
+     *  @param[in] targets - The images to write
+     *  @param[in] progress - Called while the targets are written
+     *
+     *  @return The statistics of the pipeline stages of each target
+     *
+     *  @throw std::runtime_error if any target fails or the write is
+     *         cancelled, after all threads have stopped
+     */
+    static std::vector<std::vector<Pipeline::StageStats>>
+        write(const std::vector<Target>& targets,
+              const Progress& progress = {});
+
+    /** @brief The number of bytes written to the partition of a target
+     *
+     *  @param[in] target - The target
+     *
+     *  @return The size, or std::nullopt if it is not known up front
+     */
+    static std::optional<uint64_t> targetSize(const Target& target);
+
+    /** @brief Read the decompressed size from the header of a zstd frame
+     *
+     *  @param[in] path - Path to the compressed file
+     *
+     *  @return The size, or std::nullopt if the header does not record it
+     */
+    static std::optional<uint64_t> zstdContentSize(const std::string& path);
+};
+
+} // namespace updater
+} // namespace software
+} // namespace phosphor
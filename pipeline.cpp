@@ -0,0 +1,425 @@
+#include "pipeline.hpp"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <array>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+extern char** environ;
+
+namespace phosphor
+{
+namespace software
+{
+namespace updater
+{
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+/** @brief Fill a buffer from a file or pipe, stopping early at the end
+ *
+ *  @return The number of bytes read
+ */
+size_t readFull(int fd, uint8_t* data, size_t size, const std::string& path)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        auto n = ::read(fd, data + done, size - done);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            throw std::runtime_error("Failed to read " + path + ": " +
+                                     std::strerror(errno));
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+} // namespace
+
+Pipeline::Pipeline(std::unique_ptr<Source> source,
+                   std::vector<std::unique_ptr<Sink>> sinks,
+                   size_t chunkSize) :
+    source(std::move(source)),
+    sinks(std::move(sinks)), chunkSize(chunkSize)
+{}
+
+std::vector<Pipeline::StageStats> Pipeline::run(const Progress& progress,
+                                                std::stop_token stop)
+{
+    std::vector<StageStats> stats;
+    stats.push_back({source->name(), 0, {}});
+    for (const auto& sink : sinks)
+    {
+        stats.push_back({sink->name(), 0, {}});
+    }
+
+    using Buffer = std::unique_ptr<uint8_t, decltype(&std::free)>;
+    std::array<Buffer, 2> buffers{
+        Buffer(static_cast<uint8_t*>(std::aligned_alloc(alignment, chunkSize)),
+               std::free),
+        Buffer(static_cast<uint8_t*>(std::aligned_alloc(alignment, chunkSize)),
+               std::free)};
+    if (!buffers[0] || !buffers[1])
+    {
+        throw std::bad_alloc();
+    }
+    std::array<size_t, 2> sizes{};
+
+    std::mutex mutex;
+    std::condition_variable_any cv;
+    std::deque<size_t> empty{0, 1};
+    std::deque<size_t> filled;
+    bool sourceDone = false;
+    std::exception_ptr sourceError;
+
+    // Joined before anything above goes away
+    std::jthread reader([&](std::stop_token abort) {
+        try
+        {
+            while (true)
+            {
+                size_t index = 0;
+                {
+                    std::unique_lock lock(mutex);
+                    if (!cv.wait(lock, abort, [&]() { return !empty.empty(); }))
+                    {
+                        return;
+                    }
+                    index = empty.front();
+                    empty.pop_front();
+                }
+
+                auto start = Clock::now();
+                auto size = source->read(buffers[index].get(), chunkSize);
+                if (size == 0)
+                {
+                    source->finish();
+                }
+                stats[0].busy += Clock::now() - start;
+                stats[0].bytes += size;
+
+                std::lock_guard lock(mutex);
+                if (size == 0)
+                {
+                    sourceDone = true;
+                    cv.notify_all();
+                    return;
+                }
+                sizes[index] = size;
+                filled.push_back(index);
+                cv.notify_all();
+            }
+        }
+        catch (...)
+        {
+            std::lock_guard lock(mutex);
+            sourceError = std::current_exception();
+            sourceDone = true;
+            cv.notify_all();
+        }
+    });
+
+    auto abort = [&]() {
+        reader.request_stop();
+        reader.join();
+    };
+
+    uint64_t done = 0;
+    while (true)
+    {
+        size_t index = 0;
+        {
+            std::unique_lock lock(mutex);
+            cv.wait(lock, stop,
+                    [&]() { return !filled.empty() || sourceDone; });
+            if (stop.stop_requested())
+            {
+                lock.unlock();
+                abort();
+                throw std::runtime_error("Pipeline cancelled");
+            }
+            if (filled.empty())
+            {
+                break;
+            }
+            index = filled.front();
+            filled.pop_front();
+        }
+
+        try
+        {
+            for (size_t i = 0; i < sinks.size(); i++)
+            {
+                auto start = Clock::now();
+                sinks[i]->write(buffers[index].get(), sizes[index]);
+                stats[i + 1].busy += Clock::now() - start;
+                stats[i + 1].bytes += sizes[index];
+            }
+        }
+        catch (...)
+        {
+            abort();
+            throw;
+        }
+
+        done += sizes[index];
+        if (progress && !progress(done))
+        {
+            abort();
+            throw std::runtime_error("Pipeline cancelled");
+        }
+
+        std::lock_guard lock(mutex);
+        empty.push_back(index);
+        cv.notify_all();
+    }
+
+    reader.join();
+    if (sourceError)
+    {
+        std::rethrow_exception(sourceError);
+    }
+
+    for (size_t i = 0; i < sinks.size(); i++)
+    {
+        auto start = Clock::now();
+        sinks[i]->finish();
+        stats[i + 1].busy += Clock::now() - start;
+    }
+    return stats;
+}
+
+FileSource::FileSource(const std::string& path, off_t offset) :
+    path(path), fd(open(path.c_str(), O_RDONLY | O_CLOEXEC)), offset(offset)
+{
+    if (fd < 0)
+    {
+        throw std::runtime_error("Failed to open " + path + ": " +
+                                 std::strerror(errno));
+    }
+}
+
+FileSource::~FileSource()
+{
+    close(fd);
+}
+
+size_t FileSource::read(uint8_t* data, size_t size)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        auto n = pread(fd, data + done, size - done, offset);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            throw std::runtime_error("Failed to read " + path + ": " +
+                                     std::strerror(errno));
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        done += n;
+        offset += n;
+    }
+    return done;
+}
+
+ZstdSource::ZstdSource(const std::string& path, off_t offset) : path(path)
+{
+    // The child reads the file from its stdin, from the offset on
+    int in = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0 || lseek(in, offset, SEEK_SET) != offset)
+    {
+        auto err = errno;
+        if (in >= 0)
+        {
+            close(in);
+        }
+        throw std::runtime_error("Failed to open " + path + ": " +
+                                 std::strerror(err));
+    }
+
+    std::array<int, 2> fds{};
+    if (pipe2(fds.data(), O_CLOEXEC) < 0)
+    {
+        auto err = errno;
+        close(in);
+        throw std::runtime_error(std::string("Failed to create pipe: ") +
+                                 std::strerror(err));
+    }
+    fd = fds[0];
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    std::array<const char*, 6> argv{"zstd", "-d", "-c", "-q", "-", nullptr};
+    auto rc = posix_spawnp(&pid, "zstd", &actions, nullptr,
+                           const_cast<char* const*>(argv.data()), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    close(in);
+    if (rc != 0)
+    {
+        close(fd);
+        pid = -1;
+        throw std::runtime_error("Failed to run zstd: " +
+                                 std::string(std::strerror(rc)));
+    }
+}
+
+ZstdSource::~ZstdSource()
+{
+    close(fd);
+    if (pid > 0)
+    {
+        kill(pid, SIGTERM);
+        wait();
+    }
+}
+
+size_t ZstdSource::read(uint8_t* data, size_t size)
+{
+    return readFull(fd, data, size, path);
+}
+
+void ZstdSource::finish()
+{
+    if (!wait())
+    {
+        throw std::runtime_error("Failed to decompress " + path);
+    }
+}
+
+bool ZstdSource::wait()
+{
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+    {}
+    pid = -1;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+Sha256Sink::Sha256Sink() : ctx(EVP_MD_CTX_new(), ::EVP_MD_CTX_free)
+{
+    if (!ctx || EVP_DigestInit_ex(ctx.get(), EVP_sha256(), nullptr) != 1)
+    {
+        throw std::runtime_error("Failed to initialize SHA-256");
+    }
+}
+
+void Sha256Sink::write(const uint8_t* data, size_t size)
+{
+    if (EVP_DigestUpdate(ctx.get(), data, size) != 1)
+    {
+        throw std::runtime_error("Failed to update SHA-256");
+    }
+}
+
+void Sha256Sink::finish()
+{
+    std::array<uint8_t, EVP_MAX_MD_SIZE> md{};
+    unsigned int mdSize = 0;
+    if (EVP_DigestFinal_ex(ctx.get(), md.data(), &mdSize) != 1)
+    {
+        throw std::runtime_error("Failed to finalize SHA-256");
+    }
+
+    static constexpr auto hex = "0123456789abcdef";
+    hexDigest.clear();
+    for (unsigned int i = 0; i < mdSize; i++)
+    {
+        hexDigest += hex[md[i] >> 4];
+        hexDigest += hex[md[i] & 0xf];
+    }
+}
+
+DeviceSink::DeviceSink(const std::string& path, off_t offset) :
+    path(path), fd(open(path.c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC)),
+    offset(offset)
+{
+    // Not every file system supports O_DIRECT, tmpfs for one
+    if (fd < 0 && errno == EINVAL)
+    {
+        fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    }
+    if (fd < 0)
+    {
+        throw std::runtime_error("Failed to open " + path + ": " +
+                                 std::strerror(errno));
+    }
+}
+
+DeviceSink::~DeviceSink()
+{
+    close(fd);
+}
+
+void DeviceSink::write(const uint8_t* data, size_t size)
+{
+    if (size % Pipeline::alignment || offset % Pipeline::alignment)
+    {
+        // Only the tail of the data is unaligned, it goes through the page
+        // cache
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+    }
+
+    for (size_t written = 0; written < size;)
+    {
+        auto n = pwrite(fd, data + written, size - written, offset);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            throw std::runtime_error("Failed to write " + path + ": " +
+                                     std::strerror(errno));
+        }
+        written += n;
+        offset += n;
+    }
+}
+
+void DeviceSink::finish()
+{
+    if (fdatasync(fd) < 0 && errno != EINVAL)
+    {
+        throw std::runtime_error("Failed to sync " + path + ": " +
+                                 std::strerror(errno));
+    }
+}
+
+} // namespace updater
+} // namespace software
+} // namespace phosphor
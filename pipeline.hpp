@@ -0,0 +1,321 @@
+#pragma once
+
+#include <openssl/evp.h>
+#include <sys/types.h>
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <stop_token>
+#include <string>
+#include <vector>
+
+namespace phosphor
+{
+namespace software
+{
+namespace updater
+{
+
+/** @class Source
+ *  @brief The first stage of a Pipeline, produces the data to write
+ */
+class Source
+{
+  public:
+    virtual ~Source() = default;
+
+    /** @brief Name of the stage, for the statistics */
+    virtual std::string name() const = 0;
+
+    /** @brief Fill a buffer with the next data
+     *  @details The buffer is only filled partially at the end of the data.
+     *
+     *  @param[out] data - The buffer
+     *  @param[in] size - The size of the buffer
+     *
+     *  @return The number of bytes read, 0 at the end of the data
+     *
+     *  @throw std::runtime_error on failure
+     */
+    virtual size_t read(uint8_t* data, size_t size) = 0;
+
+    /** @brief Called once all data has been read
+     *
+     *  @throw std::runtime_error if the data turns out to be incomplete
+     */
+    virtual void finish() {}
+};
+
+/** @class Sink
+ *  @brief A later stage of a Pipeline, consumes the data
+ */
+class Sink
+{
+  public:
+    virtual ~Sink() = default;
+
+    /** @brief Name of the stage, for the statistics */
+    virtual std::string name() const = 0;
+
+    /** @brief Consume the next data
+     *
+     *  @param[in] data - The data
+     *  @param[in] size - The number of bytes
+     *
+     *  @throw std::runtime_error on failure
+     */
+    virtual void write(const uint8_t* data, size_t size) = 0;
+
+    /** @brief Called once all data has been written
+     *
+     *  @throw std::runtime_error on failure
+     */
+    virtual void finish() {}
+};
+
+/** @class Pipeline
+ *  @brief Streams data from a source through sinks with bounded memory.
+ *  @details The source runs in its own thread and fills one buffer while
+ *  the sinks, e.g. a hash and a block writer, consume the other, so that
+ *  reading and decompressing overlap with the device writes. Two buffers
+ *  of chunkSize are all the memory used, whatever the size of the data.
+ *  The time each stage spends busy is measured, which shows whether the
+ *  CPU or the flash is the bottleneck.
+ */
+class Pipeline
+{
+  public:
+    /** @brief Statistics of one stage */
+    struct StageStats
+    {
+        /** @brief Name of the stage */
+        std::string name;
+        /** @brief Number of bytes the stage handled */
+        uint64_t bytes;
+        /** @brief Time the stage spent working */
+        std::chrono::nanoseconds busy;
+
+        /** @brief Bytes per second while busy */
+        double throughput() const
+        {
+            auto seconds = std::chrono::duration<double>(busy).count();
+            return seconds > 0 ? bytes / seconds : 0;
+        }
+    };
+
+    /** @brief Called after each chunk with the number of bytes done so far.
+     *  Returning false cancels the pipeline.
+     */
+    using Progress = std::function<bool(uint64_t done)>;
+
+    /** @brief Default size of each of the two buffers */
+    static constexpr size_t defaultChunkSize = 1024 * 1024;
+
+    /** @brief Buffers are aligned for O_DIRECT */
+    static constexpr size_t alignment = 4096;
+
+    /** @brief Constructor
+     *
+     *  @param[in] source - Produces the data
+     *  @param[in] sinks - Consume the data, in order
+     *  @param[in] chunkSize - Size of each buffer, a multiple of alignment
+     */
+    Pipeline(std::unique_ptr<Source> source,
+             std::vector<std::unique_ptr<Sink>> sinks,
+             size_t chunkSize = defaultChunkSize);
+
+    /** @brief Stream all data through the stages
+     *
+     *  @param[in] progress - Called after each chunk
+     *  @param[in] stop - Cancels the pipeline when requested
+     *
+     *  @return The statistics of the source followed by the sinks
+     *
+     *  @throw std::runtime_error if a stage fails or the pipeline is
+     *         cancelled, after the source thread has stopped
+     */
+    std::vector<StageStats> run(const Progress& progress = {},
+                                std::stop_token stop = {});
+
+  private:
+    /** @brief The source */
+    std::unique_ptr<Source> source;
+
+    /** @brief The sinks */
+    std::vector<std::unique_ptr<Sink>> sinks;
+
+    /** @brief Size of each buffer */
+    size_t chunkSize;
+};
+
+/** @class FileSource
+ *  @brief Reads a file
+ */
+class FileSource : public Source
+{
+  public:
+    /** @brief Constructor
+     *
+     *  @param[in] path - The file
+     *  @param[in] offset - Where to start reading
+     *
+     *  @throw std::runtime_error if the file cannot be opened
+     */
+    explicit FileSource(const std::string& path, off_t offset = 0);
+    ~FileSource() override;
+
+    FileSource(const FileSource&) = delete;
+    FileSource& operator=(const FileSource&) = delete;
+
+    std::string name() const override
+    {
+        return "read";
+    }
+
+    size_t read(uint8_t* data, size_t size) override;
+
+  private:
+    /** @brief The path, for error messages */
+    std::string path;
+
+    /** @brief The open file */
+    int fd;
+
+    /** @brief The position of the next read */
+    off_t offset;
+};
+
+/** @class ZstdSource
+ *  @brief Decompresses a zstd file in a zstd child process
+ */
+class ZstdSource : public Source
+{
+  public:
+    /** @brief Start "zstd -d -c" on the file
+     *
+     *  @param[in] path - The compressed file
+     *  @param[in] offset - Where the compressed data starts
+     *
+     *  @throw std::runtime_error if the file cannot be opened or zstd cannot
+     *         be started
+     */
+    explicit ZstdSource(const std::string& path, off_t offset = 0);
+
+    /** @brief Stops the child if it is still running */
+    ~ZstdSource() override;
+
+    ZstdSource(const ZstdSource&) = delete;
+    ZstdSource& operator=(const ZstdSource&) = delete;
+
+    std::string name() const override
+    {
+        return "decompress";
+    }
+
+    size_t read(uint8_t* data, size_t size) override;
+
+    /** @brief Checks that zstd succeeded */
+    void finish() override;
+
+  private:
+    /** @brief Wait for the child to exit
+     *
+     *  @return Whether it exited successfully
+     */
+    bool wait();
+
+    /** @brief The path, for error messages */
+    std::string path;
+
+    /** @brief The read end of the pipe from the child */
+    int fd = -1;
+
+    /** @brief The child process */
+    pid_t pid = -1;
+};
+
+/** @class Sha256Sink
+ *  @brief Computes the SHA-256 of the data
+ */
+class Sha256Sink : public Sink
+{
+  public:
+    /** @brief Constructor
+     *
+     *  @throw std::runtime_error if the digest cannot be initialized
+     */
+    Sha256Sink();
+
+    Sha256Sink(const Sha256Sink&) = delete;
+    Sha256Sink& operator=(const Sha256Sink&) = delete;
+
+    std::string name() const override
+    {
+        return "hash";
+    }
+
+    void write(const uint8_t* data, size_t size) override;
+
+    void finish() override;
+
+    /** @brief The digest as a hex string, once finished */
+    const std::string& digest() const
+    {
+        return hexDigest;
+    }
+
+  private:
+    /** @brief The openssl digest context */
+    std::unique_ptr<EVP_MD_CTX, decltype(&::EVP_MD_CTX_free)> ctx;
+
+    /** @brief The result */
+    std::string hexDigest;
+};
+
+/** @class DeviceSink
+ *  @brief Writes the data to a block device with O_DIRECT
+ *  @details Falls back to buffered writes where O_DIRECT is not supported,
+ *  and for the unaligned tail of the data.
+ */
+class DeviceSink : public Sink
+{
+  public:
+    /** @brief Constructor
+     *
+     *  @param[in] path - The device, or a plain file
+     *  @param[in] offset - Where to start writing
+     *
+     *  @throw std::runtime_error if the device cannot be opened
+     */
+    explicit DeviceSink(const std::string& path, off_t offset = 0);
+    ~DeviceSink() override;
+
+    DeviceSink(const DeviceSink&) = delete;
+    DeviceSink& operator=(const DeviceSink&) = delete;
+
+    std::string name() const override
+    {
+        return "write";
+    }
+
+    void write(const uint8_t* data, size_t size) override;
+
+    /** @brief Flushes the data to the device */
+    void finish() override;
+
+  private:
+    /** @brief The path, for error messages */
+    std::string path;
+
+    /** @brief The open device */
+    int fd;
+
+    /** @brief The position of the next write */
+    off_t offset;
+};
+
+} // namespace updater
+} // namespace software
+} // namespace phosphor
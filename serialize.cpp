@@ -22,6 +22,9 @@ namespace fs = std::filesystem;
 
 const std::string priorityName = "priority";
 const std::string purposeName = "purpose";
+const std::string flashJournalDir = "flash-journals";
+const std::string mirrorCacheName = "uboot-mirror";
+const std::string flashModelName = "flash-model";
 
 void storePriority(const std::string& flashId, uint8_t priority)
 {
@@ -148,6 +151,21 @@ bool restorePurpose(const std::string& flashId, VersionPurpose& purpose)
     return false;
 }
 
+std::string flashJournalPath(const std::string& versionId)
+{
+    return fs::path(PERSIST_DIR) / flashJournalDir / versionId;
+}
+
+std::string mirrorCachePath()
+{
+    return fs::path(PERSIST_DIR) / mirrorCacheName;
+}
+
+std::string flashModelPath()
+{
+    return fs::path(PERSIST_DIR) / flashModelName;
+}
+
 void removePersistDataDirectory(const std::string& flashId)
 {
     std::error_code ec;
@@ -46,6 +46,23 @@ bool restorePriority(const std::string& flashId, uint8_t& priority);
  **/
 bool restorePurpose(const std::string& flashId, VersionPurpose& purpose);
 
+/** @brief Returns the path of the journal of an interrupted flash write
+ *  @param[in] versionId - The id of the version being written.
+ *  @return The journal path, in the journal directory shared by all
+ *          versions
+ **/
+std::string flashJournalPath(const std::string& versionId);
+
+/** @brief Returns the path of the cache of the U-Boot mirror
+ *  @return The cache path, in the serial directory
+ **/
+std::string mirrorCachePath();
+
+/** @brief Returns the path of the measured throughput of the flash devices
+ *  @return The model path, in the serial directory
+ **/
+std::string flashModelPath();
+
 /** @brief Removes the serial directory for a given version.
  *  @param[in] flash Id - The flash id of the version for which to remove a
  *                        file, if it exists.
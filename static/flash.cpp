@@ -6,15 +6,99 @@
 #include "images.hpp"
 #include "item_updater.hpp"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
 #include <phosphor-logging/lg2.hpp>
 
+#include <cerrno>
 #include <filesystem>
+#include <stdexcept>
+#include <string>
 #include <system_error>
 
 namespace
 {
 constexpr auto PATH_INITRAMFS = "/run/initramfs";
-constexpr auto FLASH_ALT_SERVICE_TMPL = "obmc-flash-bmc-alt@";
+constexpr auto FLASH_ALT_PREPARE_SERVICE = "obmc-flash-bmc-alt-prepare.service";
+constexpr auto FLASH_ALT_FINISH_SERVICE = "obmc-flash-bmc-alt-finish.service";
+constexpr auto FLASH_ALT_DEVICE = "/dev/mtd/alt-bmc";
+
+namespace fs = std::filesystem;
+
+/** @brief Copy a file in the kernel, without a user space buffer
+ *
+ *  @param[in] from - The source file
+ *  @param[in] to - The destination file, replaced if it exists
+ *
+ *  @return The error, if any
+ */
+std::error_code copyFileRange(const fs::path& from, const fs::path& to)
+{
+    int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+    {
+        return {errno, std::generic_category()};
+    }
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0)
+    {
+        std::error_code ec(errno, std::generic_category());
+        close(in);
+        return ec;
+    }
+
+    std::error_code ec;
+    ssize_t copied = 0;
+    do
+    {
+        copied = copy_file_range(in, nullptr, out, nullptr, SSIZE_MAX, 0);
+    } while (copied > 0);
+    if (copied < 0)
+    {
+        ec.assign(errno, std::generic_category());
+    }
+    close(in);
+    close(out);
+
+    if (ec == std::errc::function_not_supported ||
+        ec == std::errc::cross_device_link ||
+        ec == std::errc::invalid_argument)
+    {
+        // Older kernels cannot copy between file systems
+        ec.clear();
+        fs::copy_file(from, to, fs::copy_options::overwrite_existing, ec);
+    }
+    return ec;
+}
+
+/** @brief Put an image into place without holding a second copy in RAM
+ *  @details Both directories usually live on the same tmpfs, in which case
+ *  the image is hard linked and no data is copied at all.
+ *
+ *  @param[in] from - The uploaded image
+ *  @param[in] to - The staged image, replaced if it exists
+ *
+ *  @return The error, if any
+ */
+std::error_code stageImage(const fs::path& from, const fs::path& to)
+{
+    std::error_code ec;
+    fs::remove(to, ec);
+    if (ec)
+    {
+        return ec;
+    }
+    fs::create_hard_link(from, to, ec);
+    if (!ec)
+    {
+        return ec;
+    }
+    return copyFileRange(from, to);
+}
+
 } // namespace
 
 namespace phosphor
@@ -37,11 +121,24 @@ void Activation::flashWrite()
         // It's running on the secondary chip, update the primary one
         info("Flashing primary flash from secondary, id: {ID}", "ID",
              versionId);
-        auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
-                                          SYSTEMD_INTERFACE, "StartUnit");
-        auto serviceFile = FLASH_ALT_SERVICE_TMPL + versionId + ".service";
-        method.append(serviceFile, "replace");
-        bus.call_noreply(method);
+        startJob(FLASH_ALT_PREPARE_SERVICE, [this](const std::string&) {
+            // Only the blocks that differ are written, see MtdWriter
+            auto image = fs::path(IMG_UPLOAD_DIR) / versionId / bmcFullImages;
+            writeMtd(image, FLASH_ALT_DEVICE,
+                     [this](const std::string& writeResult) {
+                // Like the ExecStartPost of flashcp, remounting and
+                // resetting cs0 onto the chip is for a complete image only
+                if (writeResult != "done")
+                {
+                    onStateChanges(writeResult);
+                    return;
+                }
+                startJob(FLASH_ALT_FINISH_SERVICE,
+                         [this, writeResult](const std::string&) {
+                    onStateChanges(writeResult);
+                });
+            });
+        });
         return;
     }
 #endif
@@ -51,29 +148,81 @@ void Activation::flashWrite()
     fs::path uploadDir(IMG_UPLOAD_DIR);
     fs::path toPath(PATH_INITRAMFS);
 
+    struct stat toStat
+    {};
+    if (stat(toPath.c_str(), &toStat) < 0)
+    {
+        throw std::system_error(errno, std::generic_category(),
+                                "Failed to stat " + toPath.string());
+    }
+
+    // Only images that cannot be linked take up space, make sure they fit
+    // before anything is staged so that a reboot never flashes half of them.
+    uintmax_t totalSize = 0;
+    uintmax_t copySize = 0;
+    for (const auto& bmcImage : parent.imageUpdateList)
+    {
+        struct stat imageStat
+        {};
+        if (stat((uploadDir / versionId / bmcImage).c_str(), &imageStat) < 0)
+        {
+            continue;
+        }
+        totalSize += imageStat.st_size;
+        if (imageStat.st_dev != toStat.st_dev)
+        {
+            copySize += imageStat.st_size;
+        }
+    }
+
+    struct statvfs toFs
+    {};
+    if (copySize > 0 && statvfs(toPath.c_str(), &toFs) == 0 &&
+        static_cast<uintmax_t>(toFs.f_bavail) * toFs.f_frsize < copySize)
+    {
+        throw std::runtime_error("Not enough space in " + toPath.string() +
+                                 " to stage " + std::to_string(copySize) +
+                                 " bytes");
+    }
+
+    uintmax_t stagedSize = 0;
+    auto startProgress = activationProgress ? activationProgress->progress()
+                                            : 0;
     for (const auto& bmcImage : parent.imageUpdateList)
     {
+        auto from = uploadDir / versionId / bmcImage;
         std::error_code ec;
-        fs::copy_file(uploadDir / versionId / bmcImage, toPath / bmcImage,
-                      fs::copy_options::overwrite_existing, ec);
+        auto size = fs::file_size(from, ec);
+        if (ec)
+        {
+            continue;
+        }
+
+        ec = stageImage(from, toPath / bmcImage);
+        if (ec)
+        {
+            auto message = "Failed to stage " + bmcImage + ": " + ec.message();
+            for (const auto& staged : parent.imageUpdateList)
+            {
+                fs::remove(toPath / staged, ec);
+            }
+            throw std::runtime_error(message);
+        }
+
+        stagedSize += size;
+        if (activationProgress && totalSize > 0)
+        {
+            activationProgress->progress(
+                startProgress +
+                (90 - startProgress) * stagedSize / totalSize);
+        }
     }
 }
 
-void Activation::onStateChanges([[maybe_unused]] sdbusplus::message_t& msg)
+void Activation::onStateChanges([[maybe_unused]] const std::string& result)
 {
 #ifdef BMC_STATIC_DUAL_IMAGE
-    uint32_t newStateID;
-    auto serviceFile = FLASH_ALT_SERVICE_TMPL + versionId + ".service";
-    sdbusplus::message::object_path newStateObjPath;
-    std::string newStateUnit{};
-    std::string newStateResult{};
-    msg.read(newStateID, newStateObjPath, newStateUnit, newStateResult);
-
-    if (newStateUnit != serviceFile)
-    {
-        return;
-    }
-    if (newStateResult == "done")
+    if (result == "done")
     {
         activationProgress->progress(90);
         onFlashWriteSuccess();
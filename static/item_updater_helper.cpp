@@ -2,6 +2,8 @@
 
 #include "utils.hpp"
 
+#include <phosphor-logging/lg2.hpp>
+
 namespace phosphor
 {
 namespace software
@@ -9,6 +11,8 @@ namespace software
 namespace updater
 {
 
+PHOSPHOR_LOG2_USING;
+
 void Helper::setEntry(const std::string& /* entryId */, uint8_t /* value */)
 {
     // Empty
@@ -32,12 +36,13 @@ void Helper::factoryReset()
 
     // Set vendorfieldmode=disabled env in U-Boot.
     // This will disable the vendor field mode settings.
-    utils::execute("/sbin/fw_setenv", "vendorfieldmode", "disabled");
+    env.set("vendorfieldmode", "disabled");
 #else
     // Set openbmconce=factory-reset env in U-Boot.
     // The init will cleanup rwfs during boot.
-    utils::execute("/sbin/fw_setenv", "openbmconce", "factory-reset");
+    env.set("openbmconce", "factory-reset");
 #endif
+    commitEnv();
 }
 
 void Helper::removeVersion(const std::string& /* flashId */)
@@ -0,0 +1,224 @@
+#include "config.h"
+
+#include "async_utils.hpp"
+#include "job_tracker.hpp"
+
+#include <sys/socket.h>
+#include <systemd/sd-bus.h>
+#include <systemd/sd-id128.h>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <sdbusplus/asio/connection.hpp>
+#include <sdbusplus/asio/object_server.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+using phosphor::software::updater::JobTracker;
+using namespace std::chrono_literals;
+
+namespace
+{
+
+/** @brief How long the stand-in service takes for each call */
+constexpr auto serviceDelay = 500ms;
+
+/** @brief Open one end of a peer to peer bus, no bus daemon involved */
+std::shared_ptr<sdbusplus::asio::connection>
+    openPeer(boost::asio::io_context& io, int fd, bool server)
+{
+    sd_bus* bus = nullptr;
+    EXPECT_GE(sd_bus_new(&bus), 0);
+    EXPECT_GE(sd_bus_set_fd(bus, fd, fd), 0);
+    if (server)
+    {
+        sd_id128_t id;
+        EXPECT_GE(sd_id128_randomize(&id), 0);
+        EXPECT_GE(sd_bus_set_server(bus, 1, id), 0);
+    }
+    EXPECT_GE(sd_bus_start(bus), 0);
+
+    auto connection = std::make_shared<sdbusplus::asio::connection>(io, bus);
+    sd_bus_unref(bus);
+    return connection;
+}
+
+/** @class SlowService
+ *  @brief Stands in for systemd and the object mapper, and blocks for
+ *  serviceDelay in each call. Runs its own event loop on a thread, like a
+ *  separate process would.
+ */
+class SlowService
+{
+  public:
+    explicit SlowService(int fd) :
+        connection(openPeer(io, fd, true)), server(connection, true)
+    {
+        auto systemd = server.add_interface(SYSTEMD_PATH, SYSTEMD_INTERFACE);
+        systemd->register_method("Subscribe", []() {});
+        systemd->register_method(
+            "StartUnit", [this](const std::string& unit, const std::string&) {
+            std::this_thread::sleep_for(serviceDelay);
+            auto id = ++jobs;
+            sdbusplus::message::object_path job(
+                std::string(SYSTEMD_PATH) + "/job/" + std::to_string(id));
+
+            // The job completes after the reply, as systemd does
+            auto timer = std::make_shared<boost::asio::steady_timer>(io);
+            timer->expires_after(serviceDelay);
+            timer->async_wait(
+                [this, timer, id, job, unit](const boost::system::error_code&) {
+                auto signal = connection->new_signal(
+                    SYSTEMD_PATH, SYSTEMD_INTERFACE, "JobRemoved");
+                signal.append(id, job, unit, std::string("done"));
+                signal.signal_send();
+            });
+            return job;
+        });
+        systemd->initialize();
+
+        auto mapper = server.add_interface(MAPPER_PATH, MAPPER_INTERFACE);
+        mapper->register_method(
+            "GetObject",
+            [](const std::string&, const std::vector<std::string>&) {
+            std::this_thread::sleep_for(serviceDelay);
+            return std::map<std::string, std::vector<std::string>>{
+                {"xyz.openbmc_project.Stand.In", {}}};
+        });
+        mapper->initialize();
+
+        thread = std::thread([this]() { io.run(); });
+    }
+
+    ~SlowService()
+    {
+        io.stop();
+        thread.join();
+    }
+
+    SlowService(const SlowService&) = delete;
+    SlowService& operator=(const SlowService&) = delete;
+
+    /** @brief Number of units started */
+    std::atomic<uint32_t> jobs{0};
+
+  private:
+    boost::asio::io_context io;
+    std::shared_ptr<sdbusplus::asio::connection> connection;
+    sdbusplus::asio::object_server server;
+    std::thread thread;
+};
+
+} // namespace
+
+class AsyncTest : public testing::Test
+{
+  protected:
+    AsyncTest()
+    {
+        int fds[2];
+        EXPECT_EQ(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds), 0);
+        service = std::make_unique<SlowService>(fds[0]);
+        bus = openPeer(io, fds[1], false);
+    }
+
+    /** @brief Run the updater loop until done, while a timer measures how
+     *  long the loop goes without running a handler
+     */
+    void runUntil(const bool& done)
+    {
+        auto last = std::chrono::steady_clock::now();
+        boost::asio::steady_timer tick(io);
+        std::function<void()> schedule = [&]() {
+            tick.expires_after(10ms);
+            tick.async_wait([&](const boost::system::error_code& ec) {
+                if (ec)
+                {
+                    return;
+                }
+                auto now = std::chrono::steady_clock::now();
+                longestStall = std::max(longestStall, now - last);
+                last = now;
+                ticks++;
+                schedule();
+            });
+        };
+        schedule();
+
+        auto deadline = std::chrono::steady_clock::now() + 10 * serviceDelay;
+        while (!done && std::chrono::steady_clock::now() < deadline)
+        {
+            io.run_one_for(10ms);
+        }
+        tick.cancel();
+        io.poll();
+    }
+
+    boost::asio::io_context io;
+    std::unique_ptr<SlowService> service;
+    std::shared_ptr<sdbusplus::asio::connection> bus;
+
+    /** @brief Ticks of the timer while waiting */
+    int ticks = 0;
+
+    /** @brief Longest time the loop ran no handler while waiting */
+    std::chrono::steady_clock::duration longestStall{};
+};
+
+TEST_F(AsyncTest, TestJobStaysResponsive)
+{
+    JobTracker tracker(*bus);
+    std::string result;
+    bool done = false;
+
+    tracker.startUnit("stand-in.service", [&](const std::string& r) {
+        result = r;
+        done = true;
+    });
+    // Busy from the request on, and the result arrives from the loop
+    EXPECT_TRUE(tracker.busy());
+    EXPECT_FALSE(done);
+
+    auto start = std::chrono::steady_clock::now();
+    runUntil(done);
+    EXPECT_TRUE(done);
+    EXPECT_EQ(result, "done");
+    EXPECT_EQ(service->jobs.load(), 1U);
+    EXPECT_FALSE(tracker.busy());
+
+    // The reply and the job took two service delays, during which the loop
+    // kept running the timer
+    EXPECT_GE(std::chrono::steady_clock::now() - start, 2 * serviceDelay);
+    EXPECT_GT(ticks, 10);
+    EXPECT_LT(longestStall, serviceDelay / 2);
+}
+
+TEST_F(AsyncTest, TestServiceStaysResponsive)
+{
+    std::string name;
+    bool done = false;
+
+    utils::getServiceAsync(*bus, "/xyz/openbmc_project/stand_in",
+                           "xyz.openbmc_project.Stand.In",
+                           [&](const std::string& s) {
+        name = s;
+        done = true;
+    });
+    EXPECT_FALSE(done);
+
+    runUntil(done);
+    EXPECT_TRUE(done);
+    EXPECT_EQ(name, "xyz.openbmc_project.Stand.In");
+    EXPECT_GT(ticks, 10);
+    EXPECT_LT(longestStall, serviceDelay / 2);
+}
@@ -0,0 +1,220 @@
+#include "cec_simulator.hpp"
+#include "i2c_comm_lib.hpp"
+
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+using namespace std::chrono;
+
+/** @brief A simulated CEC, the adapter it sits behind, the pages written
+ *  before their status is read, and the largest page */
+struct Configuration
+{
+    std::string name;
+    CecSimulator::Latency latency;
+    uint8_t minor;
+    size_t maxLength;
+    uint8_t window;
+    uint16_t maxBlockSize = 128;
+};
+
+/** @brief Time an operation, in nanoseconds per call */
+template <typename Operation>
+double timeOperation(size_t iterations, Operation&& operation)
+{
+    auto start = steady_clock::now();
+    for (size_t i = 0; i < iterations; i++)
+    {
+        operation();
+    }
+    duration<double, std::nano> elapsed = steady_clock::now() - start;
+    return elapsed.count() / iterations;
+}
+
+/** @brief Time the checksum and the OTA header parser */
+void runMicrobenchmarks(const std::string& dir)
+{
+    volatile uint32_t sink = 0;
+
+    std::cout << std::left << std::setw(32) << "Checksum" << std::right
+              << std::setw(14) << "Bytewise ns" << std::setw(14)
+              << "Wordwise ns" << "\n";
+    for (size_t size : {11, 139, 1024, 65536})
+    {
+        std::vector<uint8_t> data(size);
+        std::iota(data.begin(), data.end(), 0);
+        size_t iterations = (1 << 26) / size;
+        auto bytewise = timeOperation(iterations, [&]() {
+            sink = sink + (std::accumulate(data.begin(), data.end(), 0) & 0xff);
+        });
+        auto wordwise = timeOperation(iterations, [&]() {
+            sink = sink + I2CCommLib::Checksum(data.data(), data.size());
+        });
+        std::cout << std::left << std::setw(32)
+                  << (std::to_string(size) + " bytes") << std::right
+                  << std::fixed << std::setprecision(1) << std::setw(14)
+                  << bytewise << std::setw(14) << wordwise << "\n";
+    }
+
+    // Two images, read in turn to miss the cache
+    std::vector<std::string> images;
+    for (auto name : {"/ota1.bin", "/ota2.bin"})
+    {
+        std::vector<uint8_t> data(64 * 1024);
+        data[0xE9] = 0x10;
+        images.push_back(dir + name);
+        std::ofstream(images.back(), std::ios::binary)
+            .write(reinterpret_cast<const char*>(data.data()), data.size());
+    }
+    size_t next = 0;
+    auto parsed = timeOperation(10000, [&]() {
+        sink = sink + I2CCommLib::ReadOtaHeader(images[next++ % 2]).imageSize;
+    });
+    auto cached = timeOperation(10000, [&]() {
+        sink = sink + I2CCommLib::ReadOtaHeader(images[0]).imageSize;
+    });
+    std::cout << std::left << std::setw(32) << "OTA header" << std::right
+              << std::setw(14) << "Parsed ns" << std::setw(14) << "Cached ns"
+              << "\n"
+              << std::left << std::setw(32) << "64 KiB .bin" << std::right
+              << std::setw(14) << parsed << std::setw(14) << cached
+              << "\n\n";
+}
+
+/** @brief Time attestations, signed by the CEC and answered from the
+ *  cache */
+void runAttestationBenchmark()
+{
+    CecSimulator::Latency latency;
+    I2CCommLib deviceLayer(std::make_unique<CecSimulator>(latency));
+    std::vector<uint8_t> nonce(32);
+    uint8_t next = 0;
+    auto signedByCec = timeOperation(20, [&]() {
+        nonce[0] = next++;
+        deviceLayer.Attest(nonce, "");
+    });
+    auto cached = timeOperation(20, [&]() { deviceLayer.Attest(nonce, ""); });
+    std::cout << "\n"
+              << std::left << std::setw(32) << "Attestation" << std::right
+              << std::setw(14) << "Signed ms" << std::setw(14) << "Cached ms"
+              << "\n"
+              << std::left << std::setw(32)
+              << (std::to_string(latency.sign.count()) + " ms to sign")
+              << std::right << std::fixed << std::setprecision(3)
+              << std::setw(14) << signedByCec / 1e6 << std::setw(14)
+              << cached / 1e6 << "\n";
+}
+
+int main(int argc, char** argv)
+{
+    // The image size in KiB
+    size_t size = (argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 32) * 1024;
+
+    char dir[] = "/tmp/cec_benchmarkXXXXXX";
+    if (!mkdtemp(dir))
+    {
+        std::cerr << "Failed to create the image directory\n";
+        return 1;
+    }
+    std::string file = std::string(dir) + "/image.bin";
+    std::vector<uint8_t> image(size);
+    std::iota(image.begin(), image.end(), 0);
+    std::ofstream(file, std::ios::binary)
+        .write(reinterpret_cast<const char*>(image.data()), image.size());
+
+    runMicrobenchmarks(dir);
+
+    CecSimulator::Latency fast;
+    CecSimulator::Latency slowBus = fast;
+    slowBus.perByte = nanoseconds(90000);
+    CecSimulator::Latency slowFlash = fast;
+    slowFlash.perPage = microseconds(5000);
+
+    // The simulator buffers the pages of a window from 1.1 on
+    const std::vector<Configuration> configurations = {
+        {"400 kHz, 1.0", fast, 0, UINT8_MAX, 1},
+        {"400 kHz, 1.1", fast, 1, UINT8_MAX, 1},
+        {"400 kHz, 1.1", fast, 1, UINT8_MAX, 8},
+        {"400 kHz, 1.1, 75 byte adapter", fast, 1, 75, 8},
+        {"400 kHz, 1.1, 240 byte pages", fast, 1, UINT8_MAX, 8, 240},
+        {"100 kHz, 1.0", slowBus, 0, UINT8_MAX, 1},
+        {"100 kHz, 1.1", slowBus, 1, UINT8_MAX, 1},
+        {"100 kHz, 1.1", slowBus, 1, UINT8_MAX, 8},
+        {"400 kHz, 1.0, slow flash", slowFlash, 0, UINT8_MAX, 1},
+        {"400 kHz, 1.1, slow flash", slowFlash, 1, UINT8_MAX, 1},
+        {"400 kHz, 1.1, slow flash", slowFlash, 1, UINT8_MAX, 8},
+    };
+
+    std::cout << std::left << std::setw(32) << "Configuration" << std::right
+              << std::setw(7) << "Window" << std::setw(7) << "Block"
+              << std::setw(10) << "Copy s"
+              << std::setw(10) << "Flow s" << std::setw(10) << "KB/s"
+              << std::setw(14) << "Transactions" << "\n";
+
+    int ret = 0;
+    for (const auto& configuration : configurations)
+    {
+        auto simulator = std::make_unique<CecSimulator>(
+            configuration.latency, 1, configuration.minor,
+            configuration.maxLength);
+        auto& cec = *simulator;
+        I2CCommLib deviceLayer(std::move(simulator));
+        I2CCommLib::StatusPolling polling;
+        // The settle delay is a fixed wait, and would hide the transfer.
+        polling.settleDelay = milliseconds(0);
+        polling.window = configuration.window;
+        polling.maxBlockSize = configuration.maxBlockSize;
+        deviceLayer.SetStatusPolling(polling);
+        deviceLayer.SetCheckpointFile(std::string(dir) + "/checkpoint");
+
+        try
+        {
+            auto start = steady_clock::now();
+            RunUpdateFlow(deviceLayer, file, size);
+            duration<double> flow = steady_clock::now() - start;
+            if (cec.image != image)
+            {
+                throw std::runtime_error("The CEC got another image");
+            }
+
+            const auto& stats = deviceLayer.GetTransferStats();
+            std::cout << std::left << std::setw(32) << configuration.name
+                      << std::right << std::setw(7)
+                      << static_cast<int>(configuration.window) << std::setw(7)
+                      << stats.blockSize
+                      << std::fixed << std::setprecision(3) << std::setw(10)
+                      << double(size) / stats.bytesPerSecond << std::setw(10)
+                      << flow.count() << std::setprecision(1) << std::setw(10)
+                      << stats.bytesPerSecond / 1000.0 << std::setw(14)
+                      << cec.transactions << "\n";
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << configuration.name << ": " << e.what() << "\n";
+            ret = 1;
+        }
+    }
+
+    try
+    {
+        runAttestationBenchmark();
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Attestation: " << e.what() << "\n";
+        ret = 1;
+    }
+
+    fs::remove_all(dir);
+    return ret;
+}
@@ -0,0 +1,448 @@
+#pragma once
+
+#include "i2c_comm_lib.hpp"
+#include "i2c_interface.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <numeric>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using phosphor::software::updater::I2CCommLib;
+using phosphor::software::updater::I2CException;
+using phosphor::software::updater::I2CInterface;
+
+/** @class CecSimulator
+ *
+ *  @brief A CEC in userspace, speaking its register protocol
+ *
+ *  Commands are written to register 0x03 and verified like the CEC does,
+ *  the command status is read from 0x04, the update status from 0x05 and
+ *  the interrupt from 0x08. The image pages take time to process, and the
+ *  CEC reports busy until they are done. From version 1.1 the pages are
+ *  buffered, and the first failed one latched until the status is read.
+ *  A page longer than the CEC takes is rejected, and so is every page
+ *  after it until a new StartFWUpdate.
+ *  An attestation is signed while the CEC reports busy, then read from
+ *  0x06 in blocks. Faults of the bus and the CEC can be injected by the
+ *  index of the command status read.
+ */
+class CecSimulator : public I2CInterface
+{
+  public:
+    using CommandStatus = I2CCommLib::CommandStatus;
+    using FirmwareUpdateStatus = I2CCommLib::FirmwareUpdateStatus;
+    using CECInterruptStatus = I2CCommLib::CECInterruptStatus;
+
+    /** @struct Latency
+     *  @brief How long the bus and the CEC take.
+     */
+    struct Latency
+    {
+        /** @brief The bus time of a byte, 400 kHz by default */
+        std::chrono::nanoseconds perByte{22500};
+        /** @brief The time to program a page */
+        std::chrono::microseconds perPage{1000};
+        /** @brief The time to verify and apply the image */
+        std::chrono::milliseconds update{10};
+        /** @brief The time to sign an attestation */
+        std::chrono::milliseconds sign{20};
+    };
+
+    explicit CecSimulator(const Latency& latency, uint8_t major = 1,
+                          uint8_t minor = 0, size_t maxLength = UINT8_MAX) :
+        latency(latency),
+        maxLength(maxLength), major(major), minor(minor)
+    {}
+
+    void open() override
+    {
+        opened = true;
+        opens++;
+    }
+
+    bool isOpen() const override
+    {
+        return opened;
+    }
+
+    void close() override
+    {
+        opened = false;
+    }
+
+    void readCustom(uint8_t addr, uint8_t& size, uint8_t* result) override
+    {
+        transfer(size);
+        read(addr, size, result);
+    }
+
+    void writeCustom(uint8_t /*addr*/, uint8_t size, uint8_t* data) override
+    {
+        transfer(size);
+        write(size, data);
+    }
+
+    size_t maxWriteLength() override
+    {
+        return maxLength;
+    }
+
+    /** @brief How long the bus and the CEC take */
+    Latency latency;
+
+    /** @brief The longest write the adapter takes */
+    size_t maxLength;
+
+    /** @brief The longest image page the CEC takes */
+    size_t maxPage = UINT8_MAX;
+
+    /** @brief The status read reporting a checksum error, none if
+     *  negative */
+    int checksumErrorAt = -1;
+
+    /** @brief The status read failing on the bus, none if negative */
+    int failStatusReadAt = -1;
+
+    /** @brief The status reads reporting busy, besides the pages being
+     *  processed */
+    std::set<int> busyReads;
+
+    /** @brief Fail the next read on the bus */
+    bool failNextRead = false;
+
+    /** @brief The image the CEC got */
+    std::vector<uint8_t> image;
+
+    /** @brief The length of each image page written, taken or not */
+    std::vector<size_t> pageSizes;
+
+    /** @brief The page writes and status reads in order, P and S */
+    std::string events;
+
+    /** @brief The command status reads */
+    int statusReads = 0;
+
+    /** @brief The time from the last page written to each status read */
+    std::vector<std::chrono::steady_clock::duration> statusDelays;
+
+    /** @brief The pages written after a status read reported busy */
+    int writesWhileBusy = 0;
+
+    /** @brief The times the device was opened */
+    int opens = 0;
+
+    /** @brief The image size of the last StartFWUpdate */
+    uint32_t imageSize = 0;
+
+    /** @brief The StartFWUpdate commands taken */
+    int starts = 0;
+
+    /** @brief The transactions on the bus */
+    int transactions = 0;
+
+    /** @brief Signs the attestation data into the raw r and s, zeroes if
+     *  unset */
+    std::function<std::vector<uint8_t>(const std::vector<uint8_t>& data)> sign;
+
+    /** @brief The attestation commands taken */
+    int attestations = 0;
+
+  private:
+    static constexpr uint8_t WR_DEVICE_REG{0x03};
+    static constexpr uint8_t FIRMWARE_VERSION_REG{0x01};
+    static constexpr uint8_t RD_CMD_STATUS_REG{0x04};
+    static constexpr uint8_t RD_FW_UPDATE_REG{0x05};
+    static constexpr uint8_t RD_QUERY_INTERRUPT_REG{0x08};
+    static constexpr uint8_t CHALLENGE_RESPONSE_REG{0x06};
+    static constexpr uint8_t START_FW_UPDATE_CMD{0x00};
+    static constexpr uint8_t COPY_IMG_COMPLETE_CMD{0x01};
+    static constexpr uint8_t ATTESTATION_CMD{0x02};
+    static constexpr size_t COMMAND_HEADER_SIZE{11};
+    static constexpr size_t NONCE_SIZE{32};
+    static constexpr size_t SIGNATURE_SIZE{96};
+
+    /** @brief The bus is busy for the bytes of a transaction */
+    void transfer(size_t bytes)
+    {
+        transactions++;
+        std::this_thread::sleep_for(latency.perByte * (bytes + 1));
+    }
+
+    /** @brief Fill a register, with the checksum of its bytes first */
+    static void fill(uint8_t* result, uint8_t size,
+                     std::initializer_list<uint8_t> bytes)
+    {
+        std::fill(result, result + size, 0);
+        std::copy_n(bytes.begin(), std::min<size_t>(bytes.size(), size - 1),
+                    result + 1);
+        result[0] = std::accumulate(result + 1, result + size, 0) & 0xff;
+    }
+
+    void read(uint8_t reg, uint8_t size, uint8_t* result)
+    {
+        if (failNextRead)
+        {
+            failNextRead = false;
+            throw I2CException("Simulated failure", "simulator", reg, EIO);
+        }
+        auto now = std::chrono::steady_clock::now();
+        switch (reg)
+        {
+            case FIRMWARE_VERSION_REG:
+                fill(result, size, {major, minor});
+                break;
+            case RD_CMD_STATUS_REG:
+            {
+                events += 'S';
+                statusDelays.push_back(now - pageWritten);
+                auto index = statusReads++;
+                // The status stays latched for the next read
+                if (index == failStatusReadAt)
+                {
+                    throw I2CException("Simulated failure", "simulator", reg,
+                                       EIO);
+                }
+                auto status = latched;
+                if (status == CommandStatus::SUCCESS &&
+                    index == checksumErrorAt)
+                {
+                    status = CommandStatus::ERR_I2C_CHECKSUM;
+                }
+                else if (status == CommandStatus::SUCCESS &&
+                         (now < busyUntil || busyReads.contains(index)))
+                {
+                    status = CommandStatus::ERR_BUSY;
+                }
+                busy = status == CommandStatus::ERR_BUSY;
+                latched = CommandStatus::SUCCESS;
+                fill(result, size,
+                     {lastCommand, 0, static_cast<uint8_t>(status)});
+                break;
+            }
+            case RD_FW_UPDATE_REG:
+            {
+                auto status = updateStatus;
+                if (status == FirmwareUpdateStatus::STATUS_UPDATE_IN_PROGRESS &&
+                    now >= updateDone)
+                {
+                    status = updateStatus =
+                        FirmwareUpdateStatus::STATUS_UPDATE_FINISH;
+                }
+                uint8_t progress = imageSize ? image.size() * 100 / imageSize
+                                             : 0;
+                fill(result, size, {progress, static_cast<uint8_t>(status)});
+                break;
+            }
+            case RD_QUERY_INTERRUPT_REG:
+                fill(result, size, {static_cast<uint8_t>(interrupt)});
+                break;
+            case CHALLENGE_RESPONSE_REG:
+                if (response.size() - responseSent < size - 1u)
+                {
+                    throw I2CException("Read past the response", "simulator",
+                                       reg, EIO);
+                }
+                std::copy_n(response.begin() + responseSent, size - 1,
+                            result + 1);
+                responseSent += size - 1;
+                result[0] = std::accumulate(result + 1, result + size, 0) &
+                            0xff;
+                break;
+            default:
+                throw I2CException("Unknown register", "simulator", reg,
+                                   ENXIO);
+        }
+    }
+
+    /** @brief Take a write, which starts with the register */
+    void write(uint8_t size, uint8_t* data)
+    {
+        if (size < COMMAND_HEADER_SIZE || data[0] != 0 ||
+            data[1] != WR_DEVICE_REG)
+        {
+            throw I2CException("Invalid write", "simulator", WR_DEVICE_REG,
+                               EINVAL);
+        }
+
+        auto checksum = std::accumulate(data + 3, data + size, 0) & 0xff;
+        uint32_t length = (data[7] << 24) | (data[8] << 16) | (data[9] << 8) |
+                          data[10];
+        lastCommand = data[5];
+        if (data[2] != checksum)
+        {
+            fail(CommandStatus::ERR_I2C_CHECKSUM);
+        }
+        else if (data[3] != 1)
+        {
+            fail(CommandStatus::ERR_CMD_VERSION_SUPPORTED);
+        }
+        else if (length != size - COMMAND_HEADER_SIZE)
+        {
+            fail(CommandStatus::ERR_CMD_LENGTH_MISMATCH);
+        }
+        else if (lastCommand == START_FW_UPDATE_CMD)
+        {
+            imageSize = (data[13] << 24) | (data[14] << 16) |
+                        (data[15] << 8) | data[16];
+            starts++;
+            dropped = false;
+            image.clear();
+            updateStatus = FirmwareUpdateStatus::STATUS_UPDATE_INIT;
+            interrupt = CECInterruptStatus::UNKNOWN;
+        }
+        else if (lastCommand == ATTESTATION_CMD &&
+                 length == NONCE_SIZE + 2)
+        {
+            attest(data + COMMAND_HEADER_SIZE + 2);
+        }
+        else if (lastCommand == COPY_IMG_COMPLETE_CMD && length > 0)
+        {
+            events += 'P';
+            pageWritten = std::chrono::steady_clock::now();
+            pageSizes.push_back(length);
+            writesWhileBusy += busy;
+            if (length > maxPage)
+            {
+                dropped = true;
+                fail(CommandStatus::ERR_CMD_LENGTH_MISMATCH);
+                return;
+            }
+            if (dropped)
+            {
+                fail(CommandStatus::ERR_CMD_INVALID);
+                return;
+            }
+            // Before 1.1 a page is only taken once the last one is done.
+            auto now = std::chrono::steady_clock::now();
+            if (major == 1 && minor == 0 && now < busyUntil)
+            {
+                std::this_thread::sleep_until(busyUntil);
+                now = busyUntil;
+            }
+            image.insert(image.end(), data + COMMAND_HEADER_SIZE, data + size);
+            busyUntil = std::max(busyUntil, now) + latency.perPage;
+        }
+        else if (lastCommand == COPY_IMG_COMPLETE_CMD)
+        {
+            if (image.size() != imageSize)
+            {
+                updateStatus = FirmwareUpdateStatus::STATUS_ERR_FIRMWARE_HEADER;
+                interrupt = CECInterruptStatus::BMC_FW_UPDATE_FAIL;
+                return;
+            }
+            updateStatus = FirmwareUpdateStatus::STATUS_UPDATE_IN_PROGRESS;
+            updateDone = std::max(busyUntil, std::chrono::steady_clock::now()) +
+                         latency.update;
+            interrupt = CECInterruptStatus::BMC_FW_UPDATE_REQUEST_RESET_LATER;
+        }
+        else
+        {
+            fail(CommandStatus::ERR_CMD_INVALID);
+        }
+    }
+
+    /** @brief Sign the nonce and the measurements, which are read after
+     *  the CEC is no longer busy */
+    void attest(const uint8_t* nonce)
+    {
+        attestations++;
+        response.assign(nonce, nonce + NONCE_SIZE);
+        response.resize(I2CCommLib::ATTESTATION_PAYLOAD_SIZE - SIGNATURE_SIZE);
+        std::iota(response.begin() + NONCE_SIZE, response.end(), 0);
+        auto signature = sign ? sign(response)
+                              : std::vector<uint8_t>(SIGNATURE_SIZE);
+        response.insert(response.end(), signature.begin(), signature.end());
+        responseSent = 0;
+        busyUntil = std::max(busyUntil, std::chrono::steady_clock::now()) +
+                    latency.sign;
+    }
+
+    /** @brief Latch the first failure until the status is read */
+    void fail(CommandStatus status)
+    {
+        if (latched == CommandStatus::SUCCESS)
+        {
+            latched = status;
+        }
+    }
+
+    uint8_t major;
+    uint8_t minor;
+    bool opened = false;
+    /** @brief Whether the last status read reported busy */
+    bool busy = false;
+    /** @brief Whether a page was rejected since the last StartFWUpdate */
+    bool dropped = false;
+    uint8_t lastCommand = 0;
+    CommandStatus latched = CommandStatus::SUCCESS;
+    FirmwareUpdateStatus updateStatus = FirmwareUpdateStatus::STATUS_CODE_OTHER;
+    CECInterruptStatus interrupt = CECInterruptStatus::UNKNOWN;
+    std::chrono::steady_clock::time_point busyUntil;
+    std::chrono::steady_clock::time_point pageWritten;
+    std::vector<uint8_t> response;
+    size_t responseSent = 0;
+    std::chrono::steady_clock::time_point updateDone;
+};
+
+/** @brief Run the commands of the PrisStateMachine states, without the
+ *  D-Bus objects around them
+ *
+ *  @param[in] deviceLayer - The CEC
+ *  @param[in] file - The image
+ *  @param[in] size - The size of the image
+ *
+ *  @return The firmware update status after the copy, once it is no longer
+ *          in progress
+ */
+inline uint8_t RunUpdateFlow(I2CCommLib& deviceLayer, std::string file,
+                             uint32_t size)
+{
+    using CommandStatus = I2CCommLib::CommandStatus;
+    using FirmwareUpdateStatus = I2CCommLib::FirmwareUpdateStatus;
+
+    // StateCheckCECStatus
+    if (deviceLayer.GetCECState() !=
+        static_cast<uint8_t>(CommandStatus::SUCCESS))
+    {
+        throw std::runtime_error("The CEC is not ready");
+    }
+
+    // StateStartFwUpdate, unless the copy can resume
+    if (!deviceLayer.CanResumeImage(file, size))
+    {
+        deviceLayer.SendStartFWUpdate(size);
+        if (deviceLayer.GetLastCmdStatus() !=
+            static_cast<uint8_t>(CommandStatus::SUCCESS))
+        {
+            throw std::runtime_error("The CEC failed StartFWUpdate");
+        }
+    }
+
+    // StateCopyImage
+    deviceLayer.SendImageToCEC(file, size);
+
+    // StateSendCopyComplete
+    deviceLayer.SendCopyImageComplete();
+    if (deviceLayer.GetLastCmdStatus() !=
+        static_cast<uint8_t>(CommandStatus::SUCCESS))
+    {
+        throw std::runtime_error("The CEC failed CopyImageComplete");
+    }
+
+    // StateCheckUpdateStatus, on the interrupt of the CEC
+    uint8_t status;
+    while ((status = deviceLayer.GetFWUpdateStatus()) ==
+           static_cast<uint8_t>(
+               FirmwareUpdateStatus::STATUS_UPDATE_IN_PROGRESS))
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return status;
+}
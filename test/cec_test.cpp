@@ -0,0 +1,592 @@
+#include "cec_simulator.hpp"
+#include "i2c_comm_lib.hpp"
+
+#include <openssl/ec.h>
+#include <openssl/pem.h>
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace fs = std::filesystem;
+using phosphor::software::updater::I2CCommLib;
+
+class CecTest : public testing::Test
+{
+  protected:
+    void SetUp() override
+    {
+        char dir[] = "./cecXXXXXX";
+        path = mkdtemp(dir);
+
+        writeImage(3 * 128 + 10);
+
+        polling.initialDelay = std::chrono::milliseconds(1);
+        polling.maxDelay = std::chrono::milliseconds(20);
+        polling.pageTimeout = std::chrono::milliseconds(100);
+        polling.settleDelay = std::chrono::milliseconds(0);
+    }
+
+    void TearDown() override
+    {
+        fs::remove_all(path);
+    }
+
+    void writeImage(size_t size)
+    {
+        image.resize(size);
+        std::iota(image.begin(), image.end(), 0);
+        file = path + "/image.bin";
+        std::ofstream(file, std::ios::binary)
+            .write(reinterpret_cast<const char*>(image.data()), image.size());
+    }
+
+    /** @brief A CEC that takes no time, behind an adapter taking pages of
+     *  up to 128 bytes */
+    static std::unique_ptr<CecSimulator> makeCec()
+    {
+        CecSimulator::Latency latency;
+        latency.perByte = std::chrono::nanoseconds(0);
+        latency.perPage = std::chrono::microseconds(0);
+        latency.update = std::chrono::milliseconds(0);
+        latency.sign = std::chrono::milliseconds(0);
+        return std::make_unique<CecSimulator>(latency, 1, 0, 11 + 128);
+    }
+
+    std::string path;
+    std::string file;
+    std::vector<uint8_t> image;
+    I2CCommLib::StatusPolling polling;
+};
+
+/** @brief Test that an image is sent over one handle, with the status of
+ *  each page read before the next one is written
+ */
+TEST_F(CecTest, TestImageTransfer)
+{
+    auto simulator = makeCec();
+    auto& cec = *simulator;
+    I2CCommLib lib(std::move(simulator));
+    lib.SetStatusPolling(polling);
+
+    lib.SendImageToCEC(file, image.size());
+    EXPECT_EQ(cec.image, image);
+    EXPECT_EQ(cec.opens, 1);
+    // Stop-and-wait by default, each page then its status
+    EXPECT_EQ(cec.transactions, 4 + 4);
+    EXPECT_EQ(cec.events, "PSPSPSPS");
+}
+
+/** @brief Test that the status of a busy page is polled until the CEC is
+ *  done with it before the next page is written, that the wait recovers
+ *  after it, and that a page busy for longer than the timeout fails the
+ *  transfer
+ */
+TEST_F(CecTest, TestBusyPolling)
+{
+    auto simulator = makeCec();
+    auto& cec = *simulator;
+    I2CCommLib lib(std::move(simulator));
+    lib.SetStatusPolling(polling);
+
+    // The second page is busy for two reads, the last one for three
+    cec.busyReads = {1, 2, 5, 6, 7};
+    lib.SendImageToCEC(file, image.size());
+    EXPECT_EQ(cec.image, image);
+    EXPECT_EQ(cec.statusReads, 4 + 2 + 3);
+    EXPECT_EQ(cec.writesWhileBusy, 0);
+
+    // The wait after a page backs off after a busy one, and shrinks back
+    // once the pages are done within it
+    writeImage(20 * 128);
+    cec.image.clear();
+    cec.statusReads = 0;
+    cec.statusDelays.clear();
+    cec.busyReads = {1};
+    polling.initialDelay = std::chrono::milliseconds(5);
+    lib.SetStatusPolling(polling);
+    lib.SendImageToCEC(file, image.size());
+    EXPECT_EQ(cec.image, image);
+    ASSERT_EQ(cec.statusDelays.size(), 20 + 1);
+    EXPECT_GE(cec.statusDelays[3], 2 * polling.initialDelay);
+    EXPECT_LT(cec.statusDelays.back(), polling.initialDelay * 3 / 2);
+    polling.initialDelay = std::chrono::milliseconds(1);
+    lib.SetStatusPolling(polling);
+
+    cec.image.clear();
+    cec.busyReads.clear();
+    cec.latency.perPage = std::chrono::hours(1);
+    auto start = std::chrono::steady_clock::now();
+    EXPECT_THROW(lib.SendImageToCEC(file, image.size()), std::runtime_error);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    EXPECT_EQ(cec.image.size(), 128);
+    EXPECT_EQ(cec.writesWhileBusy, 0);
+    EXPECT_GE(elapsed, polling.pageTimeout);
+    EXPECT_LT(elapsed, polling.pageTimeout + 5 * polling.maxDelay);
+}
+
+/** @brief Test that pages go in windows when configured, with the status
+ *  read after each window, falling back to stop-and-wait when the CEC
+ *  stays busy
+ */
+TEST_F(CecTest, TestWindow)
+{
+    writeImage(20 * 128);
+    auto simulator = makeCec();
+    auto& cec = *simulator;
+    I2CCommLib lib(std::move(simulator));
+    polling.window = 4;
+    lib.SetStatusPolling(polling);
+
+    lib.SendImageToCEC(file, image.size());
+    EXPECT_EQ(cec.image, image);
+    EXPECT_EQ(cec.events, "PPPPS"
+                          "PPPPS"
+                          "PPPPS"
+                          "PPPPS"
+                          "PPPPS");
+
+    // Busy after two windows in a row, each polled until it is done
+    cec.image.clear();
+    cec.events.clear();
+    cec.statusReads = 0;
+    cec.busyReads = {1, 3};
+    lib.SendImageToCEC(file, image.size());
+    EXPECT_EQ(cec.image, image);
+    EXPECT_EQ(cec.events, "PPPPS"
+                          "PPPPSS"
+                          "PPPPSS"
+                          "PSPSPSPSPSPSPSPS");
+    EXPECT_EQ(cec.writesWhileBusy, 0);
+}
+
+/** @brief Test that the block size fits the adapter and the CEC, stays
+ *  within the 128 bytes of the protocol unless configured, and steps down
+ *  after a checksum error until clean transfers step it back up
+ */
+TEST_F(CecTest, TestBlockSize)
+{
+    auto simulator = makeCec();
+    auto& cec = *simulator;
+    I2CCommLib lib(std::move(simulator));
+    lib.SetStatusPolling(polling);
+
+    cec.maxLength = 11 + 100;
+    lib.SendImageToCEC(file, image.size());
+    EXPECT_EQ(cec.image, image);
+    EXPECT_EQ(cec.pageSizes, (std::vector<size_t>{64, 64, 64, 64, 64, 64, 10}));
+    EXPECT_EQ(lib.GetTransferStats().blockSize, 64);
+    EXPECT_GT(lib.GetTransferStats().bytesPerSecond, 0);
+
+    auto send = [&]() {
+        cec.image.clear();
+        cec.pageSizes.clear();
+        cec.statusReads = 0;
+        lib.SendImageToCEC(file, image.size());
+        EXPECT_EQ(cec.image, image);
+        return cec.pageSizes;
+    };
+    cec.maxLength = UINT8_MAX;
+    cec.maxPage = 192;
+    EXPECT_EQ(send(), (std::vector<size_t>{128, 128, 128, 10}));
+    EXPECT_EQ(cec.starts, 0);
+
+    // The CEC drops the first page longer than it takes, and the update
+    // starts over in shorter pages
+    polling.maxBlockSize = 240;
+    lib.SetStatusPolling(polling);
+    EXPECT_EQ(send(), (std::vector<size_t>{240, 192, 192, 10}));
+    EXPECT_EQ(cec.starts, 1);
+    EXPECT_EQ(lib.GetTransferStats().blockSize, 192);
+    EXPECT_EQ(send(), (std::vector<size_t>{192, 192, 10}));
+    EXPECT_EQ(cec.starts, 1);
+
+    cec.image.clear();
+    cec.statusReads = 0;
+    cec.checksumErrorAt = 1;
+    EXPECT_THROW(lib.SendImageToCEC(file, image.size()), std::runtime_error);
+    cec.checksumErrorAt = -1;
+    EXPECT_EQ(lib.GetTransferStats().blockSize, 192);
+    EXPECT_EQ(send(), (std::vector<size_t>{128, 128, 128, 10}));
+    EXPECT_EQ(send(), (std::vector<size_t>{128, 128, 128, 10}));
+    EXPECT_EQ(send(), (std::vector<size_t>{128, 128, 128, 10}));
+    // Up to the limit of the CEC after three clean transfers
+    EXPECT_EQ(send(), (std::vector<size_t>{192, 192, 10}));
+
+    std::string stats = path + "/stats";
+    I2CCommLib::WriteTransferStats(stats, lib.GetTransferStats());
+    EXPECT_EQ(I2CCommLib::ReadTransferStats(stats).blockSize, 192);
+    EXPECT_EQ(I2CCommLib::ReadTransferStats(path + "/missing").blockSize, 0);
+
+    cec.maxLength = 11 + 31;
+    EXPECT_THROW(lib.SendImageToCEC(file, image.size()), std::runtime_error);
+}
+
+/** @brief Test that the pages are read from the file as they are sent */
+TEST_F(CecTest, TestImageFile)
+{
+    auto simulator = makeCec();
+    auto& cec = *simulator;
+    I2CCommLib lib(std::move(simulator));
+    lib.SetStatusPolling(polling);
+
+    // Only the given size is sent
+    lib.SendImageToCEC(file, image.size() - 1);
+    image.pop_back();
+    EXPECT_EQ(cec.image, image);
+
+    std::string rom = path + "/image.rom";
+    fs::rename(file, rom);
+    cec.image.clear();
+    lib.SendImageToCEC(rom, image.size());
+    EXPECT_EQ(cec.image, image);
+
+    EXPECT_THROW(lib.SendImageToCEC(rom, image.size() + 2),
+                 std::runtime_error);
+    EXPECT_THROW(lib.SendImageToCEC(file, image.size()), std::runtime_error);
+}
+
+/** @brief Test that the handle is reopened after a failed transaction */
+TEST_F(CecTest, TestReopen)
+{
+    auto simulator = makeCec();
+    auto& cec = *simulator;
+    I2CCommLib lib(std::move(simulator));
+
+    EXPECT_EQ(lib.GetCECState(), 0);
+    EXPECT_EQ(lib.GetLastCmdStatus(), 0);
+    EXPECT_EQ(cec.opens, 1);
+
+    cec.failNextRead = true;
+    EXPECT_THROW(lib.GetCECState(), std::runtime_error);
+    EXPECT_FALSE(cec.isOpen());
+
+    EXPECT_EQ(lib.GetCECState(), 0);
+    EXPECT_EQ(cec.opens, 2);
+}
+
+/** @brief Test that a failed transfer resumes with the page after the last
+ *  one the CEC got, and restarts only with a new update
+ */
+TEST_F(CecTest, TestResume)
+{
+    auto simulator = makeCec();
+    auto& cec = *simulator;
+    I2CCommLib lib(std::move(simulator));
+    lib.SetStatusPolling(polling);
+    std::string checkpoint = path + "/checkpoint";
+    lib.SetCheckpointFile(checkpoint);
+
+    // The status read before the third page fails, so two pages are sent
+    cec.failStatusReadAt = 1;
+    EXPECT_THROW(lib.SendImageToCEC(file, image.size()), std::runtime_error);
+    EXPECT_EQ(cec.pageSizes.size(), 2);
+    EXPECT_TRUE(fs::exists(checkpoint));
+    EXPECT_TRUE(lib.CanResumeImage(file, image.size()));
+    EXPECT_FALSE(lib.CanResumeImage(file, image.size() - 1));
+
+    lib.SendImageToCEC(file, image.size());
+    EXPECT_EQ(cec.image, image);
+    EXPECT_EQ(cec.pageSizes.size(), 4);
+    EXPECT_FALSE(fs::exists(checkpoint));
+
+    // Another process resumes in the pages of the checkpoint
+    cec.image.clear();
+    cec.pageSizes.clear();
+    cec.statusReads = 0;
+    cec.maxLength = 11 + 64;
+    cec.failStatusReadAt = 1;
+    EXPECT_THROW(lib.SendImageToCEC(file, image.size()), std::runtime_error);
+    {
+        auto next = makeCec();
+        auto& nextCec = *next;
+        I2CCommLib nextLib(std::move(next));
+        nextLib.SetStatusPolling(polling);
+        nextLib.SetCheckpointFile(checkpoint);
+        EXPECT_TRUE(nextLib.CanResumeImage(file, image.size()));
+        nextLib.SendImageToCEC(file, image.size());
+        EXPECT_EQ(nextCec.pageSizes,
+                  (std::vector<size_t>{64, 64, 64, 64, 10}));
+        cec.image.insert(cec.image.end(), nextCec.image.begin(),
+                            nextCec.image.end());
+        EXPECT_EQ(cec.image, image);
+    }
+    cec.maxLength = 11 + 128;
+
+    // A checkpoint of another image is not resumed
+    cec.image.clear();
+    cec.statusReads = 0;
+    EXPECT_THROW(lib.SendImageToCEC(file, image.size()), std::runtime_error);
+    cec.failStatusReadAt = -1;
+    writeImage(image.size() + 1);
+    EXPECT_FALSE(lib.CanResumeImage(file, image.size()));
+    EXPECT_THROW(lib.SendImageToCEC(file, image.size()), std::runtime_error);
+    EXPECT_TRUE(fs::exists(checkpoint));
+
+    lib.SendStartFWUpdate(image.size(), 0);
+    EXPECT_FALSE(fs::exists(checkpoint));
+    cec.image.clear();
+    lib.SendImageToCEC(file, image.size());
+    EXPECT_EQ(cec.image, image);
+}
+
+/** @brief Test that the page callback reports the bytes sent, and cancels
+ *  the transfer
+ */
+TEST_F(CecTest, TestPageCallback)
+{
+    auto simulator = makeCec();
+    auto& cec = *simulator;
+    I2CCommLib lib(std::move(simulator));
+    lib.SetStatusPolling(polling);
+    lib.SetCheckpointFile(path + "/checkpoint");
+
+    std::vector<uint32_t> sent;
+    lib.SetPageCallback([&sent](uint32_t bytes, uint32_t size) {
+        EXPECT_EQ(size, 3 * 128 + 10);
+        sent.push_back(bytes);
+        return bytes < 2 * 128;
+    });
+    EXPECT_THROW(lib.SendImageToCEC(file, image.size()), std::runtime_error);
+    EXPECT_EQ(sent, (std::vector<uint32_t>{128, 256}));
+
+    lib.SetPageCallback([&sent](uint32_t bytes, uint32_t) {
+        sent.push_back(bytes);
+        return true;
+    });
+    lib.SendImageToCEC(file, image.size());
+    EXPECT_EQ(sent, (std::vector<uint32_t>{128, 256, 384, 394}));
+    EXPECT_EQ(cec.image, image);
+}
+
+/** @brief Test the update flow against the simulated CEC */
+TEST_F(CecTest, TestSimulatedUpdate)
+{
+    using Status = I2CCommLib::FirmwareUpdateStatus;
+    for (uint8_t minor : {0, 1})
+    {
+        CecSimulator::Latency latency;
+        latency.perByte = std::chrono::nanoseconds(0);
+        latency.perPage = std::chrono::microseconds(200);
+        auto simulator = std::make_unique<CecSimulator>(latency, 1, minor);
+        auto& cec = *simulator;
+        I2CCommLib lib(std::move(simulator));
+        lib.SetStatusPolling(polling);
+        lib.SetCheckpointFile(path + "/checkpoint");
+
+        EXPECT_EQ(RunUpdateFlow(lib, file, image.size()),
+                  static_cast<uint8_t>(Status::STATUS_UPDATE_FINISH));
+        EXPECT_EQ(cec.image, image);
+        EXPECT_EQ(lib.QueryAboutInterrupt(),
+                  static_cast<uint8_t>(I2CCommLib::CECInterruptStatus::
+                                           BMC_FW_UPDATE_REQUEST_RESET_LATER));
+
+        // Short of the size given to StartFWUpdate
+        EXPECT_EQ(RunUpdateFlow(lib, file, image.size() - 1),
+                  static_cast<uint8_t>(Status::STATUS_UPDATE_FINISH));
+        lib.SendStartFWUpdate(image.size());
+        lib.SendImageToCEC(file, image.size() - 1);
+        lib.SendCopyImageComplete();
+        EXPECT_EQ(lib.GetFWUpdateStatus(),
+                  static_cast<uint8_t>(Status::STATUS_ERR_FIRMWARE_HEADER));
+    }
+}
+
+/** @brief Test that the word-wise checksum is the sum of the bytes */
+TEST(CecChecksumTest, TestChecksum)
+{
+    std::vector<uint8_t> data(1200);
+    for (size_t i = 0; i < data.size(); i++)
+    {
+        data[i] = static_cast<uint8_t>(i * 131 + 7) | 0x80;
+    }
+    for (size_t offset : {0, 1, 3})
+    {
+        for (size_t size = 0; size + offset <= data.size(); size += 13)
+        {
+            uint8_t expected = std::accumulate(data.begin() + offset,
+                                               data.begin() + offset + size,
+                                               0) &
+                               0xff;
+            EXPECT_EQ(I2CCommLib::Checksum(data.data() + offset, size),
+                      expected);
+        }
+    }
+}
+
+/** @brief Test that the OTA header is found, validated and cached */
+TEST_F(CecTest, TestOtaHeader)
+{
+    auto writeHeader = [this](const std::string& name, size_t fileSize,
+                              size_t offset, uint32_t size) {
+        std::vector<uint8_t> data(fileSize, 0xff);
+        data[offset + 0xE8] = size & 0xff;
+        data[offset + 0xE9] = (size >> 8) & 0xff;
+        data[offset + 0xEA] = (size >> 16) & 0xff;
+        data[offset + 0xEB] = size >> 24;
+        std::string file = path + "/" + name;
+        std::ofstream(file, std::ios::binary)
+            .write(reinterpret_cast<const char*>(data.data()), data.size());
+        return file;
+    };
+
+    auto bin = writeHeader("image.bin", 0x1000, 0, 0x0cd0);
+    auto header = I2CCommLib::ReadOtaHeader(bin);
+    EXPECT_EQ(header.offset, 0);
+    EXPECT_EQ(header.imageSize, 0x130 + 0x0cd0);
+
+    auto rom = writeHeader("image.rom", 0x100000, 0xFF000, 0x80000);
+    header = I2CCommLib::ReadOtaHeader(rom);
+    EXPECT_EQ(header.offset, 0xFF000);
+    EXPECT_EQ(header.imageSize, 0x130 + 0x80000);
+
+    rom = writeHeader("image.rom", 0x200000, 0x1FF000, 0x1000f0);
+    EXPECT_EQ(I2CCommLib::ReadOtaHeader(rom).imageSize, 0x130 + 0x1000f0);
+
+    // A changed file is read again
+    fs::resize_file(rom, 0x1FF000 + 0x100);
+    EXPECT_THROW(I2CCommLib::ReadOtaHeader(rom), std::runtime_error);
+    auto big = writeHeader("big.bin", 0x1000, 0, 0x1000);
+    EXPECT_THROW(I2CCommLib::ReadOtaHeader(big), std::runtime_error);
+    EXPECT_THROW(I2CCommLib::ReadOtaHeader(path + "/missing.bin"),
+                 std::runtime_error);
+    fs::copy_file(bin, path + "/image.txt");
+    EXPECT_THROW(I2CCommLib::ReadOtaHeader(path + "/image.txt"),
+                 std::runtime_error);
+
+    // The size in the header is sent by default
+    auto simulator = makeCec();
+    auto& cec = *simulator;
+    I2CCommLib lib(std::move(simulator));
+    lib.SetStatusPolling(polling);
+    lib.SendImageToCEC(bin, 0);
+    EXPECT_EQ(cec.image.size(), 0x130 + 0x0cd0);
+}
+
+/** @brief An EC P-384 key, like the one the CEC signs attestations with */
+static EVP_PKEY* generateKey()
+{
+    EVP_PKEY* key = nullptr;
+    std::unique_ptr<EVP_PKEY_CTX, decltype(&::EVP_PKEY_CTX_free)> ctx(
+        EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr), &::EVP_PKEY_CTX_free);
+    EVP_PKEY_keygen_init(ctx.get());
+    EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx.get(), NID_secp384r1);
+    EVP_PKEY_keygen(ctx.get(), &key);
+    return key;
+}
+
+/** @brief Sign data like the CEC, into the raw r and s */
+static std::vector<uint8_t> signRaw(EVP_PKEY* key,
+                                    const std::vector<uint8_t>& data)
+{
+    std::unique_ptr<EVP_MD_CTX, decltype(&::EVP_MD_CTX_free)> ctx(
+        EVP_MD_CTX_new(), &::EVP_MD_CTX_free);
+    size_t length = 0;
+    EVP_DigestSignInit(ctx.get(), nullptr, EVP_sha384(), nullptr, key);
+    EVP_DigestSign(ctx.get(), nullptr, &length, data.data(), data.size());
+    std::vector<uint8_t> der(length);
+    EVP_DigestSign(ctx.get(), der.data(), &length, data.data(), data.size());
+
+    const uint8_t* in = der.data();
+    std::unique_ptr<ECDSA_SIG, decltype(&::ECDSA_SIG_free)> sig(
+        d2i_ECDSA_SIG(nullptr, &in, length), &::ECDSA_SIG_free);
+    std::vector<uint8_t> raw(96);
+    BN_bn2binpad(ECDSA_SIG_get0_r(sig.get()), raw.data(), 48);
+    BN_bn2binpad(ECDSA_SIG_get0_s(sig.get()), raw.data() + 48, 48);
+    return raw;
+}
+
+/** @brief The PEM public key of a key */
+static std::string publicKeyPem(EVP_PKEY* key)
+{
+    std::unique_ptr<BIO, decltype(&::BIO_free)> bio(BIO_new(BIO_s_mem()),
+                                                    &::BIO_free);
+    PEM_write_bio_PUBKEY(bio.get(), key);
+    char* data = nullptr;
+    auto length = BIO_get_mem_data(bio.get(), &data);
+    return std::string(data, length);
+}
+
+/** @brief Test that an attestation is verified in memory, and cached by
+ *  nonce
+ */
+TEST_F(CecTest, TestAttestation)
+{
+    std::unique_ptr<EVP_PKEY, decltype(&::EVP_PKEY_free)> key(
+        generateKey(), &::EVP_PKEY_free);
+    std::unique_ptr<EVP_PKEY, decltype(&::EVP_PKEY_free)> otherKey(
+        generateKey(), &::EVP_PKEY_free);
+    ASSERT_TRUE(key && otherKey);
+
+    CecSimulator::Latency latency;
+    latency.perByte = std::chrono::nanoseconds(0);
+    auto simulator = std::make_unique<CecSimulator>(latency);
+    auto& cec = *simulator;
+    cec.sign = [&key](const std::vector<uint8_t>& data) {
+        return signRaw(key.get(), data);
+    };
+    I2CCommLib lib(std::move(simulator));
+    lib.SetStatusPolling(polling);
+
+    std::vector<uint8_t> nonce(32);
+    std::iota(nonce.begin(), nonce.end(), 0x80);
+    auto attestation = lib.AttestAsync(nonce, publicKeyPem(key.get())).get();
+    EXPECT_EQ(cec.attestations, 1);
+    EXPECT_EQ(attestation.nonce, nonce);
+    ASSERT_EQ(attestation.payload.size(), I2CCommLib::ATTESTATION_PAYLOAD_SIZE);
+    EXPECT_TRUE(std::equal(nonce.begin(), nonce.end(),
+                           attestation.payload.begin()));
+    ASSERT_TRUE(attestation.verified);
+    EXPECT_TRUE(*attestation.verified);
+
+    // The same nonce is answered from the cache, and verified again
+    attestation = lib.Attest(nonce, publicKeyPem(otherKey.get()));
+    EXPECT_EQ(cec.attestations, 1);
+    ASSERT_TRUE(attestation.verified);
+    EXPECT_FALSE(*attestation.verified);
+    EXPECT_FALSE(lib.Attest(nonce, "").verified);
+    EXPECT_EQ(cec.attestations, 1);
+
+    // Another nonce goes to the CEC, with any block size
+    nonce[0]++;
+    attestation = lib.Attest(nonce, publicKeyPem(key.get()),
+                             I2CCommLib::ATTESTATION_PAYLOAD_SIZE,
+                             I2CCommLib::BLOCK_SIZE_48_BYTE);
+    EXPECT_EQ(cec.attestations, 2);
+    EXPECT_EQ(attestation.payload[0], nonce[0]);
+    EXPECT_TRUE(attestation.verified.value_or(false));
+
+    // A command waits for the attestation on the bus, rather than reading
+    // its status while the CEC signs
+    nonce[0]++;
+    std::future<I2CCommLib::Attestation> pending;
+    std::promise<void> returned;
+    std::promise<int> replied;
+    pending = lib.AttestAsync(
+        nonce, "", I2CCommLib::ATTESTATION_PAYLOAD_SIZE,
+        I2CCommLib::BLOCK_SIZE_128_BYTE,
+        [&pending, returned = returned.get_future().share(), &replied]() {
+        // Reply the way the loop of secure-monitor does, taking only an
+        // attestation whose future is ready
+        returned.wait();
+        replied.set_value(pending.wait_for(std::chrono::seconds(0)) ==
+                                  std::future_status::ready
+                              ? pending.get().payload[0]
+                              : -1);
+    });
+    returned.set_value();
+    std::this_thread::sleep_for(latency.sign / 4);
+    EXPECT_EQ(lib.GetCECState(),
+              static_cast<uint8_t>(I2CCommLib::CommandStatus::SUCCESS));
+    EXPECT_EQ(replied.get_future().get(), nonce[0]);
+    EXPECT_EQ(cec.attestations, 3);
+
+    EXPECT_THROW(lib.Attest(std::vector<uint8_t>(16), ""), std::runtime_error);
+}
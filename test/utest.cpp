@@ -1,12 +1,22 @@
 #include "config.h"
 
+#include "activation_scheduler.hpp"
+#include "delta_image.hpp"
+#include "flash_model.hpp"
 #include "image_verify.hpp"
+#include "mtd_writer.hpp"
+#include "partition_writer.hpp"
+#include "pipeline.hpp"
+#include "uboot_env.hpp"
+#include "uboot_mirror.hpp"
 #include "utils.hpp"
 #include "version.hpp"
 
 #include <openssl/evp.h>
 #include <stdlib.h>
 
+#include <algorithm>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
@@ -18,6 +28,18 @@
 
 using namespace phosphor::software::manager;
 using namespace phosphor::software::image;
+using phosphor::software::updater::ActivationScheduler;
+using phosphor::software::updater::DeltaImage;
+using phosphor::software::updater::DeviceSink;
+using phosphor::software::updater::FlashModel;
+using phosphor::software::updater::FileSource;
+using phosphor::software::updater::MtdWriter;
+using phosphor::software::updater::PartitionWriter;
+using phosphor::software::updater::Pipeline;
+using phosphor::software::updater::Sha256Sink;
+using phosphor::software::updater::Sink;
+using phosphor::software::updater::UbootEnv;
+using phosphor::software::updater::UbootMirror;
 
 class VersionTest : public testing::Test
 {
@@ -452,3 +474,1011 @@ TEST(ExecTest, TestConstructArgv)
     EXPECT_EQ(charArray[2], arg2);
     EXPECT_EQ(charArray[3], nullptr);
 }
+
+TEST(ServiceCacheTest, TestLookup)
+{
+    utils::ServiceCache cache;
+    EXPECT_EQ(cache.lookup("/a", "x.Y"), std::nullopt);
+    EXPECT_EQ(cache.misses(), 1);
+
+    cache.insert("/a", "x.Y", "x.Service");
+    EXPECT_EQ(cache.lookup("/a", "x.Y"), "x.Service");
+    EXPECT_EQ(cache.lookup("/a", "x.Z"), std::nullopt);
+    EXPECT_EQ(cache.hits(), 1);
+    EXPECT_EQ(cache.misses(), 2);
+}
+
+TEST(ServiceCacheTest, TestInvalidate)
+{
+    utils::ServiceCache cache;
+    cache.insert("/a", "x.Y", "x.Service");
+    cache.insert("/a", "x.Z", "x.Service");
+    cache.insert("/b", "x.Y", "x.Other");
+
+    cache.invalidatePath("/a", {"x.Z"});
+    EXPECT_EQ(cache.lookup("/a", "x.Y"), "x.Service");
+    EXPECT_EQ(cache.lookup("/a", "x.Z"), std::nullopt);
+
+    cache.invalidateService("x.Service");
+    EXPECT_EQ(cache.lookup("/a", "x.Y"), std::nullopt);
+    EXPECT_EQ(cache.lookup("/b", "x.Y"), "x.Other");
+}
+
+class UbootEnvTest : public testing::Test
+{
+  protected:
+    static constexpr size_t envSize = 0x1000;
+
+    /** @brief Write one redundant environment copy to the image file */
+    void writeCopy(off_t offset, uint8_t flags, const std::string& vars)
+    {
+        std::vector<uint8_t> env(envSize, 0);
+        env[4] = flags;
+        std::copy(vars.begin(), vars.end(), env.begin() + 5);
+        auto crc = UbootEnv::crc32(env.data() + 5, env.size() - 5);
+        std::memcpy(env.data(), &crc, sizeof(crc));
+
+        std::fstream f(image, std::ios::in | std::ios::out | std::ios::binary);
+        f.seekp(offset);
+        f.write(reinterpret_cast<const char*>(env.data()), env.size());
+    }
+
+    /** @brief Read the raw bytes of one environment copy */
+    std::vector<uint8_t> readCopy(off_t offset)
+    {
+        std::vector<uint8_t> env(envSize);
+        std::ifstream f(image, std::ios::binary);
+        f.seekg(offset);
+        f.read(reinterpret_cast<char*>(env.data()), env.size());
+        return env;
+    }
+
+    virtual void SetUp()
+    {
+        tmpDir = fs::temp_directory_path() / "testUbootEnvXXXXXX";
+        if (!mkdtemp(tmpDir.data()))
+        {
+            throw "Failed to create tmp dir";
+        }
+        image = tmpDir + "/env.img";
+        std::ofstream f(image, std::ios::binary);
+        std::vector<char> erased(envSize * 2, '\xff');
+        f.write(erased.data(), erased.size());
+    }
+
+    virtual void TearDown()
+    {
+        fs::remove_all(tmpDir);
+    }
+
+    std::vector<UbootEnv::Location> locations()
+    {
+        return {{image, 0, envSize, 0}, {image, envSize, envSize, 0}};
+    }
+
+    std::string tmpDir;
+    std::string image;
+};
+
+/** @brief Make sure the copy with the newer flag is used */
+TEST_F(UbootEnvTest, TestReadActiveCopy)
+{
+    writeCopy(0, 4, std::string("bootcmd=old\0", 12));
+    writeCopy(envSize, 5, std::string("bootcmd=new\0", 12));
+
+    UbootEnv env(locations());
+    EXPECT_EQ(env.get("bootcmd"), "new");
+    EXPECT_EQ(env.get("missing"), std::nullopt);
+}
+
+/** @brief Make sure a copy with a bad CRC is ignored */
+TEST_F(UbootEnvTest, TestCorruptCopy)
+{
+    writeCopy(0, 1, std::string("bootcmd=good\0", 13));
+    writeCopy(envSize, 2, std::string("bootcmd=bad\0", 12));
+
+    std::fstream f(image, std::ios::in | std::ios::out | std::ios::binary);
+    f.seekp(envSize + 8);
+    f.put('X');
+    f.close();
+
+    UbootEnv env(locations());
+    EXPECT_EQ(env.get("bootcmd"), "good");
+
+    writeCopy(0, 1, "");
+    f.open(image, std::ios::in | std::ios::out | std::ios::binary);
+    f.seekp(8);
+    f.put('X');
+    f.close();
+    EXPECT_THROW(env.get("bootcmd"), std::runtime_error);
+}
+
+/** @brief Make sure a failed commit keeps the changes for the next one */
+TEST_F(UbootEnvTest, TestTryCommit)
+{
+    UbootEnv env(locations());
+    env.set("fieldmode", "true");
+    EXPECT_FALSE(env.tryCommit());
+    EXPECT_TRUE(env.pending());
+
+    writeCopy(0, 1, std::string("bootcmd=run\0", 12));
+    EXPECT_TRUE(env.tryCommit());
+    EXPECT_FALSE(env.pending());
+    EXPECT_EQ(UbootEnv(locations()).get("fieldmode"), "true");
+}
+
+/** @brief Make sure staged changes are written in one commit to both copies */
+TEST_F(UbootEnvTest, TestCommit)
+{
+    writeCopy(0, 7, std::string("bootcmd=run\0a=1\0b=2\0", 22));
+    writeCopy(envSize, 6, std::string("bootcmd=old\0", 12));
+
+    UbootEnv env(locations());
+    env.set("a", "3");
+    env.unset("b");
+    env.set("rwreset", "true");
+    EXPECT_TRUE(env.pending());
+    EXPECT_EQ(env.get("rwreset"), "true");
+    EXPECT_EQ(env.get("b"), std::nullopt);
+    env.commit();
+    EXPECT_FALSE(env.pending());
+
+    auto first = readCopy(0);
+    auto second = readCopy(envSize);
+    EXPECT_EQ(first, second);
+    EXPECT_EQ(first[4], 8);
+
+    std::string expected("bootcmd=run\0a=3\0rwreset=true\0\0", 31);
+    EXPECT_TRUE(std::equal(expected.begin(), expected.end(),
+                           first.begin() + 5));
+
+    UbootEnv reread(locations());
+    EXPECT_EQ(reread.get("bootcmd"), "run");
+    EXPECT_EQ(reread.get("a"), "3");
+    EXPECT_EQ(reread.get("b"), std::nullopt);
+    EXPECT_EQ(reread.get("rwreset"), "true");
+}
+
+/** @brief Make sure the fw_env.config format is understood */
+TEST_F(UbootEnvTest, TestConfigFile)
+{
+    writeCopy(0, 1, std::string("openbmconce=\0", 13));
+    writeCopy(envSize, 2, std::string("openbmconce=factory-reset\0", 26));
+
+    auto config = tmpDir + "/fw_env.config";
+    std::ofstream f(config);
+    f << "# device offset size\n";
+    f << image << " 0x0 0x1000\n";
+    f << image << " 0x1000 0x1000\n";
+    f.close();
+
+    UbootEnv env(config, "");
+    EXPECT_EQ(env.get("openbmconce"), "factory-reset");
+}
+
+class MtdWriterTest : public testing::Test
+{
+  protected:
+    static constexpr size_t blockSize = 0x1000;
+
+    /** @brief Write a file of the given size filled with a byte */
+    void writeFile(const std::string& path, size_t size, char fill)
+    {
+        std::ofstream f(path, std::ios::binary);
+        std::vector<char> data(size, fill);
+        f.write(data.data(), data.size());
+    }
+
+    /** @brief Read a whole file */
+    std::vector<char> readFile(const std::string& path)
+    {
+        std::ifstream f(path, std::ios::binary);
+        return {std::istreambuf_iterator<char>(f),
+                std::istreambuf_iterator<char>()};
+    }
+
+    virtual void SetUp()
+    {
+        tmpDir = fs::temp_directory_path() / "testMtdWriterXXXXXX";
+        if (!mkdtemp(tmpDir.data()))
+        {
+            throw "Failed to create tmp dir";
+        }
+        image = tmpDir + "/image-bmc";
+        device = tmpDir + "/mtd";
+        writeFile(image, blockSize * 3 + 16, 'a');
+        writeFile(device, blockSize * 4, '\xff');
+    }
+
+    virtual void TearDown()
+    {
+        fs::remove_all(tmpDir);
+    }
+
+    std::string tmpDir;
+    std::string image;
+    std::string device;
+};
+
+/** @brief Make sure the comparison finds what write() would write, and
+ *  that writing the plan writes only that */
+TEST_F(MtdWriterTest, TestCompare)
+{
+    MtdWriter writer(device, blockSize);
+    auto plan = writer.compare(image);
+    EXPECT_EQ(plan.bytes, blockSize * 3 + 16);
+    EXPECT_EQ(plan.differs, std::vector<bool>(4, true));
+    EXPECT_EQ(readFile(device), std::vector<char>(blockSize * 4, '\xff'));
+
+    writer.write(image);
+    plan = writer.compare(image);
+    EXPECT_EQ(plan.bytes, 0);
+
+    std::fstream f(device, std::ios::in | std::ios::out | std::ios::binary);
+    f.seekp(blockSize + 1);
+    f.put('b');
+    f.close();
+    plan = writer.compare(image);
+    EXPECT_EQ(plan.bytes, blockSize);
+    EXPECT_EQ(plan.differs, (std::vector<bool>{false, true, false, false}));
+
+    auto stats = writer.write(plan);
+    EXPECT_EQ(stats.written, 1);
+    auto data = readFile(device);
+    EXPECT_TRUE(std::all_of(data.begin(), data.begin() + blockSize * 3 + 16,
+                            [](char c) { return c == 'a'; }));
+
+    writeFile(image, blockSize * 5, 'a');
+    EXPECT_THROW(writer.write(plan), std::runtime_error);
+}
+
+/** @brief Make sure the scratch region is restored once measured */
+TEST_F(MtdWriterTest, TestCharacterize)
+{
+    std::vector<char> before(blockSize * 4);
+    for (size_t i = 0; i < before.size(); i++)
+    {
+        before[i] = static_cast<char>(i * 7);
+    }
+    std::ofstream(device, std::ios::binary)
+        .write(before.data(), before.size());
+
+    MtdWriter writer(device, blockSize);
+    auto rates = writer.characterize(blockSize, blockSize * 2);
+    EXPECT_EQ(rates.erase, 0);
+    EXPECT_GT(rates.program, 0);
+    EXPECT_GT(rates.read, 0);
+    EXPECT_EQ(readFile(device), before);
+
+    EXPECT_THROW(writer.characterize(1, blockSize), std::runtime_error);
+    EXPECT_THROW(writer.characterize(0, 0), std::runtime_error);
+}
+
+/** @brief Make sure the model is persisted and estimates the duration */
+TEST_F(MtdWriterTest, TestFlashModel)
+{
+    auto path = tmpDir + "/model/flash-model";
+    EXPECT_FALSE(FlashModel(path).rates(device));
+
+    FlashModel(path).store(device, {0, 1000, 4000});
+    FlashModel(path).store("/dev/mtd9", {500, 250, 1000});
+
+    FlashModel model(path);
+    auto rates = model.rates(device);
+    ASSERT_TRUE(rates);
+    EXPECT_EQ(rates->program, 1000);
+    EXPECT_EQ(rates->read, 4000);
+
+    // 8000 compared and 2000 written and read back, nothing erased
+    EXPECT_EQ(FlashModel::duration(*rates, 8000, 2000).count(), 5);
+
+    rates = model.rates("/dev/mtd9");
+    ASSERT_TRUE(rates);
+    EXPECT_EQ(FlashModel::duration(*rates, 0, 1000).count(), 7);
+}
+
+/** @brief Make sure only the blocks that differ are written */
+TEST_F(MtdWriterTest, TestSkipUnchangedBlocks)
+{
+    MtdWriter writer(device, blockSize);
+    auto stats = writer.write(image);
+    EXPECT_EQ(stats.blocks, 4);
+    EXPECT_EQ(stats.written, 4);
+
+    auto written = readFile(device);
+    ASSERT_EQ(written.size(), blockSize * 4);
+    EXPECT_EQ(written[blockSize * 3 + 15], 'a');
+    EXPECT_EQ(written[blockSize * 3 + 16], '\xff');
+
+    stats = writer.write(image);
+    EXPECT_EQ(stats.written, 0);
+
+    std::fstream f(image, std::ios::in | std::ios::out | std::ios::binary);
+    f.seekp(blockSize + 1);
+    f.put('b');
+    f.close();
+
+    stats = writer.write(image);
+    EXPECT_EQ(stats.written, 1);
+    EXPECT_EQ(readFile(device)[blockSize + 1], 'b');
+}
+
+/** @brief Make sure progress is reported and can cancel the write */
+TEST_F(MtdWriterTest, TestProgress)
+{
+    MtdWriter writer(device, blockSize);
+    std::vector<size_t> done;
+    writer.write(image, [&done](size_t block, size_t total) {
+        EXPECT_EQ(total, 4);
+        done.push_back(block);
+        return true;
+    });
+    EXPECT_EQ(done, (std::vector<size_t>{1, 2, 3, 4}));
+
+    writeFile(image, blockSize * 2, 'c');
+    EXPECT_THROW(writer.write(image, [](size_t, size_t) { return false; }),
+                 std::runtime_error);
+    EXPECT_EQ(readFile(device)[0], 'c');
+    EXPECT_EQ(readFile(device)[blockSize], 'a');
+}
+
+/** @brief Make sure an interrupted write resumes from its journal, and
+ *  that a journaled block written with something else since is written
+ *  again */
+TEST_F(MtdWriterTest, TestResumeFromJournal)
+{
+    auto journal = tmpDir + "/journal";
+    auto blocks = MtdWriter::journalInterval * 2;
+    writeFile(image, blockSize * blocks, 'd');
+    writeFile(device, blockSize * blocks, '\xff');
+
+    auto interrupt = [](size_t done, size_t) {
+        return done <= MtdWriter::journalInterval;
+    };
+    auto corrupt = [this]() {
+        std::fstream f(device, std::ios::in | std::ios::out | std::ios::binary);
+        f.put('x');
+    };
+    MtdWriter writer(device, blockSize);
+    EXPECT_THROW(writer.write(image, interrupt, journal), std::runtime_error);
+    EXPECT_TRUE(fs::exists(journal));
+    corrupt();
+
+    auto stats = writer.write(image, {}, journal);
+    EXPECT_EQ(stats.resumed, MtdWriter::journalInterval);
+    EXPECT_EQ(stats.written, MtdWriter::journalInterval);
+    EXPECT_FALSE(fs::exists(journal));
+    EXPECT_EQ(readFile(device), readFile(image));
+
+    // Also when the blocks to write come from a comparison
+    writeFile(device, blockSize * blocks, '\xff');
+    EXPECT_THROW(writer.write(image, interrupt, journal), std::runtime_error);
+    corrupt();
+    stats = writer.write(writer.compare(image), {}, journal);
+    EXPECT_EQ(stats.resumed, MtdWriter::journalInterval);
+    EXPECT_EQ(stats.written, MtdWriter::journalInterval);
+    EXPECT_EQ(readFile(device), readFile(image));
+}
+
+/** @brief Make sure the journal of a failed write is removed */
+TEST_F(MtdWriterTest, TestJournalOfFailedWrite)
+{
+    auto journal = tmpDir + "/journal";
+    auto blocks = MtdWriter::journalInterval * 2;
+    writeFile(image, blockSize * blocks, 'd');
+    writeFile(device, blockSize * blocks, '\xff');
+
+    // The image is cut short after the journal was written
+    auto truncate = [this](size_t done, size_t) {
+        if (done == MtdWriter::journalInterval + 1)
+        {
+            fs::resize_file(image, blockSize * done);
+        }
+        return true;
+    };
+    MtdWriter writer(device, blockSize);
+    EXPECT_THROW(writer.write(image, truncate, journal), std::runtime_error);
+    EXPECT_FALSE(fs::exists(journal));
+}
+
+/** @brief Make sure the journal of a different image is ignored */
+TEST_F(MtdWriterTest, TestJournalOfOtherImage)
+{
+    auto journal = tmpDir + "/journal";
+    auto blocks = MtdWriter::journalInterval * 2;
+    writeFile(image, blockSize * blocks, 'd');
+    writeFile(device, blockSize * blocks, '\xff');
+
+    auto interrupt = [](size_t done, size_t) {
+        return done <= MtdWriter::journalInterval;
+    };
+    MtdWriter writer(device, blockSize);
+    EXPECT_THROW(writer.write(image, interrupt, journal), std::runtime_error);
+
+    writeFile(image, blockSize * blocks, 'e');
+    auto stats = writer.write(image, {}, journal);
+    EXPECT_EQ(stats.resumed, 0);
+    EXPECT_EQ(stats.written, blocks);
+}
+
+/** @brief Make sure a BIOS update covering the whole SPI flash, of which
+ *  only a few sectors change, writes just those sectors */
+TEST_F(MtdWriterTest, TestBiosUpdate)
+{
+    static constexpr size_t sectors = 16;
+    writeFile(device, blockSize * sectors, 'v');
+    writeFile(image, blockSize * sectors, 'v');
+    std::fstream f(image, std::ios::in | std::ios::out | std::ios::binary);
+    for (auto sector : {2, 3, 11})
+    {
+        f.seekp(blockSize * sector);
+        f.put('w');
+    }
+    f.close();
+
+    MtdWriter writer(device, blockSize);
+    size_t calls = 0;
+    auto stats = writer.write(image, [&calls](size_t done, size_t total) {
+        EXPECT_EQ(done, ++calls);
+        EXPECT_EQ(total, sectors);
+        return true;
+    });
+    EXPECT_EQ(calls, sectors);
+    EXPECT_EQ(stats.written, 3);
+    EXPECT_EQ(readFile(device), readFile(image));
+}
+
+class PartitionWriterTest : public testing::Test
+{
+  protected:
+    /** @brief Write a file of the given size with varying content */
+    void writeFile(const std::string& path, size_t size, char seed)
+    {
+        std::ofstream f(path, std::ios::binary);
+        for (size_t i = 0; i < size; i++)
+        {
+            f.put(static_cast<char>(seed + i % 251));
+        }
+    }
+
+    /** @brief Read a whole file */
+    std::string readFile(const std::string& path)
+    {
+        std::ifstream f(path, std::ios::binary);
+        return {std::istreambuf_iterator<char>(f),
+                std::istreambuf_iterator<char>()};
+    }
+
+    virtual void SetUp()
+    {
+        tmpDir = fs::temp_directory_path() / "testPartitionWriterXXXXXX";
+        if (!mkdtemp(tmpDir.data()))
+        {
+            throw "Failed to create tmp dir";
+        }
+        writeFile(tmpDir + "/image-kernel", 3 * 1024 * 1024 + 100, 'k');
+        writeFile(tmpDir + "/image-rofs", 2 * 1024 * 1024, 'r');
+        std::ofstream(tmpDir + "/boot-b");
+        std::ofstream(tmpDir + "/rofs-b");
+    }
+
+    virtual void TearDown()
+    {
+        fs::remove_all(tmpDir);
+    }
+
+    std::string tmpDir;
+};
+
+/** @brief Make sure all partitions are written with progress */
+TEST_F(PartitionWriterTest, TestWrite)
+{
+    uint64_t lastDone = 0;
+    uint64_t lastTotal = 0;
+    PartitionWriter::write(
+        {{tmpDir + "/image-kernel", tmpDir + "/boot-b", false},
+         {tmpDir + "/image-rofs", tmpDir + "/rofs-b", false}},
+        [&](uint64_t done, uint64_t total) {
+        EXPECT_GE(done, lastDone);
+        lastDone = done;
+        lastTotal = total;
+        return true;
+    });
+
+    EXPECT_EQ(lastTotal, 5 * 1024 * 1024 + 100);
+    EXPECT_EQ(lastDone, lastTotal);
+    EXPECT_EQ(readFile(tmpDir + "/boot-b"), readFile(tmpDir + "/image-kernel"));
+    EXPECT_EQ(readFile(tmpDir + "/rofs-b"), readFile(tmpDir + "/image-rofs"));
+}
+
+/** @brief Make sure a missing image fails the whole write */
+TEST_F(PartitionWriterTest, TestMissingImage)
+{
+    EXPECT_THROW(
+        PartitionWriter::write(
+            {{tmpDir + "/image-kernel", tmpDir + "/boot-b", false},
+             {tmpDir + "/image-missing", tmpDir + "/rofs-b", false}}),
+        std::runtime_error);
+}
+
+/** @brief Make sure zstd images are decompressed while written */
+TEST_F(PartitionWriterTest, TestCompressed)
+{
+    auto image = tmpDir + "/image-rofs";
+    if (std::system(("zstd -q -k " + image).c_str()) != 0)
+    {
+        GTEST_SKIP() << "zstd is not available";
+    }
+
+    EXPECT_EQ(PartitionWriter::zstdContentSize(image + ".zst"),
+              2 * 1024 * 1024);
+    EXPECT_EQ(PartitionWriter::zstdContentSize(image), std::nullopt);
+
+    PartitionWriter::write({{image + ".zst", tmpDir + "/rofs-b", true}});
+    EXPECT_EQ(readFile(tmpDir + "/rofs-b"), readFile(image));
+}
+
+class PipelineTest : public testing::Test
+{
+  protected:
+    /** @brief A sink that fails after the first chunk */
+    class FailingSink : public Sink
+    {
+      public:
+        std::string name() const override
+        {
+            return "fail";
+        }
+
+        void write(const uint8_t*, size_t) override
+        {
+            if (chunks++)
+            {
+                throw std::runtime_error("Sink failed");
+            }
+        }
+
+        size_t chunks = 0;
+    };
+
+    virtual void SetUp()
+    {
+        tmpDir = fs::temp_directory_path() / "testPipelineXXXXXX";
+        if (!mkdtemp(tmpDir.data()))
+        {
+            throw "Failed to create tmp dir";
+        }
+        input = tmpDir + "/input";
+        output = tmpDir + "/output";
+        std::ofstream f(input, std::ios::binary);
+        for (size_t i = 0; i < inputSize; i++)
+        {
+            f.put(static_cast<char>(i % 253));
+        }
+        std::ofstream(output).close();
+    }
+
+    virtual void TearDown()
+    {
+        fs::remove_all(tmpDir);
+    }
+
+    /** @brief Build a pipeline copying input to output with a hash */
+    Pipeline makePipeline(Sha256Sink** hash = nullptr)
+    {
+        std::vector<std::unique_ptr<Sink>> sinks;
+        auto sha = std::make_unique<Sha256Sink>();
+        if (hash)
+        {
+            *hash = sha.get();
+        }
+        sinks.push_back(std::move(sha));
+        sinks.push_back(std::make_unique<DeviceSink>(output));
+        return Pipeline(std::make_unique<FileSource>(input), std::move(sinks),
+                        Pipeline::alignment);
+    }
+
+    static constexpr size_t inputSize = Pipeline::alignment * 5 + 3;
+    std::string tmpDir;
+    std::string input;
+    std::string output;
+};
+
+/** @brief Make sure data flows through every stage */
+TEST_F(PipelineTest, TestRun)
+{
+    Sha256Sink* hash = nullptr;
+    auto pipeline = makePipeline(&hash);
+    uint64_t done = 0;
+    auto stats = pipeline.run([&done](uint64_t bytes) {
+        EXPECT_GT(bytes, done);
+        done = bytes;
+        return true;
+    });
+    EXPECT_EQ(done, inputSize);
+
+    ASSERT_EQ(stats.size(), 3);
+    EXPECT_EQ(stats[0].name, "read");
+    EXPECT_EQ(stats[1].name, "hash");
+    EXPECT_EQ(stats[2].name, "write");
+    for (const auto& stage : stats)
+    {
+        EXPECT_EQ(stage.bytes, inputSize);
+    }
+
+    std::ifstream in(input, std::ios::binary);
+    std::ifstream out(output, std::ios::binary);
+    std::string inData{std::istreambuf_iterator<char>(in),
+                       std::istreambuf_iterator<char>()};
+    std::string outData{std::istreambuf_iterator<char>(out),
+                        std::istreambuf_iterator<char>()};
+    EXPECT_EQ(inData, outData);
+
+    Sha256Sink expected;
+    expected.write(reinterpret_cast<const uint8_t*>(inData.data()),
+                   inData.size());
+    expected.finish();
+    EXPECT_EQ(hash->digest(), expected.digest());
+}
+
+/** @brief Make sure the SHA-256 is the standard one */
+TEST_F(PipelineTest, TestSha256)
+{
+    Sha256Sink hash;
+    hash.write(reinterpret_cast<const uint8_t*>("abc"), 3);
+    hash.finish();
+    EXPECT_EQ(hash.digest(), "ba7816bf8f01cfea414140de5dae2223"
+                             "b00361a396177a9cb410ff61f20015ad");
+}
+
+/** @brief Make sure failures and cancellation stop the pipeline */
+TEST_F(PipelineTest, TestFailure)
+{
+    std::vector<std::unique_ptr<Sink>> sinks;
+    sinks.push_back(std::make_unique<FailingSink>());
+    Pipeline failing(std::make_unique<FileSource>(input), std::move(sinks),
+                     Pipeline::alignment);
+    EXPECT_THROW(failing.run(), std::runtime_error);
+
+    auto pipeline = makePipeline();
+    EXPECT_THROW(pipeline.run([](uint64_t) { return false; }),
+                 std::runtime_error);
+
+    EXPECT_THROW(FileSource(tmpDir + "/missing"), std::runtime_error);
+}
+
+class DeltaImageTest : public testing::Test
+{
+  protected:
+    /** @brief Write a file of whole blocks, each filled with its seed */
+    void writeBlocks(const std::string& path, const std::string& seeds,
+                     const std::string& tail = {})
+    {
+        std::ofstream f(path, std::ios::binary);
+        for (auto seed : seeds)
+        {
+            f << std::string(blockSize, seed);
+        }
+        f << tail;
+    }
+
+    /** @brief Read a whole file */
+    std::string readFile(const std::string& path)
+    {
+        std::ifstream f(path, std::ios::binary);
+        return {std::istreambuf_iterator<char>(f),
+                std::istreambuf_iterator<char>()};
+    }
+
+    virtual void SetUp()
+    {
+        tmpDir = fs::temp_directory_path() / "testDeltaImageXXXXXX";
+        if (!mkdtemp(tmpDir.data()))
+        {
+            throw "Failed to create tmp dir";
+        }
+        base = tmpDir + "/base";
+        target = tmpDir + "/target";
+        delta = tmpDir + "/image-rofs.delta";
+        writeBlocks(base, "abcdefgh");
+    }
+
+    virtual void TearDown()
+    {
+        fs::remove_all(tmpDir);
+    }
+
+    static constexpr uint32_t blockSize = 512;
+    std::string tmpDir;
+    std::string base;
+    std::string target;
+    std::string delta;
+};
+
+/** @brief Make sure a delta reconstructs the target from the base */
+TEST_F(DeltaImageTest, TestReconstruct)
+{
+    // Changed, moved and appended blocks and a short tail
+    writeBlocks(target, "abXdhfghZ", "tail");
+    DeltaImage::create(base, target, "2.0.1", delta, blockSize, false);
+    EXPECT_LT(fs::file_size(delta), fs::file_size(target) / 2);
+
+    auto header = DeltaImage::readHeader(delta);
+    EXPECT_EQ(header.baseVersion, "2.0.1");
+    EXPECT_EQ(header.blockSize, blockSize);
+    EXPECT_EQ(header.targetSize, fs::file_size(target));
+    EXPECT_NO_THROW(DeltaImage::validate(delta, false));
+
+    auto output = tmpDir + "/rofs-b";
+    std::ofstream(output).close();
+    uint64_t lastTotal = 0;
+    PartitionWriter::write({{delta, output, false, base}},
+                           [&lastTotal](uint64_t, uint64_t total) {
+        lastTotal = total;
+        return true;
+    });
+    EXPECT_EQ(lastTotal, fs::file_size(target));
+    EXPECT_EQ(readFile(output), readFile(target));
+
+    EXPECT_THROW(DeltaImage::readHeader(target), std::runtime_error);
+}
+
+/** @brief Make sure a delta written over its base never reads a block that
+ *  was already overwritten */
+TEST_F(DeltaImageTest, TestInPlace)
+{
+    // Block 5 of the target is block 1 of the base
+    writeBlocks(target, "abcdebgh");
+    DeltaImage::create(base, target, "2.0.1", delta, blockSize, false);
+    EXPECT_NO_THROW(DeltaImage::validate(delta, false));
+    EXPECT_THROW(DeltaImage::validate(delta, true), std::runtime_error);
+
+    auto original = readFile(base);
+    EXPECT_THROW(PartitionWriter::write({{delta, base, false, base}}),
+                 std::runtime_error);
+    EXPECT_EQ(readFile(base), original);
+
+    // Blocks only moving towards the start are safe
+    writeBlocks(target, "abcdhfgh");
+    DeltaImage::create(base, target, "2.0.1", delta, blockSize, false);
+    PartitionWriter::write({{delta, base, false, base}});
+    EXPECT_EQ(readFile(base), readFile(target));
+}
+
+/** @brief Make sure a delta applied to the wrong base is detected */
+TEST_F(DeltaImageTest, TestWrongBase)
+{
+    writeBlocks(target, "abcdXfgh");
+    DeltaImage::create(base, target, "2.0.1", delta, blockSize, false);
+    writeBlocks(base, "abcdefgY");
+
+    auto output = tmpDir + "/rofs-b";
+    std::ofstream(output).close();
+    EXPECT_THROW(PartitionWriter::write({{delta, output, false, base}}),
+                 std::runtime_error);
+
+    // A truncated delta is rejected up front
+    fs::resize_file(delta, fs::file_size(delta) - 1);
+    EXPECT_THROW(DeltaImage::validate(delta, false), std::runtime_error);
+}
+
+/** @brief Make sure compressed records keep a delta smaller than the
+ *  compressed full image */
+TEST_F(DeltaImageTest, TestCompressed)
+{
+    // Text compresses well, the second half of it changes
+    auto writeText = [](const std::string& path, const std::string& tail) {
+        std::ofstream f(path, std::ios::binary);
+        for (int i = 0; f.tellp() < 32 * blockSize; i++)
+        {
+            f << "line " << i << " of "
+              << (f.tellp() < 16 * blockSize ? "1.0" : tail) << "\n";
+        }
+    };
+    writeText(base, "1.0");
+    writeText(target, "2.0");
+    if (std::system(("zstd -q -k " + target).c_str()) != 0)
+    {
+        GTEST_SKIP() << "zstd is not available";
+    }
+
+    auto raw = tmpDir + "/raw.delta";
+    DeltaImage::create(base, target, "1.0", raw, blockSize, false);
+    DeltaImage::create(base, target, "1.0", delta, blockSize);
+    EXPECT_TRUE(DeltaImage::readHeader(delta).compressed);
+    EXPECT_FALSE(DeltaImage::readHeader(raw).compressed);
+    EXPECT_LT(fs::file_size(delta), fs::file_size(raw));
+    EXPECT_LT(fs::file_size(delta), fs::file_size(target + ".zst"));
+    EXPECT_NO_THROW(DeltaImage::validate(delta, true));
+
+    auto output = tmpDir + "/rofs-b";
+    std::ofstream(output).close();
+    PartitionWriter::write({{delta, output, false, base}});
+    EXPECT_EQ(readFile(output), readFile(target));
+
+    // Applied in place as well
+    PartitionWriter::write({{delta, base, false, base}});
+    EXPECT_EQ(readFile(base), readFile(target));
+
+    // A damaged frame is rejected up front
+    fs::resize_file(delta, fs::file_size(delta) - 1);
+    EXPECT_THROW(DeltaImage::validate(delta, false), std::runtime_error);
+}
+
+class UbootMirrorTest : public testing::Test
+{
+  protected:
+    static constexpr size_t blockSize = MtdWriter::defaultBlockSize;
+
+    /** @brief Write a file of whole blocks, each filled with its seed */
+    void writeBlocks(const std::string& path, const std::string& seeds)
+    {
+        std::ofstream f(path, std::ios::binary);
+        for (auto seed : seeds)
+        {
+            f << std::string(blockSize, seed);
+        }
+    }
+
+    /** @brief Read a whole file */
+    std::string readFile(const std::string& path)
+    {
+        std::ifstream f(path, std::ios::binary);
+        return {std::istreambuf_iterator<char>(f),
+                std::istreambuf_iterator<char>()};
+    }
+
+    virtual void SetUp()
+    {
+        tmpDir = fs::temp_directory_path() / "testUbootMirrorXXXXXX";
+        if (!mkdtemp(tmpDir.data()))
+        {
+            throw "Failed to create tmp dir";
+        }
+        uboot = tmpDir + "/u-boot";
+        altUboot = tmpDir + "/alt-u-boot";
+        cache = tmpDir + "/persist/uboot-mirror";
+        writeBlocks(uboot, "abcd");
+        writeBlocks(altUboot, "abXd");
+    }
+
+    virtual void TearDown()
+    {
+        fs::remove_all(tmpDir);
+    }
+
+    std::string tmpDir;
+    std::string uboot;
+    std::string altUboot;
+    std::string cache;
+};
+
+/** @brief Make sure only differing blocks are copied */
+TEST_F(UbootMirrorTest, TestMirror)
+{
+    UbootMirror mirror(cache, "boot1");
+    auto result = mirror.mirror(uboot, altUboot);
+    EXPECT_EQ(result.check, UbootMirror::Check::compared);
+    EXPECT_EQ(result.written, 1);
+    EXPECT_EQ(readFile(altUboot), readFile(uboot));
+}
+
+/** @brief Make sure the cache avoids reading the partitions again */
+TEST_F(UbootMirrorTest, TestCache)
+{
+    UbootMirror(cache, "boot1").mirror(uboot, altUboot);
+
+    // Within the same boot nothing is read, even a changed target
+    writeBlocks(altUboot, "abcY");
+    auto result = UbootMirror(cache, "boot1").mirror(uboot, altUboot);
+    EXPECT_EQ(result.check, UbootMirror::Check::cached);
+    EXPECT_EQ(result.written, 0);
+
+    // After a reboot the source is read, and matches the cached digest
+    result = UbootMirror(cache, "boot2").mirror(uboot, altUboot);
+    EXPECT_EQ(result.check, UbootMirror::Check::digest);
+    EXPECT_EQ(result.written, 0);
+
+    // A changed source is compared and copied
+    writeBlocks(uboot, "abcZ");
+    result = UbootMirror(cache, "boot3").mirror(uboot, altUboot);
+    EXPECT_EQ(result.check, UbootMirror::Check::compared);
+    EXPECT_EQ(result.written, 1);
+    EXPECT_EQ(readFile(altUboot), readFile(uboot));
+
+    // So is one written within the boot, which invalidates the cache
+    writeBlocks(uboot, "Wbcd");
+    UbootMirror::invalidate(cache);
+    result = UbootMirror(cache, "boot3").mirror(uboot, altUboot);
+    EXPECT_EQ(result.check, UbootMirror::Check::compared);
+    EXPECT_EQ(result.written, 2);
+    EXPECT_EQ(readFile(altUboot), readFile(uboot));
+}
+
+TEST(ActivationSchedulerTest, TestConcurrent)
+{
+    int changes = 0;
+    ActivationScheduler scheduler([&changes]() { changes++; });
+
+    // Different flashes are written concurrently
+    EXPECT_TRUE(scheduler.request("bmc", {ActivationScheduler::bmcFlash}, {}));
+    EXPECT_TRUE(
+        scheduler.request("bios", {ActivationScheduler::biosFlash}, {}));
+    EXPECT_EQ(scheduler.running(), std::vector<std::string>({"bmc", "bios"}));
+    EXPECT_TRUE(scheduler.queued().empty());
+    EXPECT_EQ(changes, 2);
+
+    scheduler.release("bmc");
+    scheduler.release("unknown");
+    EXPECT_EQ(scheduler.running(), std::vector<std::string>({"bios"}));
+    EXPECT_EQ(changes, 3);
+}
+
+TEST(ActivationSchedulerTest, TestQueue)
+{
+    ActivationScheduler scheduler;
+    std::vector<std::string> started;
+    auto start = [&started](const std::string& id) {
+        return [&started, id]() { started.push_back(id); };
+    };
+
+    EXPECT_TRUE(scheduler.request("bmc1", {ActivationScheduler::bmcFlash},
+                                  start("bmc1")));
+    EXPECT_FALSE(scheduler.request("bmc2", {ActivationScheduler::bmcFlash},
+                                   start("bmc2")));
+    // Does not overtake the queued activation it conflicts with
+    EXPECT_FALSE(scheduler.request("both",
+                                   {ActivationScheduler::bmcFlash,
+                                    ActivationScheduler::biosFlash},
+                                   start("both")));
+    EXPECT_FALSE(scheduler.request("bios", {ActivationScheduler::biosFlash},
+                                   start("bios")));
+    EXPECT_EQ(scheduler.queued(),
+              std::vector<std::string>({"bmc2", "both", "bios"}));
+    EXPECT_TRUE(started.empty());
+
+    // A queued activation that is deleted never starts
+    scheduler.release("bios");
+    EXPECT_EQ(scheduler.queued(), std::vector<std::string>({"bmc2", "both"}));
+
+    scheduler.release("bmc1");
+    EXPECT_EQ(started, std::vector<std::string>({"bmc2"}));
+    EXPECT_EQ(scheduler.running(), std::vector<std::string>({"bmc2"}));
+
+    scheduler.release("bmc2");
+    EXPECT_EQ(started, std::vector<std::string>({"bmc2", "both"}));
+    EXPECT_TRUE(scheduler.queued().empty());
+}
+
+TEST(ActivationSchedulerTest, TestWhenIdle)
+{
+    ActivationScheduler scheduler;
+    std::vector<std::string> events;
+    auto reboot = [&events]() { events.push_back("reboot"); };
+
+    // The BMC image completes while a BIOS write is still running, and
+    // another BMC activation is queued behind it
+    EXPECT_TRUE(scheduler.request("bmc1", {ActivationScheduler::bmcFlash}, {}));
+    EXPECT_TRUE(
+        scheduler.request("bios", {ActivationScheduler::biosFlash}, {}));
+    EXPECT_FALSE(scheduler.request(
+        "bmc2", {ActivationScheduler::bmcFlash},
+        [&events]() { events.push_back("bmc2"); }));
+    scheduler.release("bmc1");
+    scheduler.whenIdle(reboot);
+    EXPECT_EQ(events, std::vector<std::string>({"bmc2"}));
+
+    scheduler.release("bmc2");
+    EXPECT_FALSE(scheduler.idle());
+    EXPECT_EQ(events, std::vector<std::string>({"bmc2"}));
+
+    // The reboot waits for the last running activation
+    scheduler.release("bios");
+    EXPECT_TRUE(scheduler.idle());
+    EXPECT_EQ(events, std::vector<std::string>({"bmc2", "reboot"}));
+
+    // Runs once, and right away when already idle
+    scheduler.release("bios");
+    scheduler.whenIdle(reboot);
+    EXPECT_EQ(events, std::vector<std::string>({"bmc2", "reboot", "reboot"}));
+}
@@ -2,6 +2,8 @@
 
 #include "activation.hpp"
 #include "item_updater.hpp"
+#include "serialize.hpp"
+#include "uboot_mirror.hpp"
 
 namespace phosphor
 {
@@ -14,81 +16,65 @@ namespace softwareServer = sdbusplus::server::xyz::openbmc_project::software;
 
 void Activation::flashWrite()
 {
-    auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
-                                      SYSTEMD_INTERFACE, "StartUnit");
-    method.append("obmc-flash-bmc-ubirw.service", "replace");
-    bus.call_noreply(method);
+    startJob("obmc-flash-bmc-ubirw.service", [this](const std::string& result) {
+        if (result == "done")
+        {
+            rwVolumeCreated = true;
+            activationProgress->progress(activationProgress->progress() + 20);
+        }
+        onStateChanges(result);
+    });
 
+    // The service also writes U-Boot, so the mirror has to compare again
+    UbootMirror::invalidate(mirrorCachePath());
     auto roServiceFile = "obmc-flash-bmc-ubiro@" + versionId + ".service";
-    method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
-                                 SYSTEMD_INTERFACE, "StartUnit");
-    method.append(roServiceFile, "replace");
-    bus.call_noreply(method);
+    startJob(roServiceFile, [this](const std::string& result) {
+        if (result == "done")
+        {
+            roVolumeCreated = true;
+            activationProgress->progress(activationProgress->progress() + 50);
+        }
+        onStateChanges(result);
+    });
 
     return;
 }
 
-void Activation::onStateChanges(sdbusplus::message_t& msg)
+void Activation::onStateChanges(const std::string& result)
 {
-    uint32_t newStateID{};
-    sdbusplus::message::object_path newStateObjPath;
-    std::string newStateUnit{};
-    std::string newStateResult{};
-
-    // Read the msg and populate each variable
-    msg.read(newStateID, newStateObjPath, newStateUnit, newStateResult);
-
-    auto rwServiceFile = "obmc-flash-bmc-ubirw.service";
-    auto roServiceFile = "obmc-flash-bmc-ubiro@" + versionId + ".service";
-    auto flashId = parent.versions.find(versionId)->second->path();
-    auto ubootVarsServiceFile = "obmc-flash-bmc-updateubootvars@" + flashId +
-                                ".service";
-
-    if (newStateUnit == rwServiceFile && newStateResult == "done")
-    {
-        rwVolumeCreated = true;
-        activationProgress->progress(activationProgress->progress() + 20);
-    }
-
-    if (newStateUnit == roServiceFile && newStateResult == "done")
+    if (result == "failed" || result == "dependency" || result == "timeout")
     {
-        roVolumeCreated = true;
-        activationProgress->progress(activationProgress->progress() + 50);
+        Activation::activation(softwareServer::Activation::Activations::Failed);
     }
-
-    if (newStateUnit == ubootVarsServiceFile && newStateResult == "done")
+    else if (rwVolumeCreated && roVolumeCreated) // Volumes were created
     {
-        ubootEnvVarsUpdated = true;
-    }
-
-    if (newStateUnit == rwServiceFile || newStateUnit == roServiceFile ||
-        newStateUnit == ubootVarsServiceFile)
-    {
-        if (newStateResult == "failed" || newStateResult == "dependency")
+        if (!ubootEnvVarsUpdated)
         {
-            Activation::activation(
-                softwareServer::Activation::Activations::Failed);
-        }
-        else if (rwVolumeCreated && roVolumeCreated) // Volumes were created
-        {
-            if (!ubootEnvVarsUpdated)
-            {
-                activationProgress->progress(90);
-
-                // Set the priority which triggers the service that updates the
-                // environment variables.
-                if (!Activation::redundancyPriority)
+            activationProgress->progress(90);
+
+            // Setting the priority starts the service that updates the
+            // environment variables, so wait for it before doing so.
+            auto flashId = parent.versions.find(versionId)->second->path();
+            auto ubootVarsServiceFile = "obmc-flash-bmc-updateubootvars@" +
+                                        flashId + ".service";
+            watchJob(ubootVarsServiceFile, [this](const std::string& result) {
+                if (result == "done")
                 {
-                    Activation::redundancyPriority =
-                        std::make_unique<RedundancyPriority>(bus, path, *this,
-                                                             0);
+                    ubootEnvVarsUpdated = true;
                 }
-            }
-            else // Environment variables were updated
+                onStateChanges(result);
+            });
+
+            if (!Activation::redundancyPriority)
             {
-                Activation::onFlashWriteSuccess();
+                Activation::redundancyPriority =
+                    std::make_unique<RedundancyPriority>(bus, path, *this, 0);
             }
         }
+        else // Environment variables were updated
+        {
+            Activation::onFlashWriteSuccess();
+        }
     }
 
     return;
@@ -2,10 +2,20 @@
 
 #include "item_updater_helper.hpp"
 
-#include "utils.hpp"
+#include "mtd_writer.hpp"
+#include "serialize.hpp"
+#include "uboot_mirror.hpp"
 
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
 #include <phosphor-logging/lg2.hpp>
-#include <sdbusplus/exception.hpp>
+
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+extern boost::asio::io_context& getIOContext();
 
 namespace phosphor
 {
@@ -16,39 +26,82 @@ namespace updater
 
 PHOSPHOR_LOG2_USING;
 
+namespace
+{
+
+/** @brief Find an MTD device by name, like findmtd in obmc-flash-bmc
+ *
+ *  @param[in] name - The name of the MTD partition
+ *
+ *  @return The path of the device
+ *
+ *  @throw std::runtime_error if there is no such partition
+ */
+std::string findMtd(const std::string& name)
+{
+    std::error_code ec;
+    for (const auto& entry :
+         std::filesystem::directory_iterator("/sys/class/mtd", ec))
+    {
+        std::ifstream file(entry.path() / "name");
+        std::string mtdName;
+        auto mtd = entry.path().filename().string();
+        // Skip the read-only mtdXro aliases
+        if (std::getline(file, mtdName) && mtdName == name &&
+            !mtd.ends_with("ro"))
+        {
+            return "/dev/" + mtd;
+        }
+    }
+    throw std::runtime_error("No MTD partition named " + name);
+}
+
+} // namespace
+
 void Helper::setEntry(const std::string& entryId, uint8_t value)
 {
-    std::string serviceFile = "obmc-flash-bmc-setenv@" + entryId + "\\x3d" +
-                              std::to_string(value) + ".service";
-    auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
-                                      SYSTEMD_INTERFACE, "StartUnit");
-    method.append(serviceFile, "replace");
-    bus.call_noreply(method);
+    env.set(entryId, std::to_string(value));
+
+    // Priority changes usually come in bursts (see freePriority), so defer
+    // the write until the current D-Bus request has been handled and write
+    // them all at once.
+    if (!envCommitQueued)
+    {
+        envCommitQueued = true;
+        boost::asio::post(getIOContext(), [this]() { commitEnv(); });
+    }
 }
 
 void Helper::clearEntry(const std::string& entryId)
 {
     // Remove the priority environment variable.
-    auto serviceFile = "obmc-flash-bmc-setenv@" + entryId + ".service";
-    auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
-                                      SYSTEMD_INTERFACE, "StartUnit");
-    method.append(serviceFile, "replace");
-    bus.call_noreply(method);
+    env.unset(entryId);
+
+    if (!envCommitQueued)
+    {
+        envCommitQueued = true;
+        boost::asio::post(getIOContext(), [this]() { commitEnv(); });
+    }
 }
 
 void Helper::cleanup()
 {
     // Remove any volumes that do not match current versions.
-    auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
-                                      SYSTEMD_INTERFACE, "StartUnit");
-    method.append("obmc-flash-bmc-cleanup.service", "replace");
-    bus.call_noreply(method);
+    jobTracker.startUnit("obmc-flash-bmc-cleanup.service",
+                         [](const std::string& result) {
+        if (result != "done")
+        {
+            error("Failed to clean up volumes: {RESULT}", "RESULT", result);
+        }
+    });
 }
 
 void Helper::factoryReset()
 {
-    // Mark the read-write partition for recreation upon reboot.
-    utils::execute("/sbin/fw_setenv", "rwreset", "true");
+    // Mark the read-write partition for recreation upon reboot. Any staged
+    // priority changes go out in the same write.
+    env.set("rwreset", "true");
+    commitEnv();
 }
 
 void Helper::removeVersion(const std::string& flashId)
@@ -56,46 +109,68 @@ void Helper::removeVersion(const std::string& flashId)
     auto serviceFile = "obmc-flash-bmc-ubiro-remove@" + flashId + ".service";
 
     // Remove the read-only partitions.
-    auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
-                                      SYSTEMD_INTERFACE, "StartUnit");
-    method.append(serviceFile, "replace");
-    bus.call_noreply(method);
+    jobTracker.startUnit(serviceFile, [serviceFile](const std::string& result) {
+        if (result != "done")
+        {
+            error("Failed to remove version, {UNIT}: {RESULT}", "UNIT",
+                  serviceFile, "RESULT", result);
+        }
+    });
 }
 
 void Helper::updateUbootVersionId(const std::string& flashId)
 {
-    auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
-                                      SYSTEMD_INTERFACE, "StartUnit");
     auto updateEnvVarsFile = "obmc-flash-bmc-updateubootvars@" + flashId +
                              ".service";
-    method.append(updateEnvVarsFile, "replace");
-
-    try
-    {
-        bus.call_noreply(method);
-    }
-    catch (const sdbusplus::exception_t& e)
-    {
-        error("Failed to update u-boot env variables: {FLASHID}", "FLASHID",
-              flashId);
-    }
+    jobTracker.startUnit(updateEnvVarsFile,
+                         [flashId](const std::string& result) {
+        if (result != "done")
+        {
+            error("Failed to update u-boot env variables: {FLASHID}",
+                  "FLASHID", flashId);
+        }
+    });
 }
 
 void Helper::mirrorAlt()
 {
-    auto method = bus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
-                                      SYSTEMD_INTERFACE, "StartUnit");
-    auto mirrorUbootFile = "obmc-flash-bmc-mirroruboot.service";
-    method.append(mirrorUbootFile, "replace");
-
-    try
-    {
-        bus.call_noreply(method);
-    }
-    catch (const sdbusplus::exception_t& e)
-    {
-        error("Failed to copy U-Boot to alternate chip: {ERROR}", "ERROR", e);
-    }
+    // Reading the partitions takes a while, keep it off the event loop
+    mirrorWorker = std::jthread([this](std::stop_token stop) {
+        try
+        {
+            auto uboot = findMtd("u-boot");
+            auto altUboot = findMtd("alt-u-boot");
+            UbootMirror mirror(mirrorCachePath());
+            auto result = mirror.mirror(uboot, altUboot, stop);
+            if (result.written == 0)
+            {
+                return;
+            }
+
+            info("Mirrored {BLOCKS} blocks of U-Boot to alternate chip",
+                 "BLOCKS", result.written);
+            MtdWriter altEnv(findMtd("alt-u-boot-env"));
+            altEnv.write(findMtd("u-boot-env"));
+        }
+        catch (const std::exception& e)
+        {
+            error("Failed to copy U-Boot to alternate chip: {ERROR}",
+                  "ERROR", e.what());
+            return;
+        }
+
+        // The copied environment still points at the volumes of this chip
+        boost::asio::post(getIOContext(), [this]() {
+            auto serviceFile = "obmc-flash-bmc-mirrorenv.service";
+            jobTracker.startUnit(serviceFile, [](const std::string& result) {
+                if (result != "done")
+                {
+                    error("Failed to update alternate environment: {RESULT}",
+                          "RESULT", result);
+                }
+            });
+        });
+    });
 }
 
 } // namespace updater
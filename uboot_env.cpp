@@ -0,0 +1,437 @@
+#include "uboot_env.hpp"
+
+#include <fcntl.h>
+#include <mtd/mtd-user.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <phosphor-logging/lg2.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace phosphor
+{
+namespace software
+{
+namespace updater
+{
+
+namespace
+{
+
+/** @brief Size of the CRC32 at the start of every copy */
+constexpr size_t crcSize = sizeof(uint32_t);
+
+/** @brief Flag value of the active copy when the boolean scheme is used */
+constexpr uint8_t activeFlag = 1;
+
+constexpr auto crcTable = [] {
+    std::array<uint32_t, 256> table{};
+    for (uint32_t i = 0; i < table.size(); i++)
+    {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+        {
+            c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        }
+        table[i] = c;
+    }
+    return table;
+}();
+
+/** @brief RAII wrapper for a file descriptor */
+struct FileDescriptor
+{
+    explicit FileDescriptor(int fd) : fd(fd) {}
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+    ~FileDescriptor()
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+
+    int fd;
+};
+
+/** @brief Holds the lock shared with fw_printenv/fw_setenv */
+struct EnvLock
+{
+    explicit EnvLock(const std::string& path) :
+        lock(path.empty()
+                 ? -1
+                 : open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666))
+    {
+        if (!path.empty() && (lock.fd < 0 || flock(lock.fd, LOCK_EX) < 0))
+        {
+            throw std::runtime_error("Failed to lock " + path + ": " +
+                                     std::strerror(errno));
+        }
+    }
+
+    FileDescriptor lock;
+};
+
+/** @brief Whether the device is NOR flash, which uses the boolean scheme
+ *  for the redundant flags instead of an incrementing counter.
+ */
+bool isNorFlash(int fd)
+{
+    mtd_info_user info{};
+    return ioctl(fd, MEMGETINFO, &info) == 0 && info.type == MTD_NORFLASH;
+}
+
+} // namespace
+
+UbootEnv::UbootEnv(const std::string& configFile, const std::string& lockFile) :
+    lockFile(lockFile)
+{
+    std::ifstream config(configFile);
+    std::string line;
+    while (std::getline(config, line))
+    {
+        std::istringstream fields(line);
+        std::string device;
+        std::string offset;
+        std::string size;
+        std::string sectorSize;
+        if (!(fields >> device) || device.starts_with('#'))
+        {
+            continue;
+        }
+        if (!(fields >> offset >> size))
+        {
+            continue;
+        }
+        fields >> sectorSize;
+
+        try
+        {
+            locations.push_back(
+                {device, static_cast<off_t>(std::stoll(offset, nullptr, 0)),
+                 std::stoul(size, nullptr, 0),
+                 sectorSize.empty() ? 0 : std::stoul(sectorSize, nullptr, 0)});
+        }
+        catch (const std::logic_error&)
+        {
+            continue;
+        }
+    }
+}
+
+UbootEnv::UbootEnv(std::vector<Location> locations,
+                   const std::string& lockFile) :
+    locations(std::move(locations)),
+    lockFile(lockFile)
+{}
+
+uint32_t UbootEnv::crc32(const uint8_t* data, size_t size)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < size; i++)
+    {
+        crc = crcTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFF;
+}
+
+std::optional<std::string> UbootEnv::get(const std::string& name)
+{
+    auto change = changes.find(name);
+    if (change != changes.end())
+    {
+        return change->second;
+    }
+
+    EnvLock lock(lockFile);
+    size_t active = 0;
+    uint8_t flags = 0;
+    for (const auto& [key, value] : load(active, flags))
+    {
+        if (key == name)
+        {
+            return value;
+        }
+    }
+    return std::nullopt;
+}
+
+void UbootEnv::set(const std::string& name, const std::string& value)
+{
+    changes[name] = value;
+}
+
+void UbootEnv::unset(const std::string& name)
+{
+    changes[name] = std::nullopt;
+}
+
+void UbootEnv::commit()
+{
+    if (changes.empty())
+    {
+        return;
+    }
+
+    EnvLock lock(lockFile);
+    size_t active = 0;
+    uint8_t flags = 0;
+    auto vars = load(active, flags);
+    const auto current = vars;
+
+    for (const auto& [name, value] : changes)
+    {
+        auto it = std::find_if(vars.begin(), vars.end(),
+                               [&name](const auto& var) {
+            return var.first == name;
+        });
+        if (!value)
+        {
+            if (it != vars.end())
+            {
+                vars.erase(it);
+            }
+        }
+        else if (it != vars.end())
+        {
+            it->second = *value;
+        }
+        else
+        {
+            vars.emplace_back(name, *value);
+        }
+    }
+
+    // Like ubi_setenv, skip the flash write if nothing actually changed
+    if (vars != current)
+    {
+        store(vars, active, flags);
+    }
+    changes.clear();
+}
+
+bool UbootEnv::tryCommit() noexcept
+{
+    try
+    {
+        commit();
+    }
+    catch (const std::exception& e)
+    {
+        lg2::error("Failed to write U-Boot environment: {ERROR}", "ERROR",
+                   e.what());
+        return false;
+    }
+    return true;
+}
+
+UbootEnv::Variables UbootEnv::load(size_t& activeCopy, uint8_t& flags) const
+{
+    if (locations.empty())
+    {
+        throw std::runtime_error("No U-Boot environment configured");
+    }
+
+    const size_t headerSize = crcSize + (redundant() ? 1 : 0);
+    std::optional<size_t> active;
+    std::vector<std::vector<uint8_t>> copies;
+    std::vector<uint8_t> copyFlags;
+    bool booleanFlags = false;
+
+    for (size_t i = 0; i < locations.size() && i < 2; i++)
+    {
+        const auto& location = locations[i];
+        std::vector<uint8_t> buf(location.size);
+        FileDescriptor file(open(location.device.c_str(), O_RDONLY));
+        if (file.fd < 0 || location.size <= headerSize ||
+            pread(file.fd, buf.data(), buf.size(), location.offset) !=
+                static_cast<ssize_t>(buf.size()))
+        {
+            copies.emplace_back();
+            copyFlags.push_back(0);
+            continue;
+        }
+        if (i == 0)
+        {
+            booleanFlags = isNorFlash(file.fd);
+        }
+
+        uint32_t crc = 0;
+        std::memcpy(&crc, buf.data(), crcSize);
+        if (crc != crc32(buf.data() + headerSize, buf.size() - headerSize))
+        {
+            buf.clear();
+        }
+        copyFlags.push_back((redundant() && !buf.empty()) ? buf[crcSize] : 0);
+        copies.push_back(std::move(buf));
+    }
+
+    if (!copies[0].empty())
+    {
+        active = 0;
+    }
+    if (copies.size() > 1 && !copies[1].empty())
+    {
+        if (!active)
+        {
+            active = 1;
+        }
+        else if (booleanFlags)
+        {
+            if (copyFlags[1] == activeFlag && copyFlags[0] != activeFlag)
+            {
+                active = 1;
+            }
+        }
+        else if ((copyFlags[1] == 0 && copyFlags[0] == 0xFF) ||
+                 (copyFlags[1] > copyFlags[0] &&
+                  !(copyFlags[1] == 0xFF && copyFlags[0] == 0)))
+        {
+            active = 1;
+        }
+    }
+
+    if (!active)
+    {
+        throw std::runtime_error("No valid U-Boot environment found");
+    }
+
+    activeCopy = *active;
+    flags = copyFlags[*active];
+
+    Variables vars;
+    const auto& data = copies[*active];
+    auto pos = data.begin() + headerSize;
+    while (pos != data.end() && *pos != '\0')
+    {
+        auto end = std::find(pos, data.end(), '\0');
+        std::string entry(pos, end);
+        auto separator = entry.find('=');
+        if (separator != std::string::npos)
+        {
+            vars.emplace_back(entry.substr(0, separator),
+                              entry.substr(separator + 1));
+        }
+        pos = (end == data.end()) ? end : end + 1;
+    }
+
+    return vars;
+}
+
+void UbootEnv::store(const Variables& vars, size_t active,
+                     uint8_t flags) const
+{
+    const size_t headerSize = crcSize + (redundant() ? 1 : 0);
+
+    // Write the obsolete copy first, so that a power loss part way through
+    // always leaves one valid environment behind. Both copies then carry the
+    // same content and flag, which keeps readers of either copy consistent.
+    std::vector<size_t> order{0};
+    if (redundant())
+    {
+        order = (active == 0) ? std::vector<size_t>{1, 0}
+                              : std::vector<size_t>{0, 1};
+    }
+
+    uint8_t newFlags = static_cast<uint8_t>(flags + 1);
+    {
+        FileDescriptor file(open(locations[0].device.c_str(), O_RDONLY));
+        if (file.fd >= 0 && isNorFlash(file.fd))
+        {
+            newFlags = activeFlag;
+        }
+    }
+
+    for (auto i : order)
+    {
+        const auto& location = locations[i];
+        FileDescriptor file(open(location.device.c_str(), O_RDWR));
+        if (file.fd < 0)
+        {
+            throw std::runtime_error("Failed to open " + location.device +
+                                     ": " + std::strerror(errno));
+        }
+
+        std::vector<uint8_t> env(location.size, 0);
+        size_t pos = headerSize;
+        for (const auto& [name, value] : vars)
+        {
+            auto entry = name + "=" + value;
+            // Keep room for the terminating double NUL
+            if (pos + entry.size() + 2 > env.size())
+            {
+                throw std::runtime_error("U-Boot environment is full");
+            }
+            std::memcpy(env.data() + pos, entry.data(), entry.size());
+            pos += entry.size() + 1;
+        }
+
+        if (redundant())
+        {
+            env[crcSize] = newFlags;
+        }
+        uint32_t crc = crc32(env.data() + headerSize, env.size() - headerSize);
+        std::memcpy(env.data(), &crc, crcSize);
+
+        mtd_info_user info{};
+        if (ioctl(file.fd, MEMGETINFO, &info) == 0)
+        {
+            // Flash needs whole erase blocks, so read-modify-write the blocks
+            // that hold the environment.
+            size_t eraseSize = location.sectorSize ? location.sectorSize
+                                                   : info.erasesize;
+            off_t start = location.offset - (location.offset % eraseSize);
+            off_t end = location.offset + location.size;
+            end += (eraseSize - (end % eraseSize)) % eraseSize;
+
+            std::vector<uint8_t> blocks(end - start);
+            if (pread(file.fd, blocks.data(), blocks.size(), start) !=
+                static_cast<ssize_t>(blocks.size()))
+            {
+                throw std::runtime_error("Failed to read " + location.device +
+                                         ": " + std::strerror(errno));
+            }
+            std::memcpy(blocks.data() + (location.offset - start), env.data(),
+                        env.size());
+
+            erase_info_user erase{static_cast<uint32_t>(start),
+                                  static_cast<uint32_t>(blocks.size())};
+            if (ioctl(file.fd, MEMERASE, &erase) < 0)
+            {
+                throw std::runtime_error("Failed to erase " + location.device +
+                                         ": " + std::strerror(errno));
+            }
+            env = std::move(blocks);
+            if (pwrite(file.fd, env.data(), env.size(), start) !=
+                static_cast<ssize_t>(env.size()))
+            {
+                throw std::runtime_error("Failed to write " + location.device +
+                                         ": " + std::strerror(errno));
+            }
+        }
+        else if (pwrite(file.fd, env.data(), env.size(), location.offset) !=
+                 static_cast<ssize_t>(env.size()))
+        {
+            throw std::runtime_error("Failed to write " + location.device +
+                                     ": " + std::strerror(errno));
+        }
+
+        if (fsync(file.fd) < 0)
+        {
+            throw std::runtime_error("Failed to sync " + location.device +
+                                     ": " + std::strerror(errno));
+        }
+    }
+}
+
+} // namespace updater
+} // namespace software
+} // namespace phosphor
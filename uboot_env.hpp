@@ -0,0 +1,165 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace phosphor
+{
+namespace software
+{
+namespace updater
+{
+
+/** @brief Default fw_printenv/fw_setenv configuration file */
+constexpr auto ubootEnvConfigFile = "/etc/fw_env.config";
+
+/** @brief Lock file shared with fw_printenv/fw_setenv */
+constexpr auto ubootEnvLockFile = "/var/lock/fw_printenv.lock";
+
+/** @class UbootEnv
+ *  @brief Native reader/writer for the U-Boot environment block.
+ *  @details Understands the same fw_env.config format as the U-Boot tools,
+ *  with either one or two (redundant) copies of the environment. Changes are
+ *  staged in memory by set()/unset() and written with a single commit(), so
+ *  several variables can be updated in one flash write.
+ */
+class UbootEnv
+{
+  public:
+    /** @brief Location of one copy of the environment */
+    struct Location
+    {
+        /** @brief Device or file holding the environment */
+        std::string device;
+        /** @brief Byte offset of the environment in the device */
+        off_t offset;
+        /** @brief Size of the environment in bytes, including the header */
+        size_t size;
+        /** @brief Erase block size, 0 if the device does not need erasing */
+        size_t sectorSize;
+    };
+
+    UbootEnv(const UbootEnv&) = delete;
+    UbootEnv& operator=(const UbootEnv&) = delete;
+    UbootEnv(UbootEnv&&) = default;
+    UbootEnv& operator=(UbootEnv&&) = default;
+    ~UbootEnv() = default;
+
+    /** @brief Constructor
+     *
+     *  @param[in] configFile - Path to the fw_env.config style file
+     *  @param[in] lockFile - Path to the lock file, empty to disable locking
+     */
+    explicit UbootEnv(const std::string& configFile = ubootEnvConfigFile,
+                      const std::string& lockFile = ubootEnvLockFile);
+
+    /** @brief Constructor
+     *
+     *  @param[in] locations - One or two environment copies
+     *  @param[in] lockFile - Path to the lock file, empty to disable locking
+     */
+    explicit UbootEnv(std::vector<Location> locations,
+                      const std::string& lockFile = "");
+
+    /** @brief Read a variable, including any staged change
+     *
+     *  @param[in] name - The variable name
+     *
+     *  @return The value, or std::nullopt if the variable is not set
+     *
+     *  @throw std::runtime_error if no valid environment can be read
+     */
+    std::optional<std::string> get(const std::string& name);
+
+    /** @brief Stage a variable change
+     *
+     *  @param[in] name - The variable name
+     *  @param[in] value - The variable value
+     */
+    void set(const std::string& name, const std::string& value);
+
+    /** @brief Stage the removal of a variable
+     *
+     *  @param[in] name - The variable name
+     */
+    void unset(const std::string& name);
+
+    /** @brief Whether there are staged changes not yet committed */
+    bool pending() const
+    {
+        return !changes.empty();
+    }
+
+    /** @brief Write all staged changes to the environment
+     *  @details The current environment is re-read under the lock before the
+     *  changes are applied, so updates made by fw_setenv in the meantime are
+     *  preserved. All copies are rewritten with the same content.
+     *
+     *  @throw std::runtime_error if the environment cannot be read or written
+     */
+    void commit();
+
+    /** @brief Write all staged changes, logging a failure instead of
+     *  throwing
+     *  @details The changes stay staged after a failure, so the next commit
+     *  retries them.
+     *
+     *  @return true if the environment was written
+     */
+    bool tryCommit() noexcept;
+
+    /** @brief Compute the CRC32 used in the environment header
+     *
+     *  @param[in] data - Pointer to the data
+     *  @param[in] size - Number of bytes
+     *
+     *  @return The CRC32 of the data
+     */
+    static uint32_t crc32(const uint8_t* data, size_t size);
+
+  private:
+    /** @brief Variables in the order they appear in the environment */
+    using Variables = std::vector<std::pair<std::string, std::string>>;
+
+    /** @brief Read the environment from the active copy
+     *
+     *  @param[out] active - The index of the active copy
+     *  @param[out] flags - The flags byte of the active copy
+     *
+     *  @return The variables of the active copy
+     */
+    Variables load(size_t& active, uint8_t& flags) const;
+
+    /** @brief Write the environment to every copy
+     *
+     *  @param[in] vars - The variables to write
+     *  @param[in] active - The index of the currently active copy
+     *  @param[in] flags - The flags byte of the currently active copy
+     */
+    void store(const Variables& vars, size_t active, uint8_t flags) const;
+
+    /** @brief Whether the environment has a redundant copy */
+    bool redundant() const
+    {
+        return locations.size() > 1;
+    }
+
+    /** @brief The environment copies */
+    std::vector<Location> locations;
+
+    /** @brief Lock file shared with the U-Boot tools */
+    std::string lockFile;
+
+    /** @brief Staged changes, std::nullopt marks a removal */
+    std::map<std::string, std::optional<std::string>> changes;
+};
+
+} // namespace updater
+} // namespace software
+} // namespace phosphor
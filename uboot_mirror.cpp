@@ -0,0 +1,115 @@
+#include "uboot_mirror.hpp"
+
+#include "mtd_writer.hpp"
+
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <system_error>
+
+namespace phosphor
+{
+namespace software
+{
+namespace updater
+{
+
+namespace
+{
+
+constexpr auto bootIdPath = "/proc/sys/kernel/random/boot_id";
+
+/** @brief The content of the cache file */
+struct CacheEntry
+{
+    std::string source;
+    std::string target;
+    std::string digest;
+    std::string bootId;
+};
+
+/** @brief Read the cache, empty fields if there is none */
+CacheEntry loadCache(const std::string& path)
+{
+    CacheEntry entry;
+    std::ifstream file(path);
+    if (!(file >> entry.source >> entry.target >> entry.digest >>
+          entry.bootId))
+    {
+        return {};
+    }
+    return entry;
+}
+
+/** @brief Replace the cache atomically */
+void storeCache(const std::string& path, const CacheEntry& entry)
+{
+    std::error_code ec;
+    std::filesystem::create_directories(
+        std::filesystem::path(path).parent_path(), ec);
+
+    auto tmp = path + ".tmp";
+    {
+        std::ofstream file(tmp, std::ios::trunc);
+        file << entry.source << "\n"
+             << entry.target << "\n"
+             << entry.digest << "\n"
+             << entry.bootId << "\n";
+        if (!file.flush())
+        {
+            return;
+        }
+    }
+    std::filesystem::rename(tmp, path, ec);
+}
+
+} // namespace
+
+UbootMirror::UbootMirror(const std::string& cache,
+                         const std::string& bootId) :
+    cache(cache), bootId(bootId)
+{}
+
+UbootMirror::Result UbootMirror::mirror(const std::string& source,
+                                        const std::string& target,
+                                        std::stop_token stop)
+{
+    auto entry = loadCache(cache);
+    bool samePartitions = entry.source == source && entry.target == target;
+    if (samePartitions && !bootId.empty() && entry.bootId == bootId)
+    {
+        return {Check::cached, 0};
+    }
+
+    auto digest = MtdWriter::digest(source);
+    if (samePartitions && entry.digest == digest)
+    {
+        storeCache(cache, {source, target, digest, bootId});
+        return {Check::digest, 0};
+    }
+
+    MtdWriter writer(target);
+    auto stats = writer.write(source, [&stop](size_t, size_t) {
+        return !stop.stop_requested();
+    });
+    storeCache(cache, {source, target, digest, bootId});
+    return {Check::compared, stats.written};
+}
+
+void UbootMirror::invalidate(const std::string& cache)
+{
+    std::error_code ec;
+    std::filesystem::remove(cache, ec);
+}
+
+std::string UbootMirror::currentBootId()
+{
+    std::string id;
+    std::ifstream file(bootIdPath);
+    file >> id;
+    return id;
+}
+
+} // namespace updater
+} // namespace software
+} // namespace phosphor
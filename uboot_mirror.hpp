@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstddef>
+#include <stop_token>
+#include <string>
+
+namespace phosphor
+{
+namespace software
+{
+namespace updater
+{
+
+/** @class UbootMirror
+ *  @brief Keeps the alternate U-Boot partition a copy of the primary one.
+ *  @details Replaces comparing the md5sum of both partitions and copying
+ *  the whole partition when they differ: the partitions are compared one
+ *  erase block at a time by MtdWriter, which only rewrites the blocks that
+ *  differ.
+ *
+ *  The digest of the primary partition is cached after each mirror. Within
+ *  the same boot the primary partition only changes when the updater writes
+ *  it, which invalidates the cache, so a restart of the updater reads
+ *  nothing at all. After a reboot only the primary partition is read, and
+ *  the alternate one is left alone if the digest is the cached one.
+ */
+class UbootMirror
+{
+  public:
+    /** @brief How mirror() established that the target is up to date */
+    enum class Check
+    {
+        /** @brief The cache is from this boot, nothing was read */
+        cached,
+        /** @brief The source digest matched the cache */
+        digest,
+        /** @brief The partitions were compared block by block */
+        compared,
+    };
+
+    /** @brief What mirror() did */
+    struct Result
+    {
+        /** @brief How the target was checked */
+        Check check;
+        /** @brief Number of erase blocks written to the target */
+        size_t written;
+    };
+
+    /** @brief Constructor
+     *
+     *  @param[in] cache - Path to the cache file
+     *  @param[in] bootId - Identifies the current boot
+     */
+    explicit UbootMirror(const std::string& cache,
+                         const std::string& bootId = currentBootId());
+
+    /** @brief Make the target a copy of the source
+     *
+     *  @param[in] source - The primary partition
+     *  @param[in] target - The alternate partition
+     *  @param[in] stop - Cancels the mirror when requested
+     *
+     *  @return What was done
+     *
+     *  @throw std::runtime_error if a partition cannot be read or written,
+     *         or the mirror is cancelled
+     */
+    Result mirror(const std::string& source, const std::string& target,
+                  std::stop_token stop = {});
+
+    /** @brief Forget the cached digest, e.g. before writing the source
+     *
+     *  @param[in] cache - Path to the cache file
+     */
+    static void invalidate(const std::string& cache);
+
+    /** @brief The kernel's id of the current boot */
+    static std::string currentBootId();
+
+  private:
+    /** @brief Path to the cache file */
+    std::string cache;
+
+    /** @brief Identifies the current boot */
+    std::string bootId;
+};
+
+} // namespace updater
+} // namespace software
+} // namespace phosphor
@@ -5,15 +5,138 @@
 #include <phosphor-logging/lg2.hpp>
 
 #include <fstream>
+#include <functional>
+#include <memory>
 
 namespace utils
 {
 
 PHOSPHOR_LOG2_USING;
 
+namespace
+{
+
+/** @brief Matches that keep the service cache up to date */
+struct ServiceCacheWatch
+{
+    ServiceCacheWatch(sdbusplus::bus_t& bus, ServiceCache& cache) :
+        bus(bus.get()), cache(cache),
+        nameOwnerChanged(bus, sdbusplus::bus::match::rules::nameOwnerChanged(),
+                         std::bind(std::mem_fn(&ServiceCacheWatch::onOwner),
+                                   this, std::placeholders::_1)),
+        interfacesRemoved(
+            bus,
+            sdbusplus::bus::match::rules::type::signal() +
+                sdbusplus::bus::match::rules::member("InterfacesRemoved") +
+                sdbusplus::bus::match::rules::interface(
+                    "org.freedesktop.DBus.ObjectManager"),
+            std::bind(std::mem_fn(&ServiceCacheWatch::onRemoved), this,
+                      std::placeholders::_1))
+    {}
+
+    /** @brief A service was started, stopped or restarted */
+    void onOwner(sdbusplus::message_t& msg)
+    {
+        std::string name;
+        try
+        {
+            msg.read(name);
+        }
+        catch (const sdbusplus::exception_t&)
+        {
+            cache.clear();
+            return;
+        }
+        cache.invalidateService(name);
+    }
+
+    /** @brief A service removed interfaces from an object */
+    void onRemoved(sdbusplus::message_t& msg)
+    {
+        sdbusplus::message::object_path path;
+        std::vector<std::string> interfaces;
+        try
+        {
+            msg.read(path, interfaces);
+        }
+        catch (const sdbusplus::exception_t&)
+        {
+            cache.clear();
+            return;
+        }
+        cache.invalidatePath(path.str, interfaces);
+    }
+
+    /** @brief The bus the matches are installed on */
+    sd_bus* bus;
+
+    /** @brief The cache to invalidate */
+    ServiceCache& cache;
+
+    sdbusplus::bus::match_t nameOwnerChanged;
+    sdbusplus::bus::match_t interfacesRemoved;
+};
+
+} // namespace
+
+std::optional<std::string> ServiceCache::lookup(const std::string& path,
+                                                const std::string& interface)
+{
+    auto it = entries.find({path, interface});
+    if (it == entries.end())
+    {
+        missCount++;
+        return std::nullopt;
+    }
+    hitCount++;
+    return it->second;
+}
+
+void ServiceCache::insert(const std::string& path, const std::string& interface,
+                          const std::string& service)
+{
+    entries[{path, interface}] = service;
+}
+
+void ServiceCache::invalidateService(const std::string& service)
+{
+    std::erase_if(entries, [&service](const auto& entry) {
+        return entry.second == service;
+    });
+}
+
+void ServiceCache::invalidatePath(const std::string& path,
+                                  const std::vector<std::string>& interfaces)
+{
+    for (const auto& interface : interfaces)
+    {
+        entries.erase({path, interface});
+    }
+}
+
+ServiceCache& getServiceCache(sdbusplus::bus_t& bus)
+{
+    static ServiceCache cache;
+    static std::unique_ptr<ServiceCacheWatch> watch;
+
+    // Entries learned on another connection cannot be kept up to date
+    if (!watch || watch->bus != bus.get())
+    {
+        cache.clear();
+        watch = std::make_unique<ServiceCacheWatch>(bus, cache);
+    }
+    return cache;
+}
+
 std::string getService(sdbusplus::bus_t& bus, const std::string& path,
                        const std::string& interface)
 {
+    auto& cache = getServiceCache(bus);
+    if (auto service = cache.lookup(path, interface))
+    {
+        return *service;
+    }
+
     auto method = bus.new_method_call(MAPPER_BUSNAME, MAPPER_PATH,
                                       MAPPER_BUSNAME, "GetObject");
 
@@ -40,6 +163,7 @@ std::string getService(sdbusplus::bus_t& bus, const std::string& path,
               "ERROR", e, "PATH", path, "INTERFACE", interface);
         return std::string{};
     }
+    cache.insert(path, interface, response[0].first);
     return response[0].first;
 }
 
@@ -3,9 +3,12 @@
 
 #include <sdbusplus/server.hpp>
 
+#include <cstdint>
 #include <fstream>
 #include <map>
+#include <optional>
 #include <string>
+#include <utility>
 
 namespace utils
 {
@@ -13,9 +16,94 @@ namespace utils
 using PropertyValue =
     std::variant<std::string, std::vector<sdbusplus::message::object_path>>;
 
+/** @class ServiceCache
+ *  @brief Remembers which service provides an interface on a path.
+ *  @details The owner of an object almost never changes, so the result of
+ *  the mapper GetObject call is kept until the service drops off the bus or
+ *  removes the interface.
+ */
+class ServiceCache
+{
+  public:
+    /** @brief Look up a cached service, counting the hit or miss
+     *
+     * @param[in] path - The D-Bus object path
+     * @param[in] interface - The D-Bus interface
+     *
+     * @return The service, or std::nullopt if it is not cached
+     */
+    std::optional<std::string> lookup(const std::string& path,
+                                      const std::string& interface);
+
+    /** @brief Remember the service of a path and interface
+     *
+     * @param[in] path - The D-Bus object path
+     * @param[in] interface - The D-Bus interface
+     * @param[in] service - The service providing the interface
+     */
+    void insert(const std::string& path, const std::string& interface,
+                const std::string& service);
+
+    /** @brief Forget every entry of a service, e.g. when it changes owner
+     *
+     * @param[in] service - The service name
+     */
+    void invalidateService(const std::string& service);
+
+    /** @brief Forget the entries of interfaces removed from a path
+     *
+     * @param[in] path - The D-Bus object path
+     * @param[in] interfaces - The removed interfaces
+     */
+    void invalidatePath(const std::string& path,
+                        const std::vector<std::string>& interfaces);
+
+    /** @brief Forget all entries */
+    void clear()
+    {
+        entries.clear();
+    }
+
+    /** @brief Number of lookups answered from the cache */
+    uint64_t hits() const
+    {
+        return hitCount;
+    }
+
+    /** @brief Number of lookups that needed a mapper call */
+    uint64_t misses() const
+    {
+        return missCount;
+    }
+
+  private:
+    /** @brief Services by (path, interface) */
+    std::map<std::pair<std::string, std::string>, std::string> entries;
+
+    /** @brief Number of lookups answered from the cache */
+    uint64_t hitCount = 0;
+
+    /** @brief Number of lookups that needed a mapper call */
+    uint64_t missCount = 0;
+};
+
+/**
+ * @brief Get the service cache used by getService()
+ *
+ * The first call for a bus installs the matches that invalidate the cache
+ * when a service changes owner or removes interfaces.
+ *
+ * @param[in] bus - The bus the cached services live on
+ *
+ * @return The process wide cache
+ **/
+ServiceCache& getServiceCache(sdbusplus::bus_t& bus);
+
 /**
  * @brief Get the bus service
  *
+ * Results are cached, see getServiceCache().
+ *
  * @return the bus service as a string
  **/
 std::string getService(sdbusplus::bus_t& bus, const std::string& path,